@@ -217,7 +217,11 @@ void help(void)
     mprintf("    --bell                               Sound bell on virus detection\n");
     mprintf("\n");
     mprintf("    --tempdir=DIRECTORY                  Create temporary files in DIRECTORY\n");
+    mprintf("    --cache-file=FILE                    Remember clean files in FILE across scans\n");
+    mprintf("    --snapshot=FILE                      Load the compiled engine from FILE, or save\n");
+    mprintf("                                         it there if the databases changed since\n");
     mprintf("    --leave-temps[=yes/no(*)]            Do not remove temporary files\n");
+    mprintf("    --direct-map[=yes/no(*)]             Map big files instead of reading them\n");
     mprintf("    --database=FILE/DIR   -d FILE/DIR    Load virus database from FILE or load\n");
     mprintf("                                         all supported db files from DIR\n");
     mprintf("    --official-db-only[=yes/no(*)]       Only load official signatures\n");
@@ -227,6 +231,7 @@ void help(void)
     mprintf("    --cross-fs[=yes(*)/no]               Scan files and directories on other filesystems\n");
     mprintf("    --follow-dir-symlinks[=0/1(*)/2]     Follow directory symlinks (0 = never, 1 = direct, 2 = always)\n");
     mprintf("    --follow-file-symlinks[=0/1(*)/2]    Follow file symlinks (0 = never, 1 = direct, 2 = always)\n");
+    mprintf("    --threads=#n                         Scan files with #n threads (default: 1)\n");
     mprintf("    --file-list=FILE      -f FILE        Scan files from FILE\n");
     mprintf("    --remove[=yes/no(*)]                 Remove infected files. Be careful!\n");
     mprintf("    --move=DIRECTORY                     Move infected files into DIRECTORY\n");
@@ -240,6 +245,7 @@ void help(void)
     mprintf("    --bytecode-unsigned[=yes/no(*)]      Load unsigned bytecode\n");
     mprintf("    --bytecode-timeout=N                 Set bytecode timeout (in milliseconds)\n");
     mprintf("    --bytecode-statistics[=yes/no(*)]    Collect and print bytecode statistics\n");
+    mprintf("    --signature-statistics[=yes/no(*)]   Collect and print signature statistics\n");
     mprintf("    --detect-pua[=yes/no(*)]             Detect Possibly Unwanted Applications\n");
     mprintf("    --exclude-pua=CAT                    Skip PUA sigs of category CAT\n");
     mprintf("    --include-pua=CAT                    Load PUA sigs of category CAT\n");
@@ -276,6 +282,7 @@ void help(void)
     mprintf("    --max-htmlnotags=#n                  Maximum size of normalized HTML file to scan\n");
     mprintf("    --max-scriptnormalize=#n             Maximum size of script file to normalize\n");
     mprintf("    --max-ziptypercg=#n                  Maximum size zip to type reanalyze\n");
+    mprintf("    --max-inmemory=#n                    Maximum size of extracted file kept in memory\n");
     mprintf("\n");
     mprintf("(*) Default scan settings\n");
     mprintf("(**) Certain files (e.g. documents, archives, etc.) may in turn contain other\n");
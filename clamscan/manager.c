@@ -46,7 +46,11 @@
 #include <sys/types.h>
 #include <signal.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <target.h>
+#ifdef CL_THREAD_SAFE
+#include <pthread.h>
+#endif
 
 #include "manager.h"
 #include "global.h"
@@ -61,6 +65,7 @@
 #include "libclamav/matcher-ac.h"
 #include "libclamav/str.h"
 #include "libclamav/readdb.h"
+#include "libclamav/sigstats.h"
 #include "libclamav/cltypes.h"
 
 #ifdef C_LINUX
@@ -120,7 +125,70 @@ static int checkaccess(const char *path, const char *username, int mode)
 }
 #endif
 
+/* A file scanned by one of the --threads workers. Everything it would
+ * print is kept with the job and flushed in submission order, so that
+ * the report looks the same as with a serial scan. */
+struct scanmsg {
+	struct scanmsg *next;
+	int console;
+	char str[1];
+};
+
+struct scanjob {
+	char *filename;
+	int done, virus;
+	struct s_info info;
+	struct scanmsg *msgs, *lastmsg;
+	struct scanjob *qnext, *onext;
+};
+
+static void msg_print(const char *str, int console)
+{
+	char fmt[4] = { 0, '%', 's', 0 };
+	const char *pt = fmt + 1;
+
+	/* keep the logg()/mprintf() prefix in the format string */
+	if (*str && strchr("!^~#*$@", *str)) {
+		fmt[0] = *str++;
+		pt = fmt;
+	}
+	if (console)
+		mprintf(pt, str);
+	else
+		logg(pt, str);
+}
+
+static void joblog(struct scanjob *job, int console, const char *fmt, ...)
+{
+	va_list args;
+	struct scanmsg *msg;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	if (len < 0 || !(msg = malloc(sizeof(*msg) + len)))
+		return;
+	va_start(args, fmt);
+	vsnprintf(msg->str, len + 1, fmt, args);
+	va_end(args);
+
+	if (!job) {
+		msg_print(msg->str, console);
+		free(msg);
+		return;
+	}
+	msg->console = console;
+	msg->next = NULL;
+	if (job->lastmsg)
+		job->lastmsg->next = msg;
+	else
+		job->msgs = msg;
+	job->lastmsg = msg;
+}
+
 struct metachain {
+	struct scanjob *job;
 	char **chains;
 	unsigned lastadd;
 	unsigned lastvir;
@@ -208,11 +276,11 @@ static cl_error_t meta(const char* container_type, unsigned long fsize_container
 	}
 	c->chains[c->n - 1] = chain;
 	toolong = print_chain(c, prev, sizeof(prev));
-	logg("*Scanning %s%s!%s\n", prev, toolong ? "..." : "", chain);
+	joblog(c->job, 0, "*Scanning %s%s!%s\n", prev, toolong ? "..." : "", chain);
 	return CL_CLEAN;
 }
 
-static void scanfile(const char *filename, struct cl_engine *engine, const struct optstruct *opts, unsigned int options)
+static void scanfile_job(const char *filename, struct cl_engine *engine, const struct optstruct *opts, unsigned int options, struct scanjob *job)
 {
 	int ret = 0, fd, included;
 	unsigned i;
@@ -221,12 +289,13 @@ static void scanfile(const char *filename, struct cl_engine *engine, const struc
 	const char **virpp = &virname;
 	STATBUF sb;
 	struct metachain chain;
+	struct s_info *inf = job ? &job->info : &info;
 
 	if ((opt = optget(opts, "exclude"))->enabled) {
 		while (opt) {
 			if (match_regex(filename, opt->strarg) == 1) {
 				if (!printinfected)
-					logg("~%s: Excluded\n", filename);
+					joblog(job, 0, "~%s: Excluded\n", filename);
 				return;
 			}
 			opt = opt->nextarg;
@@ -244,7 +313,7 @@ static void scanfile(const char *filename, struct cl_engine *engine, const struc
 		}
 		if (!included) {
 			if (!printinfected)
-				logg("~%s: Excluded\n", filename);
+				joblog(job, 0, "~%s: Excluded\n", filename);
 			return;
 		}
 	}
@@ -254,29 +323,30 @@ static void scanfile(const char *filename, struct cl_engine *engine, const struc
 #ifdef C_LINUX
 		if(procdev && sb.st_dev == procdev) {
 			if(!printinfected)
-				logg("~%s: Excluded (/proc)\n", filename);
+				joblog(job, 0, "~%s: Excluded (/proc)\n", filename);
 			return;
 		}
 #endif    
 		if (!sb.st_size) {
 			if (!printinfected)
-				logg("~%s: Empty file\n", filename);
+				joblog(job, 0, "~%s: Empty file\n", filename);
 			return;
 		}
-		info.rblocks += sb.st_size / CL_COUNT_PRECISION;
+		inf->rblocks += sb.st_size / CL_COUNT_PRECISION;
 	}
 
 #ifndef _WIN32
 	if(geteuid())
 	if(checkaccess(filename, NULL, R_OK) != 1) {
 		if(!printinfected)
-			logg("~%s: Access denied\n", filename);
-		info.errors++;
+			joblog(job, 0, "~%s: Access denied\n", filename);
+		inf->errors++;
 		return;
 	}
 #endif
 
 	memset(&chain, 0, sizeof(chain));
+	chain.job = job;
 	if (optget(opts, "archive-verbose")->enabled) {
 		chain.chains = malloc(sizeof(*chain.chains));
 		if (chain.chains) {
@@ -284,51 +354,51 @@ static void scanfile(const char *filename, struct cl_engine *engine, const struc
 			chain.n = 1;
 		}
 	}
-	logg("*Scanning %s\n", filename);
+	joblog(job, 0, "*Scanning %s\n", filename);
 
 	if ((fd = safe_open(filename, O_RDONLY | O_BINARY)) == -1) {
-		logg("^Can't open file %s: %s\n", filename, strerror(errno));
-		info.errors++;
+		joblog(job, 0, "^Can't open file %s: %s\n", filename, strerror(errno));
+		inf->errors++;
 		return;
 	}
 
 
-	if ((ret = cl_scandesc_callback(fd, virpp, &info.blocks, engine, options, &chain)) == CL_VIRUS) {
+	if ((ret = cl_scandesc_callback(fd, virpp, &inf->blocks, engine, options, &chain)) == CL_VIRUS) {
 		if (optget(opts, "archive-verbose")->enabled) {
 			if (chain.n > 1) {
 				char str[128];
 				int toolong = print_chain(&chain, str, sizeof(str));
-				logg("~%s%s!(%d)%s: %s FOUND\n", str, toolong ? "..." : "", chain.lastvir - 1, chain.chains[chain.n - 1], virname);
+				joblog(job, 0, "~%s%s!(%d)%s: %s FOUND\n", str, toolong ? "..." : "", chain.lastvir - 1, chain.chains[chain.n - 1], virname);
 			}
 			else if (chain.lastvir)
-				logg("~%s!(%d): %s FOUND\n", filename, chain.lastvir - 1, virname);
+				joblog(job, 0, "~%s!(%d): %s FOUND\n", filename, chain.lastvir - 1, virname);
 		}
 		if (options & CL_SCAN_ALLMATCHES) {
 			int i = 0;
 			virpp = (const char **)*virpp; /* horrible */
 			virname = virpp[0];
 			while (virpp[i])
-				logg("~%s: %s FOUND\n", filename, virpp[i++]);
+				joblog(job, 0, "~%s: %s FOUND\n", filename, virpp[i++]);
 			free((void *)virpp);
 		}
 		else
-			logg("~%s: %s FOUND\n", filename, virname);
-		info.files++;
-		info.ifiles++;
+			joblog(job, 0, "~%s: %s FOUND\n", filename, virname);
+		inf->files++;
+		inf->ifiles++;
 
-		if (bell)
+		if (bell && !job)
 			fprintf(stderr, "\007");
 
 	}
 	else if (ret == CL_CLEAN) {
 		if (!printinfected && printclean)
-			mprintf("~%s: OK\n", filename);
-		info.files++;
+			joblog(job, 1, "~%s: OK\n", filename);
+		inf->files++;
 	}
 	else {
 		if (!printinfected)
-			logg("~%s: %s ERROR\n", filename, cl_strerror(ret));
-		info.errors++;
+			joblog(job, 0, "~%s: %s ERROR\n", filename, cl_strerror(ret));
+		inf->errors++;
 	}
 
 	for (i = 0; i < chain.n; i++)
@@ -336,8 +406,203 @@ static void scanfile(const char *filename, struct cl_engine *engine, const struc
 	free(chain.chains);
 	close(fd);
 
-	if (ret == CL_VIRUS && action)
-		action(filename);
+	if (ret == CL_VIRUS) {
+		if (job)
+			job->virus = 1;
+		else if (action)
+			action(filename);
+	}
+}
+
+#ifdef CL_THREAD_SAFE
+static struct scanpool {
+	pthread_mutex_t mutex;
+	pthread_cond_t nonempty, room;
+	struct scanjob *queue, *queue_tail;	/* waiting for a worker */
+	struct scanjob *order, *order_tail;	/* not printed yet, in submission order */
+	unsigned long submitted, printed;
+	unsigned int maxjobs, nthreads;
+	int stop;
+	pthread_t *threads;
+	struct cl_engine *engine;
+	const struct optstruct *opts;
+	unsigned int options;
+} *pool;
+
+/* called with pool->mutex held */
+static void pool_flush(struct scanjob *job)
+{
+	struct scanmsg *msg;
+
+	while ((msg = job->msgs)) {
+		job->msgs = msg->next;
+		msg_print(msg->str, msg->console);
+		free(msg);
+	}
+	info.files += job->info.files;
+	info.ifiles += job->info.ifiles;
+	info.errors += job->info.errors;
+	info.blocks += job->info.blocks;
+	info.rblocks += job->info.rblocks;
+	if (job->virus) {
+		if (bell)
+			fprintf(stderr, "\007");
+		if (action)
+			action(job->filename);
+	}
+	free(job->filename);
+	free(job);
+}
+
+static void *pool_worker(void *arg)
+{
+	struct scanjob *job;
+
+	(void)arg;
+	pthread_mutex_lock(&pool->mutex);
+	while (1) {
+		while (!pool->queue && !pool->stop)
+			pthread_cond_wait(&pool->nonempty, &pool->mutex);
+		if (!(job = pool->queue))
+			break;
+		if (!(pool->queue = job->qnext))
+			pool->queue_tail = NULL;
+		pthread_mutex_unlock(&pool->mutex);
+
+		scanfile_job(job->filename, pool->engine, pool->opts, pool->options, job);
+
+		pthread_mutex_lock(&pool->mutex);
+		job->done = 1;
+		while ((job = pool->order) && job->done) {
+			if (!(pool->order = job->onext))
+				pool->order_tail = NULL;
+			pool_flush(job);
+			pool->printed++;
+		}
+		pthread_cond_broadcast(&pool->room);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+static void pool_start(unsigned int nthreads, struct cl_engine *engine, const struct optstruct *opts, unsigned int options)
+{
+	unsigned int i;
+
+	if (!(pool = calloc(1, sizeof(*pool))) || !(pool->threads = calloc(nthreads, sizeof(pthread_t)))) {
+		logg("^Can't allocate memory for the scan threads, scanning serially\n");
+		free(pool);
+		pool = NULL;
+		return;
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->nonempty, NULL);
+	pthread_cond_init(&pool->room, NULL);
+	pool->maxjobs = nthreads * 4;
+	pool->engine = engine;
+	pool->opts = opts;
+	pool->options = options;
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, pool_worker, NULL))
+			break;
+		pool->nthreads++;
+	}
+	if (!pool->nthreads) {
+		logg("^Can't create the scan threads, scanning serially\n");
+		free(pool->threads);
+		free(pool);
+		pool = NULL;
+	}
+}
+
+/* wait until every submitted file has been reported */
+static void pool_sync(void)
+{
+	if (!pool)
+		return;
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->printed != pool->submitted)
+		pthread_cond_wait(&pool->room, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void pool_lock(void)
+{
+	if (pool)
+		pthread_mutex_lock(&pool->mutex);
+}
+
+static void pool_unlock(void)
+{
+	if (pool)
+		pthread_mutex_unlock(&pool->mutex);
+}
+
+static void pool_stop(void)
+{
+	unsigned int i;
+
+	if (!pool)
+		return;
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->nonempty);
+	pthread_mutex_unlock(&pool->mutex);
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+	pthread_cond_destroy(&pool->nonempty);
+	pthread_cond_destroy(&pool->room);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+	pool = NULL;
+}
+
+static int pool_add(const char *filename)
+{
+	struct scanjob *job;
+
+	if (!(job = calloc(1, sizeof(*job))) || !(job->filename = strdup(filename))) {
+		free(job);
+		return -1;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	/* bound the number of jobs (and their buffered output) in flight */
+	while (pool->submitted - pool->printed >= pool->maxjobs)
+		pthread_cond_wait(&pool->room, &pool->mutex);
+	pool->submitted++;
+	if (pool->queue_tail)
+		pool->queue_tail->qnext = job;
+	else
+		pool->queue = job;
+	pool->queue_tail = job;
+	if (pool->order_tail)
+		pool->order_tail->onext = job;
+	else
+		pool->order = job;
+	pool->order_tail = job;
+	pthread_cond_signal(&pool->nonempty);
+	pthread_mutex_unlock(&pool->mutex);
+	return 0;
+}
+#else
+static void pool_sync(void) { }
+static void pool_lock(void) { }
+static void pool_unlock(void) { }
+#endif
+
+static void scanfile(const char *filename, struct cl_engine *engine, const struct optstruct *opts, unsigned int options)
+{
+#ifdef CL_THREAD_SAFE
+	if (pool) {
+		if (!pool_add(filename))
+			return;
+		pool_sync();
+	}
+#endif
+	scanfile_job(filename, engine, opts, options, NULL);
 }
 
 static void scandirs(const char *dirname, struct cl_engine *engine, const struct optstruct *opts, unsigned int options, unsigned int depth, dev_t dev)
@@ -354,6 +619,7 @@ static void scandirs(const char *dirname, struct cl_engine *engine, const struct
 	if ((opt = optget(opts, "exclude-dir"))->enabled) {
 		while (opt) {
 			if (match_regex(dirname, opt->strarg) == 1) {
+				pool_sync();
 				if (!printinfected)
 					logg("~%s: Excluded\n", dirname);
 				return;
@@ -372,6 +638,7 @@ static void scandirs(const char *dirname, struct cl_engine *engine, const struct
 			opt = opt->nextarg;
 		}
 		if (!included) {
+			pool_sync();
 			if (!printinfected)
 				logg("~%s: Excluded\n", dirname);
 			return;
@@ -385,7 +652,9 @@ static void scandirs(const char *dirname, struct cl_engine *engine, const struct
 	filelnk = optget(opts, "follow-file-symlinks")->numarg;
 
 	if ((dd = opendir(dirname)) != NULL) {
+		pool_lock();
 		info.dirs++;
+		pool_unlock();
 		depth++;
 		while ((dent = readdir(dd))) {
 			if (dent->d_ino) {
@@ -393,6 +662,7 @@ static void scandirs(const char *dirname, struct cl_engine *engine, const struct
 					/* build the full name */
 					fname = malloc(strlen(dirname) + strlen(dent->d_name) + 2);
 					if (fname == NULL) { /* oops, malloc() failed, print warning and return */
+						pool_sync();
 						logg("!scandirs: Memory allocation failed for fname\n");
 						break;
 					}
@@ -406,6 +676,7 @@ static void scandirs(const char *dirname, struct cl_engine *engine, const struct
 					if (LSTAT(fname, &sb) != -1) {
 						if (!optget(opts, "cross-fs")->enabled) {
 							if (sb.st_dev != dev) {
+								pool_sync();
 								if (!printinfected)
 									logg("~%s: Excluded\n", fname);
 								free(fname);
@@ -414,6 +685,7 @@ static void scandirs(const char *dirname, struct cl_engine *engine, const struct
 						}
 						if (S_ISLNK(sb.st_mode)) {
 							if (dirlnk != 2 && filelnk != 2) {
+								pool_sync();
 								if (!printinfected)
 									logg("%s: Symbolic link\n", fname);
 							}
@@ -426,6 +698,7 @@ static void scandirs(const char *dirname, struct cl_engine *engine, const struct
 										scandirs(fname, engine, opts, options, depth, dev);
 								}
 								else {
+									pool_sync();
 									if (!printinfected)
 										logg("%s: Symbolic link\n", fname);
 								}
@@ -445,6 +718,7 @@ static void scandirs(const char *dirname, struct cl_engine *engine, const struct
 		closedir(dd);
 	}
 	else {
+		pool_sync();
 		if (!printinfected)
 			logg("~%s: Can't open directory.\n", dirname);
 		info.errors++;
@@ -533,15 +807,47 @@ static int scanstdin(const struct cl_engine *engine, const struct optstruct *opt
 	return ret;
 }
 
+/* returns 1 if the snapshot was saved from the databases we'd load and
+ * none of them changed since */
+static int snapshot_uptodate(const char *snapshot, const struct optstruct *opts)
+{
+	const struct optstruct *opt;
+	const char **dbpaths, *dbpath;
+	unsigned int n = 0;
+	char *dbdir;
+	int ret;
+
+	if ((opt = optget(opts, "database"))->active) {
+		for (; opt->nextarg; opt = opt->nextarg)
+			n++;
+		if (!(dbpaths = malloc((n + 1) * sizeof(*dbpaths))))
+			return 0;
+		n = 0;
+		for (opt = optget(opts, "database"); opt; opt = opt->nextarg)
+			dbpaths[n++] = opt->strarg;
+		ret = cl_snapshot_check(snapshot, dbpaths, n);
+		free(dbpaths);
+	} else {
+		dbdir = freshdbdir();
+		dbpath = dbdir;
+		ret = cl_snapshot_check(snapshot, &dbpath, 1);
+		free(dbdir);
+	}
+	return ret == CL_SUCCESS;
+}
+
 int scanmanager(const struct optstruct *opts)
 {
 	int ret = 0, i;
-	unsigned int options = 0, dboptions = 0, dirlnk = 1, filelnk = 1;
+	unsigned int options = 0, dboptions = 0, dirlnk = 1, filelnk = 1, nthreads;
 	struct cl_engine *engine;
 	STATBUF sb;
 	char *file, cwd[1024], *pua_cats = NULL;
 	const char *filename;
 	const struct optstruct *opt;
+	const char *snapshot = NULL;
+	struct cl_settings *settings;
+	int loaded = 0;
 #ifndef _WIN32
 	struct rlimit rlim;
 #endif
@@ -558,6 +864,18 @@ int scanmanager(const struct optstruct *opts)
 		return 2;
 	}
 
+	nthreads = optget(opts, "threads")->numarg;
+	if (nthreads < 1 || nthreads > 256) {
+		logg("!--threads: Invalid argument\n");
+		return 2;
+	}
+#ifndef CL_THREAD_SAFE
+	if (nthreads > 1) {
+		logg("^--threads: Not supported by this build, scanning serially\n");
+		nthreads = 1;
+	}
+#endif
+
 	if (optget(opts, "phishing-sigs")->enabled)
 		dboptions |= CL_DB_PHISHING;
 
@@ -583,6 +901,14 @@ int scanmanager(const struct optstruct *opts)
 	if (optget(opts, "disable-cache")->enabled)
 		cl_engine_set_num(engine, CL_ENGINE_DISABLE_CACHE, 1);
 
+	if ((opt = optget(opts, "cache-file"))->enabled) {
+		if ((ret = cl_engine_set_str(engine, CL_ENGINE_CACHE_FILE, opt->strarg))) {
+			logg("!cli_engine_set_str(CL_ENGINE_CACHE_FILE) failed: %s\n", cl_strerror(ret));
+			cl_engine_free(engine);
+			return 2;
+		}
+	}
+
 	if (optget(opts, "detect-pua")->enabled) {
 		dboptions |= CL_DB_PUA;
 		if ((opt = optget(opts, "exclude-pua"))->enabled) {
@@ -650,12 +976,18 @@ int scanmanager(const struct optstruct *opts)
 	if (optget(opts, "force-to-disk")->enabled)
 		cl_engine_set_num(engine, CL_ENGINE_FORCETODISK, 1);
 
+	if (optget(opts, "direct-map")->enabled)
+		cl_engine_set_num(engine, CL_ENGINE_DIRECT_MAP, 1);
+
 	if (optget(opts, "bytecode-unsigned")->enabled)
 		dboptions |= CL_DB_BYTECODE_UNSIGNED;
 
 	if (optget(opts, "bytecode-statistics")->enabled)
 		dboptions |= CL_DB_BYTECODE_STATS;
 
+	if (optget(opts, "signature-statistics")->enabled)
+		dboptions |= CL_DB_SIGNATURE_STATS;
+
 	if ((opt = optget(opts, "bytecode-timeout"))->enabled)
 		cl_engine_set_num(engine, CL_ENGINE_BYTECODE_TIMEOUT, opt->numarg);
 	if ((opt = optget(opts, "bytecode-mode"))->enabled) {
@@ -679,32 +1011,67 @@ int scanmanager(const struct optstruct *opts)
 		}
 	}
 
-	if ((opt = optget(opts, "database"))->active) {
-		while (opt) {
-			if ((ret = cl_load(opt->strarg, engine, &info.sigs, dboptions))) {
-				logg("!%s\n", cl_strerror(ret));
-				cl_engine_free(engine);
+	if ((opt = optget(opts, "snapshot"))->enabled)
+		snapshot = opt->strarg;
+
+	if (snapshot && snapshot_uptodate(snapshot, opts)) {
+		if (!(settings = cl_engine_settings_copy(engine))) {
+			logg("!Can't copy engine settings\n");
+			cl_engine_free(engine);
+			return 2;
+		}
+		if ((ret = cl_engine_load_snapshot(engine, snapshot, &info.sigs, dboptions))) {
+			/* start over with the databases */
+			logg("^Can't load snapshot %s: %s\n", snapshot, cl_strerror(ret));
+			cl_engine_free(engine);
+			if (!(engine = cl_engine_new()) || cl_engine_settings_apply(engine, settings)) {
+				logg("!Can't initialize antivirus engine\n");
+				cl_engine_settings_free(settings);
+				if (engine)
+					cl_engine_free(engine);
 				return 2;
 			}
-			opt = opt->nextarg;
+			info.sigs = 0;
+		} else {
+			logg("*Loaded snapshot %s\n", snapshot);
+			loaded = 1;
 		}
+		cl_engine_settings_free(settings);
 	}
-	else {
-		char *dbdir = freshdbdir();
 
-		if ((ret = cl_load(dbdir, engine, &info.sigs, dboptions))) {
-			logg("!%s\n", cl_strerror(ret));
+	if (!loaded) {
+		if ((opt = optget(opts, "database"))->active) {
+			while (opt) {
+				if ((ret = cl_load(opt->strarg, engine, &info.sigs, dboptions))) {
+					logg("!%s\n", cl_strerror(ret));
+					cl_engine_free(engine);
+					return 2;
+				}
+				opt = opt->nextarg;
+			}
+		}
+		else {
+			char *dbdir = freshdbdir();
+
+			if ((ret = cl_load(dbdir, engine, &info.sigs, dboptions))) {
+				logg("!%s\n", cl_strerror(ret));
+				free(dbdir);
+				cl_engine_free(engine);
+				return 2;
+			}
 			free(dbdir);
+		}
+
+		if ((ret = cl_engine_compile(engine)) != 0) {
+			logg("!Database initialization error: %s\n", cl_strerror(ret));;
 			cl_engine_free(engine);
 			return 2;
 		}
-		free(dbdir);
-	}
 
-	if ((ret = cl_engine_compile(engine)) != 0) {
-		logg("!Database initialization error: %s\n", cl_strerror(ret));;
-		cl_engine_free(engine);
-		return 2;
+		if (snapshot && (ret = cl_engine_save(engine, snapshot))) {
+			logg("^Can't save snapshot %s: %s\n", snapshot, cl_strerror(ret));
+			ret = 0;
+		}
 	}
 
 	if (optget(opts, "archive-verbose")->enabled) {
@@ -806,6 +1173,14 @@ int scanmanager(const struct optstruct *opts)
 		}
 	}
 
+	if ((opt = optget(opts, "max-inmemory"))->active) {
+		if ((ret = cl_engine_set_num(engine, CL_ENGINE_MAX_INMEMORY, opt->numarg))) {
+			logg("!cli_engine_set_num(CL_ENGINE_MAX_INMEMORY) failed: %s\n", cl_strerror(ret));
+			cl_engine_free(engine);
+			return 2;
+		}
+	}
+
 	/* set scan options */
 	if (optget(opts, "allmatch")->enabled)
 		options |= CL_SCAN_ALLMATCHES;
@@ -910,6 +1285,11 @@ int scanmanager(const struct optstruct *opts)
 		procdev = sb.st_dev;
 #endif
 
+#ifdef CL_THREAD_SAFE
+	if (nthreads > 1 && !(opts->filename && !optget(opts, "file-list")->enabled && !strcmp(opts->filename[0], "-")))
+		pool_start(nthreads, engine, opts, options);
+#endif
+
 	/* check filetype */
 	if (!opts->filename && !optget(opts, "file-list")->enabled) {
 		/* we need full path for some reasons (eg. archive handling) */
@@ -933,6 +1313,7 @@ int scanmanager(const struct optstruct *opts)
 
 		while ((filename = filelist(opts, &ret)) && (file = strdup(filename))) {
 			if (LSTAT(file, &sb) == -1) {
+				pool_sync();
 				perror(file);
 				logg("^%s: Can't access file\n", file);
 				ret = 2;
@@ -947,6 +1328,7 @@ int scanmanager(const struct optstruct *opts)
 
 				if (S_ISLNK(sb.st_mode)) {
 					if (dirlnk == 0 && filelnk == 0) {
+						pool_sync();
 						if (!printinfected)
 							logg("%s: Symbolic link\n", file);
 					}
@@ -958,6 +1340,7 @@ int scanmanager(const struct optstruct *opts)
 							scandirs(file, engine, opts, options, 1, sb.st_dev);
 						}
 						else {
+							pool_sync();
 							if (!printinfected)
 								logg("%s: Symbolic link\n", file);
 						}
@@ -970,6 +1353,7 @@ int scanmanager(const struct optstruct *opts)
 					scandirs(file, engine, opts, options, 1, sb.st_dev);
 				}
 				else {
+					pool_sync();
 					logg("^%s: Not supported file type\n", file);
 					ret = 2;
 				}
@@ -978,11 +1362,18 @@ int scanmanager(const struct optstruct *opts)
 		}
 	}
 
+#ifdef CL_THREAD_SAFE
+	pool_stop();
+#endif
+
 	if (optget(opts, "bytecode-statistics")->enabled) {
 		cli_sigperf_print();
 		cli_sigperf_events_destroy();
 	}
 
+	if (optget(opts, "signature-statistics")->enabled)
+		cli_sigstats_print(engine);
+
 	/* free the engine */
 	cl_engine_free(engine);
 
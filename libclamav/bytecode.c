@@ -38,6 +38,7 @@
 #include "bytecode_api.h"
 #include "bytecode_api_impl.h"
 #include "builtin_bytecodes.h"
+#include "md5.h"
 #include <string.h>
 
 #define MAX_BC 64
@@ -1541,6 +1542,7 @@ int cli_bytecode_load(struct cli_bc *bc, FILE *f, struct cli_dbio *dbio, int tru
     char firstbuf[FILEBUFF];
     enum parse_state state;
     int rc, end=0;
+    cli_md5_ctx md5;
 
     memset(bc, 0, sizeof(*bc));
     cli_dbgmsg("Loading %s bytecode\n", trust ? "trusted" : "untrusted");
@@ -1554,6 +1556,8 @@ int cli_bytecode_load(struct cli_bc *bc, FILE *f, struct cli_dbio *dbio, int tru
 	return CL_EMALFDB;
     }
     cli_chomp(firstbuf);
+    cli_md5_init(&md5);
+    cli_md5_update(&md5, firstbuf, strlen(firstbuf));
     rc = parseHeader(bc, (unsigned char*)firstbuf, &linelength);
     state = PARSE_BC_LSIG;
     if (rc == CL_BREAK) {
@@ -1579,6 +1583,7 @@ int cli_bytecode_load(struct cli_bc *bc, FILE *f, struct cli_dbio *dbio, int tru
     }
     while (cli_dbgets(buffer, linelength, f, dbio) && !end) {
 	cli_chomp(buffer);
+	cli_md5_update(&md5, buffer, strlen(buffer));
 	row++;
 	switch (state) {
 	    case PARSE_BC_LSIG:
@@ -1691,6 +1696,7 @@ DEAD CODE
 	}
     }
     free(buffer);
+    cli_md5_final(bc->md5, &md5);
     cli_dbgmsg("Parsed %d functions\n", current_func);
     if (sigperf)
 	sigperf_events_init(bc);
@@ -2040,6 +2046,58 @@ static int calc_gepz(struct cli_bc *bc, struct cli_bc_func *func, uint16_t tid,
     return 1;
 }
 
+/* Fuses the pairs the interpreter has a superinstruction for, the first
+ * instruction of the pair executes the second one too and steps over it.
+ * The second one is left as it is. */
+static void prepare_superinsts(struct cli_bc_bb *bb)
+{
+    unsigned k;
+
+    for (k=0;k+1<bb->numInsts;k++) {
+	struct cli_bc_inst *inst = &bb->insts[k];
+	const struct cli_bc_inst *next = &bb->insts[k+1];
+
+	switch (inst->opcode) {
+	    case OP_BC_ICMP_EQ:
+	    case OP_BC_ICMP_NE:
+	    case OP_BC_ICMP_UGT:
+	    case OP_BC_ICMP_UGE:
+	    case OP_BC_ICMP_ULT:
+	    case OP_BC_ICMP_ULE:
+	    case OP_BC_ICMP_SGT:
+	    case OP_BC_ICMP_SGE:
+	    case OP_BC_ICMP_SLE:
+	    case OP_BC_ICMP_SLT:
+		if (next->opcode != OP_BC_BRANCH || next->u.branch.condition != inst->dest)
+		    continue;
+		inst->interp_op = OP_BC_ICMP_BR + inst->interp_op - OP_BC_ICMP_EQ*5;
+		break;
+	    case OP_BC_GEPZ:
+		if (next->opcode != OP_BC_LOAD || next->u.unaryop != inst->dest)
+		    continue;
+		/* stack or pointer base */
+		inst->interp_op = OP_BC_GEP_LOAD + (inst->interp_op%5 ? 5 : 0) + next->interp_op%5;
+		break;
+	    case OP_BC_GEP1:
+		if (next->opcode != OP_BC_LOAD || next->u.unaryop != inst->dest || !(inst->interp_op%5))
+		    continue;
+		inst->interp_op = OP_BC_GEP_LOAD + 10 + next->interp_op%5;
+		break;
+	    case OP_BC_LOAD:
+		/* same width add of the loaded value, not for i1 */
+		if (next->opcode != OP_BC_ADD || !(inst->interp_op%5) ||
+		    next->interp_op%5 != inst->interp_op%5 ||
+		    (next->u.binop[0] != inst->dest && next->u.binop[1] != inst->dest))
+		    continue;
+		inst->interp_op = OP_BC_LOAD_ADD + inst->interp_op%5;
+		break;
+	    default:
+		continue;
+	}
+	k++;
+    }
+}
+
 static int cli_bytecode_prepare_interpreter(struct cli_bc *bc)
 {
     unsigned i, j, k;
@@ -2309,6 +2367,8 @@ static int cli_bytecode_prepare_interpreter(struct cli_bc *bc)
 		    ret = CL_EBYTECODE;
 	    }
 	}
+	for (j=0;j<bcfunc->numBB && ret == CL_SUCCESS;j++)
+	    prepare_superinsts(&bcfunc->BB[j]);
     if (map)
 	    free(map);
     }
@@ -72,6 +72,7 @@ struct cli_bc {
     uint8_t *globalBytes;
     uint32_t sigtime_id, sigmatch_id;
     char * hook_name;
+    unsigned char md5[16];/* of the text up to the source, zero for builtins */
 };
 
 struct cli_all_bc {
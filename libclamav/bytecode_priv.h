@@ -56,7 +56,13 @@ struct cli_bc_cast {
     uint8_t size;/* 0: 1-bit, 1: 8b, 2: 16b, 3: 32b, 4: 64b */
 };
 
-typedef uint8_t interp_op_t;
+/* The interpreter opcodes are opcode*5 + operand size, the superinstructions
+ * (an instruction and the next one, which uses its result) follow them */
+typedef uint16_t interp_op_t;
+#define OP_BC_ICMP_BR (OP_BC_INVALID*5)		/* icmp + branch on it */
+#define OP_BC_GEP_LOAD (OP_BC_ICMP_BR + 50)	/* gepz/gep1 + load through it */
+#define OP_BC_LOAD_ADD (OP_BC_GEP_LOAD + 15)	/* load + add of the loaded value */
+#define OP_BC_INTERP_MAX (OP_BC_LOAD_ADD + 5)
 struct cli_bc_inst {
     enum bc_opcode opcode;
     uint16_t type;
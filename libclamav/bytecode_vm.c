@@ -346,8 +346,30 @@ static always_inline struct stack_entry *pop_stack(struct stack *stack,
 
 #define BINOP(i) inst->u.binop[i]
 
+/* With GNU C every handler jumps straight to the next one through a table of
+ * label addresses, only control transfers and errors go back to the loop.
+ * Otherwise NEXT is the break out of the switch. */
+#ifdef __GNUC__
+#define VM_THREADED
+#endif
+
+#ifdef VM_THREADED
+#define VM_LABEL(label) label:
+#define NEXT {\
+	bb_inst++;\
+	inst++;\
+	CHECK_GT(bb->numInsts, bb_inst);\
+	goto *dispatch[inst->interp_op];\
+    }
+#else
+#define VM_LABEL(label)
+#define NEXT break
+#endif
+#define VM_CASE(label, value) case value: VM_LABEL(label)
+#define CASE_N(opc, n) VM_CASE(L_##opc##_##n, opc*5+n)
+
 #define DEFINE_BINOP_BC_HELPER(opc, OP, W0, W1, W2, W3, W4) \
-    case opc*5: {\
+    CASE_N(opc, 0) {\
 		    uint8_t op0, op1, res;\
 		    int8_t sop0, sop1;\
 		    READ1(op0, BINOP(0));\
@@ -355,9 +377,9 @@ static always_inline struct stack_entry *pop_stack(struct stack *stack,
 		    sop0 = op0; sop1 = op1;\
 		    OP;\
 		    W0(inst->dest, res);\
-		    break;\
+		    NEXT;\
 		}\
-    case opc*5+1: {\
+    CASE_N(opc, 1) {\
 		    uint8_t op0, op1, res;\
 		    int8_t sop0, sop1;\
 		    READ8(op0, BINOP(0));\
@@ -365,9 +387,9 @@ static always_inline struct stack_entry *pop_stack(struct stack *stack,
 		    sop0 = op0; sop1 = op1;\
 		    OP;\
 		    W1(inst->dest, res);\
-		    break;\
+		    NEXT;\
 		}\
-    case opc*5+2: {\
+    CASE_N(opc, 2) {\
 		    uint16_t op0, op1, res;\
 		    int16_t sop0, sop1;\
 		    READ16(op0, BINOP(0));\
@@ -375,9 +397,9 @@ static always_inline struct stack_entry *pop_stack(struct stack *stack,
 		    sop0 = op0; sop1 = op1;\
 		    OP;\
 		    W2(inst->dest, res);\
-		    break;\
+		    NEXT;\
 		}\
-    case opc*5+3: {\
+    CASE_N(opc, 3) {\
 		    uint32_t op0, op1, res;\
 		    int32_t sop0, sop1;\
 		    READ32(op0, BINOP(0));\
@@ -385,9 +407,9 @@ static always_inline struct stack_entry *pop_stack(struct stack *stack,
 		    sop0 = op0; sop1 = op1;\
 		    OP;\
 		    W3(inst->dest, res);\
-		    break;\
+		    NEXT;\
 		}\
-    case opc*5+4: {\
+    CASE_N(opc, 4) {\
 		    uint64_t op0, op1, res;\
 		    int64_t sop0, sop1;\
 		    READ64(op0, BINOP(0));\
@@ -395,7 +417,7 @@ static always_inline struct stack_entry *pop_stack(struct stack *stack,
 		    sop0 = op0; sop1 = op1;\
 		    OP;\
 		    W4(inst->dest, res);\
-		    break;\
+		    NEXT;\
 		}
 
 #define DEFINE_BINOP(opc, OP) DEFINE_BINOP_BC_HELPER(opc, OP, WRITE8, WRITE8, WRITE16, WRITE32, WRITE64)
@@ -404,40 +426,40 @@ static always_inline struct stack_entry *pop_stack(struct stack *stack,
 #define CHECK_OP(cond, msg) if((cond)) { cli_dbgmsg(msg); stop = CL_EBYTECODE; break;}
 
 #define DEFINE_SCASTOP(opc, OP) \
-    case opc*5: {\
+    CASE_N(opc, 0) {\
 		    uint8_t res;\
 		    int8_t sres;\
 		    OP;\
 		    WRITE8(inst->dest, res);\
-		    break;\
+		    NEXT;\
 		}\
-    case opc*5+1: {\
+    CASE_N(opc, 1) {\
 		    uint8_t res;\
 		    int8_t sres;\
 		    OP;\
 		    WRITE8(inst->dest, res);\
-		    break;\
+		    NEXT;\
 		}\
-    case opc*5+2: {\
+    CASE_N(opc, 2) {\
 		    uint16_t res;\
 		    int16_t sres;\
 		    OP;\
 		    WRITE16(inst->dest, res);\
-		    break;\
+		    NEXT;\
 		}\
-    case opc*5+3: {\
+    CASE_N(opc, 3) {\
 		    uint32_t res;\
 		    int32_t sres;\
 		    OP;\
 		    WRITE32(inst->dest, res);\
-		    break;\
+		    NEXT;\
 		}\
-    case opc*5+4: {\
+    CASE_N(opc, 4) {\
 		    uint64_t res;\
 		    int64_t sres;\
 		    OP;\
 		    WRITE64(inst->dest, res);\
-		    break;\
+		    NEXT;\
 		}
 #define DEFINE_CASTOP(opc, OP) DEFINE_SCASTOP(opc, OP; (void)sres)
 
@@ -446,7 +468,7 @@ static always_inline struct stack_entry *pop_stack(struct stack *stack,
     case opc*5+1: /* fall-through */\
     case opc*5+2: /* fall-through */\
     case opc*5+3: /* fall-through */\
-    case opc*5+4:
+    VM_CASE(L_##opc, opc*5+4)
 
 #define CHOOSE(OP0, OP1, OP2, OP3, OP4) \
     switch (inst->u.cast.size) {\
@@ -458,8 +480,8 @@ static always_inline struct stack_entry *pop_stack(struct stack *stack,
 	default: CHECK_UNREACHABLE;\
     }
 
-#define DEFINE_OP_BC_RET_N(OP, T, R0, W0) \
-    case OP: {\
+#define DEFINE_OP_BC_RET_N(opc, n, T, R0, W0) \
+    CASE_N(opc, n) {\
 		T tmp;\
 		R0(tmp, inst->u.unaryop);\
 		CHECK_GT(stack_depth, 0);\
@@ -475,9 +497,82 @@ static always_inline struct stack_entry *pop_stack(struct stack *stack,
 		}\
 		stackid = ptr_register_stack(&ptrinfos, values, 0, func->numBytes)>>32;\
 		inst = &bb->insts[bb_inst];\
-		break;\
+		NEXT;\
 	    }
 
+/* icmp fused with the branch after it: the result is still stored for
+ * the other users */
+#define DEFINE_ICMPOP_BR_N(opc, n, T, ST, R, OP) \
+    VM_CASE(L_BR_##opc##_##n, OP_BC_ICMP_BR+(opc-OP_BC_ICMP_EQ)*5+n) {\
+		    T op0, op1;\
+		    ST sop0, sop1;\
+		    uint8_t res;\
+		    R(op0, BINOP(0));\
+		    R(op1, BINOP(1));\
+		    sop0 = op0; sop1 = op1;\
+		    (void)sop0; (void)sop1;\
+		    OP;\
+		    WRITE8(inst->dest, res);\
+		    inst++;\
+		    stop = jump(func, res ? inst->u.branch.br_true : inst->u.branch.br_false,\
+				&bb, &inst, &bb_inst);\
+		    continue;\
+		}
+
+#define DEFINE_ICMPOP_BR(opc, OP) \
+    DEFINE_ICMPOP_BR_N(opc, 0, uint8_t, int8_t, READ1, OP)\
+    DEFINE_ICMPOP_BR_N(opc, 1, uint8_t, int8_t, READ8, OP)\
+    DEFINE_ICMPOP_BR_N(opc, 2, uint16_t, int16_t, READ16, OP)\
+    DEFINE_ICMPOP_BR_N(opc, 3, uint32_t, int32_t, READ32, OP)\
+    DEFINE_ICMPOP_BR_N(opc, 4, uint64_t, int64_t, READ64, OP)
+
+/* gepz (stack or pointer base) or gep1 fused with the load through the
+ * pointer it computes, the pointer isn't read back from the values */
+#define DEFINE_GEP_LOAD_N(n, T, W, V) \
+    case OP_BC_GEP_LOAD+n: /* fall-through */\
+    case OP_BC_GEP_LOAD+5+n: /* fall-through */\
+    VM_CASE(L_GEP_LOAD_##n, OP_BC_GEP_LOAD+10+n) {\
+		    int64_t ptr;\
+		    int32_t off;\
+		    T *p;\
+		    READ32(off, inst->u.three[2]);\
+		    if (inst->interp_op < OP_BC_GEP_LOAD+5) {\
+			ptr = ptr_compose(stackid, inst->u.three[1]+off);\
+		    } else {\
+			READ64(ptr, inst->u.three[1]);\
+			if (inst->interp_op < OP_BC_GEP_LOAD+10)\
+			    ptr += off;\
+			else\
+			    ptr += off*inst->u.three[0];\
+		    }\
+		    WRITE64(inst->dest, ptr);\
+		    inst++;\
+		    bb_inst++;\
+		    p = ptr_torealptr(&ptrinfos, ptr, sizeof(*p));\
+		    if (!p) {\
+			stop = CL_EBYTECODE;\
+			break;\
+		    }\
+		    W(inst->dest, V);\
+		    NEXT;\
+		}
+
+/* load fused with the add of the loaded value to another operand, the
+ * loaded value is stored for the other users */
+#define DEFINE_LOAD_ADD_N(n, T, PT, W, R, V) \
+    VM_CASE(L_LOAD_ADD_##n, OP_BC_LOAD_ADD+n) {\
+		    PT *p;\
+		    T v, op;\
+		    READPOP(p, inst->u.unaryop, sizeof(*p));\
+		    v = V;\
+		    W(inst->dest, v);\
+		    inst++;\
+		    bb_inst++;\
+		    R(op, BINOP(BINOP(0) == inst[-1].dest));\
+		    W(inst->dest, (T)(v + op));\
+		    NEXT;\
+		}
+
 struct ptr_info {
     uint8_t *base;
     uint32_t size;
@@ -628,6 +723,34 @@ static unsigned globaltypesize(uint16_t id)
     }
 }
 
+/* The timeout is checked after about VM_BUDGET opcodes worth of work. A basic
+ * block is charged in full when it is entered, memory intrinsics and API
+ * calls are charged extra for the bytes they touch, so expensive iterations
+ * can't run for long between two reads of the clock. */
+#define VM_BUDGET 5000
+#define VM_API_COST 64
+#define VM_BYTES_PER_OP 64
+#define VM_CHARGE(n) (budget -= (n))
+#define VM_CHARGE_BYTES(n) (budget -= (uint32_t)(n)/VM_BYTES_PER_OP)
+
+#ifdef VM_THREADED
+#define DISPATCH_N(opc) \
+    [opc*5] = &&L_##opc##_0, [opc*5+1] = &&L_##opc##_1,\
+    [opc*5+2] = &&L_##opc##_2, [opc*5+3] = &&L_##opc##_3,\
+    [opc*5+4] = &&L_##opc##_4
+#define DISPATCH_OP(opc) [opc*5 ... opc*5+4] = &&L_##opc
+#define DISPATCH_BR(opc) \
+    [OP_BC_ICMP_BR+(opc-OP_BC_ICMP_EQ)*5] = &&L_BR_##opc##_0,\
+    [OP_BC_ICMP_BR+(opc-OP_BC_ICMP_EQ)*5+1] = &&L_BR_##opc##_1,\
+    [OP_BC_ICMP_BR+(opc-OP_BC_ICMP_EQ)*5+2] = &&L_BR_##opc##_2,\
+    [OP_BC_ICMP_BR+(opc-OP_BC_ICMP_EQ)*5+3] = &&L_BR_##opc##_3,\
+    [OP_BC_ICMP_BR+(opc-OP_BC_ICMP_EQ)*5+4] = &&L_BR_##opc##_4
+#define DISPATCH_GEP_LOAD(n) \
+    [OP_BC_GEP_LOAD+n] = &&L_GEP_LOAD_##n,\
+    [OP_BC_GEP_LOAD+5+n] = &&L_GEP_LOAD_##n,\
+    [OP_BC_GEP_LOAD+10+n] = &&L_GEP_LOAD_##n
+#endif
+
 /* TODO: fix the APIs too */
 static struct {
     cli_apicall_pointer api;
@@ -640,6 +763,7 @@ static struct {
 int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct cli_bc_func *func, const struct cli_bc_inst *inst)
 {
     unsigned i, j, stack_depth=0, bb_inst=0, stop=0, pc=0;
+    int64_t budget=VM_BUDGET;
     struct cli_bc_func *func2;
     struct stack stack;
     struct stack_entry *stack_entry = NULL;
@@ -649,6 +773,47 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
     struct ptr_infos ptrinfos;
     struct timeval tv0, tv1, timeout;
     int stackid = 0;
+#ifdef VM_THREADED
+    static const void *const dispatch[OP_BC_INTERP_MAX] = {
+	[0 ... 4] = &&L_default,
+	DISPATCH_N(OP_BC_ADD), DISPATCH_N(OP_BC_SUB), DISPATCH_N(OP_BC_MUL),
+	DISPATCH_N(OP_BC_UDIV), DISPATCH_N(OP_BC_SDIV), DISPATCH_N(OP_BC_UREM),
+	DISPATCH_N(OP_BC_SREM), DISPATCH_N(OP_BC_SHL), DISPATCH_N(OP_BC_LSHR),
+	DISPATCH_N(OP_BC_ASHR), DISPATCH_N(OP_BC_AND), DISPATCH_N(OP_BC_OR),
+	DISPATCH_N(OP_BC_XOR),
+	DISPATCH_N(OP_BC_TRUNC), DISPATCH_N(OP_BC_SEXT), DISPATCH_N(OP_BC_ZEXT),
+	DISPATCH_OP(OP_BC_BRANCH), DISPATCH_OP(OP_BC_JMP),
+	DISPATCH_N(OP_BC_RET), DISPATCH_N(OP_BC_RET_VOID),
+	DISPATCH_N(OP_BC_ICMP_EQ), DISPATCH_N(OP_BC_ICMP_NE),
+	DISPATCH_N(OP_BC_ICMP_UGT), DISPATCH_N(OP_BC_ICMP_UGE),
+	DISPATCH_N(OP_BC_ICMP_ULT), DISPATCH_N(OP_BC_ICMP_ULE),
+	DISPATCH_N(OP_BC_ICMP_SGT), DISPATCH_N(OP_BC_ICMP_SGE),
+	DISPATCH_N(OP_BC_ICMP_SLE), DISPATCH_N(OP_BC_ICMP_SLT),
+	DISPATCH_N(OP_BC_SELECT),
+	DISPATCH_OP(OP_BC_CALL_DIRECT), DISPATCH_OP(OP_BC_CALL_API),
+	DISPATCH_N(OP_BC_COPY),
+	DISPATCH_OP(OP_BC_GEP1), DISPATCH_OP(OP_BC_GEPZ),
+	[OP_BC_GEPN*5 ... OP_BC_GEPN*5+4] = &&L_default,
+	DISPATCH_N(OP_BC_STORE), DISPATCH_N(OP_BC_LOAD),
+	DISPATCH_OP(OP_BC_MEMSET), DISPATCH_OP(OP_BC_MEMCPY),
+	DISPATCH_OP(OP_BC_MEMMOVE), DISPATCH_OP(OP_BC_MEMCMP),
+	DISPATCH_OP(OP_BC_ISBIGENDIAN),
+	[OP_BC_ABORT*5 ... OP_BC_ABORT*5+4] = &&L_default,
+	DISPATCH_OP(OP_BC_BSWAP16), DISPATCH_OP(OP_BC_BSWAP32),
+	DISPATCH_OP(OP_BC_BSWAP64), DISPATCH_OP(OP_BC_PTRDIFF32),
+	DISPATCH_OP(OP_BC_PTRTOINT64),
+	DISPATCH_BR(OP_BC_ICMP_EQ), DISPATCH_BR(OP_BC_ICMP_NE),
+	DISPATCH_BR(OP_BC_ICMP_UGT), DISPATCH_BR(OP_BC_ICMP_UGE),
+	DISPATCH_BR(OP_BC_ICMP_ULT), DISPATCH_BR(OP_BC_ICMP_ULE),
+	DISPATCH_BR(OP_BC_ICMP_SGT), DISPATCH_BR(OP_BC_ICMP_SGE),
+	DISPATCH_BR(OP_BC_ICMP_SLE), DISPATCH_BR(OP_BC_ICMP_SLT),
+	DISPATCH_GEP_LOAD(0), DISPATCH_GEP_LOAD(1), DISPATCH_GEP_LOAD(2),
+	DISPATCH_GEP_LOAD(3), DISPATCH_GEP_LOAD(4),
+	[OP_BC_LOAD_ADD] = &&L_default,
+	[OP_BC_LOAD_ADD+1] = &&L_LOAD_ADD_1, [OP_BC_LOAD_ADD+2] = &&L_LOAD_ADD_2,
+	[OP_BC_LOAD_ADD+3] = &&L_LOAD_ADD_3, [OP_BC_LOAD_ADD+4] = &&L_LOAD_ADD_4
+    };
+#endif
 
     memset(&ptrinfos, 0, sizeof(ptrinfos));
     memset(&stack, 0, sizeof(stack));
@@ -672,8 +837,11 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
     timeout.tv_usec %= 1000000;
 
     do {
-	pc++;
-	if (!(pc % 5000)) {
+	if (!bb_inst)
+	    VM_CHARGE(bb ? bb->numInsts : 1);
+	if (UNLIKELY(budget <= 0)) {
+	    pc += VM_BUDGET - budget;
+	    budget = VM_BUDGET;
 	    gettimeofday(&tv1, NULL);
 	    if (tv1.tv_sec > timeout.tv_sec ||
 		(tv1.tv_sec == timeout.tv_sec &&
@@ -737,17 +905,17 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 		stop = jump(func, inst->u.jump, &bb, &inst, &bb_inst);
 		continue;
 
-	    DEFINE_OP_BC_RET_N(OP_BC_RET*5, uint8_t, READ1, WRITE8);
-	    DEFINE_OP_BC_RET_N(OP_BC_RET*5+1, uint8_t, READ8, WRITE8);
-	    DEFINE_OP_BC_RET_N(OP_BC_RET*5+2, uint16_t, READ16, WRITE16);
-	    DEFINE_OP_BC_RET_N(OP_BC_RET*5+3, uint32_t, READ32, WRITE32);
-	    DEFINE_OP_BC_RET_N(OP_BC_RET*5+4, uint64_t, READ64, WRITE64);
+	    DEFINE_OP_BC_RET_N(OP_BC_RET, 0, uint8_t, READ1, WRITE8);
+	    DEFINE_OP_BC_RET_N(OP_BC_RET, 1, uint8_t, READ8, WRITE8);
+	    DEFINE_OP_BC_RET_N(OP_BC_RET, 2, uint16_t, READ16, WRITE16);
+	    DEFINE_OP_BC_RET_N(OP_BC_RET, 3, uint32_t, READ32, WRITE32);
+	    DEFINE_OP_BC_RET_N(OP_BC_RET, 4, uint64_t, READ64, WRITE64);
 
-	    DEFINE_OP_BC_RET_N(OP_BC_RET_VOID*5, uint8_t, (void), (void));
-	    DEFINE_OP_BC_RET_N(OP_BC_RET_VOID*5+1, uint8_t, (void), (void));
-	    DEFINE_OP_BC_RET_N(OP_BC_RET_VOID*5+2, uint8_t, (void), (void));
-	    DEFINE_OP_BC_RET_N(OP_BC_RET_VOID*5+3, uint8_t, (void), (void));
-	    DEFINE_OP_BC_RET_N(OP_BC_RET_VOID*5+4, uint8_t, (void), (void));
+	    DEFINE_OP_BC_RET_N(OP_BC_RET_VOID, 0, uint8_t, (void), (void));
+	    DEFINE_OP_BC_RET_N(OP_BC_RET_VOID, 1, uint8_t, (void), (void));
+	    DEFINE_OP_BC_RET_N(OP_BC_RET_VOID, 2, uint8_t, (void), (void));
+	    DEFINE_OP_BC_RET_N(OP_BC_RET_VOID, 3, uint8_t, (void), (void));
+	    DEFINE_OP_BC_RET_N(OP_BC_RET_VOID, 4, uint8_t, (void), (void));
 
 	    DEFINE_ICMPOP(OP_BC_ICMP_EQ, res = (op0 == op1));
 	    DEFINE_ICMPOP(OP_BC_ICMP_NE, res = (op0 != op1));
@@ -760,25 +928,36 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 	    DEFINE_ICMPOP(OP_BC_ICMP_SLE, res = (sop0 <= sop1));
 	    DEFINE_ICMPOP(OP_BC_ICMP_SLT, res = (sop0 < sop1));
 
-	    case OP_BC_SELECT*5:
+	    DEFINE_ICMPOP_BR(OP_BC_ICMP_EQ, res = (op0 == op1));
+	    DEFINE_ICMPOP_BR(OP_BC_ICMP_NE, res = (op0 != op1));
+	    DEFINE_ICMPOP_BR(OP_BC_ICMP_UGT, res = (op0 > op1));
+	    DEFINE_ICMPOP_BR(OP_BC_ICMP_UGE, res = (op0 >= op1));
+	    DEFINE_ICMPOP_BR(OP_BC_ICMP_ULT, res = (op0 < op1));
+	    DEFINE_ICMPOP_BR(OP_BC_ICMP_ULE, res = (op0 <= op1));
+	    DEFINE_ICMPOP_BR(OP_BC_ICMP_SGT, res = (sop0 > sop1));
+	    DEFINE_ICMPOP_BR(OP_BC_ICMP_SGE, res = (sop0 >= sop1));
+	    DEFINE_ICMPOP_BR(OP_BC_ICMP_SLE, res = (sop0 <= sop1));
+	    DEFINE_ICMPOP_BR(OP_BC_ICMP_SLT, res = (sop0 < sop1));
+
+	    CASE_N(OP_BC_SELECT, 0)
 	    {
 		uint8_t t0, t1, t2;
 		READ1(t0, inst->u.three[0]);
 		READ1(t1, inst->u.three[1]);
 		READ1(t2, inst->u.three[2]);
 		WRITE8(inst->dest, t0 ? t1 : t2);
-		break;
+		NEXT;
 	    }
-	    case OP_BC_SELECT*5+1:
+	    CASE_N(OP_BC_SELECT, 1)
 	    {
 	        uint8_t t0, t1, t2;
 		READ1(t0, inst->u.three[0]);
 		READ8(t1, inst->u.three[1]);
 		READ8(t2, inst->u.three[2]);
 		WRITE8(inst->dest, t0 ? t1 : t2);
-		break;
+		NEXT;
 	    }
-	    case OP_BC_SELECT*5+2:
+	    CASE_N(OP_BC_SELECT, 2)
 	    {
 	        uint8_t t0;
 		uint16_t t1, t2;
@@ -786,9 +965,9 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 		READ16(t1, inst->u.three[1]);
 		READ16(t2, inst->u.three[2]);
 		WRITE16(inst->dest, t0 ? t1 : t2);
-		break;
+		NEXT;
 	    }
-	    case OP_BC_SELECT*5+3:
+	    CASE_N(OP_BC_SELECT, 3)
 	    {
 	        uint8_t t0;
 		uint32_t t1, t2;
@@ -796,9 +975,9 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 		READ32(t1, inst->u.three[1]);
 		READ32(t2, inst->u.three[2]);
 		WRITE32(inst->dest, t0 ? t1 : t2);
-		break;
+		NEXT;
 	    }
-	    case OP_BC_SELECT*5+4:
+	    CASE_N(OP_BC_SELECT, 4)
 	    {
 	        uint8_t t0;
 		uint64_t t1, t2;
@@ -806,7 +985,7 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 		READ64(t1, inst->u.three[1]);
 		READ64(t2, inst->u.three[2]);
 		WRITE64(inst->dest, t0 ? t1 : t2);
-		break;
+		NEXT;
 	    }
 
 	    DEFINE_OP(OP_BC_CALL_API) {
@@ -815,6 +994,7 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 		int64_t res64;
 		CHECK_APIID(inst->u.ops.funcid);
 		TRACE_API(api->name, inst->dest, inst->type, stack_depth);
+		VM_CHARGE(VM_API_COST);
 	        switch (api->kind) {
 		    case 0: {
 			int32_t a, b;
@@ -838,6 +1018,7 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 			    }
 			}
 			READPOP(arg1, inst->u.ops.ops[0], arg1size);
+			VM_CHARGE_BYTES(arg2);
 			res32 = cli_apicalls1[api->idx](ctx, arg1, arg2);
 			WRITE32(inst->dest, res32);
 			break;
@@ -853,6 +1034,7 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 			int32_t a;
 			void *resp;
 			READ32(a, inst->u.ops.ops[0]);
+			VM_CHARGE_BYTES(a);
 			resp = cli_apicalls3[api->idx](ctx, a);
 			res64 = ptr_register_glob(&ptrinfos, resp, a);
 			WRITE64(inst->dest, res64);
@@ -867,6 +1049,7 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 			READ32(arg3, inst->u.ops.ops[2]);
 			READ32(arg4, inst->u.ops.ops[3]);
 			READ32(arg5, inst->u.ops.ops[4]);
+			VM_CHARGE_BYTES(arg2);
 			res32 = cli_apicalls4[api->idx](ctx, arg1, arg2, arg3, arg4, arg5);
 			WRITE32(inst->dest, res32);
 			break;
@@ -881,6 +1064,7 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 			void *resp;
 			READ32(arg1, inst->u.ops.ops[0]);
 			READ32(arg2, inst->u.ops.ops[1]);
+			VM_CHARGE_BYTES(arg2);
 			resp = cli_apicalls6[api->idx](ctx, arg1, arg2);
 			res64 = ptr_register_glob(&ptrinfos, resp, arg2);
 			WRITE64(inst->dest, res64);
@@ -904,6 +1088,8 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 			READP(arg1, inst->u.ops.ops[0], arg2);
 			READ32(arg4, inst->u.ops.ops[3]);
 			READP(arg3, inst->u.ops.ops[2], arg4);
+			VM_CHARGE_BYTES(arg2);
+			VM_CHARGE_BYTES(arg4);
 			resp = cli_apicalls8[api->idx](ctx, arg1, arg2, arg3, arg4);
 			WRITE32(inst->dest, resp);
 			break;
@@ -916,6 +1102,7 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 			/* check that arg2 is size of arg1 */
 			READP(arg1, inst->u.ops.ops[0], arg2);
 			READ32(arg3, inst->u.ops.ops[2]);
+			VM_CHARGE_BYTES(arg2);
 			resp = cli_apicalls9[api->idx](ctx, arg1, arg2, arg3);
 			WRITE32(inst->dest, resp);
 			break;
@@ -924,7 +1111,9 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 			cli_warnmsg("bytecode: type %u apicalls not yet implemented!\n", api->kind);
 			stop = CL_EBYTECODE;
 		}
-		break;
+		if (stop != CL_SUCCESS)
+		    break;
+		NEXT;
 	    }
 
 	    DEFINE_OP(OP_BC_CALL_DIRECT)
@@ -992,120 +1181,120 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 		stack_depth++;
 		continue;
 
-	    case OP_BC_COPY*5:
+	    CASE_N(OP_BC_COPY, 0)
 	    {
 		uint8_t op;
 		READ1(op, BINOP(0));
 		WRITE8(BINOP(1), op);
-		break;
+		NEXT;
 	    }
-	    case OP_BC_COPY*5+1:
+	    CASE_N(OP_BC_COPY, 1)
 	    {
 		uint8_t op;
 		READ8(op, BINOP(0));
 		WRITE8(BINOP(1), op);
-		break;
+		NEXT;
 	    }
-	    case OP_BC_COPY*5+2:
+	    CASE_N(OP_BC_COPY, 2)
 	    {
 		uint16_t op;
 		READ16(op, BINOP(0));
 		WRITE16(BINOP(1), op);
-		break;
+		NEXT;
 	    }
-	    case OP_BC_COPY*5+3:
+	    CASE_N(OP_BC_COPY, 3)
 	    {
 		uint32_t op;
 		READ32(op, BINOP(0));
 		WRITE32(BINOP(1), op);
-		break;
+		NEXT;
 	    }
-	    case OP_BC_COPY*5+4:
+	    CASE_N(OP_BC_COPY, 4)
 	    {
 		uint64_t op;
 		READ64(op, BINOP(0));
 		WRITE64(BINOP(1), op);
-		break;
+		NEXT;
 	    }
 
-	    case OP_BC_LOAD*5:
-	    case OP_BC_LOAD*5+1:
+	    CASE_N(OP_BC_LOAD, 0)
+	    CASE_N(OP_BC_LOAD, 1)
 	    {
 		uint8_t *ptr;
 		READPOP(ptr, inst->u.unaryop, 1);
 		WRITE8(inst->dest, (*ptr));
-		break;
+		NEXT;
 	    }
-	    case OP_BC_LOAD*5+2:
+	    CASE_N(OP_BC_LOAD, 2)
 	    {
 		const union unaligned_16 *ptr;
 		READPOP(ptr, inst->u.unaryop, 2);
 		WRITE16(inst->dest, (ptr->una_u16));
-		break;
+		NEXT;
 	    }
-	    case OP_BC_LOAD*5+3:
+	    CASE_N(OP_BC_LOAD, 3)
 	    {
 		const union unaligned_32 *ptr;
 		READPOP(ptr, inst->u.unaryop, 4);
 		WRITE32(inst->dest, (ptr->una_u32));
-		break;
+		NEXT;
 	    }
-	    case OP_BC_LOAD*5+4:
+	    CASE_N(OP_BC_LOAD, 4)
 	    {
 		const union unaligned_64 *ptr;
 		READPOP(ptr, inst->u.unaryop, 8);
 		WRITE64(inst->dest, (ptr->una_u64));
-		break;
+		NEXT;
 	    }
 
-	    case OP_BC_STORE*5:
+	    CASE_N(OP_BC_STORE, 0)
 	    {
 		uint8_t *ptr;
 		uint8_t v;
 		READP(ptr, BINOP(1), 1);
 		READ1(v, BINOP(0));
 		*ptr = v;
-		break;
+		NEXT;
 	    }
-	    case OP_BC_STORE*5+1:
+	    CASE_N(OP_BC_STORE, 1)
 	    {
 		uint8_t *ptr;
 		uint8_t v;
 		READP(ptr, BINOP(1), 1);
 		READ8(v, BINOP(0));
 		*ptr = v;
-		break;
+		NEXT;
 	    }
-	    case OP_BC_STORE*5+2:
+	    CASE_N(OP_BC_STORE, 2)
 	    {
 		union unaligned_16 *ptr;
 		uint16_t v;
 		READP(ptr, BINOP(1), 2);
 		READ16(v, BINOP(0));
 		ptr->una_s16 = v;
-		break;
+		NEXT;
 	    }
-	    case OP_BC_STORE*5+3:
+	    CASE_N(OP_BC_STORE, 3)
 	    {
 		union unaligned_32 *ptr;
 		uint32_t v;
 		READP(ptr, BINOP(1), 4);
 		READ32(v, BINOP(0));
 		ptr->una_u32 = v;
-		break;
+		NEXT;
 	    }
-	    case OP_BC_STORE*5+4:
+	    CASE_N(OP_BC_STORE, 4)
 	    {
 		union unaligned_64 *ptr;
 		uint64_t v;
 		READP(ptr, BINOP(1), 8);
 		READ64(v, BINOP(0));
 		ptr->una_u64 = v;
-		break;
+		NEXT;
 	    }
 	    DEFINE_OP(OP_BC_ISBIGENDIAN) {
 		WRITE8(inst->dest, WORDS_BIGENDIAN);
-		break;
+		NEXT;
 	    }
 	    DEFINE_OP(OP_BC_GEPZ) {
 		int64_t ptr;
@@ -1120,7 +1309,7 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 		    READ64(ptr, inst->u.three[1]);
 		    WRITE64(inst->dest, ptr+off);
 		}
-		break;
+		NEXT;
 	    }
 	    DEFINE_OP(OP_BC_MEMCMP) {
 		int32_t arg3;
@@ -1128,8 +1317,9 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 		READ32(arg3, inst->u.three[2]);
 		READPOP(arg1, inst->u.three[0], arg3);
 		READPOP(arg2, inst->u.three[1], arg3);
+		VM_CHARGE_BYTES(arg3);
 		WRITE32(inst->dest, memcmp(arg1, arg2, arg3));
-		break;
+		NEXT;
 	    }
 	    DEFINE_OP(OP_BC_MEMCPY) {
 		int64_t arg3;
@@ -1139,10 +1329,11 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 		READ32(arg3, inst->u.three[2]);
 		READPOP(arg1, inst->u.three[0], arg3);
 		READPOP(arg2, inst->u.three[1], arg3);
+		VM_CHARGE_BYTES(arg3);
 		memcpy(arg1, arg2, (int32_t)arg3);
 /*		READ64(res, inst->u.three[0]);*/
 		WRITE64(inst->dest, res);
-		break;
+		NEXT;
 	    }
 	    DEFINE_OP(OP_BC_MEMMOVE) {
 		int64_t arg3;
@@ -1152,10 +1343,11 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 		READ64(arg3, inst->u.three[2]);
 		READPOP(arg1, inst->u.three[0], arg3);
 		READPOP(arg2, inst->u.three[1], arg3);
+		VM_CHARGE_BYTES(arg3);
 		memmove(arg1, arg2, (int32_t)arg3);
 /*		READ64(res, inst->u.three[0]);*/
 		WRITE64(inst->dest, res);
-		break;
+		NEXT;
 	    }
 	    DEFINE_OP(OP_BC_MEMSET) {
 		int64_t arg3;
@@ -1166,28 +1358,29 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 		READ64(arg3, inst->u.three[2]);
 		READPOP(arg1, inst->u.three[0], arg3);
 		READ32(arg2, inst->u.three[1]);
+		VM_CHARGE_BYTES(arg3);
 		memset(arg1, arg2, (int32_t)arg3);
 /*		READ64(res, inst->u.three[0]);*/
 		WRITE64(inst->dest, res);
-		break;
+		NEXT;
 	    }
 	    DEFINE_OP(OP_BC_BSWAP16) {
 		int16_t arg1;
 		READ16(arg1, inst->u.unaryop);
 		WRITE16(inst->dest, cbswap16(arg1));
-		break;
+		NEXT;
 	    }
 	    DEFINE_OP(OP_BC_BSWAP32) {
 		int32_t arg1;
 		READ32(arg1, inst->u.unaryop);
 		WRITE32(inst->dest, cbswap32(arg1));
-		break;
+		NEXT;
 	    }
 	    DEFINE_OP(OP_BC_BSWAP64) {
 		int64_t arg1;
 		READ64(arg1, inst->u.unaryop);
 		WRITE64(inst->dest, cbswap64(arg1));
-		break;
+		NEXT;
 	    }
 	    DEFINE_OP(OP_BC_PTRDIFF32) {
 		int64_t ptr1, ptr2;
@@ -1200,7 +1393,7 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 		else
 		    READ64(ptr2, BINOP(1));
 		WRITE32(inst->dest, ptr_diff32(ptr1, ptr2));
-		break;
+		NEXT;
 	    }
 	    DEFINE_OP(OP_BC_PTRTOINT64) {
 		int64_t ptr;
@@ -1209,7 +1402,7 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 		else
 		    READ64(ptr, BINOP(0));
 		WRITE64(inst->dest, ptr);
-		break;
+		NEXT;
 	    }
 	    DEFINE_OP(OP_BC_GEP1) {
 		int64_t ptr;
@@ -1224,10 +1417,20 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 		    READ64(ptr, inst->u.three[1]);
 		    WRITE64(inst->dest, ptr+off*inst->u.three[0]);
 		}
-		break;
+		NEXT;
 	    }
+	    DEFINE_GEP_LOAD_N(0, const uint8_t, WRITE8, (*p));
+	    DEFINE_GEP_LOAD_N(1, const uint8_t, WRITE8, (*p));
+	    DEFINE_GEP_LOAD_N(2, const union unaligned_16, WRITE16, (p->una_u16));
+	    DEFINE_GEP_LOAD_N(3, const union unaligned_32, WRITE32, (p->una_u32));
+	    DEFINE_GEP_LOAD_N(4, const union unaligned_64, WRITE64, (p->una_u64));
+	    DEFINE_LOAD_ADD_N(1, uint8_t, const uint8_t, WRITE8, READ8, (*p));
+	    DEFINE_LOAD_ADD_N(2, uint16_t, const union unaligned_16, WRITE16, READ16, (p->una_u16));
+	    DEFINE_LOAD_ADD_N(3, uint32_t, const union unaligned_32, WRITE32, READ32, (p->una_u32));
+	    DEFINE_LOAD_ADD_N(4, uint64_t, const union unaligned_64, WRITE64, READ64, (p->una_u64));
 	    /* TODO: implement OP_BC_GEP1, OP_BC_GEP2, OP_BC_GEPN */
 	    default:
+	    VM_LABEL(L_default)
 		cli_errmsg("Opcode %u of type %u is not implemented yet!\n",
 			   inst->interp_op/5, inst->interp_op%5);
 		stop = CL_EARG;
@@ -1244,7 +1447,7 @@ int cli_vm_execute(const struct cli_bc *bc, struct cli_bc_ctx *ctx, const struct
 	tv1.tv_sec -= tv0.tv_sec;
 	tv1.tv_usec -= tv0.tv_usec;
 	cli_dbgmsg("intepreter bytecode run finished in %luus, after executing %u opcodes\n",
-		   tv1.tv_sec*1000000 + tv1.tv_usec, pc);
+		   tv1.tv_sec*1000000 + tv1.tv_usec, (unsigned)(pc + VM_BUDGET - budget));
     }
     if (stop == CL_EBYTECODE) {
 	cli_event_error_str(ctx->bc_events, "interpreter finished with error\n");
@@ -104,6 +104,7 @@ void LLVMInitializePowerPCAsmPrinter();
 #include <new>
 #include <cerrno>
 #include <string>
+#include <vector>
 
 //#define TIMING
 #undef TIMING
@@ -141,15 +142,25 @@ extern "C" {
 extern "C" unsigned int cli_rndnum(unsigned int max);
 using namespace llvm;
 typedef DenseMap<const struct cli_bc_func*, void*> FunctionMapTy;
-struct cli_bcengine {
+// The JIT and the code it generated. The engines loading the same set of
+// bytecodes (a reload with bytecode.cvd unchanged) share it instead of
+// compiling everything again.
+struct cli_bcjit {
     ExecutionEngine *EE;
     JITEventListener *Listener;
     LLVMContext Context;
-    FunctionMapTy compiledFunctions;
     union {
 	unsigned char b[16];
 	void* align;/* just to align field to ptr */
     } guard;
+    unsigned refs;
+    unsigned char key[16];
+    std::vector<void*> entries;/* entrypoint of each bytecode, by index */
+    struct cli_bcjit *next;
+};
+struct cli_bcengine {
+    struct cli_bcjit *jit;
+    FunctionMapTy compiledFunctions;
 };
 
 extern "C" uint8_t cli_debug_flag;
@@ -2223,6 +2234,53 @@ static void addFPasses(FunctionPassManager &FPM, bool trusted, const TargetData
     FPM.add(createDeadCodeEliminationPass());
 }
 
+// The JITs of the sets of bytecodes in use, protected by the LLVM API lock
+static struct cli_bcjit *jit_cache = NULL;
+
+// Hashes the bytecodes and whether each is for the JIT, fails if one of
+// them isn't loaded from a database. The code compiled for a key is only
+// shared in this process, where the LLVM version and the host CPU are
+// always the same.
+static bool jitKey(const struct cli_all_bc *bcs, unsigned char *key)
+{
+    static const unsigned char nomd5[16] = { 0 };
+    cli_md5_ctx ctx;
+
+    cli_md5_init(&ctx);
+    cli_md5_update(&ctx, &bcs->count, sizeof(bcs->count));
+    for (unsigned i=0;i<bcs->count;i++) {
+	const struct cli_bc *bc = &bcs->all_bcs[i];
+	unsigned char flags[2];
+	flags[0] = bc->trusted;
+	flags[1] = bc->state == bc_skip || bc->state == bc_interp;
+	if (!flags[1] && !memcmp(bc->md5, nomd5, sizeof(nomd5)))
+	    return false;
+	cli_md5_update(&ctx, flags, sizeof(flags));
+	cli_md5_update(&ctx, bc->md5, sizeof(bc->md5));
+    }
+    cli_md5_final(key, &ctx);
+    return true;
+}
+
+static void jitRelease(struct cli_bcjit *jit)
+{
+    if (--jit->refs)
+	return;
+    for (struct cli_bcjit **p = &jit_cache; *p; p = &(*p)->next) {
+	if (*p == jit) {
+	    *p = jit->next;
+	    break;
+	}
+    }
+    if (jit->EE) {
+	if (jit->Listener)
+	    jit->EE->UnregisterJITEventListener(jit->Listener);
+	delete jit->EE;
+    }
+    delete jit->Listener;
+    delete jit;
+}
+
 int cli_bytecode_prepare_jit(struct cli_all_bc *bcs)
 {
   if (!bcs->engine)
@@ -2233,7 +2291,39 @@ int cli_bytecode_prepare_jit(struct cli_all_bc *bcs)
   HANDLER_TRY(handler) {
   // LLVM itself never throws exceptions, but operator new may throw bad_alloc
   try {
-    Module *M = new Module("ClamAV jit module", bcs->engine->Context);
+    unsigned char key[16];
+    bool cacheable = jitKey(bcs, key);
+    struct cli_bcjit *jit;
+
+    if (bcs->engine->jit) {
+	jitRelease(bcs->engine->jit);
+	bcs->engine->jit = 0;
+    }
+    bcs->engine->compiledFunctions.clear();
+    for (jit = cacheable ? jit_cache : 0; jit; jit = jit->next) {
+	if (!memcmp(jit->key, key, sizeof(key)))
+	    break;
+    }
+    if (jit) {
+	jit->refs++;
+	bcs->engine->jit = jit;
+	for (unsigned i=0;i<bcs->count;i++) {
+	    if (!jit->entries[i])
+		continue;
+	    bcs->engine->compiledFunctions[&bcs->all_bcs[i].funcs[0]] = jit->entries[i];
+	    bcs->all_bcs[i].state = bc_jit;
+	}
+	if (cli_debug_flag)
+	    cli_dbgmsg_internal("[Bytecode JIT]: reusing the code of %u bytecodes\n", bcs->count);
+	return CL_SUCCESS;
+    }
+
+    jit = bcs->engine->jit = new cli_bcjit;
+    jit->EE = 0;
+    jit->Listener = 0;
+    jit->refs = 1;
+    jit->next = 0;
+    Module *M = new Module("ClamAV jit module", jit->Context);
     {
 	// Create the JIT.
 	std::string ErrorMsg;
@@ -2241,7 +2331,7 @@ int cli_bytecode_prepare_jit(struct cli_all_bc *bcs)
 	builder.setErrorStr(&ErrorMsg);
 	builder.setEngineKind(EngineKind::JIT);
 	builder.setOptLevel(CodeGenOpt::Default);
-	ExecutionEngine *EE = bcs->engine->EE = builder.create();
+	ExecutionEngine *EE = jit->EE = builder.create();
 	if (!EE) {
 	    if (!ErrorMsg.empty())
 		cli_errmsg("[Bytecode JIT]: error creating execution engine: %s\n",
@@ -2250,8 +2340,8 @@ int cli_bytecode_prepare_jit(struct cli_all_bc *bcs)
 		cli_errmsg("[Bytecode JIT]: JIT not registered?\n");
 	    return CL_EBYTECODE;
 	}
-	bcs->engine->Listener  = new NotifyListener();
-	EE->RegisterJITEventListener(bcs->engine->Listener);
+	jit->Listener  = new NotifyListener();
+	EE->RegisterJITEventListener(jit->Listener);
 //	EE->RegisterJITEventListener(createOProfileJITEventListener());
 	// Due to LLVM PR4816 only X86 supports non-lazy compilation, disable
 	// for now.
@@ -2270,9 +2360,9 @@ int cli_bytecode_prepare_jit(struct cli_all_bc *bcs)
 
 	//TODO: create a wrapper that calls pthread_getspecific
 	unsigned maxh = cli_globals[0].offset + sizeof(struct cli_bc_hooks);
-	constType *HiddenCtx = PointerType::getUnqual(ArrayType::get(Type::getInt8Ty(bcs->engine->Context), maxh));
+	constType *HiddenCtx = PointerType::getUnqual(ArrayType::get(Type::getInt8Ty(jit->Context), maxh));
 
-	LLVMTypeMapper apiMap(bcs->engine->Context, cli_apicall_types, cli_apicall_maxtypes, HiddenCtx);
+	LLVMTypeMapper apiMap(jit->Context, cli_apicall_types, cli_apicall_maxtypes, HiddenCtx);
 	Function **apiFuncs = new Function *[cli_apicall_maxapi];
 	for (unsigned i=0;i<cli_apicall_maxapi;i++) {
 	    const struct cli_apicall *api = &cli_apicalls[i];
@@ -2332,10 +2422,10 @@ int cli_bytecode_prepare_jit(struct cli_all_bc *bcs)
 	if (2*sizeof(void*) <= 16 && cli_rndnum(2)==2) {
 	    plus = sizeof(void*);
 	}
-	EE->addGlobalMapping(Guard, (void*)(&bcs->engine->guard.b[plus]));
-	setGuard(bcs->engine->guard.b);
-	bcs->engine->guard.b[plus+sizeof(void*)-1] = 0x00;
-//	printf("%p\n", *(void**)(&bcs->engine->guard.b[plus]));
+	EE->addGlobalMapping(Guard, (void*)(&jit->guard.b[plus]));
+	setGuard(jit->guard.b);
+	jit->guard.b[plus+sizeof(void*)-1] = 0x00;
+//	printf("%p\n", *(void**)(&jit->guard.b[plus]));
 	Function *SFail = Function::Create(FTy, Function::ExternalLinkage,
 					      "__stack_chk_fail", M);
 	EE->addGlobalMapping(SFail, (void*)(intptr_t)jit_ssp_handler);
@@ -2404,14 +2494,21 @@ int cli_bytecode_prepare_jit(struct cli_all_bc *bcs)
 	    codegenTimer.stopTimer();
 	}
 
+	jit->entries.resize(bcs->count);
 	for (unsigned i=0;i<bcs->count;i++) {
 	    const struct cli_bc_func *func = &bcs->all_bcs[i].funcs[0];
 	    if (!Functions[i])
 		continue;// not JITed
-	    bcs->engine->compiledFunctions[func] = EE->getPointerToFunction(Functions[i]);
+	    jit->entries[i] = EE->getPointerToFunction(Functions[i]);
+	    bcs->engine->compiledFunctions[func] = jit->entries[i];
 	    bcs->all_bcs[i].state = bc_jit;
 	}
 	delete [] Functions;
+	if (cacheable) {
+	    memcpy(jit->key, key, sizeof(key));
+	    jit->next = jit_cache;
+	    jit_cache = jit;
+	}
     }
     return CL_SUCCESS;
   } catch (std::bad_alloc &badalloc) {
@@ -2476,8 +2573,7 @@ int cli_bytecode_init_jit(struct cli_all_bc *bcs, unsigned dconfmask)
     bcs->engine = new(std::nothrow) cli_bcengine;
     if (!bcs->engine)
 	return CL_EMEM;
-    bcs->engine->EE = 0;
-    bcs->engine->Listener = 0;
+    bcs->engine->jit = 0;
     return 0;
 }
 
@@ -2485,14 +2581,11 @@ int cli_bytecode_done_jit(struct cli_all_bc *bcs, int partial)
 {
     LLVMApiScopedLock scopedLock;
     if (bcs->engine) {
-	if (bcs->engine->EE) {
-	    if (bcs->engine->Listener)
-		bcs->engine->EE->UnregisterJITEventListener(bcs->engine->Listener);
-	    delete bcs->engine->EE;
-	    bcs->engine->EE = 0;
+	if (bcs->engine->jit) {
+	    jitRelease(bcs->engine->jit);
+	    bcs->engine->jit = 0;
 	}
-	delete bcs->engine->Listener;
-	bcs->engine->Listener = 0;
+	bcs->engine->compiledFunctions.clear();
 	if (!partial) {
 	    delete bcs->engine;
 	    bcs->engine = 0;
@@ -26,12 +26,22 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#endif
 
 #include "md5.h"
 #include "mpool.h"
 #include "clamav.h"
 #include "cache.h"
 #include "fmap.h"
+#include "scanstats.h"
 
 #ifdef CL_THREAD_SAFE
 static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -278,6 +288,11 @@ static inline void cacheset_destroy(struct cache_set *cs, mpool_t *mempool) {
     cs->data = NULL;
 }
 
+static void cacheset_clear(struct cache_set *map, mpool_t *mempool) {
+    cacheset_destroy(map, mempool);
+    cacheset_init(map, mempool);
+}
+
 #endif /* USE_LRUHASHCACHE */
 
 /* SPLAY --------------------------------------------------------------------- */
@@ -327,6 +342,20 @@ static inline void cacheset_destroy(struct cache_set *cs, mpool_t *mempool) {
     cs->data = NULL;
 }
 
+/* Empties the tree, keeping the nodes */
+static void cacheset_clear(struct cache_set *cs) {
+    unsigned int i;
+
+    memset(cs->data, 0, NODES * sizeof(*cs->data));
+    cs->root = NULL;
+    for(i=1; i<NODES; i++) {
+	cs->data[i-1].next = &cs->data[i];
+	cs->data[i].prev = &cs->data[i-1];
+    }
+    cs->first = cs->data;
+    cs->last = &cs->data[NODES-1];
+}
+
 /* The left/right cooser for the splay tree */
 static inline int cmp(int64_t *a, ssize_t sa, int64_t *b, ssize_t sb) {
     if(a[1] < b[1]) return -1;
@@ -729,15 +758,409 @@ static inline void cacheset_remove(struct cache_set *cs, unsigned char *md5, siz
 #endif /* USE_SPLAY */
 
 
+/* CLOCK ---------------------------------------------------------------------------- */
+
+/* Alternative backend for engines shared by many threads, selected with
+   CL_ENGINE_CACHE_CLOCK. The splay trees restructure themselves on every
+   lookup, so even a hit needs the tree mutex. Here each tree is instead a
+   set associative table with a CLOCK approximation of LRU inside each set:
+   a hit only sets the reference bit and readers validate what they read
+   against a per tree sequence counter rather than locking. Adds and
+   removes still serialize on the tree mutex. */
+#define CLOCK_WAYS 4
+#define CLOCK_SETS (NODES / CLOCK_WAYS)
+
+#if defined(CL_THREAD_SAFE) && defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+#define CLOCK_SEQLOCK
+#define clock_barrier() __sync_synchronize()
+#else
+#define clock_barrier()
+#endif
+
+struct clock_entry {
+    int64_t digest[2];
+    uint64_t size; /* 0 marks an empty slot */
+    uint32_t minrec;
+    uint8_t ref;
+};
+
+struct clock_set {
+    struct clock_entry *data;
+    volatile unsigned int seq; /* odd while a writer is updating data */
+    uint8_t hand[CLOCK_SETS];
+};
+
+static int clockset_init(struct clock_set *cs, mpool_t *mempool) {
+    cs->data = mpool_calloc(mempool, NODES, sizeof(*cs->data));
+    cs->seq = 0;
+    memset(cs->hand, 0, sizeof(cs->hand));
+    return !cs->data;
+}
+
+static inline void clockset_destroy(struct clock_set *cs, mpool_t *mempool) {
+    mpool_free(mempool, cs->data);
+    cs->data = NULL;
+}
+
+static inline struct clock_entry *clockset_set(struct clock_set *cs, const unsigned char *md5) {
+    return &cs->data[(md5[1] % CLOCK_SETS) * CLOCK_WAYS];
+}
+
+static inline int clockset_find(struct clock_entry *set, const int64_t *hash, size_t size) {
+    volatile struct clock_entry *e = set;
+    unsigned int i;
+
+    for(i = 0; i < CLOCK_WAYS; i++, e++)
+	if(e->size == size && e->digest[0] == hash[0] && e->digest[1] == hash[1])
+	    return i;
+    return -1;
+}
+
+static inline void clockset_write_begin(struct clock_set *cs) {
+    cs->seq++;
+    clock_barrier();
+}
+
+static inline void clockset_write_end(struct clock_set *cs) {
+    clock_barrier();
+    cs->seq++;
+}
+
+/* Called with the tree mutex held */
+static void clockset_clear(struct clock_set *cs) {
+    clockset_write_begin(cs);
+    memset(cs->data, 0, NODES * sizeof(*cs->data));
+    memset(cs->hand, 0, sizeof(cs->hand));
+    clockset_write_end(cs);
+}
+
+/* Lockless lookup; returns -1 if it raced with a writer and the caller
+   has to retry under the mutex */
+static inline int clockset_lookup(struct clock_set *cs, unsigned char *md5, size_t size, uint32_t reclevel) {
+    struct clock_entry *set = clockset_set(cs, md5);
+    unsigned int seq;
+    uint32_t minrec = 0;
+    int64_t hash[2];
+    int i;
+
+    memcpy(hash, md5, 16);
+    seq = cs->seq;
+    if(seq & 1)
+	return -1;
+    clock_barrier();
+    if((i = clockset_find(set, hash, size)) >= 0)
+	minrec = ((volatile struct clock_entry *)&set[i])->minrec;
+    clock_barrier();
+    if(cs->seq != seq)
+	return -1;
+    if(i < 0)
+	return 0;
+    /* the only store on the hit path; losing it to a race is harmless */
+    set[i].ref = 1;
+    return reclevel >= minrec;
+}
+
+/* Called with the tree mutex held */
+static inline void clockset_add(struct clock_set *cs, unsigned char *md5, size_t size, uint32_t reclevel) {
+    struct clock_entry *set = clockset_set(cs, md5), *e;
+    unsigned int setno = md5[1] % CLOCK_SETS;
+    int64_t hash[2];
+    int i;
+
+    memcpy(hash, md5, 16);
+    if((i = clockset_find(set, hash, size)) >= 0) {
+	if(set[i].minrec > reclevel)
+	    set[i].minrec = reclevel;
+	return; /* Already there */
+    }
+
+    for(i = 0; i < CLOCK_WAYS; i++)
+	if(!set[i].size)
+	    break;
+    if(i == CLOCK_WAYS) {
+	/* sweep the hand, giving referenced entries a second chance */
+	while(set[cs->hand[setno]].ref) {
+	    set[cs->hand[setno]].ref = 0;
+	    cs->hand[setno] = (cs->hand[setno] + 1) % CLOCK_WAYS;
+	}
+	i = cs->hand[setno];
+	cs->hand[setno] = (i + 1) % CLOCK_WAYS;
+    }
+    e = &set[i];
+    clockset_write_begin(cs);
+    e->digest[0] = hash[0];
+    e->digest[1] = hash[1];
+    e->size = size;
+    e->minrec = reclevel;
+    e->ref = 0;
+    clockset_write_end(cs);
+}
+
+/* Called with the tree mutex held */
+static inline void clockset_remove(struct clock_set *cs, unsigned char *md5, size_t size) {
+    struct clock_entry *set = clockset_set(cs, md5);
+    int64_t hash[2];
+    int i;
+
+    memcpy(hash, md5, 16);
+    if((i = clockset_find(set, hash, size)) < 0) {
+	cli_dbgmsg("clockset_remove: entry not found\n");
+	return;
+    }
+    clockset_write_begin(cs);
+    memset(&set[i], 0, sizeof(set[i]));
+    clockset_write_end(cs);
+}
+
+
 /* COMMON STUFF --------------------------------------------------------------------- */
 
 struct CACHE {
     struct cache_set cacheset;
+    struct clock_set clockset;
 #ifdef CL_THREAD_SAFE
     pthread_mutex_t mutex;
 #endif
 };
 
+/* PERSISTENT CACHE ----------------------------------------------------------------- */
+
+/* The optional cache file (CL_ENGINE_CACHE_FILE) is a second tier below the
+   trees above which lets clean results outlive the process. It's a fixed
+   size, set associative hash table mmap'ed shared, so concurrent scanners
+   share it without any locking.
+   Each slot carries a checksum which also covers a tag derived from the
+   database version and the engine limits: a torn write, or an entry added
+   under a different database, simply reads as an empty slot. Nothing is
+   ever invalidated in place and the file is never shrunk (which would
+   SIGBUS the other processes mapping it). */
+#define CACHE_FILE_MAGIC "ClamAV-Cache-01"
+#define CACHE_FILE_BUCKETS 65536 /* must be a power of 2 */
+#define CACHE_FILE_WAYS 4
+
+struct cache_file_hdr {
+    char magic[16];
+    uint32_t byteorder;
+    uint32_t buckets;
+    uint32_t ways;
+    uint32_t slotsize;
+    uint8_t pad[32];
+};
+
+struct cache_file_slot {
+    uint8_t md5[16];
+    uint64_t size;
+    uint32_t options;
+    uint32_t check;
+};
+
+struct CACHE_FILE {
+    struct cache_file_hdr *hdr;
+    struct cache_file_slot *slots;
+    size_t maplen;
+    uint32_t tag;
+};
+
+static uint32_t cache_file_check(const struct cache_file_slot *slot, uint32_t tag)
+{
+    uint32_t h = tag, i, w[7];
+
+    memcpy(w, slot, sizeof(w));
+    for(i = 0; i < 7; i++) {
+	h ^= w[i];
+	h *= 0x01000193;
+	h ^= h >> 15;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    return h | 1; /* never matches an empty slot */
+}
+
+static struct cache_file_slot *cache_file_bucket(struct CACHE_FILE *cf, const unsigned char *md5)
+{
+    uint32_t key = md5[4] | (md5[5] << 8) | (md5[6] << 16) | ((uint32_t)md5[7] << 24);
+    return &cf->slots[(key & (CACHE_FILE_BUCKETS - 1)) * CACHE_FILE_WAYS];
+}
+
+static void cache_file_mkslot(struct cache_file_slot *slot, const unsigned char *md5, size_t size, uint32_t options, uint32_t tag)
+{
+    memset(slot, 0, sizeof(*slot));
+    memcpy(slot->md5, md5, 16);
+    slot->size = size;
+    slot->options = options;
+    slot->check = cache_file_check(slot, tag);
+}
+
+/* Returns the slot holding the key or -1; the slot is copied out before
+   it's verified as other processes may be writing to it */
+static int cache_file_find(const struct cache_file_slot *bucket, const struct cache_file_slot *key)
+{
+    struct cache_file_slot slot;
+    unsigned int i;
+
+    for(i = 0; i < CACHE_FILE_WAYS; i++) {
+	memcpy(&slot, &bucket[i], sizeof(slot));
+	if(!memcmp(&slot, key, sizeof(slot)))
+	    return i;
+    }
+    return -1;
+}
+
+static int cache_file_lookup(struct CACHE_FILE *cf, const unsigned char *md5, size_t size, uint32_t options)
+{
+    struct cache_file_slot key;
+
+    cache_file_mkslot(&key, md5, size, options, cf->tag);
+    return cache_file_find(cache_file_bucket(cf, md5), &key) >= 0;
+}
+
+static void cache_file_add(struct CACHE_FILE *cf, const unsigned char *md5, size_t size, uint32_t options)
+{
+    struct cache_file_slot key, slot, *bucket = cache_file_bucket(cf, md5);
+    unsigned int i, victim = md5[15] % CACHE_FILE_WAYS;
+
+    cache_file_mkslot(&key, md5, size, options, cf->tag);
+    if(cache_file_find(bucket, &key) >= 0)
+	return;
+    /* prefer a slot which is empty, torn or from another database */
+    for(i = 0; i < CACHE_FILE_WAYS; i++) {
+	memcpy(&slot, &bucket[i], sizeof(slot));
+	if(slot.check != cache_file_check(&slot, cf->tag)) {
+	    victim = i;
+	    break;
+	}
+    }
+    memcpy(&bucket[victim], &key, sizeof(key));
+}
+
+static void cache_file_remove(struct CACHE_FILE *cf, const unsigned char *md5, size_t size)
+{
+    struct cache_file_slot slot, *bucket = cache_file_bucket(cf, md5);
+    unsigned int i;
+
+    /* drop the key whatever the scan options it was added with */
+    for(i = 0; i < CACHE_FILE_WAYS; i++) {
+	memcpy(&slot, &bucket[i], sizeof(slot));
+	if(!memcmp(slot.md5, md5, 16) && slot.size == size)
+	    memset(&bucket[i], 0, sizeof(slot));
+    }
+}
+
+/* Maps the cache file, must be called once the databases are loaded */
+void cli_cache_file_init(struct cl_engine *engine)
+{
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+    struct CACHE_FILE *cf;
+    struct cache_file_hdr hdr;
+    cli_md5_ctx md5;
+    unsigned char digest[16];
+    uint64_t tag[8];
+    size_t maplen = sizeof(hdr) + sizeof(struct cache_file_slot) * CACHE_FILE_BUCKETS * CACHE_FILE_WAYS;
+    STATBUF sb;
+    void *map;
+    int fd;
+
+    if(!engine->cache_path || !engine->cache || engine->cache_file)
+	return;
+
+    if(engine->engine_options & ENGINE_OPTIONS_DISABLE_CACHE)
+	return;
+
+    if(!engine->dbversion[0]) {
+	cli_dbgmsg("cli_cache_file_init: No database version, not using %s\n", engine->cache_path);
+	return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    strcpy(hdr.magic, CACHE_FILE_MAGIC);
+    hdr.byteorder = 0x01020304;
+    hdr.buckets = CACHE_FILE_BUCKETS;
+    hdr.ways = CACHE_FILE_WAYS;
+    hdr.slotsize = sizeof(struct cache_file_slot);
+
+    if((fd = open(engine->cache_path, O_RDWR | O_CREAT | O_BINARY, 0600)) == -1) {
+	cli_warnmsg("cli_cache_file_init: Can't open %s\n", engine->cache_path);
+	return;
+    }
+    if(FSTAT(fd, &sb) == -1 || ((size_t)sb.st_size < maplen && ftruncate(fd, maplen) == -1)) {
+	cli_warnmsg("cli_cache_file_init: Can't resize %s\n", engine->cache_path);
+	close(fd);
+	return;
+    }
+    map = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+	cli_warnmsg("cli_cache_file_init: Can't map %s\n", engine->cache_path);
+	return;
+    }
+    if(memcmp(map, &hdr, sizeof(hdr))) {
+	cli_dbgmsg("cli_cache_file_init: Initializing %s\n", engine->cache_path);
+	memset(map, 0, maplen);
+	memcpy(map, &hdr, sizeof(hdr));
+    }
+
+    if(!(cf = mpool_malloc(engine->mempool, sizeof(*cf)))) {
+	cli_errmsg("cli_cache_file_init: mpool malloc fail\n");
+	munmap(map, maplen);
+	return;
+    }
+    cf->hdr = map;
+    cf->slots = (struct cache_file_slot *)(cf->hdr + 1);
+    cf->maplen = maplen;
+
+    /* everything that can turn a clean file into a detection */
+    memset(tag, 0, sizeof(tag));
+    tag[0] = engine->dbversion[0] | ((uint64_t)engine->dbversion[1] << 32);
+    tag[1] = cl_retflevel() | ((uint64_t)engine->dboptions << 32);
+    tag[2] = engine->maxscansize;
+    tag[3] = engine->maxfilesize;
+    tag[4] = engine->maxreclevel | ((uint64_t)engine->maxfiles << 32);
+    tag[5] = engine->maxembeddedpe;
+    tag[6] = engine->min_cc_count | ((uint64_t)engine->min_ssn_count << 32);
+    tag[7] = engine->engine_options;
+    cli_md5_init(&md5);
+    cli_md5_update(&md5, tag, sizeof(tag));
+    if(engine->pua_cats)
+	cli_md5_update(&md5, engine->pua_cats, strlen(engine->pua_cats));
+    cli_md5_update(&md5, cl_retver(), strlen(cl_retver()));
+    cli_md5_update(&md5, &engine->sigs, sizeof(engine->sigs));
+    cli_md5_update(&md5, engine->dbdigest, sizeof(engine->dbdigest));
+    cli_md5_final(digest, &md5);
+    memcpy(&cf->tag, digest, sizeof(cf->tag));
+
+    engine->cache_file = cf;
+    cli_dbgmsg("cli_cache_file_init: Using %s\n", engine->cache_path);
+#else
+    if(engine->cache_path)
+	cli_warnmsg("cli_cache_file_init: Cache files are not supported on this platform\n");
+#endif
+}
+
+static void cache_file_destroy(struct cl_engine *engine)
+{
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+    if(!engine->cache_file)
+	return;
+    munmap(engine->cache_file->hdr, engine->cache_file->maplen);
+    mpool_free(engine->mempool, engine->cache_file);
+    engine->cache_file = NULL;
+#endif
+}
+
+static int cache_tree_init(struct CACHE *c, const struct cl_engine *engine) {
+    if(engine->engine_options & ENGINE_OPTIONS_CACHE_CLOCK)
+	return clockset_init(&c->clockset, engine->mempool);
+    return cacheset_init(&c->cacheset, engine->mempool);
+}
+
+static void cache_tree_destroy(struct CACHE *c, const struct cl_engine *engine) {
+    if(engine->engine_options & ENGINE_OPTIONS_CACHE_CLOCK)
+	clockset_destroy(&c->clockset, engine->mempool);
+    else
+	cacheset_destroy(&c->cacheset, engine->mempool);
+}
+
 /* Allocates the trees for the engine cache */
 int cli_cache_init(struct cl_engine *engine) {
     struct CACHE *cache;
@@ -761,13 +1184,13 @@ int cli_cache_init(struct cl_engine *engine) {
     for(i=0; i<TREES; i++) {
 	if(pthread_mutex_init(&cache[i].mutex, NULL)) {
 	    cli_errmsg("cli_cache_init: mutex init fail\n");
-	    for(j=0; j<i; j++) cacheset_destroy(&cache[j].cacheset, engine->mempool);
+	    for(j=0; j<i; j++) cache_tree_destroy(&cache[j], engine);
 	    for(j=0; j<i; j++) pthread_mutex_destroy(&cache[j].mutex);
 	    mpool_free(engine->mempool, cache);
 	    return 1;
 	}
-	if(cacheset_init(&cache[i].cacheset, engine->mempool)) {
-	    for(j=0; j<i; j++) cacheset_destroy(&cache[j].cacheset, engine->mempool);
+	if(cache_tree_init(&cache[i], engine)) {
+	    for(j=0; j<i; j++) cache_tree_destroy(&cache[j], engine);
 	    for(j=0; j<=i; j++) pthread_mutex_destroy(&cache[j].mutex);
 	    mpool_free(engine->mempool, cache);
 	    return 1;
@@ -785,24 +1208,73 @@ void cli_cache_destroy(struct cl_engine *engine) {
     if(!engine || !(cache = engine->cache))
 	return;
 
-    if (engine->engine_options & ENGINE_OPTIONS_DISABLE_CACHE) {
-        return;
-    }
+    cache_file_destroy(engine);
 
     for(i=0; i<TREES; i++) {
-	cacheset_destroy(&cache[i].cacheset, engine->mempool);
+	cache_tree_destroy(&cache[i], engine);
 	pthread_mutex_destroy(&cache[i].mutex);
     }
     mpool_free(engine->mempool, cache);
+    engine->cache = NULL;
+}
+
+/* Drops everything cached so far, for when the signatures of a compiled
+   engine change (cl_engine_update()). The cache file can't be emptied
+   under the other processes; its tag is moved on with the digest of the
+   updates instead, so only engines with the same updates share entries */
+void cli_cache_clear(struct cl_engine *engine, const unsigned char *update) {
+    struct CACHE *c;
+    cli_md5_ctx md5;
+    unsigned char digest[16];
+    unsigned int i;
+
+    if(!engine || !engine->cache)
+	return;
+
+    /* scans started before this point may still be running on the old
+       signatures, cache_add() drops their verdicts */
+    engine->cache_gen++;
+    for(i=0; i<TREES; i++) {
+	c = &engine->cache[i];
+	if(pthread_mutex_lock(&c->mutex)) {
+	    cli_errmsg("cli_cache_clear: mutex lock fail\n");
+	    continue;
+	}
+	if(engine->engine_options & ENGINE_OPTIONS_CACHE_CLOCK)
+	    clockset_clear(&c->clockset);
+	else
+#ifdef USE_LRUHASHCACHE
+	    cacheset_clear(&c->cacheset, engine->mempool);
+#else
+	    cacheset_clear(&c->cacheset);
+#endif
+	pthread_mutex_unlock(&c->mutex);
+    }
+
+    if(engine->cache_file) {
+	cli_md5_init(&md5);
+	cli_md5_update(&md5, &engine->cache_file->tag, sizeof(engine->cache_file->tag));
+	cli_md5_update(&md5, update, 16);
+	cli_md5_final(digest, &md5);
+	memcpy(&engine->cache_file->tag, digest, sizeof(engine->cache_file->tag));
+    }
+    cli_dbgmsg("cli_cache_clear: Cache emptied\n");
 }
 
 /* Looks up an hash in the proper tree */
-static int cache_lookup_hash(unsigned char *md5, size_t len, struct CACHE *cache, uint32_t reclevel) {
+static int cache_lookup_hash(unsigned char *md5, size_t len, const struct cl_engine *engine, uint32_t reclevel) {
     unsigned int key = getkey(md5);
     int ret = CL_VIRUS;
     struct CACHE *c;
 
-    c = &cache[key];
+    c = &engine->cache[key];
+#ifdef CLOCK_SEQLOCK
+    if(engine->engine_options & ENGINE_OPTIONS_CACHE_CLOCK) {
+	if((ret = clockset_lookup(&c->clockset, md5, len, reclevel)) >= 0)
+	    return ret ? CL_CLEAN : CL_VIRUS;
+	ret = CL_VIRUS; /* raced with a writer, retry with the lock */
+    }
+#endif
     if(pthread_mutex_lock(&c->mutex)) {
 	cli_errmsg("cache_lookup_hash: cache_lookup_hash: mutex lock fail\n");
 	return ret;
@@ -810,17 +1282,64 @@ static int cache_lookup_hash(unsigned char *md5, size_t len, struct CACHE *cache
 
     /* cli_warnmsg("cache_lookup_hash: key is %u\n", key); */
 
-    ret = (cacheset_lookup(&c->cacheset, md5, len, reclevel)) ? CL_CLEAN : CL_VIRUS;
+    if(engine->engine_options & ENGINE_OPTIONS_CACHE_CLOCK)
+	ret = (clockset_lookup(&c->clockset, md5, len, reclevel) > 0) ? CL_CLEAN : CL_VIRUS;
+    else
+	ret = (cacheset_lookup(&c->cacheset, md5, len, reclevel)) ? CL_CLEAN : CL_VIRUS;
     pthread_mutex_unlock(&c->mutex);
     /* if(ret == CL_CLEAN) cli_warnmsg("cached\n"); */
     return ret;
 }
 
+/* Adds an hash to the proper tree, and to the cache file if tofile is set,
+   unless the cache was cleared since the scan started. The generation is
+   checked under the tree mutex which cli_cache_clear() takes after bumping
+   it, so a stale entry is either refused or cleared, and the cache file
+   slot can't pick up the tag of the next update.
+   Returns 0 if added, 1 if stale */
+static int cache_add_hash(unsigned char *md5, size_t size, const cli_ctx *ctx, uint32_t level, int tofile) {
+    const struct cl_engine *engine = ctx->engine;
+    unsigned int key = getkey(md5);
+    struct CACHE *c;
+
+    c = &engine->cache[key];
+    if(pthread_mutex_lock(&c->mutex)) {
+	cli_errmsg("cli_add: mutex lock fail\n");
+	return 1;
+    }
+
+    /* cli_warnmsg("cache_add: key is %u\n", key); */
+
+    if(ctx->cache_gen != engine->cache_gen) {
+	pthread_mutex_unlock(&c->mutex);
+	return 1;
+    }
+    if(tofile && engine->cache_file)
+	cache_file_add(engine->cache_file, md5, size, ctx->options);
+
+    if(engine->engine_options & ENGINE_OPTIONS_CACHE_CLOCK) {
+	clockset_add(&c->clockset, md5, size, level);
+	pthread_mutex_unlock(&c->mutex);
+	return 0;
+    }
+
+#ifdef USE_LRUHASHCACHE
+    cacheset_add(&c->cacheset, md5, size, engine->mempool);
+#else
+#ifdef USE_SPLAY
+    cacheset_add(&c->cacheset, md5, size, level);
+#else
+#error #define USE_SPLAY or USE_LRUHASHCACHE
+#endif
+#endif
+
+    pthread_mutex_unlock(&c->mutex);
+    return 0;
+}
+
 /* Adds an hash to the cache */
 void cache_add(unsigned char *md5, size_t size, cli_ctx *ctx) {
-    unsigned int key = getkey(md5);
     uint32_t level;
-    struct CACHE *c;
 
     if(!ctx || !ctx->engine || !ctx->engine->cache)
        return;
@@ -837,25 +1356,11 @@ void cache_add(unsigned char *md5, size_t size, cli_ctx *ctx) {
 	cli_dbgmsg("cache_add: alert found within same topfile, skipping cache\n");
 	return;
     }
-    c = &ctx->engine->cache[key];
-    if(pthread_mutex_lock(&c->mutex)) {
-	cli_errmsg("cli_add: mutex lock fail\n");
+    /* only files clean at any recursion level are worth keeping */
+    if(cache_add_hash(md5, size, ctx, level, !level)) {
+	cli_dbgmsg("cache_add: signatures updated during the scan, skipping cache\n");
 	return;
     }
-
-    /* cli_warnmsg("cache_add: key is %u\n", key); */
-
-#ifdef USE_LRUHASHCACHE
-    cacheset_add(&c->cacheset, md5, size, ctx->engine->mempool);
-#else
-#ifdef USE_SPLAY
-    cacheset_add(&c->cacheset, md5, size, level);
-#else
-#error #define USE_SPLAY or USE_LRUHASHCACHE
-#endif
-#endif
-
-    pthread_mutex_unlock(&c->mutex);
     cli_dbgmsg("cache_add: %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x (level %u)\n", md5[0], md5[1], md5[2], md5[3], md5[4], md5[5], md5[6], md5[7], md5[8], md5[9], md5[10], md5[11], md5[12], md5[13], md5[14], md5[15], level);
     return;
 }
@@ -881,30 +1386,37 @@ void cache_remove(unsigned char *md5, size_t size, const struct cl_engine *engin
 	return;
     }
 
+    if(engine->engine_options & ENGINE_OPTIONS_CACHE_CLOCK)
+	clockset_remove(&c->clockset, md5, size);
+    else
 #ifdef USE_LRUHASHCACHE
-    cacheset_remove(&c->cacheset, md5, size, engine->mempool);
+	cacheset_remove(&c->cacheset, md5, size, engine->mempool);
 #else
 #ifdef USE_SPLAY
-    cacheset_remove(&c->cacheset, md5, size);
+	cacheset_remove(&c->cacheset, md5, size);
 #else
 #error #define USE_SPLAY or USE_LRUHASHCACHE
 #endif
 #endif
 
     pthread_mutex_unlock(&c->mutex);
+    if(engine->cache_file)
+	cache_file_remove(engine->cache_file, md5, size);
     cli_dbgmsg("cache_remove: %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x\n", md5[0], md5[1], md5[2], md5[3], md5[4], md5[5], md5[6], md5[7], md5[8], md5[9], md5[10], md5[11], md5[12], md5[13], md5[14], md5[15]);
     return;
 }
 
 /* Hashes a file onto the provided buffer and looks it up the cache.
+   Only the MD5 is computed here, so a hit costs one digest; the others
+   the hash signatures need are computed by the scan on a miss.
    Returns CL_VIRUS if found, CL_CLEAN if not FIXME or a recoverable error,
    and returns CL_EREAD if unrecoverable */
-int cache_check(unsigned char *hash, cli_ctx *ctx) {
+int cache_check(struct cli_digests *digests, cli_ctx *ctx) {
     fmap_t *map;
-    size_t todo, at = 0;
-    cli_md5_ctx md5;
+    unsigned char *hash = digests->digest[CLI_HASH_MD5];
     int ret;
 
+    memset(digests->have, 0, sizeof(digests->have));
     if(!ctx || !ctx->engine || !ctx->engine->cache)
        return CL_VIRUS;
 
@@ -914,23 +1426,19 @@ int cache_check(unsigned char *hash, cli_ctx *ctx) {
     }
 
     map = *ctx->fmap;
-    todo = map->len;
-
-    cli_md5_init(&md5);
-    while(todo) {
-	const void *buf;
-	size_t readme = todo < FILEBUFF ? todo : FILEBUFF;
-	if(!(buf = fmap_need_off_once(map, at, readme)))
-	    return CL_EREAD;
-	todo -= readme;
-	at += readme;
-	if (cli_md5_update(&md5, buf, readme)) {
-	    cli_errmsg("cache_check: error reading while generating hash!\n");
-	    return CL_EREAD;
-	}
+    if(cli_multihash_map(map, map->len, CLI_DIGEST(CLI_HASH_MD5), digests)) {
+	cli_errmsg("cache_check: error reading while generating hash!\n");
+	return CL_EREAD;
+    }
+    ret = cache_lookup_hash(hash, map->len, ctx->engine, ctx->recursion);
+    if(ret == CL_VIRUS && ctx->engine->cache_file && cache_file_lookup(ctx->engine->cache_file, hash, map->len, ctx->options)) {
+	cache_add_hash(hash, map->len, ctx, 0, 0);
+	ret = CL_CLEAN;
     }
-    cli_md5_final(hash, &md5);
-    ret = cache_lookup_hash(hash, map->len, ctx->engine->cache, ctx->recursion);
+    if(ret == CL_VIRUS)
+	SCANSTATS_ADD(ctx, cache_misses, 1);
+    else
+	SCANSTATS_ADD(ctx, cache_hits, 1);
     cli_dbgmsg("cache_check: %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x is %s\n", hash[0], hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7], hash[8], hash[9], hash[10], hash[11], hash[12], hash[13], hash[14], hash[15], (ret == CL_VIRUS) ? "negative" : "positive");
     return ret;
 }
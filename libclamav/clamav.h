@@ -124,6 +124,8 @@ typedef enum {
 #define CL_DB_UNSIGNED	    0x10000 /* internal */
 #define CL_DB_BYTECODE_STATS 0x20000
 #define CL_DB_ENHANCED      0x40000
+#define CL_DB_SIGNATURE_STATS 0x80000
+#define CL_DB_SNAPSHOT	    0x100000 /* internal */
 
 /* recommended db settings */
 #define CL_DB_STDOPT	    (CL_DB_PHISHING | CL_DB_PHISHING_URLS | CL_DB_BYTECODE)
@@ -168,6 +170,8 @@ typedef enum {
 #define ENGINE_OPTIONS_NONE             0x0
 #define ENGINE_OPTIONS_DISABLE_CACHE    0x1
 #define ENGINE_OPTIONS_FORCE_TO_DISK    0x2
+#define ENGINE_OPTIONS_CACHE_CLOCK      0x4
+#define ENGINE_OPTIONS_DIRECT_MAP       0x8
 
 
 struct cl_engine;
@@ -209,7 +213,12 @@ enum cl_engine_field {
     CL_ENGINE_MAX_SCRIPTNORMALIZE,  /* uint64_t */
     CL_ENGINE_MAX_ZIPTYPERCG,       /* uint64_t */
     CL_ENGINE_FORCETODISK,          /* uint32_t */
-    CL_ENGINE_DISABLE_CACHE         /* uint32_t */
+    CL_ENGINE_DISABLE_CACHE,        /* uint32_t */
+    CL_ENGINE_CACHE_FILE,           /* (char *) */
+    CL_ENGINE_CACHE_CLOCK,          /* uint32_t */
+    CL_ENGINE_MAX_INMEMORY,         /* uint64_t */
+    CL_ENGINE_LOAD_THREADS,         /* uint32_t */
+    CL_ENGINE_DIRECT_MAP            /* uint32_t */
 };
 
 enum bytecode_security {
@@ -398,6 +407,60 @@ extern const char *cl_retdbdir(void);
 
 /* engine handling */
 
+/* A compiled engine can be saved to a snapshot file and loaded back into a
+ * fresh engine (same settings as the one it was saved from, no cl_load())
+ * instead of parsing and compiling the databases again. The signature
+ * tries and hash tables are used directly from the read-only mapping of
+ * the file, so they're shared between processes loading the same
+ * snapshot. Bytecode, phishing (.pdb/.gdb/.wdb), container (.cdb), icon
+ * (.idb) and certificate (.crb/.cat) signatures aren't part of the
+ * snapshot: cl_engine_load_snapshot() and cl_engine_attach() parse them
+ * again from the database files the snapshot was saved from, which must
+ * still be in place and unchanged.
+ * cl_engine_load_snapshot() compiles the engine; it returns CL_EARG if the
+ * snapshot was saved with different settings, dboptions or by another
+ * libclamav version, CL_EMALFDB if it's damaged. */
+extern int cl_engine_save(const struct cl_engine *engine, const char *path);
+
+extern int cl_engine_load_snapshot(struct cl_engine *engine, const char *path, unsigned int *signo, unsigned int dboptions);
+
+/* The snapshot records the paths it was loaded from with cl_load() and the
+ * size and mtime of every database file read, and
+ * cl_engine_load_snapshot() fails with CL_EARG once one of them changed.
+ * cl_snapshot_check() tells in advance: CL_SUCCESS if the snapshot was
+ * saved from the ndbpaths files or directories in dbpaths, in that order,
+ * and is up to date with them, CL_EARG if not. */
+extern int cl_snapshot_check(const char *path, const char * const *dbpaths, unsigned int ndbpaths);
+
+/* The same snapshot published in a POSIX shared memory object (name as
+ * for shm_open(), e.g. "/clamav-main") for a fleet of scanning processes:
+ * one process compiles the engine and calls cl_engine_share(), the others
+ * call cl_engine_attach() instead of cl_load() and cl_engine_compile() and
+ * map the published tries and hash tables read-only, so the bulk of the
+ * engine is in memory once. cl_engine_share() returns CL_ECREAT if a
+ * complete snapshot is published under the name already; an incomplete one,
+ * left by a publisher that died while writing it, is replaced. An attach
+ * racing the publisher gets CL_EMALFDB and one to a missing object
+ * CL_EOPEN. The object stays until cl_engine_unshare(),
+ * attached engines keep their mapping after it. CL_EARG where shared
+ * memory objects are not supported. */
+extern int cl_engine_share(const struct cl_engine *engine, const char *name);
+
+extern int cl_engine_attach(struct cl_engine *engine, const char *name, unsigned int *signo, unsigned int dboptions);
+
+extern int cl_engine_unshare(const char *name);
+
+/* Applies the changes of a cdiff to the signatures of database dbname in a
+ * compiled engine, without reloading it: added and removed are the
+ * new and the old lines, '\n' separated (either can be NULL). Scans
+ * already running keep the signatures they started with. Only .db, .ndb,
+ * .ldb, .hdb, .hsb, .mdb, .msb, .fp and .sfp files (and their .*u PUA
+ * variants) can be updated; for anything else it returns CL_EARG and the
+ * databases must be reloaded.
+ * dboptions are the options the databases were loaded with. Engines changed
+ * this way can't be saved with cl_engine_save(). */
+extern int cl_engine_update(struct cl_engine *engine, const char *dbname, const char *added, const char *removed, unsigned int dboptions);
+
 /* CVD */
 extern struct cl_cvd *cl_cvdhead(const char *file);
 extern struct cl_cvd *cl_cvdparse(const char *head);
@@ -458,14 +521,68 @@ extern void cl_fmap_close(cl_fmap_t*);
 /* Scan custom data */
 extern int cl_scanmap_callback(cl_fmap_t *map, const char **virname, unsigned long int *scanned, const struct cl_engine *engine, unsigned int scanoptions, void *context);
 
+/* Batch scanning: a cl_scanctx keeps the per-scan state (recursion stack,
+ * match counters of the signature tries) allocated across files, which
+ * matters when scanning large numbers of small objects. A context holds a
+ * reference to the engine it was created for and must not be used by more
+ * than one thread at a time - create one per thread. */
+struct cl_scanctx;
+
+struct cl_scan_item {
+    const void *data;		/* the entire object to scan */
+    size_t len;
+    void *context;		/* passed to the callbacks */
+    const char *virname;	/* out: as in cl_scanmap_callback() */
+    int result;			/* out: CL_CLEAN, CL_VIRUS or an error code */
+};
+
+extern struct cl_scanctx *cl_scanctx_new(const struct cl_engine *engine);
+
+extern void cl_scanctx_free(struct cl_scanctx *sctx);
+
+/* Scans count items with the engine of sctx; returns CL_SUCCESS unless the
+ * arguments are invalid, the result of each scan is in items[i].result */
+extern int cl_scan_batch(struct cl_scanctx *sctx, struct cl_scan_item *items, unsigned int count, unsigned long int *scanned, unsigned int scanoptions);
+
+/* Scan statistics: every engine counts where its scans spend their time.
+ * The counters are kept per scanning thread and summed up by
+ * cl_engine_get_stats(), they are never reset. */
+#define CL_STATS_LATENCY_BUCKETS 24 /* latency[i]: scans of [2^i, 2^(i+1)) usecs, the last one is open */
+#define CL_STATS_DEPTH_BUCKETS 17   /* depth[i]: files at recursion level i, the last one is i and deeper */
+
+struct cl_stats_type {
+    const char *type;			/* e.g. "CL_TYPE_ZIP" */
+    unsigned long long files;
+    unsigned long long bytes;
+    unsigned long long usecs;		/* whole scans, including the embedded files */
+    unsigned long long latency[CL_STATS_LATENCY_BUCKETS];
+    unsigned long long unpack_usecs;	/* in the unpacker/parser of the type only */
+    unsigned long long unpack_bytes;
+};
+
+struct cl_stats {
+    unsigned long long scans;		/* calls to the cl_scan*() functions */
+    unsigned long long cache_hits;
+    unsigned long long cache_misses;
+    unsigned long long fmap_pagefaults;	/* pages read into file maps */
+    unsigned long long tmpfile_bytes;	/* size of the temporary files scanned */
+    unsigned long long depth[CL_STATS_DEPTH_BUCKETS];
+    unsigned int ntypes;
+    struct cl_stats_type *types;	/* the types scanned at least once */
+};
+
+/* Returns a snapshot of the statistics of the engine (NULL on error), to be
+ * released with cl_engine_stats_free() */
+extern struct cl_stats *cl_engine_get_stats(const struct cl_engine *engine);
+
+extern void cl_engine_stats_free(struct cl_stats *stats);
+
 
 
 //example call scanning
 
 //static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 
-extern const char *logg_file;
-
 #ifdef __cplusplus
 }
 #endif
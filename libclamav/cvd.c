@@ -43,6 +43,7 @@
 #include "readdb.h"
 #include "default.h"
 #include "sha256.h"
+#include "dbstage.h"
 
 #define TAR_BLOCKSIZE 512
 
@@ -373,6 +374,51 @@ static int cli_tgzload(int fd, struct cl_engine *engine, unsigned int *signo, un
     return CL_SUCCESS;
 }
 
+/* cli_tgzload() for a CVD unpacked and checksummed by the loader threads */
+static int cli_tgzload_staged(struct cli_dbstage *stage, struct cl_engine *engine, unsigned int *signo, unsigned int options, struct cli_dbio *dbio, struct cli_dbinfo *dbinfo)
+{
+	const struct cli_dbstage_member *member;
+	struct cli_dbinfo *db;
+	unsigned int i;
+	int ret;
+
+    cli_dbgmsg("in cli_tgzload_staged()\n");
+
+    for(i = 0; i < stage->nmembers; i++) {
+	member = &stage->members[i];
+	if((!dbinfo && cli_strbcasestr(member->name, ".info")) || (dbinfo && (CLI_DBEXT(member->name) || cli_strbcasestr(member->name, ".ign") || cli_strbcasestr(member->name, ".ign2")))) {
+	    cli_dbstage_dbio(member, dbio);
+	    ret = cli_load(member->name, engine, signo, options, dbio);
+	    if(ret) {
+		cli_errmsg("cli_tgzload: Can't load %s\n", member->name);
+		return CL_EMALFDB;
+	    }
+	    if(!dbinfo)
+		return CL_SUCCESS;
+
+	    db = dbinfo;
+	    while(db && strcmp(db->name, member->name))
+		db = db->next;
+	    if(!db) {
+		cli_errmsg("cli_tgzload: File %s not found in .info\n", member->name);
+		return CL_EMALFDB;
+	    }
+	    if(dbio->bread) {
+		if(db->size != dbio->bread) {
+		    cli_errmsg("cli_tgzload: File %s not correctly loaded\n", member->name);
+		    return CL_EMALFDB;
+		}
+		if(memcmp(db->hash, member->sha256, 32)) {
+		    cli_errmsg("cli_tgzload: Invalid checksum for file %s\n", member->name);
+		    return CL_EMALFDB;
+		}
+	    }
+	}
+    }
+
+    return CL_SUCCESS;
+}
+
 struct cl_cvd *cl_cvdparse(const char *head)
 {
 	struct cl_cvd *cvd;
@@ -496,19 +542,16 @@ void cl_cvdfree(struct cl_cvd *cvd)
     free(cvd);
 }
 
-static int cli_cvdverify(FILE *fs, struct cl_cvd *cvdpt, unsigned int skipsig)
+/* head is the 512 byte header; the MD5 of the rest is md5sum when the
+ * loader threads already computed it, else it's read from fs
+ */
+static int cli_cvdverify_head(char *head, FILE *fs, const char *md5sum, struct cl_cvd *cvdpt, unsigned int skipsig)
 {
 	struct cl_cvd *cvd;
-	char *md5, head[513];
+	char *md5;
 	int i;
 
 
-    fseek(fs, 0, SEEK_SET);
-    if(fread(head, 1, 512, fs) != 512) {
-	cli_errmsg("cli_cvdverify: Can't read CVD header\n");
-	return CL_ECVD;
-    }
-
     head[512] = 0;
     for(i = 511; i > 0 && (head[i] == ' ' || head[i] == 10); head[i] = 0, i--);
 
@@ -523,7 +566,7 @@ static int cli_cvdverify(FILE *fs, struct cl_cvd *cvdpt, unsigned int skipsig)
 	return CL_SUCCESS;
     }
 
-    md5 = cli_hashstream(fs, NULL, 1);
+    md5 = md5sum ? cli_strdup(md5sum) : cli_hashstream(fs, NULL, 1);
     if (md5 == NULL) {
 	cli_dbgmsg("cli_cvdverify: Cannot generate hash, out of memory\n");
 	cl_cvdfree(cvd);
@@ -550,6 +593,20 @@ static int cli_cvdverify(FILE *fs, struct cl_cvd *cvdpt, unsigned int skipsig)
     return CL_SUCCESS;
 }
 
+static int cli_cvdverify(FILE *fs, struct cl_cvd *cvdpt, unsigned int skipsig)
+{
+	char head[513];
+
+
+    fseek(fs, 0, SEEK_SET);
+    if(fread(head, 1, 512, fs) != 512) {
+	cli_errmsg("cli_cvdverify: Can't read CVD header\n");
+	return CL_ECVD;
+    }
+
+    return cli_cvdverify_head(head, fs, NULL, cvdpt, skipsig);
+}
+
 int cl_cvdverify(const char *file)
 {
 	struct cl_engine *engine;
@@ -575,7 +632,7 @@ int cl_cvdverify(const char *file)
     return ret;
 }
 
-int cli_cvdload(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigned int options, unsigned int dbtype, const char *filename, unsigned int chkonly)
+static int cli_cvdload_common(FILE *fs, struct cli_dbstage *stage, struct cl_engine *engine, unsigned int *signo, unsigned int options, unsigned int dbtype, const char *filename, unsigned int chkonly)
 {
 	struct cl_cvd cvd, dupcvd;
 	FILE *dupfs;
@@ -589,7 +646,15 @@ int cli_cvdload(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigne
     cli_dbgmsg("in cli_cvdload()\n");
 
     /* verify */
-    if((ret = cli_cvdverify(fs, &cvd, dbtype)))
+    if(stage) {
+	    char head[513];
+
+	memcpy(head, stage->file, 512);
+	ret = cli_cvdverify_head(head, NULL, stage->md5, &cvd, dbtype);
+    } else {
+	ret = cli_cvdverify(fs, &cvd, dbtype);
+    }
+    if(ret)
 	return ret;
 
     if(dbtype <= 1) {
@@ -644,9 +709,11 @@ int cli_cvdload(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigne
 	cli_warnmsg("***********************************************************\n");
     }
 
-    cfd = fileno(fs);
-    dbio.chkonly = 0;
-    if(dbtype == 2)
+    cfd = fs ? fileno(fs) : -1;
+    memset(&dbio, 0, sizeof(dbio));
+    if(stage)
+	ret = cli_tgzload_staged(stage, engine, signo, options | (dbtype == 2 ? CL_DB_UNSIGNED : CL_DB_OFFICIAL), &dbio, NULL);
+    else if(dbtype == 2)
 	ret = cli_tgzload(cfd, engine, signo, options | CL_DB_UNSIGNED, &dbio, NULL);
     else
 	ret = cli_tgzload(cfd, engine, signo, options | CL_DB_OFFICIAL, &dbio, NULL);
@@ -670,7 +737,10 @@ int cli_cvdload(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigne
     else
 	options |= CL_DB_SIGNED | CL_DB_OFFICIAL;
 
-    ret = cli_tgzload(cfd, engine, signo, options, &dbio, dbinfo);
+    if(stage)
+	ret = cli_tgzload_staged(stage, engine, signo, options, &dbio, dbinfo);
+    else
+	ret = cli_tgzload(cfd, engine, signo, options, &dbio, dbinfo);
 
     while(engine->dbinfo) {
 	dbinfo = engine->dbinfo;
@@ -685,6 +755,16 @@ int cli_cvdload(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigne
     return ret;
 }
 
+int cli_cvdload(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigned int options, unsigned int dbtype, const char *filename, unsigned int chkonly)
+{
+    return cli_cvdload_common(fs, NULL, engine, signo, options, dbtype, filename, chkonly);
+}
+
+int cli_cvdload_staged(struct cli_dbstage *stage, struct cl_engine *engine, unsigned int *signo, unsigned int options)
+{
+    return cli_cvdload_common(NULL, stage, engine, signo, options, stage->dbtype, stage->filename, 0);
+}
+
 int cli_cvdunpack(const char *file, const char *dir)
 {
 	int fd, ret;
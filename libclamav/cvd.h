@@ -27,6 +27,9 @@
 
 #include "sha256.h"
 
+struct cli_dbstage;
+struct cli_dbstage_member;
+
 struct cli_dbio {
     gzFile gzs;
     FILE *fs;
@@ -35,9 +38,15 @@ struct cli_dbio {
     unsigned int usebuf, bufsize, readsize;
     unsigned int chkonly;
     SHA256_CTX sha256ctx;
+    /* database already read into memory by a loader thread */
+    const char *mem;
+    unsigned int memsize, mempos;
+    struct cli_dbstage *stage;
+    const struct cli_dbstage_member *member;
 };
 
 int cli_cvdload(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigned int options, unsigned int dbtype, const char *filename, unsigned int chkonly);
+int cli_cvdload_staged(struct cli_dbstage *stage, struct cl_engine *engine, unsigned int *signo, unsigned int options);
 int cli_cvdunpack(const char *file, const char *dir);
 
 #endif
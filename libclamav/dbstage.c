@@ -0,0 +1,822 @@
+/*
+ *  Database staging for cl_load()
+ *
+ *  Copyright (C) 2013 Sourcefire, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <zlib.h>
+#ifdef CL_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+#include "clamav.h"
+#include "others.h"
+#include "str.h"
+#include "md5.h"
+#include "sha256.h"
+#include "matcher-hash.h"
+#include "cvd.h"
+#include "default.h"
+#include "dbstage.h"
+
+#define TAR_BLOCKSIZE 512
+#define MD5_TOKENS 5
+#define NDB_TOKENS 6
+#define LDB_TOKENS 67
+#define CDB_TOKENS 12
+
+#define STAGE_NEW	0
+#define STAGE_LOADING	1
+#define STAGE_JOBS	2
+#define STAGE_READY	3
+
+struct cli_dbstage_job {
+    uint32_t member;
+    int32_t chunk; /* -1: checksum the member */
+};
+
+void cli_dbstage_dbio(const struct cli_dbstage_member *member, struct cli_dbio *dbio)
+{
+    memset(dbio, 0, sizeof(*dbio));
+    dbio->mem = member->data;
+    dbio->memsize = member->size;
+    dbio->usebuf = 1; /* cli_dbgets() strips the newlines */
+    if((member->hashmode || member->sigmode) && !member->textonly)
+	dbio->member = member;
+}
+
+void cli_dbstage_fields(const struct cli_dbstage_chunk *chunk, const struct cli_dbstage_sig *sig, const char **tokens, unsigned int ntokens)
+{
+	unsigned int i;
+
+    for(i = 0; i < ntokens; i++)
+	tokens[i] = i < sig->nfields ? chunk->text + chunk->fields[sig->field + i] : NULL;
+}
+
+unsigned int cli_dbstage_threads(const struct cl_engine *engine)
+{
+	unsigned int nthreads = engine->load_threads;
+
+#ifdef CL_THREAD_SAFE
+    if(!nthreads) {
+#ifdef _SC_NPROCESSORS_ONLN
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	nthreads = ncpu > 0 ? ncpu : 1;
+#else
+	nthreads = 1;
+#endif
+    }
+    if(nthreads > CLI_DBSTAGE_MAXTHREADS)
+	nthreads = CLI_DBSTAGE_MAXTHREADS;
+    return nthreads;
+#else
+    (void) nthreads;
+    return 1;
+#endif
+}
+
+#ifdef CL_THREAD_SAFE
+
+/* Which field order cli_load() would parse the file with, see cli_loadhash() */
+static unsigned int dbstage_hashmode(const char *dbname, unsigned int options)
+{
+    if(cli_strbcasestr(dbname, ".hdb") || cli_strbcasestr(dbname, ".hsb") || cli_strbcasestr(dbname, ".fp") || cli_strbcasestr(dbname, ".sfp"))
+	return 1;
+    if(cli_strbcasestr(dbname, ".mdb") || cli_strbcasestr(dbname, ".msb"))
+	return 2;
+    if(options & CL_DB_PUA) {
+	if(cli_strbcasestr(dbname, ".hdu") || cli_strbcasestr(dbname, ".hsu"))
+	    return 1;
+	if(cli_strbcasestr(dbname, ".mdu") || cli_strbcasestr(dbname, ".msu"))
+	    return 2;
+    }
+    return 0;
+}
+
+/* Which of the text loaders cli_load() would use for the file */
+static unsigned int dbstage_sigmode(const char *dbname, unsigned int options)
+{
+    if(cli_strbcasestr(dbname, ".ndb") || cli_strbcasestr(dbname, ".sdb"))
+	return 1;
+    if(cli_strbcasestr(dbname, ".ldb"))
+	return 2;
+    if(cli_strbcasestr(dbname, ".cdb"))
+	return 3;
+    if(options & CL_DB_PUA) {
+	if(cli_strbcasestr(dbname, ".ndu"))
+	    return 1;
+	if(cli_strbcasestr(dbname, ".ldu"))
+	    return 2;
+    }
+    return 0;
+}
+
+static struct cli_dbstage_member *dbstage_addmember(struct cli_dbstage *stage)
+{
+	struct cli_dbstage_member *members;
+
+    if(!(stage->nmembers % 16)) {
+	members = cli_realloc(stage->members, (stage->nmembers + 16) * sizeof(*members));
+	if(!members)
+	    return NULL;
+	stage->members = members;
+    }
+    memset(&stage->members[stage->nmembers], 0, sizeof(*members));
+    return &stage->members[stage->nmembers++];
+}
+
+static int dbstage_read(struct cli_dbstage *stage)
+{
+	STATBUF sb;
+	int fd;
+
+    if((fd = open(stage->filename, O_RDONLY|O_BINARY)) == -1)
+	return -1;
+
+    if(FSTAT(fd, &sb) || sb.st_size > 0x7fffffff) {
+	close(fd);
+	return -1;
+    }
+    stage->filesize = sb.st_size;
+    if(!(stage->file = cli_malloc(stage->filesize + 1)) || cli_readn(fd, stage->file, stage->filesize) != (int) stage->filesize) {
+	close(fd);
+	return -1;
+    }
+    stage->file[stage->filesize] = 0;
+    close(fd);
+    return 0;
+}
+
+/* Mirrors the tar walk in cli_tgzload(); anything it would complain about
+ * is left for cli_tgzload() itself */
+static int dbstage_index(struct cli_dbstage *stage, const char *tar, size_t size)
+{
+	struct cli_dbstage_member *member;
+	char osize[13];
+	unsigned int msize, pad;
+	size_t off = 0;
+
+    while(off < size) {
+	if(size - off < TAR_BLOCKSIZE)
+	    return -1;
+	if(!tar[off])
+	    break;
+	if(tar[off + 156] != '0' && tar[off + 156] != '\0')
+	    return -1;
+	strncpy(osize, tar + off + 124, 12);
+	osize[12] = '\0';
+	if(sscanf(osize, "%o", &msize) != 1)
+	    return -1;
+	if(!(member = dbstage_addmember(stage)))
+	    return -1;
+	strncpy(member->name, tar + off, 100);
+	member->name[100] = '\0';
+	if(strchr(member->name, '/'))
+	    return -1;
+
+	off += TAR_BLOCKSIZE;
+	if(msize > size - off)
+	    return -1;
+	member->data = tar + off;
+	member->size = msize;
+
+	pad = msize % TAR_BLOCKSIZE ? (TAR_BLOCKSIZE - (msize % TAR_BLOCKSIZE)) : 0;
+	off += msize;
+	off = pad < size - off ? off + pad : size;
+    }
+
+    return 0;
+}
+
+static int dbstage_unpack(struct cli_dbstage *stage)
+{
+	const unsigned char *body = (const unsigned char *) stage->file + 512;
+	size_t bodysize, cap;
+	unsigned char digest[16];
+	cli_md5_ctx md5;
+	z_stream z;
+	char *out;
+	int i, ret;
+
+    if(stage->filesize < 512 + 7)
+	return -1;
+    bodysize = stage->filesize - 512;
+
+    if(!stage->dbtype) {
+	cli_md5_init(&md5);
+	cli_md5_update(&md5, body, bodysize);
+	cli_md5_final(digest, &md5);
+	for(i = 0; i < 16; i++)
+	    sprintf(stage->md5 + 2 * i, "%02x", digest[i]);
+    }
+
+    if(!strncmp((const char *) body, "COPYING", 7))
+	return dbstage_index(stage, (const char *) body, bodysize);
+
+    /* gzread() would pass anything else through as is */
+    if(body[0] != 0x1f || body[1] != 0x8b)
+	return -1;
+
+    memset(&z, 0, sizeof(z));
+    if(inflateInit2(&z, 16 + MAX_WBITS) != Z_OK)
+	return -1;
+    cap = bodysize * 4;
+    if(!(stage->tar = cli_malloc(cap))) {
+	inflateEnd(&z);
+	return -1;
+    }
+    z.next_in = (Bytef *) body;
+    z.avail_in = bodysize;
+    do {
+	if(z.total_out == cap) {
+	    if(!(out = cli_realloc(stage->tar, cap * 2))) {
+		inflateEnd(&z);
+		return -1;
+	    }
+	    stage->tar = out;
+	    cap *= 2;
+	}
+	z.next_out = (Bytef *) stage->tar + z.total_out;
+	z.avail_out = cap - z.total_out;
+	ret = inflate(&z, Z_NO_FLUSH);
+    } while(ret == Z_OK);
+    stage->tarsize = z.total_out;
+    inflateEnd(&z);
+    if(ret != Z_STREAM_END || z.avail_in)
+	return -1;
+
+    return dbstage_index(stage, stage->tar, stage->tarsize);
+}
+
+static struct cli_dbstage_chunk *dbstage_addchunk(struct cli_dbstage_member *member)
+{
+	struct cli_dbstage_chunk *chunks;
+
+    if(!(member->nchunks % 16)) {
+	chunks = cli_realloc(member->chunks, (member->nchunks + 16) * sizeof(*chunks));
+	if(!chunks)
+	    return NULL;
+	member->chunks = chunks;
+    }
+    memset(&member->chunks[member->nchunks], 0, sizeof(*chunks));
+    return &member->chunks[member->nchunks++];
+}
+
+static int dbstage_addjob(struct cli_dbstage *stage, uint32_t member, int32_t chunk)
+{
+	struct cli_dbstage_job *jobs;
+
+    if(!(stage->njobs % 64)) {
+	jobs = cli_realloc(stage->jobs, (stage->njobs + 64) * sizeof(*jobs));
+	if(!jobs)
+	    return -1;
+	stage->jobs = jobs;
+    }
+    stage->jobs[stage->njobs].member = member;
+    stage->jobs[stage->njobs].chunk = chunk;
+    stage->njobs++;
+    return 0;
+}
+
+/* Checksum the CVD members and cut the hash and signature databases into
+ * chunks that end with a newline */
+static int dbstage_plan(struct cli_dbstage *stage)
+{
+	struct cli_dbstage_member *member;
+	struct cli_dbstage_chunk *chunk;
+	const char *pt, *nl;
+	uint32_t i, left, n;
+
+    for(i = 0; i < stage->nmembers; i++) {
+	member = &stage->members[i];
+	if(stage->dbtype >= 0 && dbstage_addjob(stage, i, -1))
+	    return -1;
+	if(!member->hashmode && !member->sigmode)
+	    continue;
+	pt = member->data;
+	left = member->size;
+	while(left) {
+	    n = left;
+	    if(n > CLI_DBSTAGE_CHUNK) {
+		nl = memchr(pt + CLI_DBSTAGE_CHUNK - 1, '\n', left - CLI_DBSTAGE_CHUNK + 1);
+		if(nl)
+		    n = nl - pt + 1;
+	    }
+	    if(!(chunk = dbstage_addchunk(member)) || dbstage_addjob(stage, i, member->nchunks - 1))
+		return -1;
+	    chunk->data = pt;
+	    chunk->size = n;
+	    pt += n;
+	    left -= n;
+	}
+    }
+    return 0;
+}
+
+static struct cli_dbstage_hash *dbstage_addhash(struct cli_dbstage_chunk *chunk)
+{
+	struct cli_dbstage_hash *hashes;
+
+    if(chunk->nhashes == chunk->maxhashes) {
+	chunk->maxhashes = chunk->maxhashes ? chunk->maxhashes * 2 : 1024;
+	hashes = cli_realloc(chunk->hashes, chunk->maxhashes * sizeof(*hashes));
+	if(!hashes)
+	    return NULL;
+	chunk->hashes = hashes;
+    }
+    return &chunk->hashes[chunk->nhashes++];
+}
+
+/* The parsing half of cli_loadhash(). Lines that don't parse become raw
+ * records, cli_loadhash() decides what to do with them and reports the
+ * errors in the right order. */
+static void dbstage_parse(struct cli_dbstage_chunk *chunk, unsigned int hashmode, int cvd)
+{
+	const char *tokens[MD5_TOKENS + 1];
+	char buffer[FILEBUFF];
+	const char *pt = chunk->data, *end = chunk->data + chunk->size, *nl, *next, *endpt;
+	struct cli_dbstage_hash *rec;
+	unsigned int tokens_count, req_fl, size_field, md5_field, len;
+	unsigned long size;
+
+    size_field = hashmode == 2 ? 0 : 1;
+    md5_field = hashmode == 2 ? 1 : 0;
+
+    for(; pt < end; pt = next) {
+	if((nl = memchr(pt, '\n', end - pt))) {
+	    len = nl - pt;
+	    next = nl + 1;
+	} else {
+	    /* cli_dbgets() only returns an unterminated last line for plain files */
+	    if(cvd) {
+		chunk->textonly = 1;
+		return;
+	    }
+	    len = end - pt;
+	    next = end;
+	}
+	if(len > FILEBUFF - 2 || memchr(pt, 0, len)) {
+	    chunk->textonly = 1;
+	    return;
+	}
+	chunk->lines++;
+	if(*pt == '#')
+	    continue;
+
+	memcpy(buffer, pt, len);
+	buffer[len] = 0;
+	cli_chomp(buffer);
+	if(!(rec = dbstage_addhash(chunk))) {
+	    chunk->textonly = 1;
+	    return;
+	}
+	rec->line = chunk->lines;
+	rec->entry = pt - chunk->data;
+	rec->entrylen = strlen(buffer);
+	rec->raw = 1;
+
+	tokens_count = cli_strtokenize(buffer, ':', MD5_TOKENS + 1, tokens);
+	if(tokens_count < 3)
+	    continue;
+	req_fl = 0;
+	if(tokens_count > MD5_TOKENS - 2) {
+	    req_fl = atoi(tokens[MD5_TOKENS - 2]);
+	    if(tokens_count > MD5_TOKENS)
+		continue;
+	    if(cl_retflevel() < req_fl || (tokens_count == MD5_TOKENS && cl_retflevel() > (unsigned int) atoi(tokens[MD5_TOKENS - 1]))) {
+		chunk->nhashes--;
+		continue;
+	    }
+	}
+
+	if(hashmode == 2 || strcmp(tokens[size_field], "*")) {
+	    size = strtoul(tokens[size_field], (char **) &endpt, 10);
+	    if(*endpt || !size || size >= 0xffffffff)
+		continue;
+	} else {
+	    size = 0;
+	    if(tokens_count < MD5_TOKENS - 1 || req_fl < 73)
+		continue;
+	}
+	rec->size = size;
+
+	switch(strlen(tokens[md5_field])) {
+	    case 32:
+		rec->type = CLI_HASH_MD5;
+		break;
+	    case 40:
+		rec->type = CLI_HASH_SHA1;
+		break;
+	    case 64:
+		rec->type = CLI_HASH_SHA256;
+		break;
+	    default:
+		continue;
+	}
+	if(cli_hex2str_to(tokens[md5_field], (char *) rec->digest, strlen(tokens[md5_field])))
+	    continue;
+
+	rec->virname = tokens[2] - buffer;
+	rec->virlen = strlen(tokens[2]);
+	rec->raw = 0;
+    }
+}
+
+static struct cli_dbstage_sig *dbstage_addsig(struct cli_dbstage_chunk *chunk)
+{
+	struct cli_dbstage_sig *sigs;
+
+    if(chunk->nsigs == chunk->maxsigs) {
+	chunk->maxsigs = chunk->maxsigs ? chunk->maxsigs * 2 : 1024;
+	sigs = cli_realloc(chunk->sigs, chunk->maxsigs * sizeof(*sigs));
+	if(!sigs)
+	    return NULL;
+	chunk->sigs = sigs;
+    }
+    return &chunk->sigs[chunk->nsigs++];
+}
+
+/* The tokenizing half of cli_loadndb(), cli_loadldb() and cli_loadcdb():
+ * the lines are copied to chunk->text and split up in place, the loaders
+ * take it from there */
+static void dbstage_split(struct cli_dbstage_chunk *chunk, unsigned int sigmode, int cvd)
+{
+	const char *tokens[LDB_TOKENS + 1];
+	char *pt, *end, *nl, *next;
+	struct cli_dbstage_sig *rec;
+	unsigned int len, maxlen, ntokens, i;
+	uint32_t *fields;
+	char delim;
+
+    switch(sigmode) {
+	case 1:
+	    delim = ':';
+	    ntokens = NDB_TOKENS + 1;
+	    maxlen = FILEBUFF - 2;
+	    break;
+	case 2:
+	    delim = ';';
+	    ntokens = LDB_TOKENS + 1;
+	    maxlen = CLI_DEFAULT_LSIG_BUFSIZE - 1;
+	    break;
+	default:
+	    delim = ':';
+	    ntokens = CDB_TOKENS + 1;
+	    maxlen = FILEBUFF - 2;
+    }
+
+    if(!(chunk->text = cli_malloc(chunk->size + 1))) {
+	chunk->textonly = 1;
+	return;
+    }
+    memcpy(chunk->text, chunk->data, chunk->size);
+    chunk->text[chunk->size] = 0;
+
+    end = chunk->text + chunk->size;
+    for(pt = chunk->text; pt < end; pt = next) {
+	if((nl = memchr(pt, '\n', end - pt))) {
+	    len = nl - pt;
+	    next = nl + 1;
+	} else {
+	    /* see dbstage_parse() */
+	    if(cvd) {
+		chunk->textonly = 1;
+		return;
+	    }
+	    len = end - pt;
+	    next = end;
+	}
+	if(len > maxlen || memchr(pt, 0, len)) {
+	    chunk->textonly = 1;
+	    return;
+	}
+	chunk->lines++;
+	if(*pt == '#')
+	    continue;
+
+	pt[len] = 0;
+	cli_chomp(pt);
+	if(!(rec = dbstage_addsig(chunk))) {
+	    chunk->textonly = 1;
+	    return;
+	}
+	rec->line = chunk->lines;
+	rec->entry = pt - chunk->text;
+	rec->entrylen = strlen(pt);
+	rec->field = chunk->nfields;
+	rec->nfields = cli_strtokenize(pt, delim, ntokens, tokens);
+
+	if(chunk->nfields + rec->nfields > chunk->maxfields) {
+	    chunk->maxfields = chunk->maxfields ? chunk->maxfields * 2 : 4096;
+	    if(!(fields = cli_realloc(chunk->fields, chunk->maxfields * sizeof(*fields)))) {
+		chunk->textonly = 1;
+		return;
+	    }
+	    chunk->fields = fields;
+	}
+	for(i = 0; i < rec->nfields; i++)
+	    chunk->fields[chunk->nfields++] = tokens[i] - chunk->text;
+    }
+}
+
+static void dbstage_job(struct cli_dbstage *stage, const struct cli_dbstage_job *job)
+{
+	struct cli_dbstage_member *member = &stage->members[job->member];
+	SHA256_CTX sha256;
+
+    if(job->chunk < 0) {
+	sha256_init(&sha256);
+	sha256_update(&sha256, member->data, member->size);
+	sha256_final(&sha256, member->sha256);
+    } else if(member->hashmode) {
+	dbstage_parse(&member->chunks[job->chunk], member->hashmode, stage->dbtype >= 0);
+    } else {
+	dbstage_split(&member->chunks[job->chunk], member->sigmode, stage->dbtype >= 0);
+    }
+}
+
+static void dbstage_free(struct cli_dbstage *stage)
+{
+	uint32_t i, j;
+
+    for(i = 0; i < stage->nmembers; i++) {
+	for(j = 0; j < stage->members[i].nchunks; j++) {
+	    free(stage->members[i].chunks[j].hashes);
+	    free(stage->members[i].chunks[j].text);
+	    free(stage->members[i].chunks[j].sigs);
+	    free(stage->members[i].chunks[j].fields);
+	}
+	free(stage->members[i].chunks);
+    }
+    free(stage->members);
+    stage->members = NULL;
+    stage->nmembers = 0;
+    free(stage->tar);
+    stage->tar = NULL;
+    free(stage->file);
+    stage->file = NULL;
+    free(stage->jobs);
+    stage->jobs = NULL;
+}
+
+static void dbstage_load(struct cli_dbstage *stage, unsigned int options)
+{
+	struct cli_dbstage_member *member;
+	const char *dbname;
+	unsigned int hashmode = 0, sigmode = 0;
+	uint32_t i;
+
+    if((dbname = strrchr(stage->filename, *PATHSEP)))
+	dbname++;
+    else
+	dbname = stage->filename;
+
+    if(cli_strbcasestr(dbname, ".cvd"))
+	stage->dbtype = 0;
+    else if(cli_strbcasestr(dbname, ".cld"))
+	stage->dbtype = 1;
+    else if(cli_strbcasestr(dbname, ".cud"))
+	stage->dbtype = 2;
+    else if(!(hashmode = dbstage_hashmode(dbname, options)) && !(sigmode = dbstage_sigmode(dbname, options))) {
+	/* nothing to gain, the text loaders do all the work */
+	stage->passthrough = 1;
+	return;
+    }
+
+    if(dbstage_read(stage))
+	goto passthrough;
+
+    if(stage->dbtype >= 0) {
+	if(dbstage_unpack(stage))
+	    goto passthrough;
+	for(i = 0; i < stage->nmembers; i++) {
+	    member = &stage->members[i];
+	    if(!(member->hashmode = dbstage_hashmode(member->name, options)))
+		member->sigmode = dbstage_sigmode(member->name, options);
+	}
+    } else {
+	if(!(member = dbstage_addmember(stage)))
+	    goto passthrough;
+	strncpy(member->name, dbname, 100);
+	member->data = stage->file;
+	member->size = stage->filesize;
+	member->hashmode = hashmode;
+	member->sigmode = sigmode;
+    }
+
+    if(dbstage_plan(stage))
+	goto passthrough;
+    return;
+
+passthrough:
+    dbstage_free(stage);
+    stage->njobs = 0;
+    stage->passthrough = 1;
+}
+
+/* All jobs of the stage are done */
+static void dbstage_finish(struct cli_dbstage *stage)
+{
+	struct cli_dbstage_member *member;
+	uint32_t i, j;
+
+    for(i = 0; i < stage->nmembers; i++) {
+	member = &stage->members[i];
+	for(j = 0; j < member->nchunks; j++)
+	    if(member->chunks[j].textonly)
+		member->textonly = 1;
+    }
+    if(stage->dbtype < 0 && stage->members[0].textonly) {
+	/* fgets() semantics, the text loaders have to read the file */
+	dbstage_free(stage);
+	stage->passthrough = 1;
+    }
+}
+
+struct cli_dbstager {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct cli_dbstage *stages;
+    unsigned int nstages;
+    unsigned int consumed;	/* stages handed to cli_loaddbdir() and released */
+    unsigned int window;	/* how far the threads may get ahead */
+    unsigned int options;
+    int stop;
+    pthread_t *threads;
+    unsigned int nthreads;
+};
+
+static void *dbstage_worker(void *arg)
+{
+	struct cli_dbstager *stager = arg;
+	struct cli_dbstage *stage;
+	const struct cli_dbstage_job *job;
+	unsigned int i, end;
+
+    pthread_mutex_lock(&stager->mutex);
+    while(!stager->stop) {
+	/* the oldest stage with work left first, the merge is waiting for it */
+	stage = NULL;
+	end = stager->consumed + stager->window;
+	if(end > stager->nstages)
+	    end = stager->nstages;
+	for(i = stager->consumed; i < end; i++) {
+	    if(stager->stages[i].state == STAGE_NEW || (stager->stages[i].state == STAGE_JOBS && stager->stages[i].nextjob < stager->stages[i].njobs)) {
+		stage = &stager->stages[i];
+		break;
+	    }
+	}
+	if(!stage) {
+	    pthread_cond_wait(&stager->cond, &stager->mutex);
+	    continue;
+	}
+
+	if(stage->state == STAGE_NEW) {
+	    stage->state = STAGE_LOADING;
+	    pthread_mutex_unlock(&stager->mutex);
+	    dbstage_load(stage, stager->options);
+	    pthread_mutex_lock(&stager->mutex);
+	    stage->state = stage->njobs ? STAGE_JOBS : STAGE_READY;
+	} else {
+	    job = &stage->jobs[stage->nextjob++];
+	    pthread_mutex_unlock(&stager->mutex);
+	    dbstage_job(stage, job);
+	    pthread_mutex_lock(&stager->mutex);
+	    if(++stage->jobsdone == stage->njobs) {
+		dbstage_finish(stage);
+		stage->state = STAGE_READY;
+	    }
+	}
+	pthread_cond_broadcast(&stager->cond);
+    }
+    pthread_mutex_unlock(&stager->mutex);
+    return NULL;
+}
+
+struct cli_dbstager *cli_dbstage_start(char **files, unsigned int nfiles, unsigned int nthreads, unsigned int options)
+{
+	struct cli_dbstager *stager;
+	unsigned int i;
+
+    if(!(stager = cli_calloc(1, sizeof(*stager))))
+	return NULL;
+    if(!(stager->stages = cli_calloc(nfiles, sizeof(*stager->stages))) || !(stager->threads = cli_calloc(nthreads, sizeof(pthread_t)))) {
+	free(stager->stages);
+	free(stager);
+	return NULL;
+    }
+    for(i = 0; i < nfiles; i++) {
+	stager->stages[i].filename = files[i];
+	stager->stages[i].dbtype = -1;
+    }
+    stager->nstages = nfiles;
+    stager->window = nthreads + 1;
+    stager->options = options;
+    pthread_mutex_init(&stager->mutex, NULL);
+    pthread_cond_init(&stager->cond, NULL);
+
+    for(i = 0; i < nthreads; i++) {
+	if(pthread_create(&stager->threads[i], NULL, dbstage_worker, stager))
+	    break;
+	stager->nthreads++;
+    }
+    if(!stager->nthreads) {
+	cli_dbgmsg("cli_dbstage_start: Can't create the loader threads\n");
+	cli_dbstage_stop(stager);
+	return NULL;
+    }
+    cli_dbgmsg("cli_dbstage_start: Loading %u files with %u threads\n", nfiles, stager->nthreads);
+
+    return stager;
+}
+
+struct cli_dbstage *cli_dbstage_get(struct cli_dbstager *stager, unsigned int idx)
+{
+	struct cli_dbstage *stage = &stager->stages[idx];
+
+    pthread_mutex_lock(&stager->mutex);
+    while(stage->state != STAGE_READY)
+	pthread_cond_wait(&stager->cond, &stager->mutex);
+    pthread_mutex_unlock(&stager->mutex);
+
+    return stage;
+}
+
+void cli_dbstage_release(struct cli_dbstager *stager, unsigned int idx)
+{
+    dbstage_free(&stager->stages[idx]);
+    pthread_mutex_lock(&stager->mutex);
+    stager->consumed = idx + 1;
+    pthread_cond_broadcast(&stager->cond);
+    pthread_mutex_unlock(&stager->mutex);
+}
+
+void cli_dbstage_stop(struct cli_dbstager *stager)
+{
+	unsigned int i;
+
+    pthread_mutex_lock(&stager->mutex);
+    stager->stop = 1;
+    pthread_cond_broadcast(&stager->cond);
+    pthread_mutex_unlock(&stager->mutex);
+    for(i = 0; i < stager->nthreads; i++)
+	pthread_join(stager->threads[i], NULL);
+
+    for(i = 0; i < stager->nstages; i++)
+	dbstage_free(&stager->stages[i]);
+    pthread_mutex_destroy(&stager->mutex);
+    pthread_cond_destroy(&stager->cond);
+    free(stager->threads);
+    free(stager->stages);
+    free(stager);
+}
+
+#else
+
+struct cli_dbstager *cli_dbstage_start(char **files, unsigned int nfiles, unsigned int nthreads, unsigned int options)
+{
+    return NULL;
+}
+
+struct cli_dbstage *cli_dbstage_get(struct cli_dbstager *stager, unsigned int idx)
+{
+    return NULL;
+}
+
+void cli_dbstage_release(struct cli_dbstager *stager, unsigned int idx)
+{
+}
+
+void cli_dbstage_stop(struct cli_dbstager *stager)
+{
+}
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ *  Database staging for cl_load()
+ *
+ *  Copyright (C) 2013 Sourcefire, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#ifndef __DBSTAGE_H
+#define __DBSTAGE_H
+
+#include "clamav.h"
+#include "cltypes.h"
+#include "cvd.h"
+
+/* The loader threads do the part of cl_load() that doesn't touch the
+ * engine: they read the database files, check and unpack the CVDs, parse
+ * the hash databases into cli_dbstage_hash records and split the lines of
+ * the .ndb, .ldb and .cdb files into their fields. cli_loaddbdir()
+ * then merges the staged files into the engine one at a time, in the same
+ * order as without loader threads. Anything out of the ordinary (broken
+ * CVDs, overlong lines, ...) is left to the regular loaders, so the
+ * results and the messages stay the same.
+ */
+
+#define CLI_DBSTAGE_CHUNK   (4 * 1048576)   /* databases are parsed in chunks of this size */
+#define CLI_DBSTAGE_MAXTHREADS 16
+
+/* One line of a hash database */
+struct cli_dbstage_hash {
+    unsigned char digest[32];
+    uint32_t size;	/* 0: any size */
+    uint32_t line;	/* in the chunk, 1-based */
+    uint32_t entry;	/* offset of the line in the chunk */
+    uint16_t entrylen;
+    uint16_t virname;	/* offset of the virus name in the line */
+    uint16_t virlen;
+    uint8_t type;	/* enum CLI_HASH_TYPE */
+    uint8_t raw;	/* not parsed, cli_loadhash() must look at it */
+};
+
+/* One line of a signature database, split up by cli_strtokenize() */
+struct cli_dbstage_sig {
+    uint32_t line;	/* in the chunk, 1-based */
+    uint32_t entry;	/* offset of the line in the chunk */
+    uint32_t field;	/* its first field in chunk->fields */
+    uint16_t entrylen;
+    uint16_t nfields;
+};
+
+struct cli_dbstage_chunk {
+    const char *data;
+    uint32_t size, lines;
+    struct cli_dbstage_hash *hashes;
+    uint32_t nhashes, maxhashes;
+    char *text;		/* copy of data with the fields terminated */
+    struct cli_dbstage_sig *sigs;
+    uint32_t nsigs, maxsigs;
+    uint32_t *fields;	/* offsets in text */
+    uint32_t nfields, maxfields;
+    int textonly;
+};
+
+struct cli_dbstage_member {
+    char name[101];
+    const char *data;
+    uint32_t size;
+    unsigned char sha256[32];
+    unsigned int hashmode;	/* 0: not a hash database, 1: .hdb fields, 2: .mdb fields */
+    unsigned int sigmode;	/* 0: not a signature database, 1: .ndb, 2: .ldb, 3: .cdb */
+    int textonly;		/* the chunks can't be used, load the text */
+    struct cli_dbstage_chunk *chunks;
+    uint32_t nchunks;
+};
+
+struct cli_dbstage {
+    char *filename;
+    int passthrough;	/* not staged, cli_load() reads the file itself */
+    int dbtype;		/* -1: plain database, else as in cli_cvdload() */
+    char md5[33];	/* of the CVD after the header, if dbtype is 0 */
+    char *file;
+    size_t filesize;
+    char *tar;		/* unpacked CVD */
+    size_t tarsize;
+    struct cli_dbstage_member *members;
+    uint32_t nmembers;
+
+    /* for the loader threads */
+    unsigned int state, njobs, nextjob, jobsdone;
+    struct cli_dbstage_job *jobs;
+};
+
+struct cli_dbstager;
+
+unsigned int cli_dbstage_threads(const struct cl_engine *engine);
+struct cli_dbstager *cli_dbstage_start(char **files, unsigned int nfiles, unsigned int nthreads, unsigned int options);
+struct cli_dbstage *cli_dbstage_get(struct cli_dbstager *stager, unsigned int idx);
+void cli_dbstage_release(struct cli_dbstager *stager, unsigned int idx);
+void cli_dbstage_stop(struct cli_dbstager *stager);
+void cli_dbstage_dbio(const struct cli_dbstage_member *member, struct cli_dbio *dbio);
+void cli_dbstage_fields(const struct cli_dbstage_chunk *chunk, const struct cli_dbstage_sig *sig, const char **tokens, unsigned int ntokens);
+
+#endif
@@ -42,5 +42,6 @@
 #define CLI_DEFAULT_MAXHTMLNOTAGS       2097152
 #define CLI_DEFAULT_MAXSCRIPTNORMALIZE  5242880
 #define CLI_DEFAULT_MAXZIPTYPERCG       1048576
+#define CLI_DEFAULT_MAXINMEMORY         1048576
 
 #endif
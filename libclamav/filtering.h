@@ -36,6 +36,7 @@ struct cli_ac_patt;
 void filter_init(struct filter *m);
 long filter_search(const struct filter *m, const unsigned char *data, unsigned long len);
 int filter_search_ext(const struct filter *m, const unsigned char *data, unsigned long len, struct filter_match_info *inf);
+int filter_search_ext_scalar(const struct filter *m, const unsigned char *data, unsigned long len, struct filter_match_info *inf);
 int  filter_add_static(struct filter *m, const unsigned char *pattern, unsigned long len, const char *name);
 int  filter_add_acpatt(struct filter *m, const struct cli_ac_patt *pat);
 
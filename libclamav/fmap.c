@@ -36,6 +36,9 @@
 #endif
 #endif
 #include <errno.h>
+#ifdef HAVE_POSIX_FADVISE
+#include <fcntl.h>
+#endif
 
 #ifdef C_LINUX
 #include <pthread.h>
@@ -44,9 +47,23 @@
 #include "others.h"
 #include "cltypes.h"
 
-static inline unsigned int fmap_align_items(unsigned int sz, unsigned int al);
-static inline unsigned int fmap_align_to(unsigned int sz, unsigned int al);
+#if defined(ANONYMOUS_MAP) && defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && !defined(_WIN32)
+/* With fmap_direct() files of at least FMAP_DIRECT_MIN bytes (disk images,
+ * backups) are mapped from the page cache instead of being copied into an
+ * anonymous map. A file truncated under such a scan gets us a SIGBUS, so it
+ * is only done on request (CL_ENGINE_DIRECT_MAP), for files nobody else is
+ * going to shrink; everything else keeps going through pread() */
+#define FMAP_DIRECT
+#define FMAP_DIRECT_MIN (256*1024*1024)
+#define FMAP_DIRECT_RELEASE 256 /* pages dropped at once behind a sequential scan */
+#endif
+
+static inline size_t fmap_align_items(size_t sz, unsigned int al);
+static inline size_t fmap_align_to(size_t sz, unsigned int al);
 static inline unsigned int fmap_which_page(fmap_t *m, size_t at);
+#ifdef FMAP_DIRECT
+static fmap_t *fmap_open_direct(int fd, off_t offset, size_t len);
+#endif
 
 #ifndef _WIN32
 /* pread proto here in order to avoid the use of XOPEN and BSD_SOURCE
@@ -60,7 +77,7 @@ static off_t pread_cb(void *handle, void *buf, size_t count, off_t offset)
 }
 
 
-fmap_t *fmap_check_empty(int fd, off_t offset, size_t len, int *empty) {
+static fmap_t *fmap_open_fd(int fd, off_t offset, size_t len, int *empty, int direct) {
     unsigned int pages, mapsz, hdrsz;
     unsigned short dumb = 1;
     int pgsz = cli_getpagesize();
@@ -84,6 +101,12 @@ fmap_t *fmap_check_empty(int fd, off_t offset, size_t len, int *empty) {
 	cli_warnmsg("fmap: attempted oof mapping\n");
 	return NULL;
     }
+#ifdef FMAP_DIRECT
+    if(direct && sizeof(size_t) >= 8 && len >= FMAP_DIRECT_MIN && (m = fmap_open_direct(fd, offset, len))) {
+	m->mtime = st.st_mtime;
+	return m;
+    }
+#endif
     m = cl_fmap_open_handle((void*)(ssize_t)fd, offset, len, pread_cb, 1);
     if (!m)
 	return NULL;
@@ -91,6 +114,10 @@ fmap_t *fmap_check_empty(int fd, off_t offset, size_t len, int *empty) {
     m->handle_is_fd = 1;
     return m;
 }
+
+fmap_t *fmap_check_empty(int fd, off_t offset, size_t len, int *empty) {
+    return fmap_open_fd(fd, offset, len, empty, 0);
+}
 #else
 /* vvvvv WIN32 STUFF BELOW vvvvv */
 static void unmap_win32(fmap_t *m) { /* WIN32 */
@@ -163,17 +190,6 @@ fmap_t *fmap_check_empty(int fd, off_t offset, size_t len, int *empty) { /* WIN3
 
 /* vvvvv SHARED STUFF BELOW vvvvv */
 
-#define FM_MASK_COUNT 0x3fffffff
-#define FM_MASK_PAGED 0x40000000
-#define FM_MASK_SEEN 0x80000000
-#define FM_MASK_LOCKED FM_MASK_SEEN
-/* 2 high bits:
-00 - not seen - not paged - N/A
-01 -    N/A   -   paged   - not locked
-10 -   seen   - not paged - N/A
-11 -    N/A   -   paged   - locked
-*/
-
 /* FIXME: tune this stuff */
 #define UNPAGE_THRSHLD_LO 4*1024*1024
 #define UNPAGE_THRSHLD_HI 8*1024*1024
@@ -185,8 +201,11 @@ fmap_t *fmap_check_empty(int fd, off_t offset, size_t len, int *empty) { /* WIN3
    Relieve some stress on mmap_sem.
    When mmap_sem is heavily hammered, the scheduler
    tends to fail to wake us up properly.
+   Only the creation and the destruction of the maps are serialized: page
+   state is per map and paging in and aging don't change the address space
+   layout, so the read path takes no global lock.
 */
-pthread_mutex_t fmap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t fmap_mutex = PTHREAD_MUTEX_INITIALIZER;
 #define fmap_lock pthread_mutex_lock(&fmap_mutex)
 #define fmap_unlock pthread_mutex_unlock(&fmap_mutex);
 #else
@@ -194,6 +213,12 @@ pthread_mutex_t fmap_mutex = PTHREAD_MUTEX_INITIALIZER;
 #define fmap_unlock
 #endif
 
+#if defined(ANONYMOUS_MAP) && defined(C_LINUX) && HAVE_MADVISE && defined(MADV_DONTNEED)
+/* private anonymous pages read back as zeroes after MADV_DONTNEED, which
+ * only needs mmap_sem for reading */
+#define FMAP_DISCARD_MADVISE
+#endif
+
 #ifndef MADV_DONTFORK
 #define MADV_DONTFORK 0
 #endif
@@ -210,7 +235,8 @@ static void unmap_malloc(fmap_t *m);
 extern cl_fmap_t *cl_fmap_open_handle(void *handle, size_t offset, size_t len,
 				      clcb_pread pread_cb, int use_aging)
 {
-    unsigned int pages, mapsz, hdrsz;
+    unsigned int pages, hdrsz;
+    size_t mapsz;
     cl_fmap_t *m;
     int pgsz = cli_getpagesize();
 
@@ -229,7 +255,7 @@ extern cl_fmap_t *cl_fmap_open_handle(void *handle, size_t offset, size_t len,
 
     pages = fmap_align_items(len, pgsz);
     hdrsz = fmap_align_to(sizeof(fmap_t) + (pages-1) * sizeof(uint32_t), pgsz); /* fmap_t includes 1 bitmap slot, hence (pages-1) */
-    mapsz = pages * pgsz + hdrsz;
+    mapsz = (size_t)pages * pgsz + hdrsz;
 
 #ifndef ANONYMOUS_MAP
     use_aging = 0;
@@ -277,10 +303,73 @@ extern cl_fmap_t *cl_fmap_open_handle(void *handle, size_t offset, size_t len,
     return m;
 }
 
+#ifdef ANONYMOUS_MAP
+/* Gives the pages back to the kernel, the contents are lost */
+static void fmap_discard(char *start, size_t len) {
+#ifdef FMAP_DISCARD_MADVISE
+    if(!madvise(start, len, MADV_DONTNEED))
+	return;
+#endif
+    if(mmap(start, len, PROT_READ | PROT_WRITE, MAP_FIXED|MAP_PRIVATE|ANONYMOUS_MAP, -1, 0) == MAP_FAILED)
+	cli_dbgmsg("fmap_aging: kernel hates you\n");
+}
+#endif
+
+/* Sequential access (each need starting inside the previous one and ending
+ * past it, as cli_fmap_scandesc() walks the map) gets the next window read
+ * ahead by the kernel while the current one is matched, and the unlocked
+ * pages left behind become the first ones fmap_aging() drops. The needs
+ * elsewhere in between (headers, hashes, lsig offsets) are ignored, one at
+ * offset 0 starts over. */
+static void fmap_sequential(fmap_t *m, size_t at, size_t len) {
+    size_t end = at + len;
+    unsigned int i, page;
+
+    if(!at) {
+	m->seq = 0;
+	m->seq_page = 0;
+	m->ra_end = 0;
+    } else if(at < m->seq_at || at > m->seq_end || end <= m->seq_end) {
+	return;
+    }
+    m->seq++;
+    m->seq_at = at;
+    m->seq_end = end;
+    if(m->seq < SEQ_MIN)
+	return;
+
+    page = fmap_which_page(m, at);
+    if(m->aging) {
+	for(i = m->seq_page; i < page; i++) {
+	    if((fmap_bitmap[i] & (FM_MASK_PAGED | FM_MASK_LOCKED)) == FM_MASK_PAGED)
+		fmap_bitmap[i] = FM_MASK_PAGED; /* age 0 */
+	}
+	m->seq_page = page;
+    }
+#if defined(FMAP_DIRECT) && defined(FMAP_DISCARD_MADVISE)
+    else if(m->direct && page >= m->seq_page + FMAP_DIRECT_RELEASE) {
+	/* the data stays in the page cache, only our page tables go: the
+	 * pointers handed out remain valid */
+	madvise((char *)m->data + (size_t)m->seq_page * m->pgsz, (size_t)(page - m->seq_page) * m->pgsz, MADV_DONTNEED);
+	m->seq_page = page;
+    }
+#endif
+
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+    if(m->handle_is_fd && end + SEQ_READAHEAD / 2 > m->ra_end && m->ra_end < m->real_len) {
+	size_t ra_at = MAX(end, m->ra_end);
+
+	m->ra_end = MIN(end + SEQ_READAHEAD, m->real_len);
+	if(ra_at < m->ra_end)
+	    posix_fadvise((int)(ssize_t)m->handle, m->offset + ra_at, m->ra_end - ra_at, POSIX_FADV_WILLNEED);
+    }
+#endif
+}
+
 static void fmap_aging(fmap_t *m) {
 #ifdef ANONYMOUS_MAP
     if(!m->aging) return;
-    if(m->paged * m->pgsz > UNPAGE_THRSHLD_HI) { /* we alloc'd too much */
+    if((size_t)m->paged * m->pgsz > UNPAGE_THRSHLD_HI) { /* we alloc'd too much */
 	unsigned int i, avail = 0, freeme[2048], maxavail = MIN(sizeof(freeme)/sizeof(*freeme), m->paged - UNPAGE_THRSHLD_LO / m->pgsz) - 1;
 
 	for(i=0; i<m->pages; i++) {
@@ -311,11 +400,11 @@ static void fmap_aging(fmap_t *m) {
 	    char *lastpage = NULL;
 	    char *firstpage = NULL;
 	    for(i=0; i<avail; i++) {
-		char *pptr = (char *)m + freeme[i] * m->pgsz + m->hdrsz;
+		char *pptr = (char *)m + (size_t)freeme[i] * m->pgsz + m->hdrsz;
 		/* we mark the page as seen */
 		fmap_bitmap[freeme[i]] = FM_MASK_SEEN;
-		/* and we mmap the page over so the kernel knows there's nothing good in there */
-		/* reduce number of mmap calls: if pages are adjacent only do 1 mmap call */
+		/* and we discard the page so the kernel knows there's nothing good in there */
+		/* reduce number of calls: if pages are adjacent only do 1 call */
 		if (lastpage && pptr == lastpage) {
 			lastpage = pptr + m->pgsz;
 			continue;
@@ -325,19 +414,12 @@ static void fmap_aging(fmap_t *m) {
 			lastpage = pptr + m->pgsz;
 			continue;
 		}
-		fmap_lock;
-		if(mmap(firstpage, lastpage - firstpage, PROT_READ | PROT_WRITE, MAP_FIXED|MAP_PRIVATE|ANONYMOUS_MAP, -1, 0) == MAP_FAILED)
-		    cli_dbgmsg("fmap_aging: kernel hates you\n");
-		fmap_unlock;
+		fmap_discard(firstpage, lastpage - firstpage);
 		firstpage = pptr;
 		lastpage = pptr + m->pgsz;
 	    }
-	    if (lastpage) {
-		fmap_lock;
-		if(mmap(firstpage, lastpage - firstpage, PROT_READ | PROT_WRITE, MAP_FIXED|MAP_PRIVATE|ANONYMOUS_MAP, -1, 0) == MAP_FAILED)
-		    cli_dbgmsg("fmap_aging: kernel hates you\n");
-		fmap_unlock;
-	    }
+	    if (lastpage)
+		fmap_discard(firstpage, lastpage - firstpage);
 	    m->paged -= avail;
 	}
     }
@@ -351,14 +433,7 @@ static int fmap_readpage(fmap_t *m, unsigned int first_page, unsigned int count,
     uint32_t s;
     unsigned int i, page = first_page, force_read = 0;
 
-    fmap_lock;
-    for(i=0; i<count; i++) { /* prefault */
-	/* Not worth checking if the page is already paged, just ping each */
-	/* Also not worth reusing the loop below */
-	volatile char faultme;
-	faultme = ((char *)m)[(first_page+i) * m->pgsz + m->hdrsz];
-    }
-    fmap_unlock;
+    /* no prefaulting: pread() faults the pages in as it fills them */
     for(i=0; i<=count; i++, page++) {
 	int lock;
 	if(lock_count) {
@@ -421,7 +496,7 @@ static int fmap_readpage(fmap_t *m, unsigned int first_page, unsigned int count,
 	    eintr_off = 0;
 	    while(readsz) {
 		ssize_t got;
-		off_t target_offset = eintr_off + m->offset + (first_page * m->pgsz);
+		off_t target_offset = eintr_off + m->offset + ((off_t)first_page * m->pgsz);
 		got=m->pread_cb(m->handle, pptr, readsz, target_offset);
 
 		if(got < 0 && errno == EINTR)
@@ -453,7 +528,7 @@ static int fmap_readpage(fmap_t *m, unsigned int first_page, unsigned int count,
 	/* page is not already paged */
 	if(!pptr) {
 	    /* set a new start for pending reads if we don't have one */
-	    pptr = (char *)m + page * m->pgsz + m->hdrsz;
+	    pptr = (char *)m + (size_t)page * m->pgsz + m->hdrsz;
 	    first_page = page;
 	}
 	if((page == m->pages - 1) && (m->real_len % m->pgsz))
@@ -465,6 +540,7 @@ static int fmap_readpage(fmap_t *m, unsigned int first_page, unsigned int count,
 	else /* no locking: set paged and set aging to max */
 	    fmap_bitmap[page] = FM_MASK_PAGED | FM_MASK_COUNT;
 	m->paged++;
+	m->faults++;
     }
     return 0;
 }
@@ -481,6 +557,7 @@ static const void *handle_need(fmap_t *m, size_t at, size_t len, int lock) {
     if(!CLI_ISCONTAINED(0, m->real_len, at, len))
 	return NULL;
 
+    fmap_sequential(m, at, len);
     fmap_aging(m);
 
     first_page = fmap_which_page(m, at);
@@ -542,10 +619,10 @@ static void handle_unneed_off(fmap_t *m, size_t at, size_t len) {
 static void unmap_mmap(fmap_t *m)
 {
 #ifdef ANONYMOUS_MAP
-    size_t len = m->pages * m->pgsz + m->hdrsz;
+    size_t len = (size_t)m->pages * m->pgsz + m->hdrsz;
     fmap_lock;
     if (munmap((void *)m, len) == -1) /* munmap() failed */
-        cli_warnmsg("funmap: unable to unmap memory segment at address: %p with length: %d\n", (void *)m, len);
+        cli_warnmsg("funmap: unable to unmap memory segment at address: %p with length: %lu\n", (void *)m, (unsigned long)len);
     fmap_unlock;
 #endif
 }
@@ -570,7 +647,7 @@ static const void *handle_need_offstr(fmap_t *m, size_t at, size_t len_hint) {
     last_page = fmap_which_page(m, at + len_hint - 1);
 
     for(i=first_page; i<=last_page; i++) {
-	char *thispage = (char *)m + m->hdrsz + i * m->pgsz;
+	char *thispage = (char *)m + m->hdrsz + (size_t)i * m->pgsz;
 	unsigned int scanat, scansz;
 
 	if(fmap_readpage(m, i, 1, 1)) {
@@ -607,7 +684,7 @@ static const void *handle_gets(fmap_t *m, char *dst, size_t *at, size_t max_len)
     last_page = fmap_which_page(m, *at + len - 1);
 
     for(i=first_page; i<=last_page; i++) {
-	char *thispage = (char *)m + m->hdrsz + i * m->pgsz;
+	char *thispage = (char *)m + m->hdrsz + (size_t)i * m->pgsz;
 	unsigned int scanat, scansz;
 
 	if(fmap_readpage(m, i, 1, 0))
@@ -718,16 +795,69 @@ static const void *mem_gets(fmap_t *m, char *dst, size_t *at, size_t max_len) {
     return dst;
 }
 
+#ifdef FMAP_DIRECT
+/* vvvvv DIRECT MAPPING STUFF BELOW vvvvv */
+
+static const void *direct_need(fmap_t *m, size_t at, size_t len, int lock) {
+    const void *ptr = mem_need(m, at, len, lock);
+
+    if(ptr)
+	fmap_sequential(m, at + m->nested_offset, len);
+    return ptr;
+}
+
+static void unmap_direct(fmap_t *m) {
+    if(munmap((void *)m->data, m->real_len) == -1)
+	cli_warnmsg("funmap: unable to unmap memory segment at address: %p with length: %lu\n", m->data, (unsigned long)m->real_len);
+    free((void *)m);
+}
+
+static fmap_t *fmap_open_direct(int fd, off_t offset, size_t len) {
+    fmap_t *m;
+    void *data;
+
+    if((size_t)offset != fmap_align_to(offset, cli_getpagesize()))
+	return NULL;
+    if((data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, offset)) == MAP_FAILED) {
+	cli_dbgmsg("fmap: direct mapping failed, reading the file instead\n");
+	return NULL;
+    }
+    if(!(m = cl_fmap_open_memory(data, len))) {
+	munmap(data, len);
+	return NULL;
+    }
+#if HAVE_MADVISE
+    madvise(data, len, MADV_DONTFORK);
+#endif
+    m->handle = (void*)(ssize_t)fd;
+    m->handle_is_fd = 1;
+    m->offset = offset;
+    m->direct = 1;
+    m->unmap = unmap_direct;
+    m->need = direct_need;
+    return m;
+}
+#endif
+
 fmap_t *fmap(int fd, off_t offset, size_t len) {
     int unused;
     return fmap_check_empty(fd, offset, len, &unused);
 }
 
-static inline unsigned int fmap_align_items(unsigned int sz, unsigned int al) {
+fmap_t *fmap_direct(int fd, off_t offset, size_t len) {
+#ifdef FMAP_DIRECT
+    int unused;
+    return fmap_open_fd(fd, offset, len, &unused, 1);
+#else
+    return fmap(fd, offset, len);
+#endif
+}
+
+static inline size_t fmap_align_items(size_t sz, unsigned int al) {
     return sz / al + (sz % al != 0);
 }
 
-static inline unsigned int fmap_align_to(unsigned int sz, unsigned int al) {
+static inline size_t fmap_align_to(size_t sz, unsigned int al) {
     return al * fmap_align_items(sz, al);
 }
 
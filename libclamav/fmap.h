@@ -52,9 +52,15 @@ struct cl_fmap {
     unsigned int hdrsz;
     unsigned int pgsz;
     unsigned int paged;
+    unsigned int faults; /* pages read in */
+    unsigned int seq; /* needs in a row moving forward */
+    unsigned int seq_page; /* first page not released by the sequential access */
+    size_t seq_at, seq_end; /* last need */
+    size_t ra_end; /* end of the readahead issued */
     unsigned short aging;
     unsigned short dont_cache_flag;
     unsigned short handle_is_fd;
+    unsigned short direct; /* fd mapped directly, see fmap.c */
 
     /* memory interface */
     const void *data;
@@ -92,8 +98,25 @@ struct cl_fmap {
     uint32_t placeholder_for_bitmap;
 };
 
+/* the page states in the bitmap of the handle maps */
+#define FM_MASK_COUNT 0x3fffffff
+#define FM_MASK_PAGED 0x40000000
+#define FM_MASK_SEEN 0x80000000
+#define FM_MASK_LOCKED FM_MASK_SEEN
+/* 2 high bits:
+00 - not seen - not paged - N/A
+01 -    N/A   -   paged   - not locked
+10 -   seen   - not paged - N/A
+11 -    N/A   -   paged   - locked
+*/
+
+#define SEQ_MIN 2 /* needs in a row before the access counts as sequential */
+#define SEQ_READAHEAD 1024*1024
+
 fmap_t *fmap(int fd, off_t offset, size_t len);
 fmap_t *fmap_check_empty(int fd, off_t offset, size_t len, int *empty);
+/* maps big files straight from the page cache, see CL_ENGINE_DIRECT_MAP */
+fmap_t *fmap_direct(int fd, off_t offset, size_t len);
 
 static inline void funmap(fmap_t *m)
 {
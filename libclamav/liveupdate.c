@@ -0,0 +1,705 @@
+/*
+ *  Live updates of compiled engines
+ *
+ *  Copyright (C) 2013 Sourcefire, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#ifdef	CL_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+#include "clamav.h"
+#include "others.h"
+#include "default.h"
+#include "matcher.h"
+#include "matcher-ac.h"
+#include "matcher-bm.h"
+#include "matcher-hash.h"
+#include "readdb.h"
+#include "cvd.h"
+#include "cache.h"
+#include "md5.h"
+#include "mpool.h"
+#include "str.h"
+#include "liveupdate.h"
+
+/* A compiled engine can't be patched in place while other threads scan
+ * with it: inserting into the AC trie means rebuilding the failure links
+ * and the frozen state tables, and the BM and hash tables get reallocated.
+ * So the signatures added with cl_engine_update() go into a second, small
+ * engine (engine->delta) which is built and compiled from all the lines
+ * added so far and then swapped in; each scan takes a reference on the
+ * delta it started with, so the old one goes away with its last scan.
+ * cli_fmap_scandesc() runs the delta after the engine itself, and the
+ * hash, PE section and false positive lookups consult it too.
+ * The removed signatures are tombstoned: their patterns, logical
+ * signatures and hash entries are flagged in place and skipped by the
+ * matchers from then on (a removed line that was added by an earlier
+ * update is simply dropped from the delta). The removed body signatures
+ * are parsed into a scratch engine and only what equals the patterns and
+ * lsigs they produce there is tombstoned, other signatures sharing the
+ * virus name stay; hash signatures are found by the hash and size.
+ */
+
+struct cli_liveupdate_db {
+    char *dbname;
+    unsigned int options;
+    char *lines;	/* the signatures added so far, '\n' terminated */
+    size_t len;
+    struct cli_liveupdate_db *next;
+};
+
+struct cli_liveupdate {
+    struct cli_liveupdate_db *dbs;
+    unsigned int updates, tombstones;
+    unsigned char digest[16];	/* of all the updates so far */
+};
+
+#ifdef CL_THREAD_SAFE
+static pthread_mutex_t cli_liveupdate_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define LU_HASH_HDB 0
+#define LU_HASH_MDB 1
+#define LU_HASH_FP  2
+
+/* Returns 1 for the body signatures, 2 for the hash signatures and 0 for
+ * what can't be updated in place */
+static int liveupdate_dbtype(const char *dbname, unsigned int *hashmode)
+{
+    *hashmode = LU_HASH_HDB;
+    if(cli_strbcasestr(dbname, ".db") || cli_strbcasestr(dbname, ".ndb") || cli_strbcasestr(dbname, ".ndu") ||
+       cli_strbcasestr(dbname, ".ldb") || cli_strbcasestr(dbname, ".ldu"))
+	return 1;
+
+    if(cli_strbcasestr(dbname, ".hdb") || cli_strbcasestr(dbname, ".hsb") ||
+       cli_strbcasestr(dbname, ".hdu") || cli_strbcasestr(dbname, ".hsu"))
+	return 2;
+
+    if(cli_strbcasestr(dbname, ".mdb") || cli_strbcasestr(dbname, ".msb") ||
+       cli_strbcasestr(dbname, ".mdu") || cli_strbcasestr(dbname, ".msu")) {
+	*hashmode = LU_HASH_MDB;
+	return 2;
+    }
+
+    if(cli_strbcasestr(dbname, ".fp") || cli_strbcasestr(dbname, ".sfp")) {
+	*hashmode = LU_HASH_FP;
+	return 2;
+    }
+
+    return 0;
+}
+
+void cli_liveupdate_free(struct cli_liveupdate *lu)
+{
+	struct cli_liveupdate_db *db;
+
+    if(!lu)
+	return;
+
+    while((db = lu->dbs)) {
+	lu->dbs = db->next;
+	free(db->dbname);
+	free(db->lines);
+	free(db);
+    }
+    free(lu);
+}
+
+#define LU_LINE_SIZE (CLI_DEFAULT_LSIG_BUFSIZE + 32)
+
+/* Returns the next line of text in buff (chomped) or NULL at the end or
+ * if the line is too long, which sets *ret */
+static const char *liveupdate_getline(const char *text, char *buff, int *ret)
+{
+	const char *nl;
+	size_t len;
+
+    if(!text || !*text || *ret)
+	return NULL;
+
+    if((nl = strchr(text, '\n')))
+	len = nl - text;
+    else
+	len = strlen(text);
+    if(len >= LU_LINE_SIZE) {
+	cli_errmsg("cl_engine_update: Line too long\n");
+	*ret = CL_EMALFDB;
+	return NULL;
+    }
+    memcpy(buff, text, len);
+    buff[len] = 0;
+    cli_chomp(buff);
+
+    return nl ? nl + 1 : text + strlen(text);
+}
+
+static int liveupdate_addline(struct cli_liveupdate_db *db, const char *line)
+{
+	size_t len = strlen(line);
+	char *newlines;
+
+    if(!(newlines = cli_realloc(db->lines, db->len + len + 1))) {
+	cli_errmsg("cl_engine_update: Can't allocate memory for the signatures\n");
+	return CL_EMEM;
+    }
+    db->lines = newlines;
+    memcpy(db->lines + db->len, line, len);
+    db->lines[db->len + len] = '\n';
+    db->len += len + 1;
+
+    return CL_SUCCESS;
+}
+
+/* Drops the line if an earlier update added it */
+static int liveupdate_delline(struct cli_liveupdate_db *db, const char *line)
+{
+	size_t len = strlen(line), off = 0, next;
+	const char *nl;
+
+    while(off < db->len) {
+	nl = memchr(db->lines + off, '\n', db->len - off);
+	next = nl - db->lines + 1;
+	if(next - off - 1 == len && !memcmp(db->lines + off, line, len)) {
+	    memmove(db->lines + off, db->lines + next, db->len - next);
+	    db->len -= next - off;
+	    return 1;
+	}
+	off = next;
+    }
+
+    return 0;
+}
+
+/* The loader appends .UNOFFICIAL to the names from unofficial databases,
+ * the removed line may come with other options than the loaded one */
+static int liveupdate_virname_eq(const char *a, const char *b)
+{
+	size_t alen, blen;
+
+    if(!a || !b)
+	return a == b;
+    alen = strlen(a);
+    blen = strlen(b);
+    if(alen > 11 && !strcmp(a + alen - 11, ".UNOFFICIAL"))
+	alen -= 11;
+    if(blen > 11 && !strcmp(b + blen - 11, ".UNOFFICIAL"))
+	blen -= 11;
+    return alen == blen && !memcmp(a, b, alen);
+}
+
+/* p from the engine, sp from the scratch engine; sigid and lsigid are
+ * only compared by the callers */
+static int liveupdate_patt_eq(const struct cli_ac_patt *p, const struct cli_ac_patt *sp)
+{
+    return p->type == sp->type && p->parts == sp->parts && p->partno == sp->partno &&
+	p->mindist == sp->mindist && p->maxdist == sp->maxdist &&
+	!memcmp(p->ch_mindist, sp->ch_mindist, sizeof(p->ch_mindist)) &&
+	!memcmp(p->ch_maxdist, sp->ch_maxdist, sizeof(p->ch_maxdist)) &&
+	p->boundary == sp->boundary && p->offset_min == sp->offset_min && p->offset_max == sp->offset_max &&
+	!memcmp(p->offdata, sp->offdata, sizeof(p->offdata)) &&
+	cli_ac_samepatt(p, sp) && liveupdate_virname_eq(p->virname, sp->virname);
+}
+
+/* Whether every part of the split signature of sp has its equal among the
+ * parts of p */
+static int liveupdate_parts_eq(const struct cli_matcher *root, const struct cli_ac_patt *p, const struct cli_matcher *sroot, const struct cli_ac_patt *sp)
+{
+	const struct cli_ac_patt *q, *sq;
+	unsigned int i, j;
+
+    for(i = 0; i < sroot->ac_patterns; i++) {
+	sq = sroot->ac_pattable[i];
+	if(sq->lsigid[0] || sq->sigid != sp->sigid)
+	    continue;
+	for(j = 0; j < root->ac_patterns; j++) {
+	    q = root->ac_pattable[j];
+	    if(!q->lsigid[0] && q->sigid == p->sigid && liveupdate_patt_eq(q, sq))
+		break;
+	}
+	if(j == root->ac_patterns)
+	    return 0;
+    }
+    return 1;
+}
+
+/* Whether the subsignatures of lsig l of root are those of sl in sroot */
+static int liveupdate_subsigs_eq(const struct cli_matcher *root, const struct cli_ac_lsig *l, const struct cli_matcher *sroot, const struct cli_ac_lsig *sl)
+{
+	const struct cli_ac_patt *q, *sq;
+	unsigned int i, j, cnt = 0, scnt = 0;
+
+    for(j = 0; j < root->ac_patterns; j++)
+	if(root->ac_pattable[j]->lsigid[0] && root->ac_pattable[j]->lsigid[1] == l->id)
+	    cnt++;
+    for(i = 0; i < sroot->ac_patterns; i++) {
+	sq = sroot->ac_pattable[i];
+	if(!sq->lsigid[0] || sq->lsigid[1] != sl->id)
+	    continue;
+	scnt++;
+	for(j = 0; j < root->ac_patterns; j++) {
+	    q = root->ac_pattable[j];
+	    if(q->lsigid[0] && q->lsigid[1] == l->id && q->lsigid[2] == sq->lsigid[2] && liveupdate_patt_eq(q, sq))
+		break;
+	}
+	if(j == root->ac_patterns)
+	    return 0;
+    }
+    return cnt == scnt;
+}
+
+static int liveupdate_lsig_eq(const struct cli_matcher *root, const struct cli_ac_lsig *l, const struct cli_matcher *sroot, const struct cli_ac_lsig *sl)
+{
+	const struct cli_lsig_tdb *t = &l->tdb, *st = &sl->tdb;
+
+    if(l->bc_idx || !liveupdate_virname_eq(l->virname, sl->virname) || strcmp(l->logic, sl->logic))
+	return 0;
+    if(t->subsigs != st->subsigs || memcmp(t->cnt, st->cnt, sizeof(t->cnt)) ||
+       (t->cnt[CLI_TDB_UINT] && memcmp(t->val, st->val, t->cnt[CLI_TDB_UINT] * sizeof(uint32_t))) ||
+       (t->cnt[CLI_TDB_RANGE] && memcmp(t->range, st->range, t->cnt[CLI_TDB_RANGE] * sizeof(uint32_t))) ||
+       (t->cnt[CLI_TDB_STR] && memcmp(t->str, st->str, t->cnt[CLI_TDB_STR])))
+	return 0;
+    return liveupdate_subsigs_eq(root, l, sroot, sl);
+}
+
+static int liveupdate_bm_eq(const struct cli_bm_patt *p, const struct cli_bm_patt *sp)
+{
+	const unsigned char *pt = p->prefix ? p->prefix : p->pattern;
+	const unsigned char *spt = sp->prefix ? sp->prefix : sp->pattern;
+
+    /* where the pattern is split depends on what else is in the root */
+    return p->length + p->prefix_length == sp->length + sp->prefix_length &&
+	!memcmp(pt, spt, p->length + p->prefix_length) &&
+	p->offset_min == sp->offset_min && p->offset_max == sp->offset_max &&
+	!memcmp(p->offdata, sp->offdata, sizeof(p->offdata)) &&
+	p->boundary == sp->boundary && p->filesize == sp->filesize &&
+	liveupdate_virname_eq(p->virname, sp->virname);
+}
+
+/* Tombstones a pattern of root with the other parts of its signature.
+ * The pattern data of the fused tries' copies is that of the original, it
+ * tells them apart; it goes to pdata for liveupdate_tombstone_fused() */
+static unsigned int liveupdate_tombstone_patt(struct cli_matcher *root, struct cli_ac_patt *p, const uint16_t ***pdata, unsigned int *npdata)
+{
+	struct cli_ac_patt *q;
+	const uint16_t **newdata;
+	unsigned int j, marked = 0;
+
+    for(j = 0; j < root->ac_patterns; j++) {
+	q = root->ac_pattable[j];
+	if(q != p && (p->lsigid[0] || q->lsigid[0] || p->parts <= 1 || q->sigid != p->sigid))
+	    continue;
+	q->tombstone = 1;
+	marked++;
+	if((newdata = cli_realloc(*pdata, (*npdata + 1) * sizeof(*newdata)))) {
+	    *pdata = newdata;
+	    newdata[(*npdata)++] = q->pattern;
+	}
+    }
+    return marked;
+}
+
+/* The parts of the signatures on the removed lines, parsed into sroot,
+ * that are in root */
+static unsigned int liveupdate_tombstone_root(struct cli_matcher *root, const struct cli_matcher *sroot, const uint16_t ***pdata, unsigned int *npdata)
+{
+	const struct cli_ac_patt *sp;
+	const struct cli_bm_patt *sbm;
+	struct cli_ac_patt *p;
+	struct cli_bm_patt *bm;
+	unsigned int i, j, k, marked = 0;
+
+    /* the subsignatures of logical signatures go with the lsig, a split
+     * signature is found by its first part */
+    for(i = 0; i < sroot->ac_patterns; i++) {
+	sp = sroot->ac_pattable[i];
+	if(sp->type || sp->lsigid[0] || sp->partno > 1)
+	    continue;
+	for(j = 0; j < root->ac_patterns; j++) {
+	    p = root->ac_pattable[j];
+	    if(p->tombstone || p->lsigid[0] || !liveupdate_patt_eq(p, sp))
+		continue;
+	    if(sp->parts > 1 && !liveupdate_parts_eq(root, p, sroot, sp))
+		continue;
+	    marked += liveupdate_tombstone_patt(root, p, pdata, npdata);
+	}
+    }
+
+    if(sroot->bm_suffix && root->bm_suffix) {
+	for(i = 0; i < BM_HASH_SIZE; i++) {
+	    for(sbm = sroot->bm_suffix[i]; sbm; sbm = sbm->next) {
+		for(j = 0; j < BM_HASH_SIZE; j++) {
+		    for(bm = root->bm_suffix[j]; bm; bm = bm->next) {
+			if(!bm->tombstone && liveupdate_bm_eq(bm, sbm)) {
+			    bm->tombstone = 1;
+			    marked++;
+			}
+		    }
+		}
+	    }
+	}
+    }
+
+    for(i = 0; i < sroot->ac_lsigs; i++) {
+	for(k = 0; k < root->ac_lsigs; k++) {
+	    if(!root->ac_lsigtable[k]->tombstone && liveupdate_lsig_eq(root, root->ac_lsigtable[k], sroot, sroot->ac_lsigtable[i])) {
+		root->ac_lsigtable[k]->tombstone = 1;
+		marked++;
+	    }
+	}
+    }
+
+    return marked;
+}
+
+/* The fused tries have their own copies of the patterns of both roots */
+static void liveupdate_tombstone_fused(struct cl_engine *engine, const uint16_t **pdata, unsigned int npdata)
+{
+	struct cli_matcher *fused;
+	unsigned int i, j, k;
+
+    for(i = 0; i < CLI_MTARGETS; i++) {
+	if(!engine->root[i] || !(fused = engine->root[i]->ac_fused))
+	    continue;
+	for(j = 0; j < fused->ac_patterns; j++)
+	    for(k = 0; k < npdata; k++)
+		if(fused->ac_pattable[j]->pattern == pdata[k])
+		    fused->ac_pattable[j]->tombstone = 1;
+    }
+}
+
+/* Creates an engine with the settings of engine and the roots for the
+ * options set up */
+static int liveupdate_engine_new(struct cl_engine *engine, unsigned int options, struct cl_engine **new)
+{
+	struct cl_settings *settings;
+	int ret;
+
+    if(!(*new = cl_engine_new()))
+	return CL_EMEM;
+
+    if(!(settings = cl_engine_settings_copy(engine))) {
+	cl_engine_free(*new);
+	return CL_EMEM;
+    }
+    ret = cl_engine_settings_apply(*new, settings);
+    cl_engine_settings_free(settings);
+    if(!ret) {
+	(*new)->dboptions |= options;
+	ret = cli_initroots(*new, options);
+    }
+    if(ret) {
+	cl_engine_free(*new);
+	*new = NULL;
+    }
+    return ret;
+}
+
+/* lines are the removed body signatures, '\n' terminated */
+static unsigned int liveupdate_tombstone_sigs(struct cl_engine *engine, const char *dbname, unsigned int options, const char *lines, size_t len)
+{
+	struct cl_engine *scratch;
+	struct cli_dbio dbio;
+	const uint16_t **pdata = NULL;
+	unsigned int i, sigs = 0, npdata = 0, marked = 0;
+	int ret;
+
+    if((ret = liveupdate_engine_new(engine, options & ~CL_DB_PUA_MODE, &scratch))) {
+	cli_errmsg("cl_engine_update: Can't set up the engine for the removed signatures: %s\n", cl_strerror(ret));
+	return 0;
+    }
+    memset(&dbio, 0, sizeof(dbio));
+    dbio.mem = lines;
+    dbio.memsize = len;
+    if((ret = cli_load(dbname, scratch, &sigs, options, &dbio))) {
+	cli_dbgmsg("cl_engine_update: Can't parse the removed signatures: %s\n", cl_strerror(ret));
+	cl_engine_free(scratch);
+	return 0;
+    }
+
+    for(i = 0; i < CLI_MTARGETS; i++)
+	if(engine->root[i] && scratch->root[i])
+	    marked += liveupdate_tombstone_root(engine->root[i], scratch->root[i], &pdata, &npdata);
+    if(npdata)
+	liveupdate_tombstone_fused(engine, pdata, npdata);
+
+    free(pdata);
+    cl_engine_free(scratch);
+    return marked;
+}
+
+/* Same fields as in cli_loadhash() */
+static unsigned int liveupdate_tombstone_hash(struct cl_engine *engine, char *line, unsigned int hashmode)
+{
+	const char *tokens[6];
+	struct cli_matcher *db;
+	unsigned int size_field = 1, md5_field = 0;
+	unsigned long size = 0;
+	char *pt;
+
+    if(cli_strtokenize(line, ':', 6, tokens) < 3)
+	return 0;
+
+    if(hashmode == LU_HASH_MDB) {
+	size_field = 0;
+	md5_field = 1;
+	db = engine->hm_mdb;
+    } else if(hashmode == LU_HASH_FP) {
+	db = engine->hm_fp;
+    } else {
+	db = engine->hm_hdb;
+    }
+    if(!db)
+	return 0;
+
+    if(hashmode == LU_HASH_MDB || strcmp(tokens[size_field], "*")) {
+	size = strtoul(tokens[size_field], &pt, 10);
+	if(*pt || !size || size >= 0xffffffff)
+	    return 0;
+    }
+
+    return hm_tombstone_str(db, tokens[md5_field], size);
+}
+
+/* lines are the removed signatures that no earlier update added, '\n'
+ * terminated */
+static unsigned int liveupdate_tombstone(struct cl_engine *engine, const char *dbname, unsigned int options, const char *lines, size_t len, char *buff)
+{
+	unsigned int hashmode, marked = 0;
+	const char *pt;
+	int ret = CL_SUCCESS;
+
+    if(liveupdate_dbtype(dbname, &hashmode) != 2) {
+	if(!(marked = liveupdate_tombstone_sigs(engine, dbname, options, lines, len)))
+	    cli_dbgmsg("cl_engine_update: Removed signatures not found in the engine\n");
+	return marked;
+    }
+
+    for(pt = lines; (pt = liveupdate_getline(pt, buff, &ret)); ) {
+	if(liveupdate_tombstone_hash(engine, buff, hashmode))
+	    marked++;
+	else
+	    cli_dbgmsg("cl_engine_update: Removed signature not found in the engine: %s\n", buff);
+    }
+    return marked;
+}
+
+/* Builds and compiles the engine for all the lines added so far, *delta
+ * is NULL if there are none */
+static int liveupdate_build(struct cl_engine *engine, struct cli_liveupdate *lu, struct cl_engine **delta)
+{
+	struct cl_engine *new;
+	struct cli_liveupdate_db *db;
+	struct cli_dbio dbio;
+	unsigned int sigs = 0, options = 0;
+	int ret;
+
+    *delta = NULL;
+    for(db = lu->dbs; db && !db->len; db = db->next);
+    if(!db)
+	return CL_SUCCESS;
+
+    for(db = lu->dbs; db; db = db->next)
+	options |= db->options;
+    if((ret = liveupdate_engine_new(engine, options & ~CL_DB_PUA_MODE, &new)))
+	return ret;
+    /* scans go through the cache of the engine itself */
+    new->engine_options |= ENGINE_OPTIONS_DISABLE_CACHE;
+    if(new->cache_path) {
+	mpool_free(new->mempool, new->cache_path);
+	new->cache_path = NULL;
+    }
+
+    for(db = lu->dbs; db; db = db->next) {
+	if(!db->len)
+	    continue;
+	memset(&dbio, 0, sizeof(dbio));
+	dbio.mem = db->lines;
+	dbio.memsize = db->len;
+	if((ret = cli_load(db->dbname, new, &sigs, db->options, &dbio))) {
+	    cl_engine_free(new);
+	    return ret;
+	}
+    }
+
+    if((ret = cl_engine_compile(new))) {
+	cl_engine_free(new);
+	return ret;
+    }
+
+    cli_dbgmsg("cl_engine_update: %u signatures in the update engine\n", sigs);
+    *delta = new;
+    return CL_SUCCESS;
+}
+
+int cl_engine_update(struct cl_engine *engine, const char *dbname, const char *added, const char *removed, unsigned int dboptions)
+{
+	struct cli_liveupdate *lu;
+	struct cl_engine *delta;
+	cli_md5_ctx md5;
+	struct cli_liveupdate_db *db = NULL;
+	char *buff = NULL, *oldlines = NULL, *tomb = NULL;
+	const char *pt, *name;
+	size_t oldlen = 0, tomblen = 0;
+	unsigned int hashmode, marked = 0, adds = 0, dels = 0;
+	int ret = CL_SUCCESS;
+
+    if(!engine || !dbname) {
+	cli_errmsg("cl_engine_update: engine == NULL\n");
+	return CL_ENULLARG;
+    }
+
+    if(!(engine->dboptions & CL_DB_COMPILED)) {
+	cli_errmsg("cl_engine_update: The engine is not compiled, use cl_load()\n");
+	return CL_EARG;
+    }
+
+    if((name = strrchr(dbname, *PATHSEP)))
+	name++;
+    else
+	name = dbname;
+
+    if(!liveupdate_dbtype(name, &hashmode)) {
+	cli_errmsg("cl_engine_update: Can't update %s in place, reload the databases\n", name);
+	return CL_EARG;
+    }
+
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_lock(&cli_liveupdate_mutex);
+#endif
+
+    if(!(buff = cli_malloc(LU_LINE_SIZE))) {
+	cli_errmsg("cl_engine_update: Can't allocate memory for the line buffer\n");
+	ret = CL_EMEM;
+	goto done;
+    }
+
+    if(!(lu = engine->liveupdate)) {
+	if(!(lu = cli_calloc(1, sizeof(*lu)))) {
+	    cli_errmsg("cl_engine_update: Can't allocate memory for the update state\n");
+	    ret = CL_EMEM;
+	    goto done;
+	}
+	engine->liveupdate = lu;
+    }
+
+    for(db = lu->dbs; db && strcmp(db->dbname, name); db = db->next);
+    if(!db) {
+	if(!(db = cli_calloc(1, sizeof(*db))) || !(db->dbname = cli_strdup(name))) {
+	    cli_errmsg("cl_engine_update: Can't allocate memory for the update state\n");
+	    free(db);
+	    ret = CL_EMEM;
+	    goto done;
+	}
+	db->next = lu->dbs;
+	lu->dbs = db;
+    }
+
+    /* keep the old lines in case the new ones don't load */
+    if(db->len) {
+	if(!(oldlines = cli_malloc(db->len))) {
+	    cli_errmsg("cl_engine_update: Can't allocate memory for the old signatures\n");
+	    ret = CL_EMEM;
+	    goto done;
+	}
+	memcpy(oldlines, db->lines, db->len);
+	oldlen = db->len;
+    }
+
+    /* lines added by earlier updates just go, the others are tombstoned
+     * once the new delta is in place */
+    for(pt = removed; (pt = liveupdate_getline(pt, buff, &ret)); ) {
+	if(!buff[0] || buff[0] == '#')
+	    continue;
+	dels++;
+	if(liveupdate_delline(db, buff))
+	    continue;
+	if(!(tomb = cli_realloc2(tomb, tomblen + strlen(buff) + 2))) {
+	    cli_errmsg("cl_engine_update: Can't allocate memory for the removed signatures\n");
+	    ret = CL_EMEM;
+	    goto done;
+	}
+	sprintf(tomb + tomblen, "%s\n", buff);
+	tomblen += strlen(buff) + 1;
+    }
+
+    if(ret)
+	goto done;
+
+    for(pt = added; (pt = liveupdate_getline(pt, buff, &ret)); ) {
+	if(!buff[0] || buff[0] == '#')
+	    continue;
+	adds++;
+	if((ret = liveupdate_addline(db, buff)))
+	    goto done;
+    }
+    if(ret)
+	goto done;
+    db->options = dboptions;
+
+    if((ret = liveupdate_build(engine, lu, &delta))) {
+	cli_errmsg("cl_engine_update: Can't load the signatures added to %s: %s\n", name, cl_strerror(ret));
+	goto done;
+    }
+
+    /* publish the additions before the removals, an XCHG never leaves a
+     * window without either version */
+    delta = cli_engine_delta_swap(engine, delta);
+    if(delta)
+	cl_engine_free(delta);
+
+    if(tomb)
+	marked = liveupdate_tombstone(engine, name, dboptions, tomb, tomblen, buff);
+    lu->tombstones += marked;
+    lu->updates++;
+
+    /* files cached as clean may match the new signatures */
+    cli_md5_init(&md5);
+    cli_md5_update(&md5, lu->digest, sizeof(lu->digest));
+    cli_md5_update(&md5, name, strlen(name) + 1);
+    if(added)
+	cli_md5_update(&md5, added, strlen(added));
+    cli_md5_update(&md5, "", 1);
+    if(removed)
+	cli_md5_update(&md5, removed, strlen(removed));
+    cli_md5_final(lu->digest, &md5);
+    cli_cache_clear(engine, lu->digest);
+
+    cli_dbgmsg("cl_engine_update: %s: %u signatures added, %u removed (%u tombstoned)\n", name, adds, dels, marked);
+
+done:
+    if(ret && db) {
+	free(db->lines);
+	db->lines = oldlines;
+	db->len = oldlen;
+	oldlines = NULL;
+    }
+    free(oldlines);
+    free(tomb);
+    free(buff);
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_unlock(&cli_liveupdate_mutex);
+#endif
+    return ret;
+}
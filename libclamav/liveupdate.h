@@ -0,0 +1,31 @@
+/*
+ *  Live updates of compiled engines
+ *
+ *  Copyright (C) 2013 Sourcefire, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#ifndef __LIVEUPDATE_H
+#define __LIVEUPDATE_H
+
+#include "clamav.h"
+
+/* State of the updates applied to an engine with cl_engine_update() */
+struct cli_liveupdate;
+
+void cli_liveupdate_free(struct cli_liveupdate *lu);
+
+#endif
@@ -45,11 +45,7 @@
 #include "filtering.h"
 
 #include "mpool.h"
-
-#define AC_SPECIAL_ALT_CHAR	1
-#define AC_SPECIAL_ALT_STR	2
-#define AC_SPECIAL_LINE_MARKER	3
-#define AC_SPECIAL_BOUNDARY	4
+#include "sigstats.h"
 
 #define AC_BOUNDARY_LEFT		1
 #define AC_BOUNDARY_LEFT_NEGATIVE	2
@@ -79,13 +75,51 @@ static char boundary[256] = {
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 };
 
+int cli_ac_samepatt(const struct cli_ac_patt *a, const struct cli_ac_patt *b)
+{
+	const struct cli_ac_special *a1, *a2;
+	unsigned int i;
+
+
+    if(a->length != b->length || a->prefix_length != b->prefix_length || a->special_len != b->special_len ||
+       a->ch[0] != b->ch[0] || a->ch[1] != b->ch[1])
+	return 0;
+    if(memcmp(a->pattern, b->pattern, a->length * sizeof(uint16_t)) ||
+       memcmp(a->prefix, b->prefix, a->prefix_length * sizeof(uint16_t)))
+	return 0;
+    if(a->special != b->special)
+	return 0;
+
+    for(i = 0; i < a->special; i++) {
+	a1 = a->special_table[i];
+	a2 = b->special_table[i];
+
+	if(a1->num != a2->num || a1->negative != a2->negative || a1->type != a2->type)
+	    return 0;
+	if(a1->type == AC_SPECIAL_ALT_CHAR) {
+	    if(memcmp(a1->str, a2->str, a1->num))
+		return 0;
+	} else if(a1->type == AC_SPECIAL_ALT_STR) {
+	    while(a1 && a2) {
+		if((a1->len != a2->len) || memcmp(a1->str, a2->str, a1->len))
+		    break;
+		a1 = a1->next;
+		a2 = a2->next;
+	    }
+	    if(a1 || a2)
+		return 0;
+	}
+    }
+
+    return 1;
+}
+
 int cli_ac_addpatt(struct cli_matcher *root, struct cli_ac_patt *pattern)
 {
 	struct cli_ac_node *pt, *next;
 	struct cli_ac_patt *ph, *ph_prev, *ph_add_after;
 	void *newtable;
-	struct cli_ac_special *a1, *a2;
-	uint8_t i, match;
+	uint8_t i;
 	uint16_t len = MIN(root->ac_maxdepth, pattern->length);
 
 
@@ -166,70 +200,21 @@ int cli_ac_addpatt(struct cli_matcher *root, struct cli_ac_patt *pattern)
     while(ph) {
 	if(!ph_add_after && ph->partno <= pattern->partno && (!ph->next || ph->next->partno > pattern->partno))
 	    ph_add_after = ph;
-	if((ph->length == pattern->length) &&
-           (ph->prefix_length == pattern->prefix_length) &&
-           (ph->special_len == pattern->special_len) &&
-           (ph->ch[0] == pattern->ch[0]) && (ph->ch[1] == pattern->ch[1])) {
-	    if(!memcmp(ph->pattern, pattern->pattern, ph->length * sizeof(uint16_t)) &&
-               !memcmp(ph->prefix, pattern->prefix, ph->prefix_length * sizeof(uint16_t))) {
-		if(!ph->special && !pattern->special) {
-		    match = 1;
-		} else if(ph->special == pattern->special) {
-		    match = 1;
-		    for(i = 0; i < ph->special; i++) {
-			a1 = ph->special_table[i];
-			a2 = pattern->special_table[i];
-
-			if(a1->num != a2->num) {
-			    match = 0;
-			    break;
-			}
-			if(a1->negative != a2->negative) {
-			    match = 0;
-			    break;
-			}
-			if(a1->type != a2->type) {
-			    match = 0;
-			    break;
-			} else if(a1->type == AC_SPECIAL_ALT_CHAR) {
-			    if(memcmp(a1->str, a2->str, a1->num)) {
-				match = 0;
-				break;
-			    }
-			} else if(a1->type == AC_SPECIAL_ALT_STR) {
-			    while(a1 && a2) {
-				if((a1->len != a2->len) || memcmp(a1->str, a2->str, a1->len))
-				    break;
-				a1 = a1->next;
-				a2 = a2->next;
-			    }
-			    if(a1 || a2) {
-				match = 0;
-				break;
-			    }
-			}
-		    }
-		} else {
-		    match = 0;
-		}
-
-		if(match) {
-		    if(pattern->partno < ph->partno) {
-			pattern->next_same = ph;
-			if(ph_prev)
-			    ph_prev->next = ph->next;
-			else
-			    pt->list = ph->next;
-			ph->next = NULL;
-			break;
-		    } else {
-			while(ph->next_same && ph->next_same->partno < pattern->partno)
-			    ph = ph->next_same;
-			pattern->next_same = ph->next_same;
-			ph->next_same = pattern;
-			return CL_SUCCESS;
-		    }
-		}
+	if(cli_ac_samepatt(ph, pattern)) {
+	    if(pattern->partno < ph->partno) {
+		pattern->next_same = ph;
+		if(ph_prev)
+		    ph_prev->next = ph->next;
+		else
+		    pt->list = ph->next;
+		ph->next = NULL;
+		break;
+	    } else {
+		while(ph->next_same && ph->next_same->partno < pattern->partno)
+		    ph = ph->next_same;
+		pattern->next_same = ph->next_same;
+		ph->next_same = pattern;
+		return CL_SUCCESS;
 	    }
 	}
 	ph_prev = ph;
@@ -375,8 +360,176 @@ static int ac_maketrans(struct cli_matcher *root)
     return CL_SUCCESS;
 }
 
+/* Largest number of own transitions kept in the sparse form; above that a
+ * state gets a full 256 entry row in ac_dtrans */
+#define AC_SPARSE_MAX 64
+
+/* Leaves don't have their own transition tables, they use the one of
+ * their fail node */
+#define AC_SHARES_TRANS(node) ((node)->fail && (node)->trans == (node)->fail->trans)
+
+static inline unsigned int ac_popcount(uint32_t v)
+{
+#ifdef __GNUC__
+    return __builtin_popcount(v);
+#else
+    v = v - ((v >> 1) & 0x55555555);
+    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+    return (((v + (v >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+#endif
+}
+
+static void ac_free_nodes(struct cli_matcher *root)
+{
+	uint32_t i;
+
+
+    if(root->ac_nodetable) {
+	/* Freeing trans nodes must be done before freeing table nodes! */
+	for(i = 0; i < root->ac_nodes; i++) {
+	    if(!IS_LEAF(root->ac_nodetable[i]) &&
+	       root->ac_nodetable[i]->fail &&
+	       root->ac_nodetable[i]->trans != root->ac_nodetable[i]->fail->trans) {
+		mpool_free(root->mempool, root->ac_nodetable[i]->trans);
+	    }
+	}
+
+	for(i = 0; i < root->ac_nodes; i++) {
+	    mpool_free(root->mempool, root->ac_nodetable[i]);
+	}
+
+	mpool_free(root->mempool, root->ac_nodetable);
+	root->ac_nodetable = NULL;
+    }
+    if(root->ac_root && root->ac_root->trans) {
+	mpool_free(root->mempool, root->ac_root->trans);
+	root->ac_root->trans = NULL;
+    }
+}
+
+/* Re-encodes the trie built by ac_maketrans() as an array of states with
+ * 32-bit transition indices. A state either has a full row in ac_dtrans or
+ * keeps only the transitions which differ from its fail state in ac_strans,
+ * indexed through a bitmap. The node based trie is released afterwards.
+ */
+static int ac_freeze(struct cli_matcher *root)
+{
+	struct cli_ac_node *node, *owner;
+	struct cli_ac_state *state;
+	uint32_t i, n, ndense = 0, nsparse = 0, d = 0, sp = 0;
+	unsigned int c, k;
+
+
+    n = root->ac_nodes + 1;
+    root->ac_root->id = 0;
+    for(i = 0; i < root->ac_nodes; i++)
+	root->ac_nodetable[i]->id = i + 1;
+
+    for(i = 0; i < n; i++) {
+	node = i ? root->ac_nodetable[i - 1] : root->ac_root;
+	if(!node->trans || AC_SHARES_TRANS(node))
+	    continue;
+	if(!node->fail) {
+	    ndense++;
+	    continue;
+	}
+	for(c = 0, k = 0; c < 256; c++)
+	    if(node->trans[c] != node->fail->trans[c])
+		k++;
+	if(k > AC_SPARSE_MAX)
+	    ndense++;
+	else
+	    nsparse += k;
+    }
+
+    root->ac_states = (struct cli_ac_state *) mpool_calloc(root->mempool, n, sizeof(struct cli_ac_state));
+    root->ac_dtrans = (uint32_t *) mpool_malloc(root->mempool, ndense * 256 * sizeof(uint32_t));
+    if(nsparse)
+	root->ac_strans = (uint32_t *) mpool_malloc(root->mempool, nsparse * sizeof(uint32_t));
+    if(!root->ac_states || !root->ac_dtrans || (nsparse && !root->ac_strans)) {
+	cli_errmsg("ac_freeze: Can't allocate memory for frozen trie\n");
+	return CL_EMEM;
+    }
+
+    for(i = 0; i < n; i++) {
+	node = i ? root->ac_nodetable[i - 1] : root->ac_root;
+	state = &root->ac_states[i];
+	state->list = node->list;
+	state->faillist = node->fail ? node->fail->list : NULL;
+	if(!node->trans) {
+	    /* unreachable, fall back to the root */
+	    continue;
+	}
+	if(AC_SHARES_TRANS(node))
+	    continue;
+
+	if(node->fail) {
+	    for(c = 0, k = 0; c < 256; c++)
+		if(node->trans[c] != node->fail->trans[c])
+		    k++;
+	}
+	if(!node->fail || k > AC_SPARSE_MAX) {
+	    state->dense = 1;
+	    state->trans = d;
+	    for(c = 0; c < 256; c++)
+		root->ac_dtrans[d++] = node->trans[c]->id;
+	} else {
+	    owner = node->fail;
+	    while(AC_SHARES_TRANS(owner))
+		owner = owner->fail;
+	    state->fail = owner->id;
+	    state->trans = sp;
+	    for(c = 0, k = 0; c < 256; c++) {
+		if(!(c & 31))
+		    state->rank[c >> 5] = k;
+		if(node->trans[c] != node->fail->trans[c]) {
+		    state->map[c >> 5] |= 1U << (c & 31);
+		    root->ac_strans[sp++] = node->trans[c]->id;
+		    k++;
+		}
+	    }
+	}
+    }
+
+    for(i = 0; i < root->ac_nodes; i++) {
+	node = root->ac_nodetable[i];
+	if(!node->trans || !AC_SHARES_TRANS(node))
+	    continue;
+	owner = node->fail;
+	while(AC_SHARES_TRANS(owner))
+	    owner = owner->fail;
+	state = &root->ac_states[i + 1];
+	state->trans = root->ac_states[owner->id].trans;
+	state->fail = root->ac_states[owner->id].fail;
+	memcpy(state->map, root->ac_states[owner->id].map, sizeof(state->map));
+	memcpy(state->rank, root->ac_states[owner->id].rank, sizeof(state->rank));
+	state->dense = root->ac_states[owner->id].dense;
+    }
+
+    cli_dbgmsg("ac_freeze: %u states (%u dense, %u sparse transitions)\n", n, ndense, nsparse);
+    ac_free_nodes(root);
+    return CL_SUCCESS;
+}
+
+static always_inline uint32_t ac_next(const struct cli_matcher *root, uint32_t current, unsigned char c)
+{
+	const struct cli_ac_state *state = &root->ac_states[current];
+	uint32_t bit = 1U << (c & 31), word;
+
+
+    while(!state->dense) {
+	word = state->map[c >> 5];
+	if(word & bit)
+	    return root->ac_strans[state->trans + state->rank[c >> 5] + ac_popcount(word & (bit - 1))];
+	state = &root->ac_states[state->fail];
+    }
+    return root->ac_dtrans[state->trans + c];
+}
+
 int cli_ac_buildtrie(struct cli_matcher *root)
 {
+	int ret;
+
     if(!root)
 	return CL_EMALFDB;
 
@@ -385,9 +538,16 @@ int cli_ac_buildtrie(struct cli_matcher *root)
 	return CL_SUCCESS;
     }
 
+    if(root->ac_states) {
+	cli_dbgmsg("cli_ac_buildtrie: AC trie already built\n");
+	return CL_SUCCESS;
+    }
+
     if (root->filter)
 	cli_dbgmsg("Using filter for trie %d\n", root->type);
-    return ac_maketrans(root);
+    if((ret = ac_maketrans(root)))
+	return ret;
+    return ac_freeze(root);
 }
 
 int cli_ac_init(struct cli_matcher *root, uint8_t mindepth, uint8_t maxdepth, uint8_t dconf_prefiltering)
@@ -454,12 +614,49 @@ static void ac_free_special(struct cli_ac_patt *p)
     mpool_free(mempool, p->special_table);
 }
 
+static void ac_free_trie(struct cli_matcher *root)
+{
+    ac_free_nodes(root);
+    if(root->ac_states)
+	mpool_free(root->mempool, root->ac_states);
+    if(root->ac_dtrans && !root->snapshot)
+	mpool_free(root->mempool, root->ac_dtrans);
+    if(root->ac_strans && !root->snapshot)
+	mpool_free(root->mempool, root->ac_strans);
+    if(root->ac_root)
+	mpool_free(root->mempool, root->ac_root);
+    if (root->filter)
+	mpool_free(root->mempool, root->filter);
+}
+
+/* The patterns of a fused trie are shallow copies, their pattern data,
+ * virnames and special tables belong to the source roots.
+ */
+static void ac_free_fused(struct cli_matcher *fused)
+{
+	uint32_t i;
+
+
+    for(i = 0; i < fused->ac_patterns; i++)
+	mpool_free(fused->mempool, fused->ac_pattable[i]);
+    if(fused->ac_pattable)
+	mpool_free(fused->mempool, fused->ac_pattable);
+
+    ac_free_trie(fused);
+    mpool_free(fused->mempool, fused);
+}
+
 void cli_ac_free(struct cli_matcher *root)
 {
 	uint32_t i;
 	struct cli_ac_patt *patt;
 
 
+    if(root->ac_fused) {
+	ac_free_fused(root->ac_fused);
+	root->ac_fused = NULL;
+    }
+
     for(i = 0; i < root->ac_patterns; i++) {
 	patt = root->ac_pattable[i];
 	mpool_free(root->mempool, patt->prefix ? patt->prefix : patt->pattern);
@@ -474,33 +671,103 @@ void cli_ac_free(struct cli_matcher *root)
     if(root->ac_reloff)
 	mpool_free(root->mempool, root->ac_reloff);
 
-    /* Freeing trans nodes must be done before freeing table nodes! */
-    for(i = 0; i < root->ac_nodes; i++) {
-	if(!IS_LEAF(root->ac_nodetable[i]) &&
-	   root->ac_nodetable[i]->fail &&
-	   root->ac_nodetable[i]->trans != root->ac_nodetable[i]->fail->trans) {
-	    mpool_free(root->mempool, root->ac_nodetable[i]->trans);
+    ac_free_trie(root);
+}
+
+static int ac_fuse_add(struct cli_matcher *fused, const struct cli_matcher *root, uint8_t rootidx)
+{
+	uint32_t i;
+	struct cli_ac_patt *patt;
+	int ret;
+
+
+    for(i = 0; i < root->ac_patterns; i++) {
+	patt = (struct cli_ac_patt *) mpool_malloc(fused->mempool, sizeof(struct cli_ac_patt));
+	if(!patt) {
+	    cli_errmsg("cli_ac_fuse: Can't allocate memory for patt\n");
+	    return CL_EMEM;
+	}
+	memcpy(patt, root->ac_pattable[i], sizeof(struct cli_ac_patt));
+	patt->next = patt->next_same = NULL;
+	patt->rootidx = rootidx;
+	if((ret = cli_ac_addpatt(fused, patt))) {
+	    mpool_free(fused->mempool, patt);
+	    return ret;
 	}
     }
 
-    for(i = 0; i < root->ac_nodes; i++) {
-	mpool_free(root->mempool, root->ac_nodetable[i]);
+    return CL_SUCCESS;
+}
+
+/* Builds a single trie holding the AC patterns of both troot and groot, so
+ * that a file of troot's type can be walked once instead of twice. The
+ * prefilter of the fused trie is the union of both filters. Must be called
+ * after cli_ac_buildtrie() on both roots; the result is stored in
+ * troot->ac_fused and released by cli_ac_free(troot).
+ */
+int cli_ac_fuse(struct cli_matcher *troot, const struct cli_matcher *groot)
+{
+	struct cli_matcher *fused;
+	unsigned int i;
+	int ret;
+
+
+    if(!troot || !groot || !troot->ac_root || !groot->ac_root)
+	return CL_SUCCESS;
+
+    if(!!troot->filter != !!groot->filter) {
+	cli_dbgmsg("cli_ac_fuse: Prefiltering mismatch, not fusing trie %d\n", troot->type);
+	return CL_SUCCESS;
     }
 
-    if(root->ac_nodetable)
-	mpool_free(root->mempool, root->ac_nodetable);
-    if(root->ac_root) {
-	mpool_free(root->mempool, root->ac_root->trans);
-	mpool_free(root->mempool, root->ac_root);
+    fused = (struct cli_matcher *) mpool_calloc(troot->mempool, 1, sizeof(struct cli_matcher));
+    if(!fused) {
+	cli_errmsg("cli_ac_fuse: Can't allocate memory for fused matcher\n");
+	return CL_EMEM;
     }
-    if (root->filter)
-	mpool_free(root->mempool, root->filter);
+    fused->type = troot->type;
+#ifdef USE_MPOOL
+    fused->mempool = troot->mempool;
+#endif
+    if((ret = cli_ac_init(fused, troot->ac_mindepth, troot->ac_maxdepth, 0))) {
+	mpool_free(troot->mempool, fused);
+	return ret;
+    }
+
+    if((ret = ac_fuse_add(fused, troot, 0)) || (ret = ac_fuse_add(fused, groot, 1))) {
+	ac_free_fused(fused);
+	return ret;
+    }
+
+    if(troot->filter) {
+	fused->filter = mpool_malloc(fused->mempool, sizeof(*fused->filter));
+	if(!fused->filter) {
+	    cli_errmsg("cli_ac_fuse: Can't allocate memory for fused->filter\n");
+	    ac_free_fused(fused);
+	    return CL_EMEM;
+	}
+	/* a zero bit in the shift-or tables means a possible match */
+	for(i = 0; i < sizeof(fused->filter->B) / sizeof(fused->filter->B[0]); i++) {
+	    fused->filter->B[i] = troot->filter->B[i] & groot->filter->B[i];
+	    fused->filter->end[i] = troot->filter->end[i] & groot->filter->end[i];
+	}
+    }
+    fused->maxpatlen = MAX(troot->maxpatlen, groot->maxpatlen);
+
+    if((ret = ac_maketrans(fused)) || (ret = ac_freeze(fused))) {
+	ac_free_fused(fused);
+	return ret;
+    }
+
+    cli_dbgmsg("cli_ac_fuse: Fused trie %d with generic trie (%u patterns, %u nodes)\n", troot->type, fused->ac_patterns, fused->ac_nodes);
+    troot->ac_fused = fused;
+    return CL_SUCCESS;
 }
 
 /*
  * In parse_only mode this function returns -1 on error or the max subsig id
  */
-int cli_ac_chklsig(const char *expr, const char *end, uint32_t *lsigcnt, unsigned int *cnt, uint64_t *ids, unsigned int parse_only)
+int cli_ac_chklsig(const char *expr, const char *end, const uint32_t *lsigcnt, unsigned int *cnt, uint64_t *ids, unsigned int parse_only)
 {
 	unsigned int i, len = end - expr, pth = 0, opoff = 0, op1off = 0, val;
 	unsigned int blkend = 0, id, modval1, modval2 = 0, lcnt = 0, rcnt = 0, tcnt, modoff = 0;
@@ -728,6 +995,284 @@ int cli_ac_chklsig(const char *expr, const char *end, uint32_t *lsigcnt, unsigne
     }
 }
 
+/* Emits the expression in postfix form into ops; follows the parsing of
+ * cli_ac_chklsig() step by step so that both always agree. Returns the
+ * evaluation stack depth needed or -1 */
+static int lsig_compile(const char *expr, const char *end, struct cli_lsig_op *ops, unsigned int *nops)
+{
+	unsigned int i, len = end - expr, pth = 0, opoff = 0, op1off = 0;
+	unsigned int blkend = 0, id, modval1 = 0, modval2 = 0, modoff = 0;
+	int ret, ldepth, rdepth;
+	char op = 0, op1 = 0, mod = 0, blkmod = 0;
+	const char *lstart = expr, *lend = NULL, *rstart = NULL, *rend = end;
+
+
+    for(i = 0; i < len; i++) {
+	switch(expr[i]) {
+	    case '(':
+		pth++;
+		break;
+
+	    case ')':
+		if(!pth)
+		    return -1;
+		pth--;
+		/* fall-through */
+
+	    case '>':
+	    case '<':
+	    case '=':
+		mod = expr[i];
+		modoff = i;
+		break;
+
+	    default:
+		if(strchr("&|", expr[i])) {
+		    if(!pth) {
+			op = expr[i];
+			opoff = i;
+		    } else if(pth == 1) {
+			op1 = expr[i];
+			op1off = i;
+		    }
+		}
+	}
+
+	if(op)
+	    break;
+
+	if(op1 && !pth) {
+	    blkend = i;
+	    if(expr[i + 1] == '>' || expr[i + 1] == '<' || expr[i + 1] == '=') {
+		blkmod = expr[i + 1];
+		ret = sscanf(&expr[i + 2], "%u,%u", &modval1, &modval2);
+		if(ret != 2)
+		    ret = sscanf(&expr[i + 2], "%u", &modval1);
+		if(!ret || ret == EOF)
+		    return -1;
+		for(i += 2; i + 1 < len && (isdigit(expr[i + 1]) || expr[i + 1] == ','); i++);
+	    }
+
+	    if(&expr[i + 1] == rend)
+		break;
+	    else
+		blkmod = 0;
+	}
+    }
+
+    if(pth)
+	return -1;
+
+    if(!op && !op1) {
+	if(expr[0] == '(')
+	    return lsig_compile(++expr, --end, ops, nops);
+
+	ret = sscanf(expr, "%u", &id);
+	if(!ret || ret == EOF || id >= 64)
+	    return -1;
+
+	ops[*nops].type = CLI_LSIG_OP_SUB;
+	ops[*nops].id = id;
+	ops[*nops].mod = 0;
+	ops[*nops].val1 = ops[*nops].val2 = 0;
+	if(mod) {
+	    ret = sscanf(expr + modoff + 1, "%u", &modval1);
+	    if(!ret || ret == EOF)
+		return -1;
+	    ops[*nops].mod = mod;
+	    ops[*nops].val1 = modval1;
+	}
+	(*nops)++;
+	return 1;
+    }
+
+    if(!op) {
+	op = op1;
+	opoff = op1off;
+	lstart++;
+	rend = &expr[blkend];
+    }
+
+    if(!opoff || opoff + 1 == len)
+	return -1;
+    lend = &expr[opoff];
+    rstart = &expr[opoff + 1];
+
+    if((ldepth = lsig_compile(lstart, lend, ops, nops)) == -1)
+	return -1;
+    if((rdepth = lsig_compile(rstart, rend, ops, nops)) == -1)
+	return -1;
+
+    ops[*nops].type = (op == '&') ? CLI_LSIG_OP_AND : CLI_LSIG_OP_OR;
+    ops[*nops].id = 0;
+    ops[*nops].mod = blkmod;
+    ops[*nops].val1 = blkmod ? modval1 : 0;
+    ops[*nops].val2 = blkmod ? modval2 : 0;
+    (*nops)++;
+
+    return MAX(ldepth, rdepth + 1);
+}
+
+struct lsig_val {
+    int ret;
+    unsigned int cnt;
+    uint64_t ids;
+};
+
+/* Evaluates an expression compiled by cli_ac_lsigcompile(), with the same
+ * result as cli_ac_chklsig() on its text */
+int cli_ac_lsigeval(const struct cli_lsig_op *ops, unsigned int nops, const uint32_t *lsigcnt)
+{
+	struct lsig_val stack[CLI_LSIG_MAXDEPTH], *l, *r;
+	unsigned int i, sp = 0, val, tcnt;
+	uint64_t tids;
+	int ret;
+
+    for(i = 0; i < nops; i++) {
+	if(ops[i].type == CLI_LSIG_OP_SUB) {
+	    r = &stack[sp++];
+	    r->ret = 0;
+	    r->cnt = 0;
+	    r->ids = 0;
+	    val = lsigcnt[ops[i].id];
+	    switch(ops[i].mod) {
+		case 0:
+		    if(!val)
+			continue;
+		    break;
+		case '=':
+		    if(val != ops[i].val1)
+			continue;
+		    break;
+		case '<':
+		    if(val >= ops[i].val1)
+			continue;
+		    break;
+		case '>':
+		    if(val <= ops[i].val1)
+			continue;
+		    break;
+		default:
+		    continue;
+	    }
+	    r->ret = 1;
+	    r->cnt = val;
+	    r->ids = (uint64_t) 1 << ops[i].id;
+	    continue;
+	}
+
+	r = &stack[--sp];
+	l = &stack[sp - 1];
+	if(ops[i].type == CLI_LSIG_OP_AND)
+	    ret = l->ret && r->ret;
+	else
+	    ret = l->ret || r->ret;
+
+	if(ret) {
+	    tcnt = l->cnt + r->cnt;
+	    tids = l->ids | r->ids;
+	} else {
+	    tcnt = 0;
+	    tids = 0;
+	}
+
+	if(!ops[i].mod) {
+	    l->ret = ret;
+	    l->cnt = tcnt;
+	    l->ids = tids;
+	    continue;
+	}
+
+	l->ret = 0;
+	l->cnt = 0;
+	l->ids = 0;
+	switch(ops[i].mod) {
+	    case '=':
+		if(tcnt != ops[i].val1)
+		    continue;
+		break;
+	    case '<':
+		if(tcnt >= ops[i].val1)
+		    continue;
+		break;
+	    case '>':
+		if(tcnt <= ops[i].val1)
+		    continue;
+		break;
+	    default:
+		continue;
+	}
+	if(ops[i].val2) {
+	    val = 0;
+	    while(tids) {
+		val += tids & (uint64_t) 1;
+		tids >>= 1;
+	    }
+	    if(val < ops[i].val2)
+		continue;
+	}
+	l->ret = 1;
+	l->cnt = tcnt;
+    }
+
+    return sp ? stack[0].ret : 0;
+}
+
+/* Compiles the logical expressions of root and collects the lsigs which
+ * have to be evaluated even when none of their subsignatures matched. Any
+ * expression that doesn't compile is left to cli_ac_chklsig() and
+ * evaluated for every file. */
+int cli_ac_lsigcompile(struct cli_matcher *root)
+{
+	static const uint32_t zero[64];
+	struct cli_lsig_op *ops;
+	struct cli_ac_lsig *lsig;
+	unsigned int i, nops;
+	int depth;
+
+    if(root->ac_lsigcompiled)
+	return CL_SUCCESS;
+
+    root->ac_lsigalways_num = 0;
+    if(root->ac_lsigs) {
+	root->ac_lsigalways = (uint32_t *) mpool_malloc(root->mempool, root->ac_lsigs * sizeof(uint32_t));
+	if(!root->ac_lsigalways) {
+	    cli_errmsg("cli_ac_lsigcompile: Can't allocate memory for ac_lsigalways\n");
+	    return CL_EMEM;
+	}
+    }
+
+    for(i = 0; i < root->ac_lsigs; i++) {
+	lsig = root->ac_lsigtable[i];
+	nops = 0;
+	ops = (struct cli_lsig_op *) cli_malloc((strlen(lsig->logic) + 1) * sizeof(struct cli_lsig_op));
+	if(!ops) {
+	    cli_errmsg("cli_ac_lsigcompile: Can't allocate memory for ops\n");
+	    return CL_EMEM;
+	}
+	depth = lsig_compile(lsig->logic, lsig->logic + strlen(lsig->logic), ops, &nops);
+	if(depth > 0 && depth <= CLI_LSIG_MAXDEPTH && nops <= 0xffff) {
+	    lsig->ops = (struct cli_lsig_op *) mpool_malloc(root->mempool, nops * sizeof(struct cli_lsig_op));
+	    if(!lsig->ops) {
+		cli_errmsg("cli_ac_lsigcompile: Can't allocate memory for lsig->ops\n");
+		free(ops);
+		return CL_EMEM;
+	    }
+	    memcpy(lsig->ops, ops, nops * sizeof(struct cli_lsig_op));
+	    lsig->nops = nops;
+	    if(cli_ac_lsigeval(lsig->ops, lsig->nops, zero) == 1)
+		root->ac_lsigalways[root->ac_lsigalways_num++] = i;
+	} else {
+	    cli_dbgmsg("cli_ac_lsigcompile: Can't compile %s, using the text form\n", lsig->logic);
+	    root->ac_lsigalways[root->ac_lsigalways_num++] = i;
+	}
+	free(ops);
+    }
+    cli_dbgmsg("cli_ac_lsigcompile: %u lsigs, %u evaluated for every file\n", root->ac_lsigs, root->ac_lsigalways_num);
+    root->ac_lsigcompiled = 1;
+    return CL_SUCCESS;
+}
+
 /* 
  * FIXME: the current support for string alternatives uses a brute-force
  *        approach and doesn't perform any kind of verification and
@@ -914,7 +1459,7 @@ inline static int ac_findmatch(const unsigned char *buffer, uint32_t offset, uin
 
 int cli_ac_initdata(struct cli_ac_data *data, uint32_t partsigs, uint32_t lsigs, uint32_t reloffsigs, uint8_t tracklen)
 {
-	unsigned int i, j;
+	unsigned int i;
 
 
     if(!data) {
@@ -923,158 +1468,244 @@ int cli_ac_initdata(struct cli_ac_data *data, uint32_t partsigs, uint32_t lsigs,
     }
     memset((void *)data, 0, sizeof(struct cli_ac_data));
 
-    data->reloffsigs = reloffsigs;
-    if(reloffsigs) {
-	data->offset = (uint32_t *) cli_malloc(reloffsigs * 2 * sizeof(uint32_t));
-	if(!data->offset) {
-	    cli_errmsg("cli_ac_init: Can't allocate memory for data->offset\n");
-	    return CL_EMEM;
-	}
-	for(i = 0; i < reloffsigs * 2; i += 2)
-	    data->offset[i] = CLI_OFF_NONE;
-    }
-
+    /* everything else is allocated on first use, see ac_lsigrow(),
+     * ac_offmatrix() and ac_reloff() */
     data->partsigs = partsigs;
-    if(partsigs) {
-	data->offmatrix = (int32_t ***) cli_calloc(partsigs, sizeof(int32_t **));
-	if(!data->offmatrix) {
-	    cli_errmsg("cli_ac_init: Can't allocate memory for data->offmatrix\n");
-	    if(reloffsigs)
-		free(data->offset);
-	    return CL_EMEM;
-	}
-    }
- 
     data->lsigs = lsigs;
-    if(lsigs) {
-	data->lsigcnt = (uint32_t **) cli_malloc(lsigs * sizeof(uint32_t *));
-	if(!data->lsigcnt) {
-	    if(partsigs)
-		free(data->offmatrix);
-	    if(reloffsigs)
-		free(data->offset);
-	    cli_errmsg("cli_ac_init: Can't allocate memory for data->lsigcnt\n");
-	    return CL_EMEM;
+    data->reloffsigs = reloffsigs;
+    data->gen = 1;
+
+    for (i=0;i<32;i++)
+	data->macro_lastmatch[i] = CLI_OFF_NONE;
+
+    data->min_partno = 1;
+
+    return CL_SUCCESS;
+}
+
+#define NOOFF4 CLI_OFF_NONE, CLI_OFF_NONE, CLI_OFF_NONE, CLI_OFF_NONE
+#define NOOFF16 NOOFF4, NOOFF4, NOOFF4, NOOFF4
+const uint32_t cli_ac_nocnt[64];
+const uint32_t cli_ac_nooff[64] = { NOOFF16, NOOFF16, NOOFF16, NOOFF16 };
+
+/* Returns size bytes from the arena of data; the memory stays valid until
+ * cli_ac_resetdata() or cli_ac_freedata() */
+static void *ac_arena_alloc(struct cli_ac_data *data, uint32_t size)
+{
+	struct cli_ac_chunk *chunk = data->arena_cur;
+	void *ret;
+
+    size = (size + 7) & ~7;
+    while(chunk && chunk->used + size > chunk->size)
+	chunk = chunk->next;
+
+    if(!chunk) {
+	uint32_t csize = data->arena ? 65536 : 4096;
+
+	if(csize < size)
+	    csize = size;
+	chunk = (struct cli_ac_chunk *) cli_malloc(sizeof(struct cli_ac_chunk) + csize);
+	if(!chunk) {
+	    cli_errmsg("cli_ac_scanbuff: Can't allocate memory for the match state\n");
+	    return NULL;
 	}
-	data->lsigcnt[0] = (uint32_t *) cli_calloc(lsigs * 64, sizeof(uint32_t));
-	if(!data->lsigcnt[0]) {
-	    free(data->lsigcnt);
-	    if(partsigs)
-		free(data->offmatrix);
-	    if(reloffsigs)
-		free(data->offset);
-	    cli_errmsg("cli_ac_init: Can't allocate memory for data->lsigcnt[0]\n");
-	    return CL_EMEM;
+	chunk->size = csize;
+	chunk->used = 0;
+	chunk->next = NULL;
+	if(data->arena_cur) {
+	    chunk->next = data->arena_cur->next;
+	    data->arena_cur->next = chunk;
+	} else {
+	    data->arena = chunk;
 	}
-	for(i = 1; i < lsigs; i++)
-	    data->lsigcnt[i] = data->lsigcnt[0] + 64 * i;
+    }
+    data->arena_cur = chunk;
+
+    ret = (char *) (chunk + 1) + chunk->used;
+    chunk->used += size;
+    return ret;
+}
 
-	/* subsig offsets */
-	data->lsigsuboff_last = (uint32_t **) cli_malloc(lsigs * sizeof(uint32_t *));
-	data->lsigsuboff_first = (uint32_t **) cli_malloc(lsigs * sizeof(uint32_t *));
-	if(!data->lsigsuboff_last || !data->lsigsuboff_first) {
-	    free(data->lsigsuboff_last);
-	    free(data->lsigsuboff_first);
-	    free(data->lsigcnt[0]);
+/* Counters and first/last offsets of the subsignatures of lsig id */
+static int ac_lsigrow(struct cli_ac_data *data, uint32_t id)
+{
+	uint32_t *row;
+	unsigned int j;
+
+    if(!data->lsigcnt) {
+	data->lsigcnt = (uint32_t **) cli_calloc(data->lsigs * 3, sizeof(uint32_t *));
+	data->lsigdirty = (uint32_t *) cli_malloc(data->lsigs * sizeof(uint32_t));
+	if(!data->lsigcnt || !data->lsigdirty) {
+	    cli_errmsg("cli_ac_scanbuff: Can't allocate memory for data->lsigcnt\n");
 	    free(data->lsigcnt);
-	    if(partsigs)
-		free(data->offmatrix);
-	    if(reloffsigs)
-		free(data->offset);
-	    cli_errmsg("cli_ac_init: Can't allocate memory for data->lsigsuboff_(last|first)\n");
+	    free(data->lsigdirty);
+	    data->lsigcnt = NULL;
+	    data->lsigdirty = NULL;
 	    return CL_EMEM;
 	}
-	data->lsigsuboff_last[0] = (uint32_t *) cli_calloc(lsigs * 64, sizeof(uint32_t));
-	data->lsigsuboff_first[0] = (uint32_t *) cli_calloc(lsigs * 64, sizeof(uint32_t));
-	if(!data->lsigsuboff_last[0] || !data->lsigsuboff_first[0]) {
-	    free(data->lsigsuboff_last[0]);
-	    free(data->lsigsuboff_first[0]);
-	    free(data->lsigsuboff_last);
-	    free(data->lsigsuboff_first);
-	    free(data->lsigcnt[0]);
-	    free(data->lsigcnt);
-	    if(partsigs)
-		free(data->offmatrix);
-	    if(reloffsigs)
-		free(data->offset);
-	    cli_errmsg("cli_ac_init: Can't allocate memory for data->lsigsuboff_(last|first)[0]\n");
+	data->lsigsuboff_last = data->lsigcnt + data->lsigs;
+	data->lsigsuboff_first = data->lsigsuboff_last + data->lsigs;
+    }
+
+    if(!(row = (uint32_t *) ac_arena_alloc(data, 3 * 64 * sizeof(uint32_t))))
+	return CL_EMEM;
+    memset(row, 0, 64 * sizeof(uint32_t));
+    for(j = 64; j < 3 * 64; j++)
+	row[j] = CLI_OFF_NONE;
+    data->lsigcnt[id] = row;
+    data->lsigsuboff_last[id] = row + 64;
+    data->lsigsuboff_first[id] = row + 128;
+    data->lsigdirty[data->nlsigdirty++] = id;
+    return CL_SUCCESS;
+}
+
+/* Offset tracking matrix of the partial signature sigid (0 based) */
+static int ac_offmatrix(struct cli_ac_data *data, uint32_t sigid, uint16_t parts)
+{
+	int32_t **offmatrix;
+	unsigned int j;
+
+    if(!data->offmatrix) {
+	data->offmatrix = (int32_t ***) cli_calloc(data->partsigs, sizeof(int32_t **));
+	data->partdirty = (uint32_t *) cli_malloc(data->partsigs * sizeof(uint32_t));
+	if(!data->offmatrix || !data->partdirty) {
+	    cli_errmsg("cli_ac_scanbuff: Can't allocate memory for data->offmatrix\n");
+	    free(data->offmatrix);
+	    free(data->partdirty);
+	    data->offmatrix = NULL;
+	    data->partdirty = NULL;
 	    return CL_EMEM;
 	}
-	for(j = 0; j < 64; j++) {
-	    data->lsigsuboff_last[0][j] = CLI_OFF_NONE;
-	    data->lsigsuboff_first[0][j] = CLI_OFF_NONE;
-	}
-	for(i = 1; i < lsigs; i++) {
-	    data->lsigsuboff_last[i] = data->lsigsuboff_last[0] + 64 * i;
-	    data->lsigsuboff_first[i] = data->lsigsuboff_first[0] + 64 * i;
-	    for(j = 0; j < 64; j++) {
-		data->lsigsuboff_last[i][j] = CLI_OFF_NONE;
-		data->lsigsuboff_first[i][j] = CLI_OFF_NONE;
-	    }
-	}
     }
-    for (i=0;i<32;i++)
-	data->macro_lastmatch[i] = CLI_OFF_NONE;
-
-    data->min_partno = 1;
 
+    offmatrix = (int32_t **) ac_arena_alloc(data, parts * sizeof(int32_t *) + parts * (CLI_DEFAULT_AC_TRACKLEN + 2) * sizeof(int32_t));
+    if(!offmatrix)
+	return CL_EMEM;
+    offmatrix[0] = (int32_t *) (offmatrix + parts);
+    memset(offmatrix[0], -1, parts * (CLI_DEFAULT_AC_TRACKLEN + 2) * sizeof(int32_t));
+    offmatrix[0][0] = 0;
+    for(j = 1; j < parts; j++) {
+	offmatrix[j] = offmatrix[0] + j * (CLI_DEFAULT_AC_TRACKLEN + 2);
+	offmatrix[j][0] = 0;
+    }
+    data->offmatrix[sigid] = offmatrix;
+    data->partdirty[data->npartdirty++] = sigid;
     return CL_SUCCESS;
 }
 
-int cli_ac_caloff(const struct cli_matcher *root, struct cli_ac_data *data, const struct cli_target_info *info)
+/* Sets *ro to the offset table entry of the relative offset pattern patt of
+ * root, calculating it the first time the pattern becomes a candidate */
+static inline int ac_reloff(const struct cli_matcher *root, struct cli_ac_data *data, const struct cli_ac_patt *patt, const uint32_t **ro)
 {
+	static const uint32_t none[2] = { CLI_OFF_NONE, CLI_OFF_NONE };
+	uint32_t idx = patt->offset_min / 2, offdata[4], *off;
 	int ret;
-	unsigned int i;
-	struct cli_ac_patt *patt;
 
-    if(info)
-	data->vinfo = &info->exeinfo.vinfo;
+    *ro = none;
+    if(!data->info)
+	return CL_SUCCESS;
 
-    for(i = 0; i < root->ac_reloff_num; i++) {
-	patt = root->ac_reloff[i];
-	if(!info) {
-	    data->offset[patt->offset_min] = CLI_OFF_NONE;
-	} else if((ret = cli_caloff(NULL, info, root->type, patt->offdata, &data->offset[patt->offset_min], &data->offset[patt->offset_max]))) {
+    if(!data->offset) {
+	data->offset = (uint32_t *) cli_malloc(data->reloffsigs * 2 * sizeof(uint32_t));
+	data->offgen = (uint32_t *) cli_calloc(data->reloffsigs, sizeof(uint32_t));
+	if(!data->offset || !data->offgen) {
+	    cli_errmsg("cli_ac_scanbuff: Can't allocate memory for data->offset\n");
+	    free(data->offset);
+	    free(data->offgen);
+	    data->offset = data->offgen = NULL;
+	    return CL_EMEM;
+	}
+    }
+
+    off = &data->offset[patt->offset_min];
+    if(data->offgen[idx] != data->gen) {
+	data->offgen[idx] = data->gen;
+	/* cli_caloff() doesn't change offdata when given info */
+	memcpy(offdata, patt->offdata, sizeof(offdata));
+	if((ret = cli_caloff(NULL, data->info, root->type, offdata, &off[0], &off[1]))) {
 	    cli_errmsg("cli_ac_caloff: Can't calculate relative offset in signature for %s\n", patt->virname);
+	    off[0] = CLI_OFF_NONE;
 	    return ret;
-	} else if((data->offset[patt->offset_min] != CLI_OFF_NONE) && (data->offset[patt->offset_min] + patt->length > info->fsize)) {
-	    data->offset[patt->offset_min] = CLI_OFF_NONE;
 	}
+	if(off[0] != CLI_OFF_NONE && off[0] + patt->length > data->info->fsize)
+	    off[0] = CLI_OFF_NONE;
     }
+    *ro = off;
+    return CL_SUCCESS;
+}
+
+int cli_ac_caloff(const struct cli_matcher *root, struct cli_ac_data *data, const struct cli_target_info *info)
+{
+    /* the offsets are calculated on demand by ac_reloff() */
+    (void) root;
+    if(info)
+	data->vinfo = &info->exeinfo.vinfo;
+    data->info = info;
 
     return CL_SUCCESS;
 }
 
-void cli_ac_freedata(struct cli_ac_data *data)
+/* Brings data back to the state of a fresh cli_ac_initdata(), keeping the
+ * memory allocated; the relative offsets are left to cli_ac_caloff() */
+void cli_ac_resetdata(struct cli_ac_data *data)
 {
+	struct cli_ac_chunk *chunk;
 	uint32_t i;
 
-    if(data && data->partsigs) {
-	for(i = 0; i < data->partsigs; i++) {
-	    if(data->offmatrix[i]) {
-		free(data->offmatrix[i][0]);
-		free(data->offmatrix[i]);
-	    }
-	}
-	free(data->offmatrix);
-	data->offmatrix = NULL;
-	data->partsigs = 0;
-    }
+    for(i = 0; i < data->nlsigdirty; i++)
+	data->lsigcnt[data->lsigdirty[i]] = data->lsigsuboff_last[data->lsigdirty[i]] = data->lsigsuboff_first[data->lsigdirty[i]] = NULL;
+    data->nlsigdirty = 0;
+
+    for(i = 0; i < data->npartdirty; i++)
+	data->offmatrix[data->partdirty[i]] = NULL;
+    data->npartdirty = 0;
+
+    for(chunk = data->arena; chunk; chunk = chunk->next)
+	chunk->used = 0;
+    data->arena_cur = data->arena;
 
-    if(data && data->lsigs) {
-	free(data->lsigcnt[0]);
-	free(data->lsigcnt);
-	free(data->lsigsuboff_last[0]);
-	free(data->lsigsuboff_last);
-	free(data->lsigsuboff_first[0]);
-	free(data->lsigsuboff_first);
-	data->lsigs = 0;
+    if(!++data->gen) {
+	if(data->offgen)
+	    memset(data->offgen, 0, data->reloffsigs * sizeof(uint32_t));
+	data->gen = 1;
     }
 
-    if(data && data->reloffsigs) {
-	free(data->offset);
-	data->reloffsigs = 0;
+    for(i = 0; i < 32; i++)
+	data->macro_lastmatch[i] = CLI_OFF_NONE;
+    data->vinfo = NULL;
+    data->info = NULL;
+    data->min_partno = 1;
+}
+
+void cli_ac_freedata(struct cli_ac_data *data)
+{
+	struct cli_ac_chunk *chunk;
+
+    if(!data)
+	return;
+
+    while((chunk = data->arena)) {
+	data->arena = chunk->next;
+	free(chunk);
     }
+    data->arena_cur = NULL;
+
+    free(data->offmatrix);
+    free(data->partdirty);
+    data->offmatrix = NULL;
+    data->partdirty = NULL;
+    data->partsigs = data->npartdirty = 0;
+
+    free(data->lsigcnt);
+    free(data->lsigdirty);
+    data->lsigcnt = data->lsigsuboff_last = data->lsigsuboff_first = NULL;
+    data->lsigdirty = NULL;
+    data->lsigs = data->nlsigdirty = 0;
+
+    free(data->offset);
+    free(data->offgen);
+    data->offset = data->offgen = NULL;
+    data->reloffsigs = 0;
 }
 
 /* returns only CL_SUCCESS or CL_EMEM */
@@ -1110,15 +1741,22 @@ inline static int ac_addtype(struct cli_matched_type **list, cli_file_t type, of
     return CL_SUCCESS;
 }
 
-static inline void lsig_sub_matched(const struct cli_matcher *root, struct cli_ac_data *mdata, uint32_t lsigid1, uint32_t lsigid2, uint32_t realoff, int partial)
+static inline int lsig_sub_matched(const struct cli_matcher *root, struct cli_ac_data *mdata, uint32_t lsigid1, uint32_t lsigid2, uint32_t realoff, int partial)
 {
 	const struct cli_lsig_tdb *tdb = &root->ac_lsigtable[lsigid1]->tdb;
 
+    if(!mdata->lsigcnt || !mdata->lsigcnt[lsigid1]) {
+	if(realoff == CLI_OFF_NONE)
+	    return CL_SUCCESS;
+	if(ac_lsigrow(mdata, lsigid1))
+	    return CL_EMEM;
+    }
+
     if(realoff != CLI_OFF_NONE) {
 	if(mdata->lsigsuboff_first[lsigid1][lsigid2] == CLI_OFF_NONE)
 	    mdata->lsigsuboff_first[lsigid1][lsigid2] = realoff;
 	if(mdata->lsigsuboff_last[lsigid1][lsigid2] != CLI_OFF_NONE && ((!partial && realoff <= mdata->lsigsuboff_last[lsigid1][lsigid2]) || (partial && realoff < mdata->lsigsuboff_last[lsigid1][lsigid2])))
-	    return;
+	    return CL_SUCCESS;
 	mdata->lsigcnt[lsigid1][lsigid2]++;
 	if(mdata->lsigcnt[lsigid1][lsigid2] <= 1 || !tdb->macro_ptids || !tdb->macro_ptids[lsigid2])
 	    mdata->lsigsuboff_last[lsigid1][lsigid2] = realoff;
@@ -1130,10 +1768,10 @@ static inline void lsig_sub_matched(const struct cli_matcher *root, struct cli_a
 	const struct cli_ac_patt *macropt;
 	uint32_t id, last_macro_match, smin, smax, last_macroprev_match;
 	if (!tdb->macro_ptids)
-	    return;
+	    return CL_SUCCESS;
 	id = tdb->macro_ptids[lsigid2];
 	if (!id)
-	    return;
+	    return CL_SUCCESS;
 	macropt = root->ac_pattable[id];
 	smin = macropt->ch_mindist[0];
 	smax = macropt->ch_maxdist[0];
@@ -1157,6 +1795,7 @@ static inline void lsig_sub_matched(const struct cli_matcher *root, struct cli_a
 	    mdata->lsigsuboff_last[lsigid1][lsigid2+1] = last_macro_match;
 	}
     }
+    return CL_SUCCESS;
 }
 
 void cli_ac_chkmacro(struct cli_matcher *root, struct cli_ac_data *data, unsigned lsigid1)
@@ -1171,39 +1810,45 @@ void cli_ac_chkmacro(struct cli_matcher *root, struct cli_ac_data *data, unsigne
 }
 
 
-int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **virname, void **customdata, struct cli_ac_result **res, const struct cli_matcher *root, struct cli_ac_data *mdata, uint32_t offset, cli_file_t ftype, struct cli_matched_type **ftoffset, unsigned int mode, cli_ctx *ctx)
+/* Walks the trie of root; patterns carry the index of the root they belong to
+ * (see cli_ac_fuse()), so that partial, relative offset and logical signature
+ * matches are recorded in the right cli_ac_data. For a normal trie nroots == 1.
+ */
+static always_inline int ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **virname, void **customdata, struct cli_ac_result **res, const struct cli_matcher *root, const struct cli_matcher **proots, struct cli_ac_data **pdata, unsigned int nroots, uint32_t offset, cli_file_t ftype, struct cli_matched_type **ftoffset, unsigned int mode, cli_ctx *ctx)
 {
-	struct cli_ac_node *current;
+	const struct cli_ac_state *current;
+	uint32_t state = 0;
 	struct cli_ac_patt *patt, *pt;
+	const struct cli_matcher *proot;
+	struct cli_ac_data *mdata;
         uint32_t i, bp, realoff, matchend;
 	uint16_t j;
 	uint8_t found, viruses_found = 0;
 	int32_t **offmatrix, swp;
-	int type = CL_CLEAN;
+	const uint32_t *ro;
+	int type = CL_CLEAN, ret;
 	struct cli_ac_result *newres;
 
-    if(!root->ac_root)
-	return CL_CLEAN;
-
-    if(!mdata && (root->ac_partsigs || root->ac_lsigs || root->ac_reloff_num)) {
-	cli_errmsg("cli_ac_scanbuff: mdata == NULL\n");
-	return CL_ENULLARG;
-    }
-
-    current = root->ac_root;
-
     for(i = 0; i < length; i++)  {
-	current = current->trans[buffer[i]];
+	state = ac_next(root, state, buffer[i]);
+	current = &root->ac_states[state];
 
 	if(UNLIKELY(IS_FINAL(current))) {
-	    struct cli_ac_patt *faillist = current->fail->list;
+	    struct cli_ac_patt *faillist = current->faillist;
 	    patt = current->list;
 	    while(patt) {
+		mdata = pdata[patt->rootidx];
 		if(patt->partno > mdata->min_partno) {
+		    if(nroots > 1) {
+			/* patterns of both roots are mixed in the list */
+			patt = patt->next;
+			continue;
+		    }
 		    patt = faillist;
 		    faillist = NULL;
 		    continue;
 		}
+		SIGSTAT_INC(proots[patt->rootidx]->sigstats, patt->perfid, candidates);
 		bp = i + 1 - patt->depth;
 		if (patt->offdata[0] != CLI_OFF_VERSION && 
                     patt->offdata[0] != CLI_OFF_MACRO && 
@@ -1221,18 +1866,27 @@ int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
 			    continue;
 			}
 		    } else {
-			if(mdata->offset[patt->offset_min] == CLI_OFF_NONE || mdata->offset[patt->offset_max] < realoff || mdata->offset[patt->offset_min] > realoff) {
+			if((ret = ac_reloff(proots[patt->rootidx], mdata, patt, &ro)))
+			    return ret;
+			if(ro[0] == CLI_OFF_NONE || ro[1] < realoff || ro[0] > realoff) {
 			    patt = patt->next;
 			    continue;
 			}
 		    }
 		}
 		pt = patt;
+		SIGSTAT_INC(proots[patt->rootidx]->sigstats, patt->perfid, verifies);
 		if(ac_findmatch(buffer, bp, offset + bp - patt->prefix_length, length, patt, &matchend)) {
 		    while(pt) {
-			if(pt->partno > mdata->min_partno)
-			    break;
-			if((pt->type && !(mode & AC_SCAN_FT)) || (!pt->type && !(mode & AC_SCAN_VIR))) {
+			mdata = pdata[pt->rootidx];
+			proot = proots[pt->rootidx];
+			if(pt->partno > mdata->min_partno) {
+			    if(nroots == 1)
+				break;
+			    pt = pt->next_same;
+			    continue;
+			}
+			if((pt->type && !(mode & AC_SCAN_FT)) || (!pt->type && !(mode & AC_SCAN_VIR)) || pt->tombstone) {
 			    pt = pt->next_same;
 			    continue;
 			}
@@ -1258,16 +1912,19 @@ int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
 				    continue;
 				}
 			    } else {
-				if(mdata->offset[pt->offset_min] == CLI_OFF_NONE || mdata->offset[pt->offset_max] < realoff || mdata->offset[pt->offset_min] > realoff) {
+				if((ret = ac_reloff(proot, mdata, pt, &ro)))
+				    return ret;
+				if(ro[0] == CLI_OFF_NONE || ro[1] < realoff || ro[0] > realoff) {
 				    pt = pt->next_same;
 				    continue;
 				}
 			    }
 			}
+			SIGSTAT_INC(proot->sigstats, pt->perfid, hits);
 			if(pt->sigid) { /* it's a partial signature */
 
 			    /* if 2nd or later part, confirm some prior part has matched */
-			    if(pt->partno != 1 && (!mdata->offmatrix[pt->sigid - 1] || !mdata->offmatrix[pt->sigid - 1][pt->partno - 2][0])) {
+			    if(pt->partno != 1 && (!mdata->offmatrix || !mdata->offmatrix[pt->sigid - 1] || !mdata->offmatrix[pt->sigid - 1][pt->partno - 2][0])) {
 				pt = pt->next_same;
 				continue;
 			    }
@@ -1276,27 +1933,8 @@ int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
 				mdata->min_partno = pt->partno + 1;
 
 			    /* sparsely populated matrix, so allocate and initialize if NULL */
-			    if(!mdata->offmatrix[pt->sigid - 1]) {
-				mdata->offmatrix[pt->sigid - 1] = cli_malloc(pt->parts * sizeof(int32_t *));
-				if(!mdata->offmatrix[pt->sigid - 1]) {
-				    cli_errmsg("cli_ac_scanbuff: Can't allocate memory for mdata->offmatrix[%u]\n", pt->sigid - 1);
-				    return CL_EMEM;
-				}
-
-				mdata->offmatrix[pt->sigid - 1][0] = cli_malloc(pt->parts * (CLI_DEFAULT_AC_TRACKLEN + 2) * sizeof(int32_t));
-				if(!mdata->offmatrix[pt->sigid - 1][0]) {
-				    cli_errmsg("cli_ac_scanbuff: Can't allocate memory for mdata->offmatrix[%u][0]\n", pt->sigid - 1);
-				    free(mdata->offmatrix[pt->sigid - 1]);
-				    mdata->offmatrix[pt->sigid - 1] = NULL;
-				    return CL_EMEM;
-				}
-				memset(mdata->offmatrix[pt->sigid - 1][0], -1, pt->parts * (CLI_DEFAULT_AC_TRACKLEN + 2) * sizeof(int32_t));
-				mdata->offmatrix[pt->sigid - 1][0][0] = 0;
-				for(j = 1; j < pt->parts; j++) {
-				    mdata->offmatrix[pt->sigid - 1][j] = mdata->offmatrix[pt->sigid - 1][0] + j * (CLI_DEFAULT_AC_TRACKLEN + 2);
-				    mdata->offmatrix[pt->sigid - 1][j][0] = 0;
-				}
-			    }
+			    if((!mdata->offmatrix || !mdata->offmatrix[pt->sigid - 1]) && ac_offmatrix(mdata, pt->sigid - 1, pt->parts))
+				return CL_EMEM;
 			    offmatrix = mdata->offmatrix[pt->sigid - 1];
 
 			    found = 0;
@@ -1361,7 +1999,8 @@ int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
 
 				} else { /* !pt->type */
 				    if(pt->lsigid[0]) {
-					lsig_sub_matched(root, mdata, pt->lsigid[1], pt->lsigid[2], offmatrix[pt->parts - 1][1], 1);
+					if(lsig_sub_matched(proot, mdata, pt->lsigid[1], pt->lsigid[2], offmatrix[pt->parts - 1][1], 1))
+					    return CL_EMEM;
 					pt = pt->next_same;
 					continue;
 				    }
@@ -1416,7 +2055,8 @@ int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
 				}
 			    } else {
 				if(pt->lsigid[0]) {
-				    lsig_sub_matched(root, mdata, pt->lsigid[1], pt->lsigid[2], realoff, 0);
+				    if(lsig_sub_matched(proot, mdata, pt->lsigid[1], pt->lsigid[2], realoff, 0))
+					return CL_EMEM;
 				    pt = pt->next_same;
 				    continue;
 				}
@@ -1465,6 +2105,39 @@ int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
     return (mode & AC_SCAN_FT) ? type : CL_CLEAN;
 }
 
+int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **virname, void **customdata, struct cli_ac_result **res, const struct cli_matcher *root, struct cli_ac_data *mdata, uint32_t offset, cli_file_t ftype, struct cli_matched_type **ftoffset, unsigned int mode, cli_ctx *ctx)
+{
+    if(!root->ac_states)
+	return CL_CLEAN;
+
+    if(!mdata && (root->ac_partsigs || root->ac_lsigs || root->ac_reloff_num)) {
+	cli_errmsg("cli_ac_scanbuff: mdata == NULL\n");
+	return CL_ENULLARG;
+    }
+
+    return ac_scanbuff(buffer, length, virname, customdata, res, root, &root, &mdata, 1, offset, ftype, ftoffset, mode, ctx);
+}
+
+int cli_ac_scanbuff_fused(const unsigned char *buffer, uint32_t length, const char **virname, void **customdata, struct cli_ac_result **res, const struct cli_matcher *troot, struct cli_ac_data *tdata, const struct cli_matcher *groot, struct cli_ac_data *gdata, uint32_t offset, cli_file_t ftype, struct cli_matched_type **ftoffset, unsigned int mode, cli_ctx *ctx)
+{
+	const struct cli_matcher *proots[2];
+	struct cli_ac_data *pdata[2];
+
+    if(!troot->ac_fused || !troot->ac_fused->ac_states)
+	return CL_CLEAN;
+
+    if(!tdata || !gdata) {
+	cli_errmsg("cli_ac_scanbuff_fused: mdata == NULL\n");
+	return CL_ENULLARG;
+    }
+
+    proots[0] = troot;
+    proots[1] = groot;
+    pdata[0] = tdata;
+    pdata[1] = gdata;
+    return ac_scanbuff(buffer, length, virname, customdata, res, troot->ac_fused, proots, pdata, 2, offset, ftype, ftoffset, mode, ctx);
+}
+
 static int qcompare(const void *a, const void *b)
 {
     return *(const unsigned char *)a - *(const unsigned char *)b;
@@ -1875,8 +2548,16 @@ int cli_ac_addsig(struct cli_matcher *root, const char *virname, const char *hex
 	return CL_EMEM;
     }
 
-    if(new->lsigid[0])
-	root->ac_lsigtable[new->lsigid[1]]->virname = new->virname;
+    if(new->lsigid[0]) {
+	struct cli_ac_lsig *lsig = root->ac_lsigtable[new->lsigid[1]];
+
+	lsig->virname = new->virname;
+	if(root->sigstats && !lsig->perfid)
+	    lsig->perfid = cli_sigstats_add(root->sigstats, new->virname, SIGSTAT_LSIG, -1);
+	new->perfid = cli_sigstats_add(root->sigstats, new->virname, SIGSTAT_AC, new->lsigid[2]);
+    } else {
+	new->perfid = cli_sigstats_add(root->sigstats, new->virname, SIGSTAT_AC, new->sigid ? new->partno : -1);
+    }
 
     ret = cli_caloff(offset, NULL, root->type, new->offdata, &new->offset_min, &new->offset_max);
     if(ret != CL_SUCCESS) {
@@ -1905,6 +2586,8 @@ int cli_ac_addsig(struct cli_matcher *root, const char *virname, const char *hex
 	new->offset_min = root->ac_reloff_num * 2;
 	new->offset_max = new->offset_min + 1;
 	root->ac_reloff_num++;
+	if(new->offdata[0] == CLI_OFF_EOF_MINUS && new->offdata[1] > root->eof_maxoff)
+	    root->eof_maxoff = new->offdata[1];
     }
 
     return CL_SUCCESS;
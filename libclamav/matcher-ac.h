@@ -33,16 +33,35 @@
 #define AC_SCAN_VIR 1
 #define AC_SCAN_FT  2
 
+#define AC_SPECIAL_ALT_CHAR	1
+#define AC_SPECIAL_ALT_STR	2
+#define AC_SPECIAL_LINE_MARKER	3
+#define AC_SPECIAL_BOUNDARY	4
+
+struct cli_ac_chunk {
+    struct cli_ac_chunk *next;
+    uint32_t size, used;
+};
+
+/* Match state of a root; apart from the fixed part it is allocated on the
+ * first hit that needs it, so a file that matches nothing costs nothing.
+ * The rows of lsigcnt and lsigsuboff_* stay NULL for the lsigs without a
+ * hit (read them with cli_ac_lsigcnt() and cli_ac_lsigsuboff()), and
+ * lsigdirty lists those with one, in order of the first hit. */
 struct cli_ac_data {
     int32_t ***offmatrix;
     uint32_t partsigs, lsigs, reloffsigs;
     uint32_t **lsigcnt;
     uint32_t **lsigsuboff_last, **lsigsuboff_first;
-    uint32_t *offset;
+    uint32_t *offset, *offgen, gen;
+    const struct cli_target_info *info;
     uint32_t macro_lastmatch[32];
     /** Hashset for versioninfo matching */
     const struct cli_hashset *vinfo;
     uint32_t min_partno;
+    uint32_t *lsigdirty, nlsigdirty;
+    uint32_t *partdirty, npartdirty;
+    struct cli_ac_chunk *arena, *arena_cur;
 };
 
 struct cli_ac_special {
@@ -69,11 +88,25 @@ struct cli_ac_patt {
     uint32_t offdata[4], offset_min, offset_max;
     uint32_t boundary;
     uint8_t depth;
+    uint8_t rootidx; /* in a fused trie: 0 - target root, 1 - generic root */
+    uint8_t tombstone; /* removed by cl_engine_update() */
+    uint32_t perfid; /* see sigstats.h */
 };
 
 struct cli_ac_node {
     struct cli_ac_patt *list;
     struct cli_ac_node **trans, *fail;
+    uint32_t id; /* index in ac_states, only valid while freezing */
+};
+
+/* Frozen trie state, see ac_freeze() */
+struct cli_ac_state {
+    struct cli_ac_patt *list, *faillist;
+    uint32_t trans;	/* first entry in ac_dtrans (dense) or ac_strans (sparse) */
+    uint32_t fail;	/* sparse: state that handles the bytes not set in map */
+    uint32_t map[8];	/* sparse: bitmap of the bytes with own transitions */
+    uint8_t rank[8];	/* sparse: number of bits set in map[0..n-1] */
+    uint8_t dense;
 };
 
 #define IS_LEAF(node) (!node->trans)
@@ -88,13 +121,35 @@ struct cli_ac_result {
 
 #include "matcher.h"
 
+struct cli_lsig_op;
+/* Whether a and b have the same pattern data, including the special
+ * tables; their offsets, parts and virus names aren't compared */
+int cli_ac_samepatt(const struct cli_ac_patt *a, const struct cli_ac_patt *b);
 int cli_ac_addpatt(struct cli_matcher *root, struct cli_ac_patt *pattern);
 int cli_ac_initdata(struct cli_ac_data *data, uint32_t partsigs, uint32_t lsigs, uint32_t reloffsigs, uint8_t tracklen);
 void cli_ac_chkmacro(struct cli_matcher *root, struct cli_ac_data *data, unsigned lsigid1);
-int cli_ac_chklsig(const char *expr, const char *end, uint32_t *lsigcnt, unsigned int *cnt, uint64_t *ids, unsigned int parse_only);
+int cli_ac_chklsig(const char *expr, const char *end, const uint32_t *lsigcnt, unsigned int *cnt, uint64_t *ids, unsigned int parse_only);
+int cli_ac_lsigcompile(struct cli_matcher *root);
+int cli_ac_lsigeval(const struct cli_lsig_op *ops, unsigned int nops, const uint32_t *lsigcnt);
+void cli_ac_resetdata(struct cli_ac_data *data);
 void cli_ac_freedata(struct cli_ac_data *data);
+
+extern const uint32_t cli_ac_nocnt[64], cli_ac_nooff[64];
+
+static inline const uint32_t *cli_ac_lsigcnt(const struct cli_ac_data *data, uint32_t id)
+{
+    return (data->lsigcnt && data->lsigcnt[id]) ? data->lsigcnt[id] : cli_ac_nocnt;
+}
+
+static inline const uint32_t *cli_ac_lsigsuboff(const struct cli_ac_data *data, uint32_t id)
+{
+    return (data->lsigcnt && data->lsigcnt[id]) ? data->lsigsuboff_first[id] : cli_ac_nooff;
+}
+
 int cli_ac_scanbuff(const unsigned char *buffer, uint32_t length, const char **virname, void **customdata, struct cli_ac_result **res, const struct cli_matcher *root, struct cli_ac_data *mdata, uint32_t offset, cli_file_t ftype, struct cli_matched_type **ftoffset, unsigned int mode, cli_ctx *ctx);
+int cli_ac_scanbuff_fused(const unsigned char *buffer, uint32_t length, const char **virname, void **customdata, struct cli_ac_result **res, const struct cli_matcher *troot, struct cli_ac_data *tdata, const struct cli_matcher *groot, struct cli_ac_data *gdata, uint32_t offset, cli_file_t ftype, struct cli_matched_type **ftoffset, unsigned int mode, cli_ctx *ctx);
 int cli_ac_buildtrie(struct cli_matcher *root);
+int cli_ac_fuse(struct cli_matcher *troot, const struct cli_matcher *groot);
 int cli_ac_init(struct cli_matcher *root, uint8_t mindepth, uint8_t maxdepth, uint8_t dconf_prefiltering);
 int cli_ac_caloff(const struct cli_matcher *root, struct cli_ac_data *data, const struct cli_target_info *info);
 void cli_ac_free(struct cli_matcher *root);
@@ -34,16 +34,31 @@
 #include "filtering.h"
 
 #include "mpool.h"
+#include "sigstats.h"
 
 #define BM_MIN_LENGTH	3
 #define BM_BLOCK_SIZE	3
 #define HASH(a,b,c) (211 * a + 37 * b + c)
 
+/* See filtering.c: built on x86-64, on i386 enabled by CPUID at runtime */
+#if defined(__SSE2__) || (defined(__i386__) && defined(__GNUC__) && !defined(__clang__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define BM_SSE2 1
+#include <emmintrin.h>
+#ifdef __SSE2__
+#define BM_SSE2_TARGET
+#define bm_have_sse2() 1
+#else
+#define BM_SSE2_TARGET __attribute__((target("sse2")))
+#define bm_have_sse2() __builtin_cpu_supports("sse2")
+#endif
+#endif
+
 int cli_bm_addpatt(struct cli_matcher *root, struct cli_bm_patt *pattern, const char *offset)
 {
 	uint16_t idx, i;
 	const unsigned char *pt = pattern->pattern;
 	struct cli_bm_patt *prev, *next = NULL;
+	uint32_t pval = 0, pmask = 0;
 	int ret;
 
 
@@ -51,6 +66,7 @@ int cli_bm_addpatt(struct cli_matcher *root, struct cli_bm_patt *pattern, const
 	cli_errmsg("cli_bm_addpatt: Signature for %s is too short\n", pattern->virname);
 	return CL_EMALFDB;
     }
+    pattern->perfid = cli_sigstats_add(root->sigstats, pattern->virname, SIGSTAT_BM, -1);
 
     if((ret = cli_caloff(offset, NULL, root->type, pattern->offdata, &pattern->offset_min, &pattern->offset_max))) {
 	cli_errmsg("cli_bm_addpatt: Can't calculate offset for signature %s\n", pattern->virname);
@@ -61,6 +77,8 @@ int cli_bm_addpatt(struct cli_matcher *root, struct cli_bm_patt *pattern, const
 	    root->bm_absoff_num++;
 	else
 	    root->bm_reloff_num++;
+	if(pattern->offdata[0] == CLI_OFF_EOF_MINUS && pattern->offdata[1] > root->eof_maxoff)
+	    root->eof_maxoff = pattern->offdata[1];
     }
 
     /* bm_offmode doesn't use the prefilter for BM signatures anyway, so
@@ -98,6 +116,25 @@ int cli_bm_addpatt(struct cli_matcher *root, struct cli_bm_patt *pattern, const
 	root->bm_shift[idx] = MIN(root->bm_shift[idx], BM_MIN_LENGTH - BM_BLOCK_SIZE - i);
     }
 
+    if(!root->bm_pref) {
+	root->bm_pref = (struct cli_bm_pref *) mpool_calloc(root->mempool, HASH(255, 255, 255) + 1, sizeof(struct cli_bm_pref));
+	if(!root->bm_pref) {
+	    cli_errmsg("cli_bm_addpatt: Can't allocate memory for root->bm_pref\n");
+	    return CL_EMEM;
+	}
+    }
+    for(i = 0; i < 4 && i < pattern->length; i++) {
+	pval |= (uint32_t) pt[i] << (8 * i);
+	pmask |= 0xffU << (8 * i);
+    }
+    if(root->bm_suffix[idx]) {
+	/* keep only the bytes all patterns of the bucket agree on */
+	pmask &= root->bm_pref[idx].mask & ~(root->bm_pref[idx].val ^ pval);
+	pval &= pmask;
+    }
+    root->bm_pref[idx].val = pval;
+    root->bm_pref[idx].mask = pmask;
+
     prev = next = root->bm_suffix[idx];
     while(next) {
 	if(pt[0] >= next->pattern0)
@@ -225,6 +262,9 @@ void cli_bm_free(struct cli_matcher *root)
     if(root->bm_pattab)
 	mpool_free(root->mempool, root->bm_pattab);
 
+    if(root->bm_pref)
+	mpool_free(root->mempool, root->bm_pref);
+
     if(root->bm_suffix) {
 	for(i = 0; i < size; i++) {
 	    patt = root->bm_suffix[i];
@@ -244,15 +284,54 @@ void cli_bm_free(struct cli_matcher *root)
     }
 }
 
+#ifdef BM_SSE2
+/* Returns the first position >= i that passes both the bm_shift[] and the
+ * bm_pref[] check. HASH() fits in 16 bits, so the hashes of 8 positions are
+ * computed at once with 16 bit multiplies; there's no gather, the table
+ * lookups stay scalar. The last positions of the buffer are left to the
+ * caller.
+ */
+static BM_SSE2_TARGET uint32_t bm_next_sse2(const struct cli_matcher *root, const unsigned char *buffer, uint32_t i, uint32_t length)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i m211 = _mm_set1_epi16(211), m37 = _mm_set1_epi16(37);
+	const struct cli_bm_pref *pref;
+	__m128i v, a, b, c;
+	uint16_t h[8];
+	unsigned int k;
+
+    for(; i + 16 <= length; i += 8) {
+	v = _mm_loadu_si128((const __m128i *) &buffer[i]);
+	a = _mm_unpacklo_epi8(v, zero);
+	b = _mm_unpacklo_epi8(_mm_srli_si128(v, 1), zero);
+	c = _mm_unpacklo_epi8(_mm_srli_si128(v, 2), zero);
+	a = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(a, m211), _mm_mullo_epi16(b, m37)), c);
+	_mm_storeu_si128((__m128i *) h, a);
+	for(k = 0; k < 8; k++) {
+	    if(root->bm_shift[h[k]])
+		continue;
+	    pref = &root->bm_pref[h[k]];
+	    if(((uint32_t) cli_readint32(&buffer[i + k]) & pref->mask) == pref->val)
+		return i + k;
+	}
+    }
+    return i;
+}
+#endif
+
 int cli_bm_scanbuff(const unsigned char *buffer, uint32_t length, const char **virname, const struct cli_bm_patt **patt, const struct cli_matcher *root, uint32_t offset, const struct cli_target_info *info, struct cli_bm_off *offdata, uint32_t *viroffset)
 {
 	uint32_t i, j, off, off_min, off_max;
 	uint8_t found, pchain, shift;
 	uint16_t idx, idxchk;
 	struct cli_bm_patt *p;
+	const struct cli_bm_pref *pref;
 	const unsigned char *bp, *pt;
 	unsigned char prefix;
         int ret;
+#ifdef BM_SSE2
+	int sse2;
+#endif
 
     if(!root || !root->bm_shift)
 	return CL_CLEAN;
@@ -273,10 +352,26 @@ int cli_bm_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
 	    return CL_CLEAN;
 	i += offdata->offtab[offdata->pos] - offset;
     }
+#ifdef BM_SSE2
+    /* bm_shift[] is 0 or 1 here, so without offdata only the positions
+     * with candidates need to be looked at */
+    sse2 = !offdata && BM_MIN_LENGTH == BM_BLOCK_SIZE && bm_have_sse2();
+#endif
     for(; i < length - BM_BLOCK_SIZE + 1; ) {
+#ifdef BM_SSE2
+	if(sse2)
+	    i = bm_next_sse2(root, buffer, i, length);
+#endif
 	idx = HASH(buffer[i], buffer[i + 1], buffer[i + 2]);
 	shift = root->bm_shift[idx];
 
+	if(shift == 0 && i - BM_MIN_LENGTH + BM_BLOCK_SIZE + 4 <= length) {
+	    /* cheap reject before touching the pattern list */
+	    pref = &root->bm_pref[idx];
+	    if(((uint32_t) cli_readint32(&buffer[i - BM_MIN_LENGTH + BM_BLOCK_SIZE]) & pref->mask) != pref->val)
+		shift = 1;
+	}
+
 	if(shift == 0) {
 	    prefix = buffer[i - BM_MIN_LENGTH + BM_BLOCK_SIZE];
 	    p = root->bm_suffix[idx];
@@ -304,7 +399,7 @@ int cli_bm_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
 		off = i - BM_MIN_LENGTH + BM_BLOCK_SIZE;
 		bp = buffer + off;
 
-		if((off + p->length > length) || (p->prefix_length > off)) {
+		if((off + p->length > length) || (p->prefix_length > off) || p->tombstone) {
 		    p = p->next;
 		    continue;
 		}
@@ -321,6 +416,7 @@ int cli_bm_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
 		    }
 		}
 
+		SIGSTAT_INC(root->sigstats, p->perfid, candidates);
 		idxchk = MIN(p->length, length - off) - 1;
 		if(idxchk) {
 		    if((bp[idxchk] != p->pattern[idxchk]) ||  (bp[idxchk / 2] != p->pattern[idxchk / 2])) {
@@ -337,6 +433,7 @@ int cli_bm_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
 		    pt = p->pattern;
 		}
 
+		SIGSTAT_INC(root->sigstats, p->perfid, verifies);
 		found = 1;
 		for(j = 0; j < p->length + p->prefix_length && off < length; j++, off++) {
 		    if(bp[j] != pt[j]) {
@@ -374,6 +471,7 @@ int cli_bm_scanbuff(const unsigned char *buffer, uint32_t length, const char **v
 			    continue;
 			}
 		    }
+		    SIGSTAT_INC(root->sigstats, p->perfid, hits);
 		    if(virname) {
 			*virname = p->virname;
 			if(viroffset)
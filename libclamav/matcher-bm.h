@@ -27,6 +27,7 @@
 #include "fmap.h"
 
 #define BM_BOUNDARY_EOL	1
+#define BM_HASH_SIZE	(211 * 255 + 37 * 255 + 255 + 1) /* size of bm_shift[], bm_suffix[] and bm_pref[] */
 
 struct cli_bm_patt {
     unsigned char *pattern, *prefix;
@@ -36,7 +37,16 @@ struct cli_bm_patt {
     uint16_t length, prefix_length;
     uint16_t cnt;
     unsigned char pattern0;
+    uint8_t tombstone; /* removed by cl_engine_update() */
     uint32_t boundary, filesize;
+    uint32_t perfid; /* see sigstats.h */
+};
+
+/* First four bytes shared by the patterns of a bm_suffix[] bucket: a
+ * candidate is only worth walking the list for if
+ * (cli_readint32(buffer) & mask) == val */
+struct cli_bm_pref {
+    uint32_t val, mask;
 };
 
 struct cli_bm_off {
@@ -71,6 +71,20 @@ const unsigned int hashlen[] = {
     CLI_HASHLEN_SHA256
 };
 
+static void hm_index_free(struct cli_matcher *root, enum CLI_HASH_TYPE type) {
+    struct cli_hm_index *index = root->hm.index[type];
+
+    if(!index)
+	return;
+    mpool_free(root->mempool, index->fps);
+    mpool_free(root->mempool, index->refs);
+    mpool_free(root->mempool, index->sets);
+    mpool_free(root->mempool, index->sizes);
+    mpool_free(root->mempool, index->bases);
+    mpool_free(root->mempool, index);
+    root->hm.index[type] = NULL;
+}
+
 int hm_addhash_bin(struct cli_matcher *root, const void *binhash, enum CLI_HASH_TYPE type, uint32_t size, const char *virusname) {
     const unsigned int hlen = hashlen[type];
     const struct cli_htu32_element *item;
@@ -78,6 +92,9 @@ int hm_addhash_bin(struct cli_matcher *root, const void *binhash, enum CLI_HASH_
     struct cli_htu32 *ht;
     int i;
 
+    /* the index is rebuilt by the next hm_flush() */
+    hm_index_free(root, type);
+
     if (size) {
         /* size non-zero, find sz_hash element in size-driven hashtable  */
         ht = &root->hm.sizehashes[type];
@@ -187,6 +204,129 @@ static void hm_sort(struct cli_sz_hash *szh, size_t l, size_t r, unsigned int ke
     hm_sort(szh, r1, r, keylen);
 }
 
+/* The digests are already well mixed, the first 8 bytes and the size
+ * are enough for the bucket and the fingerprint */
+static inline uint64_t hm_key(const unsigned char *digest, uint32_t size) {
+    uint64_t h;
+
+    memcpy(&h, digest, sizeof(h));
+    h ^= size * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 29;
+    return h;
+}
+
+static inline uint16_t hm_fingerprint(uint64_t h) {
+    uint16_t fp = h >> 48;
+
+    return fp ? fp : 1;
+}
+
+/* the low 32 bits scaled to the bucket count, no power of two needed */
+static inline uint32_t hm_bucket(uint64_t h, uint32_t nbuckets) {
+    return ((h & 0xffffffff) * nbuckets) >> 32;
+}
+
+/* The set holding an entry number of the index */
+static inline uint32_t hm_refset(const struct cli_hm_index *index, uint32_t ref) {
+    uint32_t l = 0, r = index->nsets - 1, c;
+
+    while(l < r) {
+	c = (l + r + 1) / 2;
+	if(index->bases[c] <= ref)
+	    l = c;
+	else
+	    r = c - 1;
+    }
+    return l;
+}
+
+static int hm_index_build(struct cli_matcher *root, enum CLI_HASH_TYPE type) {
+    struct cli_htu32 *ht = &root->hm.sizehashes[type];
+    const struct cli_htu32_element *item = NULL;
+    const struct cli_sz_hash *szh;
+    unsigned int keylen = hashlen[type];
+    struct cli_hm_index *index;
+    uint32_t set, i, pos, nslots, nsets = 0, n = 0;
+    uint64_t h;
+
+    hm_index_free(root, type);
+
+    if(ht->capacity) {
+	while((item = cli_htu32_next(ht, item))) {
+	    nsets++;
+	    n += ((const struct cli_sz_hash *)item->data.as_ptr)->items;
+	}
+    }
+    if(root->hwild.hashes[type].items) {
+	nsets++;
+	n += root->hwild.hashes[type].items;
+    }
+    if(!n)
+	return CL_SUCCESS;
+    if(n > 0x40000000) {
+	cli_dbgmsg("hm_index_build: too many hashes (%u)\n", n);
+	return CL_EMEM;
+    }
+
+    index = mpool_calloc(root->mempool, 1, sizeof(*index));
+    if(!index) {
+	cli_dbgmsg("hm_index_build: failed to allocate the index\n");
+	return CL_EMEM;
+    }
+    root->hm.index[type] = index;
+    /* about 85% full; the duplicates don't take a slot, so usually less */
+    index->nbuckets = ((uint64_t)n * 20 / 17 + CLI_HM_BUCKET) / CLI_HM_BUCKET;
+    nslots = index->nbuckets * CLI_HM_BUCKET;
+    index->fps = mpool_calloc(root->mempool, nslots, sizeof(*index->fps));
+    index->refs = mpool_malloc(root->mempool, nslots * sizeof(*index->refs));
+    index->sets = mpool_malloc(root->mempool, nsets * sizeof(*index->sets));
+    index->sizes = mpool_malloc(root->mempool, nsets * sizeof(*index->sizes));
+    index->bases = mpool_malloc(root->mempool, (nsets + 1) * sizeof(*index->bases));
+    if(!index->fps || !index->refs || !index->sets || !index->sizes || !index->bases) {
+	cli_dbgmsg("hm_index_build: failed to allocate %u slots\n", nslots);
+	hm_index_free(root, type);
+	return CL_EMEM;
+    }
+
+    item = NULL;
+    n = 0;
+    if(ht->capacity) {
+	while((item = cli_htu32_next(ht, item))) {
+	    index->sets[index->nsets] = szh = (const struct cli_sz_hash *)item->data.as_ptr;
+	    index->sizes[index->nsets] = item->key;
+	    index->bases[index->nsets++] = n;
+	    n += szh->items;
+	}
+    }
+    if(root->hwild.hashes[type].items) {
+	index->sets[index->nsets] = &root->hwild.hashes[type];
+	index->sizes[index->nsets] = 0;
+	index->bases[index->nsets++] = n;
+	n += root->hwild.hashes[type].items;
+    }
+    index->bases[index->nsets] = n;
+
+    /* the sets are sorted, only the first of the equal digests goes in;
+     * a full bucket spills into the next one */
+    for(set = 0; set < index->nsets; set++) {
+	szh = index->sets[set];
+	for(i = 0; i < szh->items; i++) {
+	    if(i && !hm_cmp(&szh->hash_array[keylen * i], &szh->hash_array[keylen * (i - 1)], keylen))
+		continue;
+	    h = hm_key(&szh->hash_array[keylen * i], index->sizes[set]);
+	    pos = hm_bucket(h, index->nbuckets) * CLI_HM_BUCKET;
+	    while(index->fps[pos])
+		if(++pos == nslots)
+		    pos = 0;
+	    index->fps[pos] = hm_fingerprint(h);
+	    index->refs[pos] = index->bases[set] + i;
+	}
+    }
+    return CL_SUCCESS;
+}
+
 /* flush both size-specific and agnostic hash sets */
 void hm_flush(struct cli_matcher *root) {
     enum CLI_HASH_TYPE type;
@@ -196,16 +336,27 @@ void hm_flush(struct cli_matcher *root) {
     if(!root)
 	return;
 
-    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
-	struct cli_htu32 *ht = &root->hm.sizehashes[type];
-	const struct cli_htu32_element *item = NULL;
-	szh = NULL;
+    /* a snapshot is saved sorted, its arrays are read-only */
+    if(!root->snapshot) {
+	for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
+	    struct cli_htu32 *ht = &root->hm.sizehashes[type];
+	    const struct cli_htu32_element *item = NULL;
+	    szh = NULL;
 
-	if(!root->hm.sizehashes[type].capacity)
-	    continue;
+	    if(!root->hm.sizehashes[type].capacity)
+		continue;
 
-	while((item = cli_htu32_next(ht, item))) {
-	    szh = (struct cli_sz_hash *)item->data.as_ptr;
+	    while((item = cli_htu32_next(ht, item))) {
+		szh = (struct cli_sz_hash *)item->data.as_ptr;
+		keylen = hashlen[type];
+
+		if(szh->items > 1)
+		    hm_sort(szh, 0, szh->items, keylen);
+	    }
+	}
+
+	for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
+	    szh = &root->hwild.hashes[type];
 	    keylen = hashlen[type];
 
 	    if(szh->items > 1)
@@ -213,13 +364,10 @@ void hm_flush(struct cli_matcher *root) {
 	}
     }
 
-    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
-	szh = &root->hwild.hashes[type];
-	keylen = hashlen[type];
-
-	if(szh->items > 1)
-	    hm_sort(szh, 0, szh->items, keylen);
-    }
+    /* without an index the lookups fall back to the binary search */
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++)
+	if(hm_index_build(root, type) != CL_SUCCESS)
+	    cli_dbgmsg("hm_flush: no index for the hashes of type %u, using the binary search\n", type);
 }
 
 
@@ -231,15 +379,17 @@ int cli_hm_have_wild(const struct cli_matcher *root, enum CLI_HASH_TYPE type) {
     return (root && root->hwild.hashes[type].items);
 }
 
-/* cli_hm_scan will scan only size-specific hashes, if any */
-static int hm_scan(const unsigned char *digest, const char **virname, const struct cli_sz_hash *szh, enum CLI_HASH_TYPE type) {
-    unsigned int keylen;
+/* any hashes of the given type, no matter the size */
+int cli_hm_have_any(const struct cli_matcher *root, enum CLI_HASH_TYPE type) {
+    return (root && (root->hm.sizehashes[type].capacity || root->hwild.hashes[type].items));
+}
+
+/* Returns the index of the first entry for the digest, or -1 */
+static long hm_find(const unsigned char *digest, const struct cli_sz_hash *szh, unsigned int keylen) {
     size_t l, r;
 
     if(!digest || !szh || !szh->items)
-	return CL_CLEAN;
-
-    keylen = hashlen[type];
+	return -1;
 
     l = 0;
     r = szh->items - 1;
@@ -254,6 +404,75 @@ static int hm_scan(const unsigned char *digest, const char **virname, const stru
 	} else if(res > 0)
 	    l = c + 1;
 	else {
+	    while(c && !hm_cmp(digest, &szh->hash_array[keylen * (c - 1)], keylen))
+		c--;
+	    return c;
+	}
+    }
+    return -1;
+}
+
+/* Returns the set with the hashes for the size (0: the wildcard ones) and
+ * the index of the first entry for the digest in *first, or NULL */
+static const struct cli_sz_hash *hm_lookup(const struct cli_matcher *root, enum CLI_HASH_TYPE type, uint32_t size, const unsigned char *digest, long *first) {
+    const struct cli_hm_index *index = root->hm.index[type];
+    const struct cli_htu32_element *item;
+    const struct cli_sz_hash *szh;
+    unsigned int keylen = hashlen[type];
+    uint32_t pos, start, end, set, idx, nslots;
+    uint16_t fp;
+    uint64_t h;
+
+    if(index) {
+	h = hm_key(digest, size);
+	fp = hm_fingerprint(h);
+	nslots = index->nbuckets * CLI_HM_BUCKET;
+	pos = start = hm_bucket(h, index->nbuckets) * CLI_HM_BUCKET;
+	/* nothing is removed, so the digest isn't past a bucket with room */
+	do {
+	    for(end = pos + CLI_HM_BUCKET; pos < end; pos++) {
+		if(!index->fps[pos])
+		    return NULL;
+		if(index->fps[pos] != fp)
+		    continue;
+		set = hm_refset(index, index->refs[pos]);
+		idx = index->refs[pos] - index->bases[set];
+		szh = index->sets[set];
+		if(index->sizes[set] == size && !memcmp(digest, &szh->hash_array[keylen * idx], keylen)) {
+		    *first = idx;
+		    return szh;
+		}
+	    }
+	    if(pos == nslots)
+		pos = 0;
+	} while(pos != start);
+	return NULL;
+    }
+
+    /* hashes added since the last hm_flush() */
+    if(size) {
+	if(!root->hm.sizehashes[type].capacity || !(item = cli_htu32_find(&root->hm.sizehashes[type], size)))
+	    return NULL;
+	szh = (const struct cli_sz_hash *)item->data.as_ptr;
+    } else {
+	szh = &root->hwild.hashes[type];
+    }
+    if((*first = hm_find(digest, szh, keylen)) < 0)
+	return NULL;
+    return szh;
+}
+
+static int hm_scan(const unsigned char *digest, const char **virname, const struct cli_matcher *root, enum CLI_HASH_TYPE type, uint32_t size) {
+    const struct cli_sz_hash *szh;
+    unsigned int keylen = hashlen[type];
+    long c;
+
+    if(!(szh = hm_lookup(root, type, size, digest, &c)))
+	return CL_CLEAN;
+
+    /* entries removed by cl_engine_update() have no name */
+    for(; (size_t) c < szh->items && !hm_cmp(digest, &szh->hash_array[keylen * c], keylen); c++) {
+	if(szh->virusnames[c]) {
 	    if(virname)
 		*virname = szh->virusnames[c];
 	    return CL_VIRUS;
@@ -262,21 +481,52 @@ static int hm_scan(const unsigned char *digest, const char **virname, const stru
     return CL_CLEAN;
 }
 
+/* Removes the entries for the hash, returns how many there were. The
+ * virus names stay allocated, a scan may still be using them */
+unsigned int hm_tombstone_str(struct cli_matcher *root, const char *strhash, uint32_t size) {
+    const struct cli_sz_hash *szh;
+    enum CLI_HASH_TYPE type;
+    char binhash[CLI_HASHLEN_MAX];
+    unsigned int keylen, marked = 0;
+    long c;
+
+    if(!root || !strhash)
+	return 0;
+
+    switch(strlen(strhash)) {
+    case 32:
+	type = CLI_HASH_MD5;
+	break;
+    case 40:
+	type = CLI_HASH_SHA1;
+	break;
+    case 64:
+	type = CLI_HASH_SHA256;
+	break;
+    default:
+	return 0;
+    }
+    keylen = hashlen[type];
+    if(cli_hex2str_to(strhash, binhash, keylen * 2))
+	return 0;
+
+    if(!(szh = hm_lookup(root, type, size, (const unsigned char *)binhash, &c)))
+	return 0;
+    for(; (size_t) c < szh->items && !hm_cmp((const uint8_t *)binhash, &szh->hash_array[keylen * c], keylen); c++) {
+	if(szh->virusnames[c]) {
+	    szh->virusnames[c] = NULL;
+	    marked++;
+	}
+    }
+    return marked;
+}
+
 /* cli_hm_scan will scan only size-specific hashes, if any */
 int cli_hm_scan(const unsigned char *digest, uint32_t size, const char **virname, const struct cli_matcher *root, enum CLI_HASH_TYPE type) {
-    const struct cli_htu32_element *item;
-    struct cli_sz_hash *szh;
-
     if(!digest || !size || size == 0xffffffff || !root || !root->hm.sizehashes[type].capacity)
 	return CL_CLEAN;
 
-    item = cli_htu32_find(&root->hm.sizehashes[type], size);
-    if(!item)
-	return CL_CLEAN;
-
-    szh = (struct cli_sz_hash *)item->data.as_ptr;
-
-    return hm_scan(digest, virname, szh, type);
+    return hm_scan(digest, virname, root, type, size);
 }
 
 /* cli_hm_scan_wild will scan only size-agnostic hashes, if any */
@@ -284,7 +534,7 @@ int cli_hm_scan_wild(const unsigned char *digest, const char **virname, const st
     if(!digest || !root || !root->hwild.hashes[type].items)
 	return CL_CLEAN;
 
-    return hm_scan(digest, virname, &root->hwild.hashes[type], type);
+    return hm_scan(digest, virname, root, type, 0);
 }
 
 /* free both size-specific and agnostic hash sets */
@@ -298,15 +548,18 @@ void hm_free(struct cli_matcher *root) {
 	struct cli_htu32 *ht = &root->hm.sizehashes[type];
 	const struct cli_htu32_element *item = NULL;
 
+	hm_index_free(root, type);
 	if(!root->hm.sizehashes[type].capacity)
 	    continue;
 
 	while((item = cli_htu32_next(ht, item))) {
 	    struct cli_sz_hash *szh = (struct cli_sz_hash *)item->data.as_ptr;
 
-	    mpool_free(root->mempool, szh->hash_array);
-	    while(szh->items)
-		mpool_free(root->mempool, (void *)szh->virusnames[--szh->items]);
+	    if(!root->snapshot) {
+		mpool_free(root->mempool, szh->hash_array);
+		while(szh->items)
+		    mpool_free(root->mempool, (void *)szh->virusnames[--szh->items]);
+	    }
 	    mpool_free(root->mempool, szh->virusnames);
 	    mpool_free(root->mempool, szh);
 	}
@@ -319,10 +572,104 @@ void hm_free(struct cli_matcher *root) {
 	if(!szh->items)
 	    continue;
 
-	mpool_free(root->mempool, szh->hash_array);
-	while(szh->items)
-	    mpool_free(root->mempool, (void *)szh->virusnames[--szh->items]);
+	if(!root->snapshot) {
+	    mpool_free(root->mempool, szh->hash_array);
+	    while(szh->items)
+		mpool_free(root->mempool, (void *)szh->virusnames[--szh->items]);
+	}
 	mpool_free(root->mempool, szh->virusnames);
     }
 }
 
+void cli_multihash_init(struct cli_multihash *mh, unsigned int want) {
+    mh->want = want;
+    if(want & CLI_DIGEST(CLI_HASH_MD5))
+	cli_md5_init(&mh->md5);
+    if(want & CLI_DIGEST(CLI_HASH_SHA1))
+	SHA1Init(&mh->sha1);
+    if(want & CLI_DIGEST(CLI_HASH_SHA256))
+	sha256_init(&mh->sha256);
+}
+
+void cli_multihash_update(struct cli_multihash *mh, const void *data, size_t len) {
+    const unsigned char *pt = data;
+    size_t slice;
+
+    while(len) {
+	slice = MIN(len, CLI_MULTIHASH_SLICE);
+	if(mh->want & CLI_DIGEST(CLI_HASH_MD5))
+	    cli_md5_update(&mh->md5, pt, slice);
+	if(mh->want & CLI_DIGEST(CLI_HASH_SHA1))
+	    SHA1Update(&mh->sha1, pt, slice);
+	if(mh->want & CLI_DIGEST(CLI_HASH_SHA256))
+	    sha256_update(&mh->sha256, pt, slice);
+	pt += slice;
+	len -= slice;
+    }
+}
+
+void cli_multihash_final(struct cli_multihash *mh, struct cli_digests *digests) {
+    if(mh->want & CLI_DIGEST(CLI_HASH_MD5)) {
+	cli_md5_final(digests->digest[CLI_HASH_MD5], &mh->md5);
+	digests->have[CLI_HASH_MD5] = 1;
+    }
+    if(mh->want & CLI_DIGEST(CLI_HASH_SHA1)) {
+	SHA1Final(&mh->sha1, digests->digest[CLI_HASH_SHA1]);
+	digests->have[CLI_HASH_SHA1] = 1;
+    }
+    if(mh->want & CLI_DIGEST(CLI_HASH_SHA256)) {
+	sha256_final(&mh->sha256, digests->digest[CLI_HASH_SHA256]);
+	digests->have[CLI_HASH_SHA256] = 1;
+    }
+}
+
+/* Adds the wanted digests of the first len bytes of map, those already
+ * computed are skipped */
+int cli_multihash_map(fmap_t *map, size_t len, unsigned int want, struct cli_digests *digests) {
+    struct cli_multihash mh;
+    const void *buf;
+    size_t at = 0, readme;
+    enum CLI_HASH_TYPE type;
+
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++)
+	if(digests->have[type])
+	    want &= ~CLI_DIGEST(type);
+    if(!want)
+	return CL_SUCCESS;
+
+    cli_multihash_init(&mh, want);
+    while(at < len) {
+	readme = MIN(len - at, FILEBUFF);
+	if(!(buf = fmap_need_off_once(map, at, readme)))
+	    return CL_EREAD;
+	cli_multihash_update(&mh, buf, readme);
+	at += readme;
+    }
+    cli_multihash_final(&mh, digests);
+    return CL_SUCCESS;
+}
+
+static unsigned int hm_digests(const struct cli_matcher *hdb, const struct cli_matcher *fp, uint32_t size) {
+    unsigned int want = 0;
+
+    if(!hdb)
+	return 0;
+    if(cli_hm_have_size(hdb, CLI_HASH_MD5, size) || cli_hm_have_size(fp, CLI_HASH_MD5, size))
+	want |= CLI_DIGEST(CLI_HASH_MD5);
+    if(cli_hm_have_size(hdb, CLI_HASH_SHA1, size) || cli_hm_have_wild(hdb, CLI_HASH_SHA1)
+       || cli_hm_have_size(fp, CLI_HASH_SHA1, size) || cli_hm_have_wild(fp, CLI_HASH_SHA1))
+	want |= CLI_DIGEST(CLI_HASH_SHA1);
+    if(cli_hm_have_size(hdb, CLI_HASH_SHA256, size) || cli_hm_have_wild(hdb, CLI_HASH_SHA256)
+       || cli_hm_have_size(fp, CLI_HASH_SHA256, size) || cli_hm_have_wild(fp, CLI_HASH_SHA256))
+	want |= CLI_DIGEST(CLI_HASH_SHA256);
+    return want;
+}
+
+/* The digests the hash signatures need for a file of this size */
+unsigned int cli_hm_digests(const cli_ctx *ctx, uint32_t size) {
+    unsigned int want = hm_digests(ctx->engine->hm_hdb, ctx->engine->hm_fp, size);
+
+    if(ctx->delta)
+	want |= hm_digests(ctx->delta->hm_hdb, ctx->delta->hm_fp, size);
+    return want;
+}
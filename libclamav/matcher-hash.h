@@ -27,6 +27,10 @@
 
 #include "cltypes.h"
 #include "hashtab.h"
+#include "fmap.h"
+#include "md5.h"
+#include "sha1.h"
+#include "sha256.h"
 
 enum CLI_HASH_TYPE {
     CLI_HASH_MD5 = 0,
@@ -48,8 +52,26 @@ struct cli_sz_hash {
     uint32_t items;
 };
 
+/* Built by hm_flush() over the size-specific and the wildcard (size 0)
+ * hashes of one type: a table of buckets of CLI_HM_BUCKET slots keyed on
+ * (size, digest), sized for about 85% of the slots in use. A slot is a
+ * 16-bit fingerprint plus the number of the entry over all the sets, so
+ * a miss usually costs one bucket of fingerprints and no digest */
+#define CLI_HM_BUCKET 8
+
+struct cli_hm_index {
+    uint32_t nbuckets;
+    uint16_t *fps;	/* 0: free slot */
+    uint32_t *refs;	/* bases[set] + the first entry for the digest */
+    const struct cli_sz_hash **sets;
+    uint32_t *sizes;
+    uint32_t *bases;	/* nsets + 1 */
+    uint32_t nsets;
+};
+
 struct cli_hash_patt {
     struct cli_htu32 sizehashes[CLI_HASH_AVAIL_TYPES];
+    struct cli_hm_index *index[CLI_HASH_AVAIL_TYPES];
 };
 
 struct cli_hash_wild {
@@ -59,10 +81,38 @@ struct cli_hash_wild {
 int hm_addhash_str(struct cli_matcher *root, const char *strhash, uint32_t size, const char *virusname);
 int hm_addhash_bin(struct cli_matcher *root, const void *binhash, enum CLI_HASH_TYPE type, uint32_t size, const char *virusname);
 void hm_flush(struct cli_matcher *root);
+unsigned int hm_tombstone_str(struct cli_matcher *root, const char *strhash, uint32_t size);
 int cli_hm_scan(const unsigned char *digest, uint32_t size, const char **virname, const struct cli_matcher *root, enum CLI_HASH_TYPE type);
 int cli_hm_scan_wild(const unsigned char *digest, const char **virname, const struct cli_matcher *root, enum CLI_HASH_TYPE type);
 int cli_hm_have_size(const struct cli_matcher *root, enum CLI_HASH_TYPE type, uint32_t size);
 int cli_hm_have_wild(const struct cli_matcher *root, enum CLI_HASH_TYPE type);
+int cli_hm_have_any(const struct cli_matcher *root, enum CLI_HASH_TYPE type);
 void hm_free(struct cli_matcher *root);
 
+/* The digests of a file; cache_check() computes the MD5 for the cache key,
+ * the scan pass adds the others the hash signatures need */
+struct cli_digests {
+    unsigned char digest[CLI_HASH_AVAIL_TYPES][CLI_HASHLEN_MAX];
+    uint8_t have[CLI_HASH_AVAIL_TYPES];
+};
+
+#define CLI_DIGEST(t) (1 << (t))
+
+/* Several digests in one pass: the data is fed to each of them in slices
+ * small enough to stay in the L1 cache */
+struct cli_multihash {
+    unsigned int want;
+    cli_md5_ctx md5;
+    SHA1Context sha1;
+    SHA256_CTX sha256;
+};
+
+#define CLI_MULTIHASH_SLICE 4096
+
+void cli_multihash_init(struct cli_multihash *mh, unsigned int want);
+void cli_multihash_update(struct cli_multihash *mh, const void *data, size_t len);
+void cli_multihash_final(struct cli_multihash *mh, struct cli_digests *digests);
+int cli_multihash_map(fmap_t *map, size_t len, unsigned int want, struct cli_digests *digests);
+unsigned int cli_hm_digests(const struct cli_ctx_tag *ctx, uint32_t size);
+
 #endif
@@ -26,6 +26,7 @@
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #ifdef	HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -53,6 +54,7 @@
 #include "regex/regex.h"
 #include "filtering.h"
 #include "perflogging.h"
+#include "sigstats.h"
 #include "bytecode_priv.h"
 #include "bytecode_api_impl.h"
 #include "sha256.h"
@@ -136,13 +138,14 @@ static inline int matcher_run(const struct cli_matcher *root,
 	    ret = cli_bm_scanbuff(buffer, length, virname, NULL, root, offset, tinfo, offdata, viroffset);
 	}
 	if (ret == CL_VIRUS) {
-	    if (ctx) {
-		cli_append_virus(ctx, *virname);
-		if (SCAN_ALL)
-		    viruses_found++;
-		else
-		    return ret;
-	    }
+	    /* without ctx the caller takes care of the name */
+	    if (!ctx)
+		return ret;
+	    cli_append_virus(ctx, *virname);
+	    if (SCAN_ALL)
+		viruses_found++;
+	    else
+		return ret;
 	}
     }
     PERF_LOG_TRIES(acmode, 0, length);
@@ -156,6 +159,98 @@ static inline int matcher_run(const struct cli_matcher *root,
     return ret;
 }
 
+/* Same as matcher_run() for troot followed by groot, but with the AC part
+ * done in a single pass over troot->ac_fused. The BM tables are kept per root.
+ */
+static inline int matcher_run_fused(const struct cli_matcher *troot,
+				    const struct cli_matcher *groot,
+				    const unsigned char *buffer, uint32_t length,
+				    const char **virname,
+				    struct cli_ac_data *tdata,
+				    struct cli_ac_data *gdata,
+				    uint32_t offset,
+				    const struct cli_target_info *tinfo,
+				    cli_file_t ftype,
+				    struct cli_matched_type **ftoffset,
+				    unsigned int acmode,
+				    struct cli_ac_result **acres,
+				    struct cli_bm_off *offdata,
+				    uint32_t *viroffset,
+				    cli_ctx *ctx)
+{
+    int ret;
+    int32_t pos = 0;
+    struct filter_match_info info;
+    const struct cli_matcher *fused = troot->ac_fused;
+    uint32_t orig_length, orig_offset;
+    const unsigned char* orig_buffer;
+    unsigned int viruses_found = 0;
+
+    if (fused->filter) {
+	if(filter_search_ext(fused->filter, buffer, length, &info) == -1) {
+	    pos = length - fused->maxpatlen - 1;
+	    if (pos < 0) pos = 0;
+	    PERF_LOG_FILTER(pos, length, fused->type);
+	} else {
+	    pos = info.first_match - fused->maxpatlen - 1;
+	    if (pos < 0) pos = 0;
+	    PERF_LOG_FILTER(pos, length, fused->type);
+	}
+    } else {
+	PERF_LOG_FILTER(0, length, fused->type);
+    }
+
+    orig_length = length;
+    orig_buffer = buffer;
+    orig_offset = offset;
+    length -= pos;
+    buffer += pos;
+    offset += pos;
+    if (!troot->ac_only) {
+	PERF_LOG_TRIES(0, 1, length);
+	/* matcher_run() for troot discards the BM virus offset */
+	if (troot->bm_offmode)
+	    ret = cli_bm_scanbuff(orig_buffer, orig_length, virname, NULL, troot, orig_offset, tinfo, offdata, NULL);
+	else
+	    ret = cli_bm_scanbuff(buffer, length, virname, NULL, troot, offset, tinfo, NULL, NULL);
+	if (ret == CL_VIRUS) {
+	    cli_append_virus(ctx, *virname);
+	    if (SCAN_ALL)
+		viruses_found++;
+	    else
+		return ret;
+	}
+    }
+    PERF_LOG_TRIES(acmode, 0, length);
+    ret = cli_ac_scanbuff_fused(buffer, length, virname, NULL, acres, troot, tdata, groot, gdata, offset, ftype, ftoffset, acmode, ctx);
+    if (ret == CL_VIRUS) {
+	if (!SCAN_ALL) {
+	    cli_append_virus(ctx, *virname);
+	    return ret;
+	}
+	viruses_found++;
+    } else if (ret == CL_EMEM) {
+	return ret;
+    }
+    if (!groot->ac_only) {
+	int bmret;
+
+	PERF_LOG_TRIES(0, 1, length);
+	bmret = cli_bm_scanbuff(buffer, length, virname, NULL, groot, offset, tinfo, NULL, viroffset);
+	if (bmret == CL_VIRUS) {
+	    cli_append_virus(ctx, *virname);
+	    if (!SCAN_ALL)
+		return bmret;
+	    viruses_found++;
+	}
+    }
+
+    if (SCAN_ALL && viruses_found)
+	return CL_VIRUS;
+
+    return ret;
+}
+
 int cli_scanbuff(const unsigned char *buffer, uint32_t length, uint32_t offset, cli_ctx *ctx, cli_file_t ftype, struct cli_ac_data **acdata)
 {
 	int ret = CL_CLEAN;
@@ -402,6 +497,13 @@ void cli_targetinfo(struct cli_target_info *info, unsigned int target, fmap_t *m
     info->fsize = map->len;
     cli_hashset_init_noalloc(&info->exeinfo.vinfo);
 
+    if((uint64_t) map->len >= CLI_OFF_NONE) {
+	/* the relative offsets wouldn't fit the 32 bit offsets of the
+	 * matchers, see scan_offset() */
+	info->status = -1;
+	return;
+    }
+
     if(target == 1)
 	einfo = cli_peheader;
     else if(target == 6)
@@ -416,24 +518,74 @@ void cli_targetinfo(struct cli_target_info *info, unsigned int target, fmap_t *m
 	info->status = 1;
 }
 
-int cli_checkfp(unsigned char *digest, size_t size, cli_ctx *ctx)
+/* The false positive hashes added with cl_engine_update() live in the delta
+ * engine and apply to the matches of both engines */
+static int fp_scan(cli_ctx *ctx, const unsigned char *digest, uint32_t size, const char **virname, enum CLI_HASH_TYPE type)
+{
+    if(cli_hm_scan(digest, size, virname, ctx->engine->hm_fp, type) == CL_VIRUS)
+	return CL_VIRUS;
+    return ctx->delta ? cli_hm_scan(digest, size, virname, ctx->delta->hm_fp, type) : CL_CLEAN;
+}
+
+static int fp_scan_wild(cli_ctx *ctx, const unsigned char *digest, const char **virname, enum CLI_HASH_TYPE type)
+{
+    if(cli_hm_scan_wild(digest, virname, ctx->engine->hm_fp, type) == CL_VIRUS)
+	return CL_VIRUS;
+    return ctx->delta ? cli_hm_scan_wild(digest, virname, ctx->delta->hm_fp, type) : CL_CLEAN;
+}
+
+static int fp_have_size(cli_ctx *ctx, enum CLI_HASH_TYPE type, uint32_t size)
+{
+    return cli_hm_have_size(ctx->engine->hm_fp, type, size) || (ctx->delta && cli_hm_have_size(ctx->delta->hm_fp, type, size));
+}
+
+static int fp_have_wild(cli_ctx *ctx, enum CLI_HASH_TYPE type)
+{
+    return cli_hm_have_wild(ctx->engine->hm_fp, type) || (ctx->delta && cli_hm_have_wild(ctx->delta->hm_fp, type));
+}
+
+int cli_checkfp(struct cli_digests *digests, size_t size, cli_ctx *ctx)
 {
 	char md5[33];
-	unsigned int i;
+	unsigned int i, want;
 	const char *virname;
-        SHA1Context sha1;
-        SHA256_CTX sha256;
         fmap_t *map;
-        const char *ptr;
         uint8_t shash1[SHA1_HASH_SIZE*2+1];
         uint8_t shash256[SHA256_HASH_SIZE*2+1];
+	unsigned char *digest;
 	int have_sha1, have_sha256, do_dsig_check = 1;
 
-    if(cli_hm_scan(digest, size, &virname, ctx->engine->hm_fp, CLI_HASH_MD5) == CL_VIRUS) {
+    if(cli_get_last_virus(ctx))
+	do_dsig_check = strncmp("W32S.", cli_get_last_virus(ctx), 5);
+
+    /* whatever cache_check() or the scan didn't hash yet is done here,
+     * in a single pass over the file */
+    map = *ctx->fmap;
+    have_sha1 = fp_have_size(ctx, CLI_HASH_SHA1, size)
+	 || fp_have_wild(ctx, CLI_HASH_SHA1)
+	 || (fp_have_size(ctx, CLI_HASH_SHA1, 1) && do_dsig_check);
+    have_sha256 = fp_have_size(ctx, CLI_HASH_SHA256, size)
+	 || fp_have_wild(ctx, CLI_HASH_SHA256);
+    want = CLI_DIGEST(CLI_HASH_MD5);
+    if(have_sha1)
+	want |= CLI_DIGEST(CLI_HASH_SHA1);
+    if(have_sha256)
+	want |= CLI_DIGEST(CLI_HASH_SHA256);
+#ifdef HAVE__INTERNAL__SHA_COLLECT
+    if((ctx->options & CL_SCAN_INTERNAL_COLLECT_SHA) && ctx->sha_collect>0)
+	want |= CLI_DIGEST(CLI_HASH_SHA1) | CLI_DIGEST(CLI_HASH_SHA256);
+#endif
+    if(cli_multihash_map(map, size, want, digests) && !digests->have[CLI_HASH_MD5]) {
+	cli_errmsg("cli_checkfp: can't compute the MD5 of the file\n");
+	return CL_VIRUS;
+    }
+    digest = digests->digest[CLI_HASH_MD5];
+
+    if(fp_scan(ctx, digest, size, &virname, CLI_HASH_MD5) == CL_VIRUS) {
 	cli_dbgmsg("cli_checkfp(md5): Found false positive detection (fp sig: %s), size: %d\n", virname, (int)size);
 	return CL_CLEAN;
     }
-    else if(cli_hm_scan_wild(digest, &virname, ctx->engine->hm_fp, CLI_HASH_MD5) == CL_VIRUS) {
+    else if(fp_scan_wild(ctx, digest, &virname, CLI_HASH_MD5) == CL_VIRUS) {
 	cli_dbgmsg("cli_checkfp(md5): Found false positive detection (fp sig: %s), size: *\n", virname);
 	return CL_CLEAN;
     }
@@ -446,68 +598,40 @@ int cli_checkfp(unsigned char *digest, size_t size, cli_ctx *ctx)
 		   cli_get_last_virus(ctx) ? cli_get_last_virus(ctx) : "Name");
     }
 
-    if(cli_get_last_virus(ctx))
-	do_dsig_check = strncmp("W32S.", cli_get_last_virus(ctx), 5);
-
-    map = *ctx->fmap;
-    have_sha1 = cli_hm_have_size(ctx->engine->hm_fp, CLI_HASH_SHA1, size)
-	 || cli_hm_have_wild(ctx->engine->hm_fp, CLI_HASH_SHA1)
-	 || (cli_hm_have_size(ctx->engine->hm_fp, CLI_HASH_SHA1, 1) && do_dsig_check);
-    have_sha256 = cli_hm_have_size(ctx->engine->hm_fp, CLI_HASH_SHA256, size)
-	 || cli_hm_have_wild(ctx->engine->hm_fp, CLI_HASH_SHA256);
-    if(have_sha1 || have_sha256) {
-	if((ptr = fmap_need_off_once(map, 0, size))) {
-	    if(have_sha1) {
-		SHA1Init(&sha1);
-		SHA1Update(&sha1, ptr, size);
-		SHA1Final(&sha1, &shash1[SHA1_HASH_SIZE]);
-		if(cli_hm_scan(&shash1[SHA1_HASH_SIZE], size, &virname, ctx->engine->hm_fp, CLI_HASH_SHA1) == CL_VIRUS) {
-		    cli_dbgmsg("cli_checkfp(sha1): Found false positive detection (fp sig: %s)\n", virname);
-		    return CL_CLEAN;
-		}
-		if(cli_hm_scan_wild(&shash1[SHA1_HASH_SIZE], &virname, ctx->engine->hm_fp, CLI_HASH_SHA1) == CL_VIRUS) {
-		    cli_dbgmsg("cli_checkfp(sha1): Found false positive detection (fp sig: %s)\n", virname);
-		    return CL_CLEAN;
-		}
-		if(do_dsig_check && cli_hm_scan(&shash1[SHA1_HASH_SIZE], 1, &virname, ctx->engine->hm_fp, CLI_HASH_SHA1) == CL_VIRUS) {
-		    cli_dbgmsg("cli_checkfp(sha1): Found false positive detection via catalog file\n");
-		    return CL_CLEAN;
-		}
-	    }
-	    if(have_sha256) {
-		sha256_init(&sha256);
-		sha256_update(&sha256, ptr, size);
-		sha256_final(&sha256, &shash256[SHA256_HASH_SIZE]);
-		if(cli_hm_scan(&shash256[SHA256_HASH_SIZE], size, &virname, ctx->engine->hm_fp, CLI_HASH_SHA256) == CL_VIRUS) {
-		    cli_dbgmsg("cli_checkfp(sha256): Found false positive detection (fp sig: %s)\n", virname);
-		    return CL_CLEAN;
-		}
-		if(cli_hm_scan_wild(&shash256[SHA256_HASH_SIZE], &virname, ctx->engine->hm_fp, CLI_HASH_SHA256) == CL_VIRUS) {
-		    cli_dbgmsg("cli_checkfp(sha256): Found false positive detection (fp sig: %s)\n", virname);
-		    return CL_CLEAN;
-		}
-	    }
+    if(have_sha1 && digests->have[CLI_HASH_SHA1]) {
+	memcpy(&shash1[SHA1_HASH_SIZE], digests->digest[CLI_HASH_SHA1], SHA1_HASH_SIZE);
+	if(fp_scan(ctx, &shash1[SHA1_HASH_SIZE], size, &virname, CLI_HASH_SHA1) == CL_VIRUS) {
+	    cli_dbgmsg("cli_checkfp(sha1): Found false positive detection (fp sig: %s)\n", virname);
+	    return CL_CLEAN;
+	}
+	if(fp_scan_wild(ctx, &shash1[SHA1_HASH_SIZE], &virname, CLI_HASH_SHA1) == CL_VIRUS) {
+	    cli_dbgmsg("cli_checkfp(sha1): Found false positive detection (fp sig: %s)\n", virname);
+	    return CL_CLEAN;
+	}
+	if(do_dsig_check && fp_scan(ctx, &shash1[SHA1_HASH_SIZE], 1, &virname, CLI_HASH_SHA1) == CL_VIRUS) {
+	    cli_dbgmsg("cli_checkfp(sha1): Found false positive detection via catalog file\n");
+	    return CL_CLEAN;
+	}
+    }
+    if(have_sha256 && digests->have[CLI_HASH_SHA256]) {
+	memcpy(&shash256[SHA256_HASH_SIZE], digests->digest[CLI_HASH_SHA256], SHA256_HASH_SIZE);
+	if(fp_scan(ctx, &shash256[SHA256_HASH_SIZE], size, &virname, CLI_HASH_SHA256) == CL_VIRUS) {
+	    cli_dbgmsg("cli_checkfp(sha256): Found false positive detection (fp sig: %s)\n", virname);
+	    return CL_CLEAN;
+	}
+	if(fp_scan_wild(ctx, &shash256[SHA256_HASH_SIZE], &virname, CLI_HASH_SHA256) == CL_VIRUS) {
+	    cli_dbgmsg("cli_checkfp(sha256): Found false positive detection (fp sig: %s)\n", virname);
+	    return CL_CLEAN;
 	}
     }
 
 #ifdef HAVE__INTERNAL__SHA_COLLECT
     if((ctx->options & CL_SCAN_INTERNAL_COLLECT_SHA) && ctx->sha_collect>0) {
-        if((ptr = fmap_need_off_once(map, 0, size))) {
-	    if(!have_sha256) {
-		sha256_init(&sha256);
-		sha256_update(&sha256, ptr, size);
-		sha256_final(&sha256, &shash256[SHA256_HASH_SIZE]);
-	    }
+        if(digests->have[CLI_HASH_SHA1] && digests->have[CLI_HASH_SHA256]) {
             for(i=0; i<SHA256_HASH_SIZE; i++)
-                sprintf((char *)shash256+i*2, "%02x", shash256[SHA256_HASH_SIZE+i]);
-
-	    if(!have_sha1) {
-		SHA1Init(&sha1);
-		SHA1Update(&sha1, ptr, size);
-		SHA1Final(&sha1, &shash1[SHA1_HASH_SIZE]);
-	    }
+                sprintf((char *)shash256+i*2, "%02x", digests->digest[CLI_HASH_SHA256][i]);
             for(i=0; i<SHA1_HASH_SIZE; i++)
-                sprintf((char *)shash1+i*2, "%02x", shash1[SHA1_HASH_SIZE+i]);
+                sprintf((char *)shash1+i*2, "%02x", digests->digest[CLI_HASH_SHA1][i]);
 
 	    cli_errmsg("COLLECT:%s:%s:%u:%s:%s\n", shash256, shash1, size, cli_get_last_virus(ctx), ctx->entry_filename);
         } else
@@ -522,7 +646,7 @@ int cli_checkfp(unsigned char *digest, size_t size, cli_ctx *ctx)
 	    cli_dbgmsg("cli_checkfp(pe): PE file whitelisted due to valid embedded digital signature\n");
 	    return CL_CLEAN;
 	case CL_VIRUS:
-	    if(cli_hm_scan(shash1, 2, &virname, ctx->engine->hm_fp, CLI_HASH_SHA1) == CL_VIRUS) {
+	    if(fp_scan(ctx, shash1, 2, &virname, CLI_HASH_SHA1) == CL_VIRUS) {
 		cli_dbgmsg("cli_checkfp(pe): PE file whitelisted by catalog file\n");
 		return CL_CLEAN;
 	    }
@@ -609,104 +733,259 @@ int cli_scandesc(int desc, cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struc
     return ret;
 }
 
-int cli_lsig_eval(cli_ctx *ctx, struct cli_matcher *root, struct cli_ac_data *acdata, struct cli_target_info *target_info, const char *hash)
+static int lsigid_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Returns the next lsig to evaluate, or root->ac_lsigs when done. With the
+ * expressions compiled, these are the lsigs with a subsignature hit merged
+ * with those that can match without one, in table order. */
+static inline uint32_t lsig_next(const struct cli_matcher *root, const struct cli_ac_data *acdata, unsigned int *d, unsigned int *a)
+{
+	uint32_t id;
+
+    if(!root->ac_lsigcompiled)
+	return (*d)++;
+
+    if(*d < acdata->nlsigdirty) {
+	id = acdata->lsigdirty[*d];
+	if(*a < root->ac_lsigalways_num && root->ac_lsigalways[*a] <= id) {
+	    if(root->ac_lsigalways[*a] == id)
+		(*d)++;
+	    return root->ac_lsigalways[(*a)++];
+	}
+	(*d)++;
+	return id;
+    }
+    if(*a < root->ac_lsigalways_num)
+	return root->ac_lsigalways[(*a)++];
+    return root->ac_lsigs;
+}
+
+/* Evaluates the logical signature i, returns CL_VIRUS when it matched */
+static int lsig_eval(cli_ctx *ctx, struct cli_matcher *root, struct cli_ac_data *acdata, struct cli_target_info *target_info, const char *hash, unsigned int i)
 {
-	unsigned int i, evalcnt;
-	uint64_t evalids;
+	unsigned int evalcnt = 0;
+	uint64_t evalids = 0;
 	fmap_t *map = *ctx->fmap;
-	unsigned int viruses_found = 0;
+	const struct cli_ac_lsig *lsig = root->ac_lsigtable[i];
 
-    for(i = 0; i < root->ac_lsigs; i++) {
-	evalcnt = 0;
-	evalids = 0;
-	cli_ac_chkmacro(root, acdata, i);
-	if(cli_ac_chklsig(root->ac_lsigtable[i]->logic, root->ac_lsigtable[i]->logic + strlen(root->ac_lsigtable[i]->logic), acdata->lsigcnt[i], &evalcnt, &evalids, 0) == 1) {
-	    if(root->ac_lsigtable[i]->tdb.container && root->ac_lsigtable[i]->tdb.container[0] != ctx->container_type)
-		continue;
-	    if(root->ac_lsigtable[i]->tdb.filesize && (root->ac_lsigtable[i]->tdb.filesize[0] > map->len || root->ac_lsigtable[i]->tdb.filesize[1] < map->len))
-		continue;
+    if(!(lsig->ops ? cli_ac_lsigeval(lsig->ops, lsig->nops, cli_ac_lsigcnt(acdata, i)) == 1 : cli_ac_chklsig(lsig->logic, lsig->logic + strlen(lsig->logic), cli_ac_lsigcnt(acdata, i), &evalcnt, &evalids, 0) == 1))
+	return CL_CLEAN;
 
-	    if(root->ac_lsigtable[i]->tdb.ep || root->ac_lsigtable[i]->tdb.nos) {
-		if(!target_info || target_info->status != 1)
-		    continue;
-		if(root->ac_lsigtable[i]->tdb.ep && (root->ac_lsigtable[i]->tdb.ep[0] > target_info->exeinfo.ep || root->ac_lsigtable[i]->tdb.ep[1] < target_info->exeinfo.ep))
-		    continue;
-		if(root->ac_lsigtable[i]->tdb.nos && (root->ac_lsigtable[i]->tdb.nos[0] > target_info->exeinfo.nsections || root->ac_lsigtable[i]->tdb.nos[1] < target_info->exeinfo.nsections))
-		    continue;
-	    }
+    if(lsig->tdb.container && lsig->tdb.container[0] != ctx->container_type)
+	return CL_CLEAN;
+    if(lsig->tdb.filesize && (lsig->tdb.filesize[0] > map->len || lsig->tdb.filesize[1] < map->len))
+	return CL_CLEAN;
 
-	    if(hash && root->ac_lsigtable[i]->tdb.handlertype) {
-		if(memcmp(ctx->handlertype_hash, hash, 16)) {
-		    ctx->recursion++;
-		    memcpy(ctx->handlertype_hash, hash, 16);
-		    if(cli_magic_scandesc_type(ctx, root->ac_lsigtable[i]->tdb.handlertype[0]) == CL_VIRUS) {
-			ctx->recursion--;
-			if (SCAN_ALL) {
-			    viruses_found++;
-			    continue;
-			}
-			return CL_VIRUS;
-		    }
-		    ctx->recursion--;
-		    continue;
-		}
-	    }
+    if(lsig->tdb.ep || lsig->tdb.nos) {
+	if(!target_info || target_info->status != 1)
+	    return CL_CLEAN;
+	if(lsig->tdb.ep && (lsig->tdb.ep[0] > target_info->exeinfo.ep || lsig->tdb.ep[1] < target_info->exeinfo.ep))
+	    return CL_CLEAN;
+	if(lsig->tdb.nos && (lsig->tdb.nos[0] > target_info->exeinfo.nsections || lsig->tdb.nos[1] < target_info->exeinfo.nsections))
+	    return CL_CLEAN;
+    }
 
-	    if(root->ac_lsigtable[i]->tdb.icongrp1 || root->ac_lsigtable[i]->tdb.icongrp2) {
-		if(!target_info || target_info->status != 1)
-		    continue;
-		if(matchicon(ctx, &target_info->exeinfo, root->ac_lsigtable[i]->tdb.icongrp1, root->ac_lsigtable[i]->tdb.icongrp2) == CL_VIRUS) {
-		    if(!root->ac_lsigtable[i]->bc_idx) {
-			cli_append_virus(ctx, root->ac_lsigtable[i]->virname);
-			if (SCAN_ALL) {
-                            viruses_found++;
-                            continue;
-                        }
-			return CL_VIRUS;
-		    } else if(cli_bytecode_runlsig(ctx, target_info, &ctx->engine->bcs, root->ac_lsigtable[i]->bc_idx, acdata->lsigcnt[i], acdata->lsigsuboff_first[i], map) == CL_VIRUS) {
-			if (SCAN_ALL) {
-                            viruses_found++;
-                            continue;
-                        }
-			return CL_VIRUS;
-		    }
-		}
-		continue;
-	    }
-	    if(!root->ac_lsigtable[i]->bc_idx) {
-		cli_append_virus(ctx, root->ac_lsigtable[i]->virname);
-		if (SCAN_ALL) {
-		    viruses_found++;
-		    continue;
-		}
- 		return CL_VIRUS;
+    if(hash && lsig->tdb.handlertype) {
+	if(memcmp(ctx->handlertype_hash, hash, 16)) {
+	    ctx->recursion++;
+	    memcpy(ctx->handlertype_hash, hash, 16);
+	    if(cli_magic_scandesc_type(ctx, lsig->tdb.handlertype[0]) == CL_VIRUS) {
+		ctx->recursion--;
+		return CL_VIRUS;
 	    }
-	    if(cli_bytecode_runlsig(ctx, target_info, &ctx->engine->bcs, root->ac_lsigtable[i]->bc_idx, acdata->lsigcnt[i], acdata->lsigsuboff_first[i], map) == CL_VIRUS) {
-		if (SCAN_ALL) {
-		    viruses_found++;
-		    continue;
-		}
- 		return CL_VIRUS;
+	    ctx->recursion--;
+	    return CL_CLEAN;
+	}
+    }
+
+    if(lsig->tdb.icongrp1 || lsig->tdb.icongrp2) {
+	if(!target_info || target_info->status != 1)
+	    return CL_CLEAN;
+	if(matchicon(ctx, &target_info->exeinfo, lsig->tdb.icongrp1, lsig->tdb.icongrp2) == CL_VIRUS) {
+	    if(!lsig->bc_idx) {
+		cli_append_virus(ctx, lsig->virname);
+		return CL_VIRUS;
+	    } else if(cli_bytecode_runlsig(ctx, target_info, &ctx->engine->bcs, lsig->bc_idx, cli_ac_lsigcnt(acdata, i), cli_ac_lsigsuboff(acdata, i), map) == CL_VIRUS) {
+		return CL_VIRUS;
 	    }
 	}
+	return CL_CLEAN;
+    }
+    if(!lsig->bc_idx) {
+	cli_append_virus(ctx, lsig->virname);
+	return CL_VIRUS;
+    }
+    if(cli_bytecode_runlsig(ctx, target_info, &ctx->engine->bcs, lsig->bc_idx, cli_ac_lsigcnt(acdata, i), cli_ac_lsigsuboff(acdata, i), map) == CL_VIRUS)
+	return CL_VIRUS;
+    return CL_CLEAN;
+}
+
+int cli_lsig_eval(cli_ctx *ctx, struct cli_matcher *root, struct cli_ac_data *acdata, struct cli_target_info *target_info, const char *hash)
+{
+	unsigned int i, d, a;
+	unsigned int viruses_found = 0;
+	const struct cli_ac_lsig *lsig;
+	struct timeval tv0, tv1;
+	int ret;
+
+    if(root->ac_lsigcompiled && acdata->nlsigdirty > 1)
+	qsort(acdata->lsigdirty, acdata->nlsigdirty, sizeof(uint32_t), lsigid_cmp);
+
+    for(d = a = 0; (i = lsig_next(root, acdata, &d, &a)) < root->ac_lsigs; ) {
+	cli_ac_chkmacro(root, acdata, i);
+	lsig = root->ac_lsigtable[i];
+	if(lsig->tombstone)
+	    continue;
+	if(UNLIKELY(lsig->perfid)) {
+	    gettimeofday(&tv0, NULL);
+	    ret = lsig_eval(ctx, root, acdata, target_info, hash, i);
+	    gettimeofday(&tv1, NULL);
+	    SIGSTAT_INC(root->sigstats, lsig->perfid, verifies);
+	    SIGSTAT_ADD(root->sigstats->stats[lsig->perfid - 1].usecs, (tv1.tv_sec - tv0.tv_sec) * 1000000 + tv1.tv_usec - tv0.tv_usec);
+	    if(ret == CL_VIRUS)
+		SIGSTAT_INC(root->sigstats, lsig->perfid, hits);
+	} else {
+	    ret = lsig_eval(ctx, root, acdata, target_info, hash, i);
+	}
+	if(ret == CL_VIRUS) {
+	    if(!SCAN_ALL)
+		return CL_VIRUS;
+	    viruses_found++;
+	}
     }
     if (SCAN_ALL && viruses_found)
 	return CL_VIRUS;
     return CL_CLEAN;
 }
 
-int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli_matched_type **ftoffset, unsigned int acmode, struct cli_ac_result **acres, unsigned char *refhash)
+/* Returns in *data the match state for the root with index idx, taken from
+ * ctx->acslots when possible and otherwise set up in local */
+static int acdata_get(cli_ctx *ctx, unsigned int idx, const struct cli_matcher *root, struct cli_ac_data *local, struct cli_ac_data **data)
+{
+	struct cli_acdata_slot *slot;
+	int ret;
+
+    *data = NULL;
+    if(!ctx->acslots || idx >= CLI_MTARGETS || ctx->acslots[idx].busy) {
+	if((ret = cli_ac_initdata(local, root->ac_partsigs, root->ac_lsigs, root->ac_reloff_num, CLI_DEFAULT_AC_TRACKLEN)))
+	    return ret;
+	*data = local;
+	return CL_SUCCESS;
+    }
+
+    slot = &ctx->acslots[idx];
+    if(slot->ready) {
+	cli_ac_resetdata(&slot->data);
+    } else {
+	if((ret = cli_ac_initdata(&slot->data, root->ac_partsigs, root->ac_lsigs, root->ac_reloff_num, CLI_DEFAULT_AC_TRACKLEN)))
+	    return ret;
+	slot->ready = 1;
+    }
+    slot->busy = 1;
+    *data = &slot->data;
+    return CL_SUCCESS;
+}
+
+static void acdata_put(cli_ctx *ctx, struct cli_ac_data *data)
+{
+	unsigned int i;
+
+    if(ctx->acslots) {
+	for(i = 0; i < CLI_MTARGETS; i++) {
+	    if(data == &ctx->acslots[i].data) {
+		ctx->acslots[i].busy = 0;
+		return;
+	    }
+	}
+    }
+    cli_ac_freedata(data);
+}
+
+void cli_acdata_slots_free(struct cli_acdata_slot *slots)
+{
+	unsigned int i;
+
+    for(i = 0; i < CLI_MTARGETS; i++) {
+	if(slots[i].ready)
+	    cli_ac_freedata(&slots[i].data);
+	slots[i].ready = slots[i].busy = 0;
+    }
+}
+
+/* The matchers work with 32 bit offsets. In files of 4 GB or more the data
+ * past 2 GB is given offsets folded into [2 GB, 3 GB): out of the reach of
+ * the absolute offsets (cli_caloff() reads them as int) while the distances
+ * between the parts of a signature hold within each gigabyte. The relative
+ * offsets are off for these files (cli_targetinfo()). Where the offsets wrap
+ * around the partial matches are dropped (scan_offset_wrap()), and what the
+ * matchers report is moved back to the offsets in the file
+ * (scan_offset_unfold()). */
+#define SCAN_OFF_FOLD 0x80000000UL
+#define SCAN_OFF_PERIOD 0x40000000UL
+
+static inline uint32_t scan_offset(const fmap_t *map, size_t offset)
+{
+    if((uint64_t) map->len < CLI_OFF_NONE || offset < SCAN_OFF_FOLD)
+	return offset;
+    return SCAN_OFF_FOLD + (offset - SCAN_OFF_FOLD) % SCAN_OFF_PERIOD;
+}
+
+/* The lsigs are evaluated on what matched before the wrap and the match
+ * state is reset, so that no signature pairs parts a multiple of
+ * SCAN_OFF_PERIOD apart. The parts of a signature on both sides of a wrap
+ * are missed. BM needs nothing, cli_bm_scanbuff() walks back through its
+ * offset table by itself */
+static int scan_offset_wrap(cli_ctx *ctx, struct cli_matcher *troot, struct cli_ac_data *tdata, struct cli_matcher *groot, struct cli_ac_data *gdata, struct cli_target_info *info, uint32_t *viruses_found)
+{
+	struct cli_matcher *root[2] = { troot, groot };
+	struct cli_ac_data *data[2] = { tdata, gdata };
+	unsigned int i;
+
+    for(i = 0; i < 2; i++) {
+	if(!root[i])
+	    continue;
+	if(cli_lsig_eval(ctx, root[i], data[i], info, NULL) == CL_VIRUS) {
+	    if(!SCAN_ALL)
+		return CL_VIRUS;
+	    *viruses_found = 1;
+	}
+	cli_ac_resetdata(data[i]);
+	cli_ac_caloff(root[i], data[i], info);
+    }
+    return CL_CLEAN;
+}
+
+/* Adds fold to the offsets of the file types found after ftlast and of the
+ * AC results added before reshead, i.e. those of the last window */
+static void scan_offset_unfold(struct cli_matched_type **ftoffset, const struct cli_matched_type *ftlast, struct cli_ac_result **acres, const struct cli_ac_result *reshead, size_t fold)
+{
+	struct cli_matched_type *ft;
+	struct cli_ac_result *res;
+
+    if(ftoffset)
+	for(ft = ftlast ? ftlast->next : *ftoffset; ft; ft = ft->next)
+	    ft->offset += fold;
+    if(acres)
+	for(res = *acres; res != reshead; res = res->next)
+	    res->offset += fold;
+}
+
+static int fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli_matched_type **ftoffset, unsigned int acmode, struct cli_ac_result **acres, struct cli_digests *digests)
 {
 	const unsigned char *buff;
-	int ret = CL_CLEAN, type = CL_CLEAN, bytes, compute_hash[CLI_HASH_AVAIL_TYPES];
-	unsigned int i = 0, bm_offmode = 0;
-	uint32_t maxpatlen, offset = 0;
-	struct cli_ac_data gdata, tdata;
+	int ret = CL_CLEAN, type = CL_CLEAN, bytes;
+	unsigned int i = 0, bm_offmode = 0, fused = 0, want = 0;
+	uint32_t maxpatlen, moffset;
+	size_t offset = 0;
+	struct cli_ac_data gdata_local, tdata_local, *gdata = NULL, *tdata = NULL;
 	struct cli_bm_off toff;
-	cli_md5_ctx md5ctx;
-	SHA256_CTX sha256ctx;
-	SHA1Context sha1ctx;
-	unsigned char digest[CLI_HASH_AVAIL_TYPES][32];
+	struct cli_multihash mh;
+	const char *refhash = NULL;
 	struct cli_matcher *groot = NULL, *troot = NULL;
 	struct cli_target_info info;
 	fmap_t *map = *ctx->fmap;
@@ -714,6 +993,9 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
 	const char *virname = NULL;
 	uint32_t viroffset = 0;
 	uint32_t viruses_found = 0;
+	size_t fold = 0;
+	struct cli_matched_type *ftlast = NULL;
+	struct cli_ac_result *reshead = NULL;
 
     if(!ctx->engine) {
 	cli_errmsg("cli_scandesc: engine == NULL\n");
@@ -747,7 +1029,9 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
     cli_targetinfo(&info, i, map);
 
     if(!ftonly)
-	if((ret = cli_ac_initdata(&gdata, groot->ac_partsigs, groot->ac_lsigs, groot->ac_reloff_num, CLI_DEFAULT_AC_TRACKLEN)) || (ret = cli_ac_caloff(groot, &gdata, &info))) {
+	if((ret = acdata_get(ctx, 0, groot, &gdata_local, &gdata)) || (ret = cli_ac_caloff(groot, gdata, &info))) {
+	    if(gdata)
+		acdata_put(ctx, gdata);
 	    if(info.exeinfo.section)
 		free(info.exeinfo.section);
 	    cli_hashset_destroy(&info.exeinfo.vinfo);
@@ -755,9 +1039,11 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
 	}
 
     if(troot) {
-	if((ret = cli_ac_initdata(&tdata, troot->ac_partsigs, troot->ac_lsigs, troot->ac_reloff_num, CLI_DEFAULT_AC_TRACKLEN)) || (ret = cli_ac_caloff(troot, &tdata, &info))) {
+	if((ret = acdata_get(ctx, i, troot, &tdata_local, &tdata)) || (ret = cli_ac_caloff(troot, tdata, &info))) {
+	    if(tdata)
+		acdata_put(ctx, tdata);
 	    if(!ftonly)
-		cli_ac_freedata(&gdata);
+		acdata_put(ctx, gdata);
 	    if(info.exeinfo.section)
 		free(info.exeinfo.section);
 	    cli_hashset_destroy(&info.exeinfo.vinfo);
@@ -767,8 +1053,8 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
 	    if(map->len >= CLI_DEFAULT_BM_OFFMODE_FSIZE) {
 		if((ret = cli_bm_initoff(troot, &toff, &info))) {
 		    if(!ftonly)
-			cli_ac_freedata(&gdata);
-		    cli_ac_freedata(&tdata);
+			acdata_put(ctx, gdata);
+		    acdata_put(ctx, tdata);
 		    if(info.exeinfo.section)
 			free(info.exeinfo.section);
 		    cli_hashset_destroy(&info.exeinfo.vinfo);
@@ -779,105 +1065,146 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
 	}
     }
 
+    /* walk the generic and target-type tries at once */
+    if(troot && !ftonly && troot->ac_fused)
+	fused = 1;
+
     hdb = ctx->engine->hm_hdb;
     fp = ctx->engine->hm_fp;
 
+    /* the MD5 cache_check() computed is reused, the missing digests
+     * are computed along with the scan */
+    if(digests->have[CLI_HASH_MD5])
+	refhash = (const char *) digests->digest[CLI_HASH_MD5];
+
     if(!ftonly && hdb) {
-	if(!refhash) {
-	    if(cli_hm_have_size(hdb, CLI_HASH_MD5, map->len) || cli_hm_have_size(fp, CLI_HASH_MD5, map->len)) {
-		cli_md5_init(&md5ctx);
-		compute_hash[CLI_HASH_MD5] = 1;
-	    } else
-		compute_hash[CLI_HASH_MD5] = 0;
-	} else {
-	    compute_hash[CLI_HASH_MD5] = 0;
-	    memcpy(digest[CLI_HASH_MD5], refhash, 16);
+	want = cli_hm_digests(ctx, map->len);
+	for(i = CLI_HASH_MD5; i < CLI_HASH_AVAIL_TYPES; i++)
+	    if(digests->have[i])
+		want &= ~CLI_DIGEST(i);
+	if(want && SCAN_ALL) {
+	    /* the windows of the scan overlap, hash the file on its own */
+	    if(cli_multihash_map(map, map->len, want, digests))
+		cli_dbgmsg("fmap_scandesc: can't compute the hashes of the file\n");
+	    want = 0;
 	}
-
-	if(cli_hm_have_size(hdb, CLI_HASH_SHA1, map->len) || cli_hm_have_wild(hdb, CLI_HASH_SHA1)
-		|| cli_hm_have_size(fp, CLI_HASH_SHA1, map->len) || cli_hm_have_wild(fp, CLI_HASH_SHA1) ) {
-	    SHA1Init(&sha1ctx);
-	    compute_hash[CLI_HASH_SHA1] = 1;
-	} else
-	    compute_hash[CLI_HASH_SHA1] = 0;
-
-	if(cli_hm_have_size(hdb, CLI_HASH_SHA256, map->len) || cli_hm_have_wild(hdb, CLI_HASH_SHA256)
-		|| cli_hm_have_size(fp, CLI_HASH_SHA256, map->len) || cli_hm_have_wild(fp, CLI_HASH_SHA256)) {
-	    sha256_init(&sha256ctx);
-	    compute_hash[CLI_HASH_SHA256] = 1;
-	} else
-	    compute_hash[CLI_HASH_SHA256] = 0;
+	cli_multihash_init(&mh, want);
     }
 
     while(offset < map->len) {
 	bytes = MIN(map->len - offset, SCANBUFF);
-	if(!(buff = fmap_need_off_once(map, offset, bytes)))
+	if(!(buff = fmap_need_off_once(map, offset, bytes))) {
+	    /* the digests of the part read so far aren't the file's */
+	    if(want) {
+		cli_dbgmsg("fmap_scandesc: short read at %lu, file digests not computed\n", (unsigned long)offset);
+		want = 0;
+	    }
 	    break;
+	}
 	if(ctx->scanned)
 	    *ctx->scanned += bytes / CL_COUNT_PRECISION;
+	moffset = scan_offset(map, offset);
+	if(offset - moffset != fold) {
+	    fold = offset - moffset;
+	    if(scan_offset_wrap(ctx, troot, tdata, groot, gdata, &info, &viruses_found) == CL_VIRUS) {
+		if(!ftonly)
+		    acdata_put(ctx, gdata);
+		if(troot) {
+		    acdata_put(ctx, tdata);
+		    if(bm_offmode)
+			cli_bm_freeoff(&toff);
+		}
+		if(info.exeinfo.section)
+		    free(info.exeinfo.section);
+		cli_hashset_destroy(&info.exeinfo.vinfo);
+		return CL_VIRUS;
+	    }
+	}
+	if(fold) {
+	    for(ftlast = ftoffset ? *ftoffset : NULL; ftlast && ftlast->next; ftlast = ftlast->next);
+	    reshead = acres ? *acres : NULL;
+	}
 
-	if(troot) {
-            virname = NULL;
-            viroffset = 0;
-	    ret = matcher_run(troot, buff, bytes, &virname, &tdata, offset, &info, ftype, ftoffset, acmode, acres, map, bm_offmode ? &toff : NULL, &viroffset, ctx);
+	if(fused) {
+	    virname = NULL;
+	    viroffset = 0;
+	    ret = matcher_run_fused(troot, groot, buff, bytes, &virname, tdata, gdata, moffset, &info, ftype, ftoffset, acmode, acres, bm_offmode ? &toff : NULL, &viroffset, ctx);
 
 	    if (virname) {
-		/* virname already appended by matcher_run */
+		/* virname already appended by matcher_run_fused */
 		viruses_found = 1;
 	    }
 	    if((ret == CL_VIRUS && !SCAN_ALL) || ret == CL_EMEM) {
-		if(!ftonly)
-		    cli_ac_freedata(&gdata);
-		cli_ac_freedata(&tdata);
+		acdata_put(ctx, gdata);
+		acdata_put(ctx, tdata);
 		if(bm_offmode)
 		    cli_bm_freeoff(&toff);
 		if(info.exeinfo.section)
 		    free(info.exeinfo.section);
 		cli_hashset_destroy(&info.exeinfo.vinfo);
 		return ret;
+	    } else if((acmode & AC_SCAN_FT) && ret >= CL_TYPENO) {
+		if(ret > type)
+		    type = ret;
 	    }
-	}
-
-	if(!ftonly) {
-	    virname = NULL;
-	    viroffset = 0;
-	    ret = matcher_run(groot, buff, bytes, &virname, &gdata, offset, &info, ftype, ftoffset, acmode, acres, map, NULL, &viroffset, ctx);
+	} else if(troot) {
+            virname = NULL;
+            viroffset = 0;
+	    ret = matcher_run(troot, buff, bytes, &virname, tdata, moffset, &info, ftype, ftoffset, acmode, acres, map, bm_offmode ? &toff : NULL, &viroffset, ctx);
 
-            if (virname) {
+	    if (virname) {
 		/* virname already appended by matcher_run */
 		viruses_found = 1;
 	    }
 	    if((ret == CL_VIRUS && !SCAN_ALL) || ret == CL_EMEM) {
-		cli_ac_freedata(&gdata);
-		if(troot) {
-		    cli_ac_freedata(&tdata);
-		    if(bm_offmode)
-			cli_bm_freeoff(&toff);
-		}
+		if(!ftonly)
+		    acdata_put(ctx, gdata);
+		acdata_put(ctx, tdata);
+		if(bm_offmode)
+		    cli_bm_freeoff(&toff);
 		if(info.exeinfo.section)
 		    free(info.exeinfo.section);
 		cli_hashset_destroy(&info.exeinfo.vinfo);
 		return ret;
-	    } else if((acmode & AC_SCAN_FT) && ret >= CL_TYPENO) {
-		if(ret > type)
-		    type = ret;
 	    }
+	}
 
-	    if(hdb && !SCAN_ALL) {
-		const void *data = buff + maxpatlen * (offset!=0);
-		uint32_t data_len = bytes - maxpatlen * (offset!=0);
+	if(!ftonly) {
+	    if(!fused) {
+		virname = NULL;
+		viroffset = 0;
+		ret = matcher_run(groot, buff, bytes, &virname, gdata, moffset, &info, ftype, ftoffset, acmode, acres, map, NULL, &viroffset, ctx);
 
-		if(compute_hash[CLI_HASH_MD5])
-		    cli_md5_update(&md5ctx, data, data_len);
-		if(compute_hash[CLI_HASH_SHA1])
-		    SHA1Update(&sha1ctx, data, data_len);
-		if(compute_hash[CLI_HASH_SHA256])
-		    sha256_update(&sha256ctx, data, data_len);
+		if (virname) {
+		    /* virname already appended by matcher_run */
+		    viruses_found = 1;
+		}
+		if((ret == CL_VIRUS && !SCAN_ALL) || ret == CL_EMEM) {
+		    acdata_put(ctx, gdata);
+		    if(troot) {
+			acdata_put(ctx, tdata);
+			if(bm_offmode)
+			    cli_bm_freeoff(&toff);
+		    }
+		    if(info.exeinfo.section)
+			free(info.exeinfo.section);
+		    cli_hashset_destroy(&info.exeinfo.vinfo);
+		    return ret;
+		} else if((acmode & AC_SCAN_FT) && ret >= CL_TYPENO) {
+		    if(ret > type)
+			type = ret;
+		}
 	    }
+
+	    if(want)
+		cli_multihash_update(&mh, buff + maxpatlen * (offset!=0), bytes - maxpatlen * (offset!=0));
 	}
 
+	if(fold)
+	    scan_offset_unfold(ftoffset, ftlast, acres, reshead, fold);
+
 	if(SCAN_ALL && viroffset) {
-	    offset = viroffset;
+	    offset = offset + viroffset - moffset;
 	    continue;
 	}
 	if(bytes < SCANBUFF) break;
@@ -887,14 +1214,11 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
     if(!ftonly && hdb) {
 	enum CLI_HASH_TYPE hashtype, hashtype2;
 
-	if(compute_hash[CLI_HASH_MD5])
-	    cli_md5_final(digest[CLI_HASH_MD5], &md5ctx);
-	if(refhash)
-	    compute_hash[CLI_HASH_MD5] = 1;
-	if(compute_hash[CLI_HASH_SHA1])
-	    SHA1Final(&sha1ctx, digest[CLI_HASH_SHA1]);
-	if(compute_hash[CLI_HASH_SHA256])
-	    sha256_final(&sha256ctx, digest[CLI_HASH_SHA256]);
+	if(want) {
+	    cli_multihash_final(&mh, digests);
+	    if(digests->have[CLI_HASH_MD5])
+		refhash = (const char *) digests->digest[CLI_HASH_MD5];
+	}
 
 	virname = NULL;
 	for(hashtype = CLI_HASH_MD5; hashtype < CLI_HASH_AVAIL_TYPES; hashtype++) {
@@ -902,29 +1226,29 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
 	    int found = 0;
 
 	    /* If no hash, skip to next type */
-	    if(!compute_hash[hashtype])
+	    if(!digests->have[hashtype])
 		continue;
 
 	    /* Do hash scan */
-	    if((ret = cli_hm_scan(digest[hashtype], map->len, &virname, hdb, hashtype)) == CL_VIRUS) {
+	    if((ret = cli_hm_scan(digests->digest[hashtype], map->len, &virname, hdb, hashtype)) == CL_VIRUS) {
 		found += 1;
 	    }
 	    if(!found || SCAN_ALL) {
-		if ((ret = cli_hm_scan_wild(digest[hashtype], &virname_w, hdb, hashtype)) == CL_VIRUS)
+		if ((ret = cli_hm_scan_wild(digests->digest[hashtype], &virname_w, hdb, hashtype)) == CL_VIRUS)
 		    found += 2;
 	    }
 
 	    /* If found, do immediate hash-only FP check */
-	    if (found && fp) {
+	    if (found && (fp || ctx->delta)) {
 		for(hashtype2 = CLI_HASH_MD5; hashtype2 < CLI_HASH_AVAIL_TYPES; hashtype2++) {
-		    if(!compute_hash[hashtype2])
+		    if(!digests->have[hashtype2])
 			continue;
-		    if(cli_hm_scan(digest[hashtype2], map->len, NULL, fp, hashtype2) == CL_VIRUS) {
+		    if(fp_scan(ctx, digests->digest[hashtype2], map->len, NULL, hashtype2) == CL_VIRUS) {
 			found = 0;
 			ret = CL_CLEAN;
 			break;
 		    }
-		    else if(cli_hm_scan_wild(digest[hashtype2], NULL, fp, hashtype2) == CL_VIRUS) {
+		    else if(fp_scan_wild(ctx, digests->digest[hashtype2], NULL, hashtype2) == CL_VIRUS) {
 			found = 0;
 			ret = CL_CLEAN;
 			break;
@@ -935,6 +1259,7 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
 	    /* If matched size-based hash ... */
 	    if (found % 2) {
 		viruses_found = 1;
+		cli_sigstats_hash(ctx->engine->sigstats, virname);
 		cli_append_virus(ctx, virname);
 		if (!SCAN_ALL)
 		    break;
@@ -943,6 +1268,7 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
 	    /* If matched size-agnostic hash ... */
 	    if (found > 1) {
 		viruses_found = 1;
+		cli_sigstats_hash(ctx->engine->sigstats, virname_w);
 		cli_append_virus(ctx, virname_w);
 		if (!SCAN_ALL)
 		    break;
@@ -952,18 +1278,18 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
 
     if(troot) {
 	if(ret != CL_VIRUS || SCAN_ALL)
-	    ret = cli_lsig_eval(ctx, troot, &tdata, &info, refhash);
+	    ret = cli_lsig_eval(ctx, troot, tdata, &info, refhash);
 	if (ret == CL_VIRUS)
 	    viruses_found++;
-	cli_ac_freedata(&tdata);
+	acdata_put(ctx, tdata);
 	if(bm_offmode)
 	    cli_bm_freeoff(&toff);
     }
 
     if(groot) {
 	if(ret != CL_VIRUS || SCAN_ALL)
-	    ret = cli_lsig_eval(ctx, groot, &gdata, &info, refhash);
-	cli_ac_freedata(&gdata);
+	    ret = cli_lsig_eval(ctx, groot, gdata, &info, refhash);
+	acdata_put(ctx, gdata);
     }
 
     if(info.exeinfo.section)
@@ -978,6 +1304,471 @@ int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli
     return (acmode & AC_SCAN_FT) ? type : CL_CLEAN;
 }
 
+int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli_matched_type **ftoffset, unsigned int acmode, struct cli_ac_result **acres, struct cli_digests *digests)
+{
+	const struct cl_engine *engine;
+	struct cli_acdata_slot *acslots;
+	struct cli_digests local;
+	int ret, dret;
+
+    if(!digests) {
+	memset(local.have, 0, sizeof(local.have));
+	digests = &local;
+    }
+
+    ret = fmap_scandesc(ctx, ftype, ftonly, ftoffset, acmode, acres, digests);
+    if(!ctx->delta || !(acmode & AC_SCAN_VIR) || (ret == CL_VIRUS && !SCAN_ALL) || (ret != CL_VIRUS && ret > CL_CLEAN && ret < CL_TYPENO))
+	return ret;
+
+    /* the signatures added with cl_engine_update() are in a small engine
+     * of their own; the two engines swap places so that the FP checks
+     * still see the hashes of both */
+    engine = ctx->engine;
+    acslots = ctx->acslots;
+    ctx->engine = ctx->delta;
+    ctx->delta = engine;
+    ctx->acslots = NULL;
+    dret = fmap_scandesc(ctx, ftype, ftonly, NULL, AC_SCAN_VIR, NULL, digests);
+    ctx->delta = ctx->engine;
+    ctx->engine = engine;
+    ctx->acslots = acslots;
+
+    if(dret != CL_CLEAN)
+	return dret;
+    return ret;
+}
+
+/* Raw scanning of data that only comes as a stream of blocks (e.g. the
+ * output of a decompressor). It gives the same results as
+ * cli_fmap_scandesc() with AC_SCAN_VIR | AC_SCAN_FT for the non-executable
+ * types, as long as cli_scanstream_final() doesn't return CL_BREAK.
+ * After a match only the .fp hashes and the size limits can change the
+ * verdict, so the data is read to the end only when either may apply; a
+ * size recorded by the container settles the limits up front.
+ */
+struct cli_scanstream {
+    cli_ctx *ctx;
+    struct cli_matcher *root;
+    cli_file_t ftype;
+    struct cli_ac_data mdata;
+    struct cli_target_info info;
+    struct cli_matched_type *ftoffset;
+    unsigned char *buff, *tail;
+    uint32_t fill, offset, taillen, tailsize;
+    uint64_t len, size, scanned;
+    const char *virname;
+    int fallback, need_fp, need_len, partial;
+    struct cli_multihash mh;
+    struct cli_digests digests;
+};
+
+/* size is the length of the data when the container records it, or 0 */
+struct cli_scanstream *cli_scanstream_init(cli_ctx *ctx, cli_file_t ftype, uint64_t size)
+{
+	struct cli_scanstream *st;
+	struct cli_matcher *root = ctx->engine->root[0];
+	const struct cl_engine *engine = ctx->engine;
+	enum CLI_HASH_TYPE type;
+	unsigned int want;
+
+
+    if(root->eof_maxoff > engine->maxinmemory) {
+	cli_dbgmsg("cli_scanstream_init: EOF-%u signatures need too much data\n", root->eof_maxoff);
+	return NULL;
+    }
+
+    if(!(st = cli_calloc(1, sizeof(*st)))) {
+	cli_errmsg("cli_scanstream_init: Can't allocate memory for the stream\n");
+	return NULL;
+    }
+    st->ctx = ctx;
+    st->root = root;
+    st->ftype = ftype;
+    st->size = size;
+
+    if(!(st->buff = cli_malloc(SCANBUFF)) || (root->eof_maxoff && !(st->tail = cli_malloc(2 * root->eof_maxoff)))) {
+	cli_errmsg("cli_scanstream_init: Can't allocate memory for the buffers\n");
+	free(st->buff);
+	free(st);
+	return NULL;
+    }
+    st->tailsize = root->eof_maxoff;
+
+    /* the size is unknown until the end, so EOF-n signatures get checked
+     * against the tail in cli_scanstream_final() */
+    memset(&st->info, 0, sizeof(st->info));
+    cli_hashset_init_noalloc(&st->info.exeinfo.vinfo);
+    st->info.status = -1;
+
+    if(cli_ac_initdata(&st->mdata, root->ac_partsigs, root->ac_lsigs, root->ac_reloff_num, CLI_DEFAULT_AC_TRACKLEN) || cli_ac_caloff(root, &st->mdata, &st->info)) {
+	cli_ac_freedata(&st->mdata);
+	free(st->tail);
+	free(st->buff);
+	free(st);
+	return NULL;
+    }
+
+    want = CLI_DIGEST(CLI_HASH_MD5);
+    if(cli_hm_have_any(engine->hm_hdb, CLI_HASH_SHA1) || cli_hm_have_any(engine->hm_fp, CLI_HASH_SHA1))
+	want |= CLI_DIGEST(CLI_HASH_SHA1);
+    if(cli_hm_have_any(engine->hm_hdb, CLI_HASH_SHA256) || cli_hm_have_any(engine->hm_fp, CLI_HASH_SHA256))
+	want |= CLI_DIGEST(CLI_HASH_SHA256);
+    cli_multihash_init(&st->mh, want);
+
+    /* A match is final unless the whitelist or the size limits can still
+     * overrule it. The .fp hashes only apply to the digests of the whole
+     * data, and only those of its size (when known) can match */
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
+	if(size ? (cli_hm_have_size(engine->hm_fp, type, size) || cli_hm_have_wild(engine->hm_fp, type)) : cli_hm_have_any(engine->hm_fp, type))
+	    st->need_fp = 1;
+    }
+    /* the catalog entries */
+    if(cli_hm_have_size(engine->hm_fp, CLI_HASH_SHA1, 1))
+	st->need_fp = 1;
+    if((engine->maxfilesize || engine->maxscansize) && (!size || size > 0xffffffff || cli_checklimits("cli_scanstream", ctx, size, 0, 0) != CL_CLEAN))
+	st->need_len = 1;
+
+    return st;
+}
+
+static int scanstream_run(struct cli_scanstream *st, const unsigned char *buff, uint32_t len, uint32_t offset, struct cli_ac_data *mdata, const struct cli_target_info *info)
+{
+	const char *virname = NULL;
+	int ret;
+
+
+    ret = matcher_run(st->root, buff, len, &virname, mdata, offset, info, st->ftype, &st->ftoffset, AC_SCAN_VIR | AC_SCAN_FT, NULL, NULL, NULL, NULL, NULL);
+    if(virname) {
+	st->virname = virname;
+	return CL_SUCCESS;
+    }
+    if(ret == CL_EMEM)
+	return ret;
+    /* embedded objects need the full scan */
+    if(ret >= CL_TYPENO || st->ftoffset)
+	st->fallback = 1;
+    return CL_SUCCESS;
+}
+
+/* After a match only the hashing for the .fp check and the length for the
+ * size limits are still needed, if anything */
+static int scanstream_matched(struct cli_scanstream *st)
+{
+    if(!st->need_fp)
+	st->partial = 1;
+    return (st->need_fp || st->need_len) ? CL_SUCCESS : CL_BREAK;
+}
+
+int cli_scanstream_update(struct cli_scanstream *st, const unsigned char *data, size_t len)
+{
+	uint32_t n, maxpatlen = st->root->maxpatlen;
+	int ret;
+
+
+    st->len += len;
+    if(st->size && st->len > st->size) {
+	/* the recorded size was wrong, e.g. a multi-member gzip file */
+	st->size = 0;
+	if(st->ctx->engine->maxfilesize || st->ctx->engine->maxscansize)
+	    st->need_len = 1;
+	if(st->virname && !st->partial)
+	    st->need_fp = 1;
+    }
+
+    if(st->fallback)
+	return CL_BREAK;
+    if(st->virname) {
+	if(st->need_fp)
+	    cli_multihash_update(&st->mh, data, len);
+	return scanstream_matched(st);
+    }
+    cli_multihash_update(&st->mh, data, len);
+
+    if(st->tailsize) {
+	if(len >= st->tailsize) {
+	    memcpy(st->tail, data + len - st->tailsize, st->tailsize);
+	    st->taillen = st->tailsize;
+	} else {
+	    if(st->taillen + len > 2 * st->tailsize) {
+		memmove(st->tail, st->tail + st->taillen - st->tailsize, st->tailsize);
+		st->taillen = st->tailsize;
+	    }
+	    memcpy(st->tail + st->taillen, data, len);
+	    st->taillen += len;
+	}
+    }
+
+    /* same windows as cli_fmap_scandesc() */
+    while(len) {
+	n = MIN(len, SCANBUFF - st->fill);
+	memcpy(st->buff + st->fill, data, n);
+	st->fill += n;
+	data += n;
+	len -= n;
+	if(st->fill < SCANBUFF)
+	    break;
+
+	st->scanned += SCANBUFF / CL_COUNT_PRECISION;
+	if((ret = scanstream_run(st, st->buff, SCANBUFF, st->offset, &st->mdata, &st->info)) != CL_SUCCESS)
+	    return ret;
+	if(st->fallback)
+	    return CL_BREAK;
+	if(st->virname)
+	    return scanstream_matched(st);
+
+	memmove(st->buff, st->buff + SCANBUFF - maxpatlen, maxpatlen);
+	st->offset += SCANBUFF - maxpatlen;
+	st->fill = maxpatlen;
+    }
+
+    return CL_SUCCESS;
+}
+
+/* lsig_eval() for the stream. The EOF-n subsignatures can only match in the
+ * tail scan (tdata), where the rest of the tail was already counted in
+ * mdata; eofsubs has their bits for each lsig. Returns CL_BREAK when the
+ * lsig matched but needs the whole file */
+static int scanstream_lsig(struct cli_scanstream *st, struct cli_ac_data *mdata, struct cli_ac_data *tdata, const uint64_t *eofsubs, unsigned int i)
+{
+	struct cli_matcher *root = st->root;
+	const struct cli_ac_lsig *lsig = root->ac_lsigtable[i];
+	const uint32_t *lsigcnt = cli_ac_lsigcnt(mdata, i), *tcnt;
+	uint32_t cnt[64];
+	unsigned int j, evalcnt = 0;
+	uint64_t evalids = 0;
+
+    if(lsig->tombstone)
+	return CL_CLEAN;
+    cli_ac_chkmacro(root, mdata, i);
+    if(tdata && eofsubs[i]) {
+	tcnt = cli_ac_lsigcnt(tdata, i);
+	for(j = 0; j < 64; j++)
+	    cnt[j] = lsigcnt[j] + (((eofsubs[i] >> j) & 1) ? tcnt[j] : 0);
+	lsigcnt = cnt;
+    }
+    if(lsig->perfid)
+	SIGSTAT_INC(root->sigstats, lsig->perfid, verifies);
+    if(!(lsig->ops ? cli_ac_lsigeval(lsig->ops, lsig->nops, lsigcnt) == 1 : cli_ac_chklsig(lsig->logic, lsig->logic + strlen(lsig->logic), lsigcnt, &evalcnt, &evalids, 0) == 1))
+	return CL_CLEAN;
+
+    if(lsig->tdb.container && lsig->tdb.container[0] != st->ctx->container_type)
+	return CL_CLEAN;
+    if(lsig->tdb.filesize && (lsig->tdb.filesize[0] > st->len || lsig->tdb.filesize[1] < st->len))
+	return CL_CLEAN;
+    /* the streamed types have no exe info */
+    if(lsig->tdb.ep || lsig->tdb.nos || lsig->tdb.icongrp1 || lsig->tdb.icongrp2)
+	return CL_CLEAN;
+    if(lsig->bc_idx || lsig->tdb.handlertype)
+	return CL_BREAK;
+
+    if(lsig->perfid)
+	SIGSTAT_INC(root->sigstats, lsig->perfid, hits);
+    st->virname = lsig->virname;
+    return CL_VIRUS;
+}
+
+/* cli_lsig_eval() for the stream */
+static int scanstream_lsigs(struct cli_scanstream *st, struct cli_ac_data *mdata, struct cli_ac_data *tdata, const uint64_t *eofsubs)
+{
+	struct cli_matcher *root = st->root;
+	unsigned int i, d, a;
+	int ret;
+
+    if(root->ac_lsigcompiled && mdata->nlsigdirty > 1)
+	qsort(mdata->lsigdirty, mdata->nlsigdirty, sizeof(uint32_t), lsigid_cmp);
+    for(d = a = 0; (i = lsig_next(root, mdata, &d, &a)) < root->ac_lsigs; )
+	if((ret = scanstream_lsig(st, mdata, tdata, eofsubs, i)) != CL_CLEAN)
+	    return ret;
+    /* those only hit in the tail */
+    if(tdata && root->ac_lsigcompiled) {
+	for(d = 0; d < tdata->nlsigdirty; d++)
+	    if((ret = scanstream_lsig(st, mdata, tdata, eofsubs, tdata->lsigdirty[d])) != CL_CLEAN)
+		return ret;
+    }
+    return CL_CLEAN;
+}
+
+/* the tail scan for the EOF-n signatures, once the size is known */
+static int scanstream_tail(struct cli_scanstream *st)
+{
+	struct cli_matcher *root = st->root;
+	struct cli_ac_data tdata;
+	struct cli_target_info info;
+	uint64_t *eofsubs = NULL;
+	unsigned int i;
+	int ret;
+
+
+    if(st->taillen > st->tailsize) {
+	memmove(st->tail, st->tail + st->taillen - st->tailsize, st->tailsize);
+	st->taillen = st->tailsize;
+    }
+    memset(&info, 0, sizeof(info));
+    cli_hashset_init_noalloc(&info.exeinfo.vinfo);
+    info.fsize = st->len;
+    if((ret = cli_ac_initdata(&tdata, root->ac_partsigs, root->ac_lsigs, root->ac_reloff_num, CLI_DEFAULT_AC_TRACKLEN)))
+	return ret;
+    if((ret = cli_ac_caloff(root, &tdata, &info)) || (ret = scanstream_run(st, st->tail, st->taillen, st->len - st->taillen, &tdata, &info))) {
+	cli_ac_freedata(&tdata);
+	return ret;
+    }
+
+    if(!st->virname && root->ac_lsigs) {
+	if(!(eofsubs = cli_calloc(root->ac_lsigs, sizeof(uint64_t)))) {
+	    cli_ac_freedata(&tdata);
+	    return CL_EMEM;
+	}
+	for(i = 0; i < root->ac_reloff_num; i++) {
+	    const struct cli_ac_patt *patt = root->ac_reloff[i];
+
+	    if(patt->lsigid[0] && patt->offdata[0] == CLI_OFF_EOF_MINUS)
+		eofsubs[patt->lsigid[1]] |= (uint64_t) 1 << patt->lsigid[2];
+	}
+	if(scanstream_lsigs(st, &st->mdata, &tdata, eofsubs) == CL_BREAK)
+	    st->fallback = 1;
+	free(eofsubs);
+    }
+    cli_ac_freedata(&tdata);
+    return CL_SUCCESS;
+}
+
+int cli_scanstream_final(struct cli_scanstream *st, const char **virname, unsigned char *md5)
+{
+	struct cli_matcher *hdb = st->ctx->engine->hm_hdb, *fp = st->ctx->engine->hm_fp;
+	enum CLI_HASH_TYPE type, type2;
+	const char *hname;
+	int ret;
+
+
+    *virname = NULL;
+    if(!st->virname && !st->fallback && st->fill) {
+	st->scanned += st->fill / CL_COUNT_PRECISION;
+	if((ret = scanstream_run(st, st->buff, st->fill, st->offset, &st->mdata, &st->info)) != CL_SUCCESS)
+	    return ret;
+    }
+
+    cli_multihash_final(&st->mh, &st->digests);
+    memcpy(md5, st->digests.digest[CLI_HASH_MD5], 16);
+
+    if(st->fallback)
+	return CL_BREAK;
+
+    if(!st->virname) {
+	if(st->taillen) {
+	    if((ret = scanstream_tail(st)) != CL_SUCCESS)
+		return ret;
+	} else if(scanstream_lsigs(st, &st->mdata, NULL, NULL) == CL_BREAK) {
+	    st->fallback = 1;
+	}
+	if(st->fallback)
+	    return CL_BREAK;
+    }
+
+    if(!st->virname && hdb) {
+	for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES && !st->virname; type++) {
+	    if(!st->digests.have[type])
+		continue;
+	    hname = NULL;
+	    if(cli_hm_scan(st->digests.digest[type], st->len, &hname, hdb, type) != CL_VIRUS && cli_hm_scan_wild(st->digests.digest[type], &hname, hdb, type) != CL_VIRUS)
+		continue;
+	    /* same hash-only FP check as in cli_fmap_scandesc() */
+	    for(type2 = CLI_HASH_MD5; type2 < CLI_HASH_AVAIL_TYPES && fp; type2++) {
+		if(!st->digests.have[type2])
+		    continue;
+		if(cli_hm_scan(st->digests.digest[type2], st->len, NULL, fp, type2) == CL_VIRUS || cli_hm_scan_wild(st->digests.digest[type2], NULL, fp, type2) == CL_VIRUS) {
+		    hname = NULL;
+		    break;
+		}
+	    }
+	    st->virname = hname;
+	    cli_sigstats_hash(st->ctx->engine->sigstats, hname);
+	}
+    }
+
+    if(st->virname) {
+	*virname = st->virname;
+	return CL_VIRUS;
+    }
+
+    return CL_CLEAN;
+}
+
+/* cli_checkfp() for the stream, which is never a PE file */
+int cli_scanstream_checkfp(struct cli_scanstream *st, const char *virname)
+{
+	const struct cli_matcher *fp = st->ctx->engine->hm_fp;
+	const char *fpname;
+	uint32_t size = st->len;
+	char md5[33];
+	unsigned int i;
+
+
+    /* stopped at the match, no .fp entry can apply */
+    if(st->partial)
+	return CL_VIRUS;
+
+    if(cli_hm_scan(st->digests.digest[CLI_HASH_MD5], size, &fpname, fp, CLI_HASH_MD5) == CL_VIRUS || cli_hm_scan_wild(st->digests.digest[CLI_HASH_MD5], &fpname, fp, CLI_HASH_MD5) == CL_VIRUS) {
+	cli_dbgmsg("cli_scanstream_checkfp(md5): Found false positive detection (fp sig: %s), size: %u\n", fpname, size);
+	return CL_CLEAN;
+    }
+
+    if(cli_debug_flag) {
+	for(i = 0; i < 16; i++)
+	    sprintf(md5 + i * 2, "%02x", st->digests.digest[CLI_HASH_MD5][i]);
+	md5[32] = 0;
+	cli_dbgmsg("FP SIGNATURE: %s:%u:%s\n", md5, size, virname);
+    }
+
+    if(st->digests.have[CLI_HASH_SHA1]) {
+	if(cli_hm_scan(st->digests.digest[CLI_HASH_SHA1], size, &fpname, fp, CLI_HASH_SHA1) == CL_VIRUS || cli_hm_scan_wild(st->digests.digest[CLI_HASH_SHA1], &fpname, fp, CLI_HASH_SHA1) == CL_VIRUS) {
+	    cli_dbgmsg("cli_scanstream_checkfp(sha1): Found false positive detection (fp sig: %s)\n", fpname);
+	    return CL_CLEAN;
+	}
+	if(strncmp("W32S.", virname, 5) && cli_hm_scan(st->digests.digest[CLI_HASH_SHA1], 1, &fpname, fp, CLI_HASH_SHA1) == CL_VIRUS) {
+	    cli_dbgmsg("cli_scanstream_checkfp(sha1): Found false positive detection via catalog file\n");
+	    return CL_CLEAN;
+	}
+    }
+    if(st->digests.have[CLI_HASH_SHA256]) {
+	if(cli_hm_scan(st->digests.digest[CLI_HASH_SHA256], size, &fpname, fp, CLI_HASH_SHA256) == CL_VIRUS || cli_hm_scan_wild(st->digests.digest[CLI_HASH_SHA256], &fpname, fp, CLI_HASH_SHA256) == CL_VIRUS) {
+	    cli_dbgmsg("cli_scanstream_checkfp(sha256): Found false positive detection (fp sig: %s)\n", fpname);
+	    return CL_CLEAN;
+	}
+    }
+
+    return CL_VIRUS;
+}
+
+/* the recorded size when the data wasn't read to the end */
+uint64_t cli_scanstream_len(const struct cli_scanstream *st)
+{
+    return st->len < st->size ? st->size : st->len;
+}
+
+/* in CL_COUNT_PRECISION units, as for ctx->scanned */
+uint64_t cli_scanstream_scanned(const struct cli_scanstream *st)
+{
+    return st->scanned;
+}
+
+void cli_scanstream_free(struct cli_scanstream *st)
+{
+	struct cli_matched_type *ftnext;
+
+
+    if(!st)
+	return;
+    while(st->ftoffset) {
+	ftnext = st->ftoffset->next;
+	free(st->ftoffset);
+	st->ftoffset = ftnext;
+    }
+    cli_ac_freedata(&st->mdata);
+    free(st->tail);
+    free(st->buff);
+    free(st);
+}
+
 int cli_matchmeta(cli_ctx *ctx, const char *fname, size_t fsizec, size_t fsizer, int encrypted, unsigned int filepos, int res1, void *res2)
 {
 	const struct cli_cdb *cdb;
@@ -73,13 +73,29 @@ struct cli_lsig_tdb {
 #endif
 };
 
+/* Logical expression in postfix form, built by cli_ac_lsigcompile() */
+#define CLI_LSIG_OP_SUB	0 /* subsignature id, optionally compared with val1 */
+#define CLI_LSIG_OP_AND	1
+#define CLI_LSIG_OP_OR	2
+#define CLI_LSIG_MAXDEPTH 64
+struct cli_lsig_op {
+    uint8_t type;
+    uint8_t mod;	/* '=', '<', '>' or 0 */
+    uint16_t id;
+    uint32_t val1, val2;
+};
+
 struct cli_bc;
 struct cli_ac_lsig {
     uint32_t id;
     unsigned bc_idx;
     char *logic;
+    struct cli_lsig_op *ops; /* NULL if logic couldn't be compiled */
+    uint16_t nops;
     const char *virname;
     struct cli_lsig_tdb tdb;
+    uint8_t tombstone; /* removed by cl_engine_update() */
+    uint32_t perfid; /* see sigstats.h */
 };
 
 struct cli_matcher {
@@ -88,6 +104,7 @@ struct cli_matcher {
     /* Extended Boyer-Moore */
     uint8_t *bm_shift;
     struct cli_bm_patt **bm_suffix, **bm_pattab;
+    struct cli_bm_pref *bm_pref;
     uint32_t *soff, soff_len; /* for PE section sigs */
     uint32_t bm_offmode, bm_patterns, bm_reloff_num, bm_absoff_num;
 
@@ -98,15 +115,26 @@ struct cli_matcher {
     /* Extended Aho-Corasick */
     uint32_t ac_partsigs, ac_nodes, ac_patterns, ac_lsigs;
     struct cli_ac_lsig **ac_lsigtable;
+    /* lsigs that may match without any subsignature hit, sorted */
+    uint32_t *ac_lsigalways, ac_lsigalways_num;
+    uint8_t ac_lsigcompiled;
     struct cli_ac_node *ac_root, **ac_nodetable;
     struct cli_ac_patt **ac_pattable;
     struct cli_ac_patt **ac_reloff;
+    struct cli_ac_state *ac_states;
+    uint32_t *ac_dtrans, *ac_strans;
     uint32_t ac_reloff_num, ac_absoff_num;
     uint8_t ac_mindepth, ac_maxdepth;
     struct filter *filter;
 
+    /* Generic + target-type AC trie, built by cli_ac_fuse() */
+    struct cli_matcher *ac_fused;
+
     uint16_t maxpatlen;
     uint8_t ac_only;
+    uint32_t eof_maxoff; /* largest n of the EOF-n signatures */
+    uint8_t snapshot; /* ac_dtrans, ac_strans and the hash arrays point into engine->snapshot */
+    struct cli_sigstats *sigstats; /* with CL_DB_SIGNATURE_STATS */
 #ifdef USE_MPOOL
     mpool_t *mempool;
 #endif
@@ -168,14 +196,33 @@ static const struct cli_mtarget cli_mtargets[CLI_MTARGETS] =  {
 #define CLI_OFF_MACRO       8
 #define CLI_OFF_SE	    9
 
+/* Match state of one root kept across files by a cl_scanctx, see
+ * cl_scan_batch(); busy while a cli_fmap_scandesc() is using it, nested
+ * scans of the same root then get a private cli_ac_data */
+struct cli_acdata_slot {
+    struct cli_ac_data data;
+    uint8_t ready, busy;
+};
+
+void cli_acdata_slots_free(struct cli_acdata_slot *slots);
+
 int cli_scanbuff(const unsigned char *buffer, uint32_t length, uint32_t offset, cli_ctx *ctx, cli_file_t ftype, struct cli_ac_data **acdata);
 
 int cli_scandesc(int desc, cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli_matched_type **ftoffset, unsigned int acmode, struct cli_ac_result **acres);
-int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli_matched_type **ftoffset, unsigned int acmode, struct cli_ac_result **acres, unsigned char *refhash);
+int cli_fmap_scandesc(cli_ctx *ctx, cli_file_t ftype, uint8_t ftonly, struct cli_matched_type **ftoffset, unsigned int acmode, struct cli_ac_result **acres, struct cli_digests *digests);
 int cli_lsig_eval(cli_ctx *ctx, struct cli_matcher *root, struct cli_ac_data *acdata, struct cli_target_info *target_info, const char *hash);
 int cli_caloff(const char *offstr, const struct cli_target_info *info, unsigned int target, uint32_t *offdata, uint32_t *offset_min, uint32_t *offset_max);
 
-int cli_checkfp(unsigned char *digest, size_t size, cli_ctx *ctx);
+int cli_checkfp(struct cli_digests *digests, size_t size, cli_ctx *ctx);
+
+struct cli_scanstream;
+struct cli_scanstream *cli_scanstream_init(cli_ctx *ctx, cli_file_t ftype, uint64_t size);
+int cli_scanstream_update(struct cli_scanstream *st, const unsigned char *data, size_t len);
+int cli_scanstream_final(struct cli_scanstream *st, const char **virname, unsigned char *md5);
+int cli_scanstream_checkfp(struct cli_scanstream *st, const char *virname);
+uint64_t cli_scanstream_len(const struct cli_scanstream *st);
+uint64_t cli_scanstream_scanned(const struct cli_scanstream *st);
+void cli_scanstream_free(struct cli_scanstream *st);
 
 int cli_matchmeta(cli_ctx *ctx, const char *fname, size_t fsizec, size_t fsizer, int encrypted, unsigned int filepos, int res1, void *res2);
 
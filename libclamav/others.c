@@ -71,6 +71,7 @@
 #include "bytecode.h"
 #include "bytecode_api_impl.h"
 #include "cache.h"
+#include "scanstats.h"
 
 int (*cli_unrar_open)(int fd, const char *dirname, unrar_state_t *state);
 int (*cli_unrar_extract_next_prepare)(unrar_state_t *state, const char *dirname);
@@ -327,6 +328,8 @@ struct cl_engine *cl_engine_new(void)
     new->maxhtmlnotags = CLI_DEFAULT_MAXHTMLNOTAGS;
     new->maxscriptnormalize = CLI_DEFAULT_MAXSCRIPTNORMALIZE;
     new->maxziptypercg = CLI_DEFAULT_MAXZIPTYPERCG;
+    new->maxinmemory = CLI_DEFAULT_MAXINMEMORY;
+    new->load_threads = 0;
 
     new->bytecode_security = CL_BYTECODE_TRUST_SIGNED;
     /* 5 seconds timeout */
@@ -378,6 +381,18 @@ struct cl_engine *cl_engine_new(void)
 	return NULL;
     }
 
+    if(!(new->scanstats = cli_scanstats_new())) {
+	cli_errmsg("cl_engine_new: Can't initialize scan statistics\n");
+	crtmgr_free(&new->cmgr);
+	mpool_free(new->mempool, new->dconf);
+	mpool_free(new->mempool, new->root);
+#ifdef USE_MPOOL
+	mpool_destroy(new->mempool);
+#endif
+	free(new);
+	return NULL;
+    }
+
     cli_dbgmsg("Initialized %s engine\n", cl_retver());
     return new;
 }
@@ -442,6 +457,20 @@ int cl_engine_set_num(struct cl_engine *engine, enum cl_engine_field field, long
 	    } else
 		engine->maxziptypercg = num;
 	    break;
+	case CL_ENGINE_MAX_INMEMORY:
+	    if(num < 0) {
+		cli_warnmsg("MaxInMemory: negative values are not allowed, using default: %u\n", CLI_DEFAULT_MAXINMEMORY);
+		engine->maxinmemory = CLI_DEFAULT_MAXINMEMORY;
+	    } else
+		engine->maxinmemory = num;
+	    break;
+	case CL_ENGINE_LOAD_THREADS:
+	    if(num < 0) {
+		cli_warnmsg("LoadThreads: negative values are not allowed, using one per CPU\n");
+		engine->load_threads = 0;
+	    } else
+		engine->load_threads = num;
+	    break;
 	case CL_ENGINE_MIN_CC_COUNT:
 	    engine->min_cc_count = num;
 	    break;
@@ -503,6 +532,29 @@ int cl_engine_set_num(struct cl_engine *engine, enum cl_engine_field field, long
                 cli_cache_init(engine);
         }
         break;
+    case CL_ENGINE_CACHE_CLOCK:
+	if (engine->dboptions & CL_DB_COMPILED) {
+	    cli_errmsg("cl_engine_set_num: CL_ENGINE_CACHE_CLOCK cannot be set after engine was compiled\n");
+	    return CL_EARG;
+	}
+	if (!num == !(engine->engine_options & ENGINE_OPTIONS_CACHE_CLOCK))
+	    break;
+	/* the cache is still empty, rebuild it with the other backend */
+	if (engine->cache) {
+	    cli_cache_destroy(engine);
+	    engine->engine_options ^= ENGINE_OPTIONS_CACHE_CLOCK;
+	    if (cli_cache_init(engine))
+		return CL_EMEM;
+	} else {
+	    engine->engine_options ^= ENGINE_OPTIONS_CACHE_CLOCK;
+	}
+	break;
+    case CL_ENGINE_DIRECT_MAP:
+	if (num)
+	    engine->engine_options |= ENGINE_OPTIONS_DIRECT_MAP;
+	else
+	    engine->engine_options &= ~(ENGINE_OPTIONS_DIRECT_MAP);
+	break;
 	default:
 	    cli_errmsg("cl_engine_set_num: Incorrect field number\n");
 	    return CL_EARG;
@@ -544,6 +596,10 @@ long long cl_engine_get_num(const struct cl_engine *engine, enum cl_engine_field
 	    return engine->maxscriptnormalize;
 	case CL_ENGINE_MAX_ZIPTYPERCG:
 	    return engine->maxziptypercg;
+	case CL_ENGINE_MAX_INMEMORY:
+	    return engine->maxinmemory;
+	case CL_ENGINE_LOAD_THREADS:
+	    return engine->load_threads;
 	case CL_ENGINE_MIN_CC_COUNT:
 	    return engine->min_cc_count;
 	case CL_ENGINE_MIN_SSN_COUNT:
@@ -570,6 +626,10 @@ long long cl_engine_get_num(const struct cl_engine *engine, enum cl_engine_field
 	    return engine->bytecode_mode;
     case CL_ENGINE_DISABLE_CACHE:
         return engine->engine_options & ENGINE_OPTIONS_DISABLE_CACHE;
+    case CL_ENGINE_CACHE_CLOCK:
+        return !!(engine->engine_options & ENGINE_OPTIONS_CACHE_CLOCK);
+    case CL_ENGINE_DIRECT_MAP:
+        return !!(engine->engine_options & ENGINE_OPTIONS_DIRECT_MAP);
 	default:
 	    cli_errmsg("cl_engine_get: Incorrect field number\n");
 	    if(err)
@@ -594,6 +654,17 @@ int cl_engine_set_str(struct cl_engine *engine, enum cl_engine_field field, cons
 	    if(!engine->tmpdir)
 		return CL_EMEM;
 	    break;
+	case CL_ENGINE_CACHE_FILE:
+	    if(engine->dboptions & CL_DB_COMPILED) {
+		cli_errmsg("cl_engine_set_str: CL_ENGINE_CACHE_FILE cannot be set after engine was compiled\n");
+		return CL_EARG;
+	    }
+	    if(engine->cache_path)
+		mpool_free(engine->mempool, engine->cache_path);
+	    engine->cache_path = cli_mpool_strdup(engine->mempool, str);
+	    if(!engine->cache_path)
+		return CL_EMEM;
+	    break;
 	default:
 	    cli_errmsg("cl_engine_set_num: Incorrect field number\n");
 	    return CL_EARG;
@@ -619,6 +690,8 @@ const char *cl_engine_get_str(const struct cl_engine *engine, enum cl_engine_fie
 	    return engine->pua_cats;
 	case CL_ENGINE_TMPDIR:
 	    return engine->tmpdir;
+	case CL_ENGINE_CACHE_FILE:
+	    return engine->cache_path;
 	default:
 	    cli_errmsg("cl_engine_get: Incorrect field number\n");
 	    if(err)
@@ -651,12 +724,15 @@ struct cl_settings *cl_engine_settings_copy(const struct cl_engine *engine)
     settings->maxhtmlnotags = engine->maxhtmlnotags;
     settings->maxscriptnormalize = engine->maxscriptnormalize;
     settings->maxziptypercg = engine->maxziptypercg;
+    settings->maxinmemory = engine->maxinmemory;
+    settings->load_threads = engine->load_threads;
     settings->min_cc_count = engine->min_cc_count;
     settings->min_ssn_count = engine->min_ssn_count;
     settings->bytecode_security = engine->bytecode_security;
     settings->bytecode_timeout = engine->bytecode_timeout;
     settings->bytecode_mode = engine->bytecode_mode;
     settings->pua_cats = engine->pua_cats ? strdup(engine->pua_cats) : NULL;
+    settings->cache_path = engine->cache_path ? strdup(engine->cache_path) : NULL;
 
     settings->cb_pre_cache = engine->cb_pre_cache;
     settings->cb_pre_scan = engine->cb_pre_scan;
@@ -685,6 +761,8 @@ int cl_engine_settings_apply(struct cl_engine *engine, const struct cl_settings
     engine->maxhtmlnotags = settings->maxhtmlnotags;
     engine->maxscriptnormalize = settings->maxscriptnormalize;
     engine->maxziptypercg = settings->maxziptypercg;
+    engine->maxinmemory = settings->maxinmemory;
+    engine->load_threads = settings->load_threads;
     engine->min_cc_count = settings->min_cc_count;
     engine->min_ssn_count = settings->min_ssn_count;
     engine->bytecode_security = settings->bytecode_security;
@@ -712,6 +790,16 @@ int cl_engine_settings_apply(struct cl_engine *engine, const struct cl_settings
 	engine->pua_cats = NULL;
     }
 
+    if(engine->cache_path)
+	mpool_free(engine->mempool, engine->cache_path);
+    if(settings->cache_path) {
+	engine->cache_path = cli_mpool_strdup(engine->mempool, settings->cache_path);
+	if(!engine->cache_path)
+	    return CL_EMEM;
+    } else {
+	engine->cache_path = NULL;
+    }
+
     engine->cb_pre_cache = settings->cb_pre_cache;
     engine->cb_pre_scan = settings->cb_pre_scan;
     engine->cb_post_scan = settings->cb_post_scan;
@@ -730,6 +818,7 @@ int cl_engine_settings_free(struct cl_settings *settings)
 
     free(settings->tmpdir);
     free(settings->pua_cats);
+    free(settings->cache_path);
     free(settings);
     return CL_SUCCESS;
 }
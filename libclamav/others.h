@@ -117,6 +117,8 @@ typedef struct cli_ctx_tag {
     unsigned long int *scanned;
     const struct cli_matcher *root;
     const struct cl_engine *engine;
+    const struct cl_engine *delta; /* signatures added by cl_engine_update(), or NULL */
+    unsigned int cache_gen; /* engine->cache_gen when the scan started */
     unsigned long scansize;
     unsigned int options;
     unsigned int recursion;
@@ -130,8 +132,11 @@ typedef struct cli_ctx_tag {
     struct cli_dconf *dconf;
     fmap_t **fmap;
     bitset_t* hook_lsig_matches;
+    struct cli_acdata_slot *acslots; /* CLI_MTARGETS entries or NULL */
     void *cb_ctx;
     cli_events_t* perf;
+    struct cli_scanstats *stats; /* counters of the scanning thread, or NULL */
+    uint64_t stats_nested; /* usecs spent in the embedded files */
 #ifdef HAVE__INTERNAL__SHA_COLLECT
     char entry_filename[2048];
     int sha_collect;
@@ -183,11 +188,22 @@ struct cli_dbinfo {
     struct cli_dbinfo *next;
 };
 
+/* A database cl_load() was called for (root) or read, see snapshot.c */
+struct cli_dbfile {
+    char *path;
+    uint64_t size; /* 0 for a directory */
+    uint64_t mtime;
+    unsigned int root;
+    struct cli_dbfile *next;
+};
+
 struct cl_engine {
     uint32_t refcount; /* reference counter */
     uint32_t sdb;
     uint32_t dboptions;
     uint32_t dbversion[2];
+    uint32_t sigs; /* number of signatures loaded */
+    unsigned char dbdigest[16]; /* of the loaded databases, see cli_load() */
     uint32_t ac_only;
     uint32_t ac_mindepth;
     uint32_t ac_maxdepth;
@@ -250,6 +266,24 @@ struct cl_engine {
 
     /* Negative cache storage */
     struct CACHE *cache;
+    char *cache_path;
+    struct CACHE_FILE *cache_file;
+    unsigned int cache_gen; /* bumped by cli_cache_clear() */
+
+    /* Mapped snapshot file, see cl_engine_load_snapshot() */
+    void *snapshot;
+    size_t snapshot_size;
+    struct cli_dbfile *dbfiles;
+
+    /* Live updates, see cl_engine_update() */
+    struct cl_engine *delta;
+    struct cli_liveupdate *liveupdate;
+
+    /* Per-signature statistics, with CL_DB_SIGNATURE_STATS */
+    struct cli_sigstats *sigstats;
+
+    /* Scan statistics, see cl_engine_get_stats() */
+    struct cli_scanstats_set *scanstats;
 
     /* Database information from .info files */
     struct cli_dbinfo *dbinfo;
@@ -284,6 +318,10 @@ struct cl_engine {
     uint64_t maxhtmlnotags; /* max size for scanning normalized HTML */
     uint64_t maxscriptnormalize; /* max size to normalize scripts */
     uint64_t maxziptypercg; /* max size to re-do zip filetype */
+    uint64_t maxinmemory; /* max size of an extracted file kept in memory */
+
+    /* Database loading */
+    uint32_t load_threads; /* 0: one per CPU, 1: no loader threads */
 };
 
 struct cl_settings {
@@ -306,6 +344,7 @@ struct cl_settings {
     uint32_t bytecode_timeout;
     enum bytecode_mode bytecode_mode;
     char *pua_cats;
+    char *cache_path;
     uint64_t engine_options;
 
     /* callbacks */
@@ -324,6 +363,10 @@ struct cl_settings {
     uint64_t maxhtmlnotags; /* max size for scanning normalized HTML */
     uint64_t maxscriptnormalize; /* max size to normalize scripts */
     uint64_t maxziptypercg; /* max size to re-do zip filetype */
+    uint64_t maxinmemory; /* max size of an extracted file kept in memory */
+
+    /* Database loading */
+    uint32_t load_threads; /* 0: one per CPU, 1: no loader threads */
 };
 
 extern int (*cli_unrar_open)(int fd, const char *dirname, unrar_state_t *state);
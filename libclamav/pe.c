@@ -60,6 +60,7 @@
 #include "ishield.h"
 #include "asn1.h"
 #include "sha1.h"
+#include "sigstats.h"
 
 #define DCONF ctx->dconf->pe
 
@@ -486,9 +487,10 @@ static void cli_parseres_special(uint32_t base, uint32_t rva, fmap_t *map, struc
 static unsigned int cli_hashsect(fmap_t *map, struct cli_exe_section *s, unsigned char **digest, int * foundhash, int * foundwild)
 {
     const void *hashme;
-    cli_md5_ctx md5;
-    SHA1Context sha1ctx;
-    SHA256_CTX sha256ctx;
+    struct cli_multihash mh;
+    struct cli_digests digests;
+    unsigned int want = 0;
+    enum CLI_HASH_TYPE type;
 
     if (s->rsz > CLI_MAX_ALLOCATION) {
         cli_dbgmsg("cli_hashsect: skipping hash calculation for too big section\n");
@@ -501,29 +503,22 @@ static unsigned int cli_hashsect(fmap_t *map, struct cli_exe_section *s, unsigne
         return 0;
     }
 
-    if(foundhash[CLI_HASH_MD5] || foundwild[CLI_HASH_MD5]) {
-        cli_md5_init(&md5);
-        cli_md5_update(&md5, hashme, s->rsz);
-        cli_md5_final(digest[CLI_HASH_MD5], &md5);
-    }
-    if(foundhash[CLI_HASH_SHA1] || foundwild[CLI_HASH_SHA1]) {
-        SHA1Init(&sha1ctx);
-        SHA1Update(&sha1ctx, hashme, s->rsz);
-        SHA1Final(&sha1ctx, digest[CLI_HASH_SHA1]);
-    }
-    if(foundhash[CLI_HASH_SHA256] || foundwild[CLI_HASH_SHA256]) {
-        sha256_init(&sha256ctx);
-        sha256_update(&sha256ctx, hashme, s->rsz);
-        sha256_final(&sha256ctx, digest[CLI_HASH_SHA256]);
-    }
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++)
+        if(foundhash[type] || foundwild[type])
+            want |= CLI_DIGEST(type);
+    cli_multihash_init(&mh, want);
+    cli_multihash_update(&mh, hashme, s->rsz);
+    cli_multihash_final(&mh, &digests);
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++)
+        if(digests.have[type])
+            memcpy(digest[type], digests.digest[type], hashlen[type]);
 
     return 1;
 }
 
 /* check hash section sigs */
-static int scan_pe_mdb (cli_ctx * ctx, struct cli_exe_section *exe_section)
+static int pe_mdb_scan (cli_ctx * ctx, const struct cli_matcher * mdb_sect, struct cli_exe_section *exe_section)
 {
-    struct cli_matcher * mdb_sect = ctx->engine->hm_mdb;
     unsigned char * hashset[CLI_HASH_AVAIL_TYPES];
     const char * virname = NULL;
     int foundsize[CLI_HASH_AVAIL_TYPES];
@@ -594,6 +589,7 @@ static int scan_pe_mdb (cli_ctx * ctx, struct cli_exe_section *exe_section)
     /* Do scans */
     for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
        if(foundsize[type] && cli_hm_scan(hashset[type], exe_section->rsz, &virname, mdb_sect, type) == CL_VIRUS) {
+            cli_sigstats_hash(ctx->engine->sigstats, virname);
             cli_append_virus(ctx, virname);
             ret = CL_VIRUS;
             if (!SCAN_ALL) {
@@ -601,6 +597,7 @@ static int scan_pe_mdb (cli_ctx * ctx, struct cli_exe_section *exe_section)
             }
        }
        if(foundwild[type] && cli_hm_scan_wild(hashset[type], &virname, mdb_sect, type) == CL_VIRUS) {
+            cli_sigstats_hash(ctx->engine->sigstats, virname);
             cli_append_virus(ctx, virname);
             ret = CL_VIRUS;
             if (!SCAN_ALL) {
@@ -615,6 +612,24 @@ end:
     return ret;
 }
 
+/* the section hashes added with cl_engine_update() are in ctx->delta */
+static int scan_pe_mdb (cli_ctx * ctx, struct cli_exe_section *exe_section)
+{
+    int ret = CL_CLEAN, dret;
+
+    if(ctx->engine->hm_mdb) {
+        ret = pe_mdb_scan(ctx, ctx->engine->hm_mdb, exe_section);
+        if((ret == CL_VIRUS && !SCAN_ALL) || (ret != CL_CLEAN && ret != CL_VIRUS))
+            return ret;
+    }
+    if(ctx->delta && ctx->delta->hm_mdb) {
+        dret = pe_mdb_scan(ctx, ctx->delta->hm_mdb, exe_section);
+        if(dret != CL_CLEAN)
+            return dret;
+    }
+    return ret;
+}
+
 int cli_scanpe(cli_ctx *ctx)
 {
 	uint16_t e_magic; /* DOS signature ("MZ") */
@@ -1091,7 +1106,7 @@ int cli_scanpe(cli_ctx *ctx)
 	    if(SCAN_ALGO && (DCONF & PE_CONF_POLIPOS) && !*sname && exe_sections[i].vsz > 40000 && exe_sections[i].vsz < 70000 && exe_sections[i].chr == 0xe0000060) polipos = i;
 
 	    /* check hash section sigs */
-	    if((DCONF & PE_CONF_MD5SECT) && ctx->engine->hm_mdb) {
+	    if((DCONF & PE_CONF_MD5SECT) && (ctx->engine->hm_mdb || (ctx->delta && ctx->delta->hm_mdb))) {
 	        ret = scan_pe_mdb(ctx, &exe_sections[i]);
 	        if (ret != CL_CLEAN) {
 	            if (ret != CL_VIRUS)
@@ -2923,7 +2938,7 @@ int cli_scanpe_hnmavocl(cli_ctx *ctx)
 			if (SCAN_ALGO && (DCONF & PE_CONF_POLIPOS) && !*sname && exe_sections[i].vsz > 40000 && exe_sections[i].vsz < 70000 && exe_sections[i].chr == 0xe0000060) polipos = i;
 
 			/* check hash section sigs */
-			if ((DCONF & PE_CONF_MD5SECT) && ctx->engine->hm_mdb) {
+			if ((DCONF & PE_CONF_MD5SECT) && (ctx->engine->hm_mdb || (ctx->delta && ctx->delta->hm_mdb))) {
 				ret = scan_pe_mdb(ctx, &exe_sections[i]);
 				if (ret != CL_CLEAN) {
 					if (ret != CL_VIRUS)
@@ -54,6 +54,7 @@
 #include "filetypes.h"
 #include "filetypes_int.h"
 #include "readdb.h"
+#include "dbstage.h"
 #include "cltypes.h"
 #include "default.h"
 #include "md5.h"
@@ -77,6 +78,10 @@
 #include "bytecode_api.h"
 #include "bytecode_priv.h"
 #include "cache.h"
+#include "snapshot.h"
+#include "liveupdate.h"
+#include "sigstats.h"
+#include "scanstats.h"
 #ifdef CL_THREAD_SAFE
 #  include <pthread.h>
 static pthread_mutex_t cli_ref_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -362,6 +367,7 @@ int cli_initroots(struct cl_engine *engine, unsigned int options)
 	    root->mempool = engine->mempool;
 #endif
 	    root->type = i;
+	    root->sigstats = engine->sigstats;
 	    if(cli_mtargets[i].ac_only || engine->ac_only)
 		root->ac_only = 1;
 
@@ -390,6 +396,32 @@ char *cli_dbgets(char *buff, unsigned int size, FILE *fs, struct cli_dbio *dbio)
     if(fs)
 	return fgets(buff, size, fs);
 
+    if(dbio->mem) { /* CVD member unpacked by a loader thread */
+	    const char *pt, *nl;
+	    unsigned int len;
+
+	if(dbio->mempos >= dbio->memsize)
+	    return NULL;
+	/* already checksummed as a whole */
+	dbio->bread = dbio->memsize;
+	pt = dbio->mem + dbio->mempos;
+	if(!(nl = memchr(pt, '\n', dbio->memsize - dbio->mempos))) {
+	    if(!dbio->mempos)
+		cli_errmsg("cli_dbgets: Invalid data or internal buffer too small\n");
+	    dbio->mempos = dbio->memsize;
+	    return NULL;
+	}
+	len = nl - pt;
+	if(len >= size) {
+	    cli_errmsg("cli_dbgets: Line too long for provided buffer\n");
+	    return NULL;
+	}
+	memcpy(buff, pt, len);
+	buff[len] = 0;
+	dbio->mempos += len + 1;
+	return buff;
+    }
+
     if(dbio->usebuf) {
 	    int bread;
 	    char *nl;
@@ -891,106 +923,145 @@ static int cli_loadpdb(FILE *fs, struct cl_engine *engine, unsigned int *signo,
 }
 
 #define NDB_TOKENS 6
-static int cli_loadndb(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigned short sdb, unsigned int options, struct cli_dbio *dbio, const char *dbname)
+static int cli_loadndb_line(struct cl_engine *engine, const char **tokens, int tokens_count, const char *buffer_cpy, unsigned short sdb, unsigned int options, int *sigs)
 {
-	const char *tokens[NDB_TOKENS + 1];
-	char buffer[FILEBUFF], *buffer_cpy = NULL;
 	const char *sig, *virname, *offset, *pt;
 	struct cli_matcher *root;
-	int line = 0, sigs = 0, ret = 0, tokens_count;
 	unsigned short target;
-	unsigned int phish = options & CL_DB_PHISHING;
 
 
-    if((ret = cli_initroots(engine, options)))
-	return ret;
+    if(tokens_count < 4 || tokens_count > 6)
+	return CL_EMALFDB;
 
-    if(engine->ignored)
-	if(!(buffer_cpy = cli_malloc(FILEBUFF))) {
-        cli_errmsg("cli_loadndb: Can't allocate memory for buffer_cpy\n");
-	    return CL_EMEM;
-    }
+    virname = tokens[0];
 
-    while(cli_dbgets(buffer, FILEBUFF, fs, dbio)) {
-	line++;
-	if(buffer[0] == '#')
-	    continue;
+    if(engine->pua_cats && (options & CL_DB_PUA_MODE) && (options & (CL_DB_PUA_INCLUDE | CL_DB_PUA_EXCLUDE)))
+	if(cli_chkpua(virname, engine->pua_cats, options))
+	    return CL_SUCCESS;
 
-	if(!phish)
-	    if(!strncmp(buffer, "HTML.Phishing", 13) || !strncmp(buffer, "Email.Phishing", 14))
-		continue;
+    if(engine->ignored && cli_chkign(engine->ignored, virname, buffer_cpy))
+	return CL_SUCCESS;
 
-	cli_chomp(buffer);
-	if(engine->ignored)
-	    strcpy(buffer_cpy, buffer);
+    if(!sdb && engine->cb_sigload && engine->cb_sigload("ndb", virname, ~options & CL_DB_OFFICIAL, engine->cb_sigload_ctx)) {
+	cli_dbgmsg("cli_loadndb: skipping %s due to callback\n", virname);
+	return CL_SUCCESS;
+    }
 
-	tokens_count = cli_strtokenize(buffer, ':', NDB_TOKENS + 1, tokens);
-	if(tokens_count < 4 || tokens_count > 6) {
-	    ret = CL_EMALFDB;
-	    break;
-	}
+    if(tokens_count > 4) { /* min version */
+	pt = tokens[4];
 
-	virname = tokens[0];
+	if(!cli_isnumber(pt))
+	    return CL_EMALFDB;
 
-	if(engine->pua_cats && (options & CL_DB_PUA_MODE) && (options & (CL_DB_PUA_INCLUDE | CL_DB_PUA_EXCLUDE)))
-	    if(cli_chkpua(virname, engine->pua_cats, options))
-		continue;
+	if((unsigned int) atoi(pt) > cl_retflevel()) {
+	    cli_dbgmsg("Signature for %s not loaded (required f-level: %d)\n", virname, atoi(pt));
+	    return CL_SUCCESS;
+	}
 
-	if(engine->ignored && cli_chkign(engine->ignored, virname, buffer_cpy))
-	    continue;
+	if(tokens_count == 6) { /* max version */
+	    pt = tokens[5];
+	    if(!cli_isnumber(pt))
+		return CL_EMALFDB;
 
-	if(!sdb && engine->cb_sigload && engine->cb_sigload("ndb", virname, ~options & CL_DB_OFFICIAL, engine->cb_sigload_ctx)) {
-	    cli_dbgmsg("cli_loadndb: skipping %s due to callback\n", virname);
-	    continue;
+	    if((unsigned int) atoi(pt) < cl_retflevel())
+		return CL_SUCCESS;
 	}
+    }
 
-	if(tokens_count > 4) { /* min version */
-	    pt = tokens[4];
+    if(!(pt = tokens[1]) || (strcmp(pt, "*") && !cli_isnumber(pt)))
+	return CL_EMALFDB;
+    target = (unsigned short) atoi(pt);
 
-	    if(!cli_isnumber(pt)) {
-		ret = CL_EMALFDB;
-		break;
-	    }
+    if(target >= CLI_MTARGETS) {
+	cli_dbgmsg("Not supported target type in signature for %s\n", virname);
+	return CL_SUCCESS;
+    }
 
-	    if((unsigned int) atoi(pt) > cl_retflevel()) {
-		cli_dbgmsg("Signature for %s not loaded (required f-level: %d)\n", virname, atoi(pt));
-		continue;
-	    }
+    root = engine->root[target];
 
-	    if(tokens_count == 6) { /* max version */
-		pt = tokens[5];
-		if(!cli_isnumber(pt)) {
-		    ret = CL_EMALFDB;
-		    break;
-		}
+    offset = tokens[2];
+    sig = tokens[3];
 
-		if((unsigned int) atoi(pt) < cl_retflevel()) {
+    if(cli_parse_add(root, virname, sig, 0, 0, offset, target, NULL, options))
+	return CL_EMALFDB;
+    (*sigs)++;
+
+    return CL_SUCCESS;
+}
+
+/* Same as the text loop in cli_loadndb() for a database split up by the
+ * loader threads */
+static int cli_loadndb_staged(struct cl_engine *engine, const struct cli_dbstage_member *member, char *buffer_cpy, unsigned short sdb, unsigned int options, int *line, int *sigs)
+{
+	const struct cli_dbstage_chunk *chunk;
+	const struct cli_dbstage_sig *rec;
+	const char *tokens[NDB_TOKENS + 1];
+	unsigned int base = 0, i, j;
+	int ret;
+
+    for(i = 0; i < member->nchunks; i++) {
+	chunk = &member->chunks[i];
+	for(j = 0; j < chunk->nsigs; j++) {
+	    rec = &chunk->sigs[j];
+	    *line = base + rec->line;
+	    cli_dbstage_fields(chunk, rec, tokens, NDB_TOKENS + 1);
+	    if(!(options & CL_DB_PHISHING))
+		if(!strncmp(tokens[0], "HTML.Phishing", 13) || !strncmp(tokens[0], "Email.Phishing", 14))
 		    continue;
-		}
+
+	    if(engine->ignored) {
+		memcpy(buffer_cpy, chunk->data + rec->entry, rec->entrylen);
+		buffer_cpy[rec->entrylen] = 0;
 	    }
+	    if((ret = cli_loadndb_line(engine, tokens, rec->nfields, buffer_cpy, sdb, options, sigs)))
+		return ret;
 	}
+	base += chunk->lines;
+    }
+    *line = base;
 
-	if(!(pt = tokens[1]) || (strcmp(pt, "*") && !cli_isnumber(pt))) {
-	    ret = CL_EMALFDB;
-	    break;
-	}
-	target = (unsigned short) atoi(pt);
+    return CL_SUCCESS;
+}
 
-	if(target >= CLI_MTARGETS) {
-	    cli_dbgmsg("Not supported target type in signature for %s\n", virname);
-	    continue;
-	}
+static int cli_loadndb(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigned short sdb, unsigned int options, struct cli_dbio *dbio, const char *dbname)
+{
+	const char *tokens[NDB_TOKENS + 1];
+	char buffer[FILEBUFF], *buffer_cpy = NULL;
+	int line = 0, sigs = 0, ret = 0, tokens_count;
+	unsigned int phish = options & CL_DB_PHISHING;
 
-	root = engine->root[target];
 
-	offset = tokens[2];
-	sig = tokens[3];
+    if((ret = cli_initroots(engine, options)))
+	return ret;
 
-	if((ret = cli_parse_add(root, virname, sig, 0, 0, offset, target, NULL, options))) {
-	    ret = CL_EMALFDB;
-	    break;
+    if(engine->ignored)
+	if(!(buffer_cpy = cli_malloc(FILEBUFF))) {
+        cli_errmsg("cli_loadndb: Can't allocate memory for buffer_cpy\n");
+	    return CL_EMEM;
+    }
+
+    if(dbio && dbio->member) {
+	ret = cli_loadndb_staged(engine, dbio->member, buffer_cpy, sdb, options, &line, &sigs);
+	if(dbio->memsize)
+	    dbio->bread = dbio->memsize;
+    } else {
+	while(cli_dbgets(buffer, FILEBUFF, fs, dbio)) {
+	    line++;
+	    if(buffer[0] == '#')
+		continue;
+
+	    if(!phish)
+		if(!strncmp(buffer, "HTML.Phishing", 13) || !strncmp(buffer, "Email.Phishing", 14))
+		    continue;
+
+	    cli_chomp(buffer);
+	    if(engine->ignored)
+		strcpy(buffer_cpy, buffer);
+
+	    tokens_count = cli_strtokenize(buffer, ':', NDB_TOKENS + 1, tokens);
+	    if((ret = cli_loadndb_line(engine, tokens, tokens_count, buffer_cpy, sdb, options, &sigs)))
+		break;
 	}
-	sigs++;
     }
     if(engine->ignored)
 	free(buffer_cpy);
@@ -1228,19 +1299,18 @@ static int lsigattribs(char *attribs, struct cli_lsig_tdb *tdb)
   } while(0);
 
 #define LDB_TOKENS 67
-static int load_oneldb(char *buffer, int chkpua, struct cl_engine *engine, unsigned int options, const char *dbname, unsigned int line, unsigned int *sigs, unsigned bc_idx, const char *buffer_cpy, int *skip)
+static int load_oneldb_fields(char **tokens, int tokens_count, int chkpua, struct cl_engine *engine, unsigned int options, const char *dbname, unsigned int line, unsigned int *sigs, unsigned bc_idx, const char *buffer_cpy, int *skip)
 {
     const char *sig, *virname, *offset, *logic;
     struct cli_ac_lsig **newtable, *lsig;
-    char *tokens[LDB_TOKENS+1], *pt;
-    int i, subsigs, tokens_count;
+    char *pt;
+    int i, subsigs;
     unsigned short target = 0;
     struct cli_matcher *root;
     struct cli_lsig_tdb tdb;
     uint32_t lsigid[2];
     int ret;
 
-    tokens_count = cli_strtokenize(buffer, ';', LDB_TOKENS + 1, (const char **) tokens);
     if(tokens_count < 4) {
 	return CL_EMALFDB;
     }
@@ -1338,6 +1408,12 @@ static int load_oneldb(char *buffer, int chkpua, struct cl_engine *engine, unsig
 
     root = engine->root[tdb.target[0]];
 
+    /* a snapshot being loaded has the lsig of the bytecode already */
+    if(bc_idx && (options & CL_DB_SNAPSHOT)) {
+	FREE_TDB(tdb);
+	return CL_SUCCESS;
+    }
+
     lsig = (struct cli_ac_lsig *) mpool_calloc(engine->mempool, 1, sizeof(struct cli_ac_lsig));
     if(!lsig) {
 	cli_errmsg("cli_loadldb: Can't allocate memory for lsig\n");
@@ -1399,6 +1475,50 @@ static int load_oneldb(char *buffer, int chkpua, struct cl_engine *engine, unsig
     return CL_SUCCESS;
 }
 
+static int load_oneldb(char *buffer, int chkpua, struct cl_engine *engine, unsigned int options, const char *dbname, unsigned int line, unsigned int *sigs, unsigned bc_idx, const char *buffer_cpy, int *skip)
+{
+    char *tokens[LDB_TOKENS+1];
+    int tokens_count;
+
+    tokens_count = cli_strtokenize(buffer, ';', LDB_TOKENS + 1, (const char **) tokens);
+    return load_oneldb_fields(tokens, tokens_count, chkpua, engine, options, dbname, line, sigs, bc_idx, buffer_cpy, skip);
+}
+
+/* Same as the text loop in cli_loadldb() for a database split up by the
+ * loader threads */
+static int cli_loadldb_staged(struct cl_engine *engine, const struct cli_dbstage_member *member, char *buffer_cpy, unsigned int options, const char *dbname, unsigned int *line, unsigned int *sigs)
+{
+    const struct cli_dbstage_chunk *chunk;
+    const struct cli_dbstage_sig *rec;
+    char *tokens[LDB_TOKENS+1];
+    unsigned int base = 0, i, j;
+    int ret;
+
+    for(i = 0; i < member->nchunks; i++) {
+	chunk = &member->chunks[i];
+	for(j = 0; j < chunk->nsigs; j++) {
+	    rec = &chunk->sigs[j];
+	    *line = base + rec->line;
+	    (*sigs)++;
+
+	    if(engine->ignored) {
+		memcpy(buffer_cpy, chunk->data + rec->entry, rec->entrylen);
+		buffer_cpy[rec->entrylen] = 0;
+	    }
+	    cli_dbstage_fields(chunk, rec, (const char **) tokens, LDB_TOKENS + 1);
+	    ret = load_oneldb_fields(tokens, rec->nfields,
+				     engine->pua_cats && (options & CL_DB_PUA_MODE) && (options & (CL_DB_PUA_INCLUDE | CL_DB_PUA_EXCLUDE)),
+				     engine, options, dbname, *line, sigs, 0, buffer_cpy, NULL);
+	    if(ret)
+		return ret;
+	}
+	base += chunk->lines;
+    }
+    *line = base;
+
+    return CL_SUCCESS;
+}
+
 static int cli_loadldb(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigned int options, struct cli_dbio *dbio, const char *dbname)
 {
 	char buffer[CLI_DEFAULT_LSIG_BUFSIZE + 1], *buffer_cpy = NULL;
@@ -1414,20 +1534,26 @@ static int cli_loadldb(FILE *fs, struct cl_engine *engine, unsigned int *signo,
         cli_errmsg("cli_loadldb: Can't allocate memory for buffer_cpy\n");
 	    return CL_EMEM;
     }
-    while(cli_dbgets(buffer, sizeof(buffer), fs, dbio)) {
-	line++;
-	if(buffer[0] == '#')
-	    continue;
-	sigs++;
-	cli_chomp(buffer);
+    if(dbio && dbio->member) {
+	ret = cli_loadldb_staged(engine, dbio->member, buffer_cpy, options, dbname, &line, &sigs);
+	if(dbio->memsize)
+	    dbio->bread = dbio->memsize;
+    } else {
+	while(cli_dbgets(buffer, sizeof(buffer), fs, dbio)) {
+	    line++;
+	    if(buffer[0] == '#')
+		continue;
+	    sigs++;
+	    cli_chomp(buffer);
 
-	if(engine->ignored)
-	    strcpy(buffer_cpy, buffer);
-	ret = load_oneldb(buffer,
-			  engine->pua_cats && (options & CL_DB_PUA_MODE) && (options & (CL_DB_PUA_INCLUDE | CL_DB_PUA_EXCLUDE)),
-			  engine, options, dbname, line, &sigs, 0, buffer_cpy, NULL);
-	if (ret)
-	    break;
+	    if(engine->ignored)
+		strcpy(buffer_cpy, buffer);
+	    ret = load_oneldb(buffer,
+			      engine->pua_cats && (options & CL_DB_PUA_MODE) && (options & (CL_DB_PUA_INCLUDE | CL_DB_PUA_EXCLUDE)),
+			      engine, options, dbname, line, &sigs, 0, buffer_cpy, NULL);
+	    if (ret)
+		break;
+	}
     }
     if(engine->ignored)
 	free(buffer_cpy);
@@ -1924,23 +2050,163 @@ static int cli_loadign(FILE *fs, struct cl_engine *engine, unsigned int options,
 #define MD5_FP	    2
 
 #define MD5_TOKENS 5
-static int cli_loadhash(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigned int mode, unsigned int options, struct cli_dbio *dbio, const char *dbname)
+
+/* Signatures dropped by the PUA selection, the ignore lists or the
+ * sigload callback */
+static int cli_hashsig_skip(struct cl_engine *engine, const char *virname, const char *entry, unsigned int options, const char *dbname)
+{
+    if(engine->pua_cats && (options & CL_DB_PUA_MODE) && (options & (CL_DB_PUA_INCLUDE | CL_DB_PUA_EXCLUDE)))
+	if(cli_chkpua(virname, engine->pua_cats, options))
+	    return 1;
+
+    if(engine->ignored && cli_chkign(engine->ignored, virname, entry))
+	return 1;
+
+    if(engine->cb_sigload) {
+	const char *dot = strchr(dbname, '.');
+	if(!dot)
+	    dot = dbname;
+	else
+	    dot++;
+	if(engine->cb_sigload(dot, virname, ~options & CL_DB_OFFICIAL, engine->cb_sigload_ctx)) {
+	    cli_dbgmsg("cli_loadhash: skipping %s (%s) due to callback\n", virname, dot);
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+static int cli_loadhash_line(struct cl_engine *engine, struct cli_matcher *db, char *buffer, char *buffer_cpy, unsigned int mode, unsigned int options, const char *dbname, unsigned int line, unsigned int *sigs)
 {
     const char *tokens[MD5_TOKENS + 1];
-    char buffer[FILEBUFF], *buffer_cpy = NULL;
     const char *pt, *virname;
-    int ret = CL_SUCCESS;
-    unsigned int size_field = 1, md5_field = 0, line = 0, sigs = 0, tokens_count;
-    unsigned int req_fl = 0; 
-    struct cli_matcher *db;
+    unsigned int size_field = 1, md5_field = 0, tokens_count;
+    unsigned int req_fl = 0;
     unsigned long size;
-
+    int ret;
 
     if(mode == MD5_MDB) {
 	size_field = 0;
 	md5_field = 1;
+    }
+
+    if(buffer[0] == '#')
+	return CL_SUCCESS;
+    cli_chomp(buffer);
+    if(engine->ignored)
+	strcpy(buffer_cpy, buffer);
+
+    tokens_count = cli_strtokenize(buffer, ':', MD5_TOKENS + 1, tokens);
+    if(tokens_count < 3)
+	return CL_EMALFDB;
+    if(tokens_count > MD5_TOKENS - 2) {
+	req_fl = atoi(tokens[MD5_TOKENS - 2]);
+
+	if(tokens_count > MD5_TOKENS)
+	    return CL_EMALFDB;
+
+	if(cl_retflevel() < req_fl)
+	    return CL_SUCCESS;
+	if(tokens_count == MD5_TOKENS) {
+	    int max_fl = atoi(tokens[MD5_TOKENS - 1]);
+	    if(cl_retflevel() > max_fl)
+		return CL_SUCCESS;
+	}
+    }
+
+    if((mode == MD5_MDB) || strcmp(tokens[size_field],"*")) {
+	size = strtoul(tokens[size_field], (char **)&pt, 10);
+	if(*pt || !size || size >= 0xffffffff) {
+	    cli_errmsg("cli_loadhash: Invalid value for the size field\n");
+	    return CL_EMALFDB;
+	}
+    }
+    else {
+	size = 0;
+	if((tokens_count < MD5_TOKENS - 1) || (req_fl < 73)) {
+	    cli_errmsg("cli_loadhash: Minimum FLEVEL field must be at least 73 for wildcard size hash signatures."
+		    " For reference, running FLEVEL is %d\n", cl_retflevel());
+	    return CL_EMALFDB;
+	}
+    }
+
+    pt = tokens[2]; /* virname */
+    if(cli_hashsig_skip(engine, pt, buffer_cpy, options, dbname))
+	return CL_SUCCESS;
+
+    virname = cli_mpool_virname(engine->mempool, pt, options & CL_DB_OFFICIAL);
+    if(!virname)
+	return CL_EMALFDB;
+
+    if((ret = hm_addhash_str(db, tokens[md5_field], size, virname))) {
+	cli_errmsg("cli_loadhash: Malformed hash string at line %u\n", line);
+	mpool_free(engine->mempool, (void *)virname);
+	return ret;
+    }
+
+    (*sigs)++;
+    return CL_SUCCESS;
+}
+
+/* Same as the text loop in cli_loadhash() for a database parsed by the
+ * loader threads, only the raw records go through cli_loadhash_line() */
+static int cli_loadhash_staged(struct cl_engine *engine, struct cli_matcher *db, const struct cli_dbstage_member *member, char *buffer, char *buffer_cpy, unsigned int mode, unsigned int options, const char *dbname, unsigned int *line, unsigned int *sigs)
+{
+    const struct cli_dbstage_chunk *chunk;
+    const struct cli_dbstage_hash *rec;
+    char name[FILEBUFF];
+    const char *virname;
+    unsigned int base = 0, i, j;
+    int ret;
+
+    for(i = 0; i < member->nchunks; i++) {
+	chunk = &member->chunks[i];
+	for(j = 0; j < chunk->nhashes; j++) {
+	    rec = &chunk->hashes[j];
+	    *line = base + rec->line;
+	    memcpy(buffer, chunk->data + rec->entry, rec->entrylen);
+	    buffer[rec->entrylen] = 0;
+	    if(rec->raw) {
+		if((ret = cli_loadhash_line(engine, db, buffer, buffer_cpy, mode, options, dbname, *line, sigs)))
+		    return ret;
+		continue;
+	    }
+
+	    memcpy(name, buffer + rec->virname, rec->virlen);
+	    name[rec->virlen] = 0;
+	    if(cli_hashsig_skip(engine, name, buffer, options, dbname))
+		continue;
+
+	    virname = cli_mpool_virname(engine->mempool, name, options & CL_DB_OFFICIAL);
+	    if(!virname)
+		return CL_EMALFDB;
+
+	    if((ret = hm_addhash_bin(db, rec->digest, rec->type, rec->size, virname))) {
+		cli_errmsg("cli_loadhash: Malformed hash string at line %u\n", *line);
+		mpool_free(engine->mempool, (void *)virname);
+		return ret;
+	    }
+	    (*sigs)++;
+	}
+	base += chunk->lines;
+    }
+    *line = base;
+
+    return CL_SUCCESS;
+}
+
+static int cli_loadhash(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigned int mode, unsigned int options, struct cli_dbio *dbio, const char *dbname)
+{
+    char buffer[FILEBUFF], *buffer_cpy = NULL;
+    int ret = CL_SUCCESS;
+    unsigned int line = 0, sigs = 0;
+    struct cli_matcher *db;
+
+
+    if(mode == MD5_MDB)
 	db = engine->hm_mdb;
-    } else if(mode == MD5_HDB)
+    else if(mode == MD5_HDB)
 	db = engine->hm_hdb;
     else
 	db = engine->hm_fp;
@@ -1965,87 +2231,16 @@ static int cli_loadhash(FILE *fs, struct cl_engine *engine, unsigned int *signo,
 	    return CL_EMEM;
     }
 
-    while(cli_dbgets(buffer, FILEBUFF, fs, dbio)) {
-	line++;
-	if(buffer[0] == '#')
-	    continue;
-	cli_chomp(buffer);
-	if(engine->ignored)
-	    strcpy(buffer_cpy, buffer);
-
-	tokens_count = cli_strtokenize(buffer, ':', MD5_TOKENS + 1, tokens);
-	if(tokens_count < 3) {
-	    ret = CL_EMALFDB;
-	    break;
-	}
-	if(tokens_count > MD5_TOKENS - 2) {
-	    req_fl = atoi(tokens[MD5_TOKENS - 2]);
-
-	    if(tokens_count > MD5_TOKENS) {
-		ret = CL_EMALFDB;
-		break;
-	    }
-
-	    if(cl_retflevel() < req_fl)
-		continue;
-	    if(tokens_count == MD5_TOKENS) {
-		int max_fl = atoi(tokens[MD5_TOKENS - 1]);
-		if(cl_retflevel() > max_fl)
-		    continue;
-	    }
-	}
-
-	if((mode == MD5_MDB) || strcmp(tokens[size_field],"*")) {
-	    size = strtoul(tokens[size_field], (char **)&pt, 10);
-	    if(*pt || !size || size >= 0xffffffff) {
-		cli_errmsg("cli_loadhash: Invalid value for the size field\n");
-		ret = CL_EMALFDB;
-		break;
-	    }
-	}
-	else {
-	    size = 0;
-	    if((tokens_count < MD5_TOKENS - 1) || (req_fl < 73)) {
-		cli_errmsg("cli_loadhash: Minimum FLEVEL field must be at least 73 for wildcard size hash signatures."
-			" For reference, running FLEVEL is %d\n", cl_retflevel());
-		ret = CL_EMALFDB;
+    if(dbio && dbio->member) {
+	ret = cli_loadhash_staged(engine, db, dbio->member, buffer, buffer_cpy, mode, options, dbname, &line, &sigs);
+	if(dbio->memsize)
+	    dbio->bread = dbio->memsize;
+    } else {
+	while(cli_dbgets(buffer, FILEBUFF, fs, dbio)) {
+	    line++;
+	    if((ret = cli_loadhash_line(engine, db, buffer, buffer_cpy, mode, options, dbname, line, &sigs)))
 		break;
-	    }
-	}
-
-	pt = tokens[2]; /* virname */
-	if(engine->pua_cats && (options & CL_DB_PUA_MODE) && (options & (CL_DB_PUA_INCLUDE | CL_DB_PUA_EXCLUDE)))
-	    if(cli_chkpua(pt, engine->pua_cats, options))
-		continue;
-
-	if(engine->ignored && cli_chkign(engine->ignored, pt, buffer_cpy))
-	    continue;
-
-	if(engine->cb_sigload) {
-	    const char *dot = strchr(dbname, '.');
-	    if(!dot)
-		dot = dbname;
-	    else
-		dot++;
-	    if(engine->cb_sigload(dot, pt, ~options & CL_DB_OFFICIAL, engine->cb_sigload_ctx)) {
-		cli_dbgmsg("cli_loadhash: skipping %s (%s) due to callback\n", pt, dot);
-	        continue;
-	    }
 	}
-
-	virname = cli_mpool_virname(engine->mempool, pt, options & CL_DB_OFFICIAL);
-	if(!virname) {
-	    ret = CL_EMALFDB;
-	    break;
-	}
-
-	if((ret = hm_addhash_str(db, tokens[md5_field], size, virname))) {
-	    cli_errmsg("cli_loadhash: Malformed hash string at line %u\n", line);
-	    mpool_free(engine->mempool, (void *)virname);
-	    break;
-	}
-
-	sigs++;
     }
     if(engine->ignored)
 	free(buffer_cpy);
@@ -2222,163 +2417,199 @@ static int cli_loadmd(FILE *fs, struct cl_engine *engine, unsigned int *signo, i
  */
 
 #define CDB_TOKENS 12
-static int cli_loadcdb(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigned int options, struct cli_dbio *dbio)
+static int cli_loadcdb_line(struct cl_engine *engine, const char **tokens, unsigned int tokens_count, unsigned int options, unsigned int *sigs)
 {
-	const char *tokens[CDB_TOKENS + 1];
-	char buffer[FILEBUFF], *buffer_cpy = NULL;
-	unsigned int line = 0, sigs = 0, tokens_count, n0, n1;
+	unsigned int n0, n1;
 	int ret = CL_SUCCESS;
 	struct cli_cdb *new;
 
 
-    if(engine->ignored)
-	if(!(buffer_cpy = cli_malloc(FILEBUFF))) {
-        cli_errmsg("cli_loadcdb: Can't allocate memory for buffer_cpy\n");
-	    return CL_EMEM;
+    if(tokens_count > CDB_TOKENS || tokens_count < CDB_TOKENS - 2) {
+	return CL_EMALFDB;
     }
 
-    while(cli_dbgets(buffer, FILEBUFF, fs, dbio)) {
-	line++;
-	if(buffer[0] == '#')
-	    continue;
-
-	cli_chomp(buffer);
-	if(engine->ignored)
-	    strcpy(buffer_cpy, buffer);
-
-	tokens_count = cli_strtokenize(buffer, ':', CDB_TOKENS + 1, tokens);
-	if(tokens_count > CDB_TOKENS || tokens_count < CDB_TOKENS - 2) {
-	    ret = CL_EMALFDB;
-	    break;
+    if(tokens_count > 10) { /* min version */
+	if(!cli_isnumber(tokens[10])) {
+	    return CL_EMALFDB;
 	}
-
-	if(tokens_count > 10) { /* min version */
-	    if(!cli_isnumber(tokens[10])) {
-		ret = CL_EMALFDB;
-		break;
-	    }
-	    if((unsigned int) atoi(tokens[10]) > cl_retflevel()) {
-		cli_dbgmsg("cli_loadcdb: Container signature for %s not loaded (required f-level: %u)\n", tokens[0], atoi(tokens[10]));
-		continue;
-	    }
-	    if(tokens_count == CDB_TOKENS) { /* max version */
-		if(!cli_isnumber(tokens[11])) {
-		    ret = CL_EMALFDB;
-		    break;
-		}
-		if((unsigned int) atoi(tokens[11]) < cl_retflevel())
-		    continue;
+	if((unsigned int) atoi(tokens[10]) > cl_retflevel()) {
+	    cli_dbgmsg("cli_loadcdb: Container signature for %s not loaded (required f-level: %u)\n", tokens[0], atoi(tokens[10]));
+	    return CL_SUCCESS;
+	}
+	if(tokens_count == CDB_TOKENS) { /* max version */
+	    if(!cli_isnumber(tokens[11])) {
+		return CL_EMALFDB;
 	    }
+	    if((unsigned int) atoi(tokens[11]) < cl_retflevel())
+		return CL_SUCCESS;
 	}
+    }
 
-	new = (struct cli_cdb *) mpool_calloc(engine->mempool, 1, sizeof(struct cli_cdb));
-	if(!new) {
-	    ret = CL_EMEM;
-	    break;
-	}
+    new = (struct cli_cdb *) mpool_calloc(engine->mempool, 1, sizeof(struct cli_cdb));
+    if(!new) {
+	return CL_EMEM;
+    }
 
-	new->virname = cli_mpool_virname(engine->mempool, tokens[0], options & CL_DB_OFFICIAL);
-	if(!new->virname) {
-	    mpool_free(engine->mempool, new);
-	    ret = CL_EMEM;
-	    break;
-	}
+    new->virname = cli_mpool_virname(engine->mempool, tokens[0], options & CL_DB_OFFICIAL);
+    if(!new->virname) {
+	mpool_free(engine->mempool, new);
+	return CL_EMEM;
+    }
 
-	if(engine->ignored && cli_chkign(engine->ignored, new->virname, buffer/*_cpy*/)) {
-	    mpool_free(engine->mempool, new->virname);
-	    mpool_free(engine->mempool, new);
-	    continue;
-	}
+    if(engine->ignored && cli_chkign(engine->ignored, new->virname, tokens[0])) {
+	mpool_free(engine->mempool, new->virname);
+	mpool_free(engine->mempool, new);
+	return CL_SUCCESS;
+    }
 
-	if(engine->cb_sigload && engine->cb_sigload("cdb", new->virname, ~options & CL_DB_OFFICIAL, engine->cb_sigload_ctx)) {
-	    cli_dbgmsg("cli_loadcdb: skipping %s due to callback\n", new->virname);
-	    mpool_free(engine->mempool, new->virname);
-	    mpool_free(engine->mempool, new);
-	    continue;
-	}
+    if(engine->cb_sigload && engine->cb_sigload("cdb", new->virname, ~options & CL_DB_OFFICIAL, engine->cb_sigload_ctx)) {
+	cli_dbgmsg("cli_loadcdb: skipping %s due to callback\n", new->virname);
+	mpool_free(engine->mempool, new->virname);
+	mpool_free(engine->mempool, new);
+	return CL_SUCCESS;
+    }
 
-	if(!strcmp(tokens[1], "*")) {
-	    new->ctype = CL_TYPE_ANY;
-	} else if((new->ctype = cli_ftcode(tokens[1])) == CL_TYPE_ERROR) {
-	    cli_dbgmsg("cli_loadcdb: Unknown container type %s in signature for %s, skipping\n", tokens[1], tokens[0]);
+    if(!strcmp(tokens[1], "*")) {
+	new->ctype = CL_TYPE_ANY;
+    } else if((new->ctype = cli_ftcode(tokens[1])) == CL_TYPE_ERROR) {
+	cli_dbgmsg("cli_loadcdb: Unknown container type %s in signature for %s, skipping\n", tokens[1], tokens[0]);
+	mpool_free(engine->mempool, new->virname);
+	mpool_free(engine->mempool, new);
+	return CL_SUCCESS;
+    }
+
+    if(strcmp(tokens[3], "*") && cli_regcomp(&new->name, tokens[3], REG_EXTENDED | REG_NOSUB)) {
+	cli_errmsg("cli_loadcdb: Can't compile regular expression %s in signature for %s\n", tokens[3], tokens[0]);
+	mpool_free(engine->mempool, new->virname);
+	mpool_free(engine->mempool, new);
+	return CL_EMEM;
+    }
+
+#define CDBRANGE(token_str, dest)					    \
+    if(strcmp(token_str, "*")) {					    \
+	if(strchr(token_str, '-')) {					    \
+	    if(sscanf(token_str, "%u-%u", &n0, &n1) != 2) {		    \
+		ret = CL_EMALFDB;					    \
+	    } else {							    \
+		dest[0] = n0;						    \
+		dest[1] = n1;						    \
+	    }								    \
+	} else {							    \
+	    if(!cli_isnumber(token_str))				    \
+		ret = CL_EMALFDB;					    \
+	    else							    \
+		dest[0] = dest[1] = atoi(token_str);			    \
+	}								    \
+	if(ret != CL_SUCCESS) {						    \
+	    cli_errmsg("cli_loadcdb: Invalid value %s in signature for %s\n",\
+		token_str, tokens[0]);					    \
+	    if(new->name.re_magic)					    \
+		cli_regfree(&new->name);				    \
+	    mpool_free(engine->mempool, new->virname);			    \
+	    mpool_free(engine->mempool, new);				    \
+	    return CL_EMEM;						    \
+	}								    \
+    } else {								    \
+	dest[0] = dest[1] = CLI_OFF_ANY;				    \
+    }
+
+    CDBRANGE(tokens[2], new->csize);
+    CDBRANGE(tokens[4], new->fsizec);
+    CDBRANGE(tokens[5], new->fsizer);
+    CDBRANGE(tokens[7], new->filepos);
+
+    if(!strcmp(tokens[6], "*")) {
+	new->encrypted = 2;
+    } else {
+	if(strcmp(tokens[6], "0") && strcmp(tokens[6], "1")) {
+	    cli_errmsg("cli_loadcdb: Invalid encryption flag value in signature for %s\n", tokens[0]);
+	    if(new->name.re_magic)
+		cli_regfree(&new->name);
 	    mpool_free(engine->mempool, new->virname);
 	    mpool_free(engine->mempool, new);
-	    continue;
+	    return CL_EMEM;
 	}
+	new->encrypted = *tokens[6] - 0x30;
+    }
 
-	if(strcmp(tokens[3], "*") && cli_regcomp(&new->name, tokens[3], REG_EXTENDED | REG_NOSUB)) {
-	    cli_errmsg("cli_loadcdb: Can't compile regular expression %s in signature for %s\n", tokens[3], tokens[0]);
+    if(strcmp(tokens[9], "*")) {
+	new->res2 = cli_mpool_strdup(engine->mempool, tokens[9]);
+	if(!new->res2) {
+	    cli_errmsg("cli_loadcdb: Can't allocate memory for res2 in signature for %s\n", tokens[0]);
+	    if(new->name.re_magic)
+		cli_regfree(&new->name);
 	    mpool_free(engine->mempool, new->virname);
 	    mpool_free(engine->mempool, new);
-	    ret = CL_EMEM;
-	    break;
+	    return CL_EMEM;
 	}
+    }
 
-#define CDBRANGE(token_str, dest)					    \
-	if(strcmp(token_str, "*")) {					    \
-	    if(strchr(token_str, '-')) {				    \
-		if(sscanf(token_str, "%u-%u", &n0, &n1) != 2) {		    \
-		    ret = CL_EMALFDB;					    \
-		} else {						    \
-		    dest[0] = n0;					    \
-		    dest[1] = n1;					    \
-		}							    \
-	    } else {							    \
-		if(!cli_isnumber(token_str))				    \
-		    ret = CL_EMALFDB;					    \
-		else							    \
-		    dest[0] = dest[1] = atoi(token_str);		    \
-	    }								    \
-	    if(ret != CL_SUCCESS) {					    \
-		cli_errmsg("cli_loadcdb: Invalid value %s in signature for %s\n",\
-		    token_str, tokens[0]);				    \
-		if(new->name.re_magic)					    \
-		    cli_regfree(&new->name);				    \
-		mpool_free(engine->mempool, new->virname);		    \
-		mpool_free(engine->mempool, new);			    \
-		ret = CL_EMEM;						    \
-		break;							    \
-	    }								    \
-	} else {							    \
-	    dest[0] = dest[1] = CLI_OFF_ANY;				    \
-	}
 
-	CDBRANGE(tokens[2], new->csize);
-	CDBRANGE(tokens[4], new->fsizec);
-	CDBRANGE(tokens[5], new->fsizer);
-	CDBRANGE(tokens[7], new->filepos);
+    new->next = engine->cdb;
+    engine->cdb = new;
+    (*sigs)++;
 
-	if(!strcmp(tokens[6], "*")) {
-	    new->encrypted = 2;
-	} else {
-	    if(strcmp(tokens[6], "0") && strcmp(tokens[6], "1")) {
-		cli_errmsg("cli_loadcdb: Invalid encryption flag value in signature for %s\n", tokens[0]);
-		if(new->name.re_magic)
-		    cli_regfree(&new->name);
-		mpool_free(engine->mempool, new->virname);
-		mpool_free(engine->mempool, new);
-		ret = CL_EMEM;
-		break;
-	    }
-	    new->encrypted = *tokens[6] - 0x30;
+    return CL_SUCCESS;
+}
+
+/* Same as the text loop in cli_loadcdb() for a database split up by the
+ * loader threads */
+static int cli_loadcdb_staged(struct cl_engine *engine, const struct cli_dbstage_member *member, unsigned int options, unsigned int *line, unsigned int *sigs)
+{
+	const struct cli_dbstage_chunk *chunk;
+	const struct cli_dbstage_sig *rec;
+	const char *tokens[CDB_TOKENS + 1];
+	unsigned int base = 0, i, j;
+	int ret;
+
+    for(i = 0; i < member->nchunks; i++) {
+	chunk = &member->chunks[i];
+	for(j = 0; j < chunk->nsigs; j++) {
+	    rec = &chunk->sigs[j];
+	    *line = base + rec->line;
+	    cli_dbstage_fields(chunk, rec, tokens, CDB_TOKENS + 1);
+	    if((ret = cli_loadcdb_line(engine, tokens, rec->nfields, options, sigs)))
+		return ret;
 	}
+	base += chunk->lines;
+    }
+    *line = base;
 
-	if(strcmp(tokens[9], "*")) {
-	    new->res2 = cli_mpool_strdup(engine->mempool, tokens[9]);
-	    if(!new->res2) {
-		cli_errmsg("cli_loadcdb: Can't allocate memory for res2 in signature for %s\n", tokens[0]);
-		if(new->name.re_magic)
-		    cli_regfree(&new->name);
-		mpool_free(engine->mempool, new->virname);
-		mpool_free(engine->mempool, new);
-		ret = CL_EMEM;
+    return CL_SUCCESS;
+}
+
+static int cli_loadcdb(FILE *fs, struct cl_engine *engine, unsigned int *signo, unsigned int options, struct cli_dbio *dbio)
+{
+	const char *tokens[CDB_TOKENS + 1];
+	char buffer[FILEBUFF], *buffer_cpy = NULL;
+	unsigned int line = 0, sigs = 0, tokens_count;
+	int ret = CL_SUCCESS;
+
+
+    if(engine->ignored)
+	if(!(buffer_cpy = cli_malloc(FILEBUFF))) {
+        cli_errmsg("cli_loadcdb: Can't allocate memory for buffer_cpy\n");
+	    return CL_EMEM;
+    }
+
+    if(dbio && dbio->member) {
+	ret = cli_loadcdb_staged(engine, dbio->member, options, &line, &sigs);
+	if(dbio->memsize)
+	    dbio->bread = dbio->memsize;
+    } else {
+	while(cli_dbgets(buffer, FILEBUFF, fs, dbio)) {
+	    line++;
+	    if(buffer[0] == '#')
+		continue;
+
+	    cli_chomp(buffer);
+	    if(engine->ignored)
+		strcpy(buffer_cpy, buffer);
+
+	    tokens_count = cli_strtokenize(buffer, ':', CDB_TOKENS + 1, tokens);
+	    if((ret = cli_loadcdb_line(engine, tokens, tokens_count, options, &sigs)))
 		break;
-	    }
 	}
-
-	new->next = engine->cdb;
-	engine->cdb = new;
-	sigs++;
     }
     if(engine->ignored)
 	free(buffer_cpy);
@@ -2576,20 +2807,84 @@ end:
 
 static int cli_loadmscat(FILE *fs, const char *dbname, struct cl_engine *engine, unsigned int options, struct cli_dbio *dbio) {
     fmap_t *map;
+    struct cli_matcher *fp = engine->hm_fp;
 
     if(!(map = fmap(fileno(fs), 0, 0))) {
 	cli_dbgmsg("Can't map cat: %s\n", dbname);
 	return 0;
     }
 
+    /* a snapshot being loaded has the hashes, only the certificates are
+     * needed again */
+    if(options & CL_DB_SNAPSHOT)
+	engine->hm_fp = NULL;
     if(asn1_load_mscat(map, engine))
 	cli_dbgmsg("Failed to load certificates from cat: %s\n", dbname);
+    if(options & CL_DB_SNAPSHOT) {
+	if(engine->hm_fp) {
+	    hm_free(engine->hm_fp);
+	    mpool_free(engine->mempool, engine->hm_fp);
+	}
+	engine->hm_fp = fp;
+    }
     funmap(map);
     return 0;
 }
 
+static int cli_dbdir_add(char ***dbfiles, unsigned int *nfiles, const char *dbfile)
+{
+	char **files;
+
+    if(!(*nfiles % 32)) {
+	if(!(files = cli_realloc(*dbfiles, (*nfiles + 32) * sizeof(char *))))
+	    return CL_EMEM;
+	*dbfiles = files;
+    }
+    if(!((*dbfiles)[*nfiles] = cli_strdup(dbfile)))
+	return CL_EMEM;
+    (*nfiles)++;
+    return CL_SUCCESS;
+}
+
+static void cli_dbdir_free(char **dbfiles, unsigned int nfiles)
+{
+	unsigned int i;
+
+    for(i = 0; i < nfiles; i++)
+	free(dbfiles[i]);
+    free(dbfiles);
+}
+
 static int cli_loaddbdir(const char *dirname, struct cl_engine *engine, unsigned int *signo, unsigned int options);
 
+/* Chains the name and the contents of a database into engine->dbdigest, so
+ * that the cache file notices any change of the signature set. Only the
+ * header of a CVD is hashed, it has the version and the MD5 of the rest */
+static void cli_dbdigest(struct cl_engine *engine, const char *dbname, FILE *fs, const char *data, size_t size)
+{
+	cli_md5_ctx md5;
+	char buff[FILEBUFF];
+	size_t bytes, max = size;
+	int cvd = cli_strbcasestr(dbname, ".cvd") || cli_strbcasestr(dbname, ".cld") || cli_strbcasestr(dbname, ".cud");
+
+    cli_md5_init(&md5);
+    cli_md5_update(&md5, engine->dbdigest, sizeof(engine->dbdigest));
+    cli_md5_update(&md5, dbname, strlen(dbname) + 1);
+    if(fs) {
+	while((bytes = fread(buff, 1, cvd ? 512 : FILEBUFF, fs))) {
+	    cli_md5_update(&md5, buff, bytes);
+	    if(cvd)
+		break;
+	}
+	rewind(fs);
+    } else if(data) {
+	if(cvd && max > 512)
+	    max = 512;
+	cli_md5_update(&md5, data, max);
+    }
+    cli_md5_final(engine->dbdigest, &md5);
+}
+
 int cli_load(const char *filename, struct cl_engine *engine, unsigned int *signo, unsigned int options, struct cli_dbio *dbio)
 {
 	FILE *fs = NULL;
@@ -2597,6 +2892,7 @@ int cli_load(const char *filename, struct cl_engine *engine, unsigned int *signo
 	uint8_t skipped = 0;
 	const char *dbname;
 	char buff[FILEBUFF];
+	STATBUF sb;
 
 
     if(dbio && dbio->chkonly) {
@@ -2622,7 +2918,27 @@ int cli_load(const char *filename, struct cl_engine *engine, unsigned int *signo
     else
 	dbname = filename;
 
-    if(cli_strbcasestr(dbname, ".db")) {
+    /* the files inside a CVD are covered by its header; a snapshot being
+     * loaded has the digest and the files already */
+    if(!(options & CL_DB_SNAPSHOT) && (!dbio || dbio->stage)) {
+	if(!dbio)
+	    cli_dbdigest(engine, dbname, fs, NULL, 0);
+	else
+	    cli_dbdigest(engine, dbname, NULL, dbio->stage->file, dbio->stage->filesize);
+	if(CLAMSTAT(filename, &sb) != -1 && cli_snapshot_adddb(engine, filename, &sb, 0)) {
+	    if(fs)
+		fclose(fs);
+	    return CL_EMEM;
+	}
+    }
+
+    if((options & CL_DB_SNAPSHOT) && !cli_snapshot_reload(dbname)) {
+	skipped = 1;
+
+    } else if(dbio && dbio->stage && dbio->stage->dbtype >= 0) {
+	ret = cli_cvdload_staged(dbio->stage, engine, signo, options);
+
+    } else if(cli_strbcasestr(dbname, ".db")) {
 	ret = cli_loaddb(fs, engine, signo, options, dbio, dbname);
 
     } else if(cli_strbcasestr(dbname, ".cvd")) {
@@ -2746,10 +3062,14 @@ static int cli_loaddbdir(const char *dirname, struct cl_engine *engine, unsigned
 	    char b[offsetof(struct dirent, d_name) + NAME_MAX + 1];
 	} result;
 #endif
-	char *dbfile;
+	char *dbfile, **dbfiles = NULL;
 	int ret = CL_EOPEN, have_cld, ends_with_sep = 0;
 	size_t dirname_len;
 	struct cl_cvd *daily_cld, *daily_cvd;
+	unsigned int nfiles = 0, nfirst, nthreads, i;
+	struct cli_dbstager *stager = NULL;
+	struct cli_dbstage *stage;
+	struct cli_dbio dbio;
 
 
     cli_dbgmsg("Loading databases from %s\n", dirname);
@@ -2800,7 +3120,8 @@ static int cli_loaddbdir(const char *dirname, struct cl_engine *engine, unsigned
 	}
     }
 
-    /* the daily db must be loaded before main */
+    /* the daily db must be loaded before main; the rest is only collected
+     * here so that the loader threads can read ahead */
     dbfile = (char *) cli_malloc(dirname_len + 20);
     if(!dbfile) {
 	closedir(dd);
@@ -2853,10 +3174,11 @@ static int cli_loaddbdir(const char *dirname, struct cl_engine *engine, unsigned
     if(have_cld)
 	cl_cvdfree(daily_cld);
 
-    if(!access(dbfile, R_OK) && (ret = cli_load(dbfile, engine, signo, options, NULL))) {
+    if(!access(dbfile, R_OK) && cli_dbdir_add(&dbfiles, &nfiles, dbfile)) {
 	free(dbfile);
+	cli_dbdir_free(dbfiles, nfiles);
 	closedir(dd);
-	return ret;
+	return CL_EMEM;
     }
 
     /* try to load local.gdb next */
@@ -2864,10 +3186,11 @@ static int cli_loaddbdir(const char *dirname, struct cl_engine *engine, unsigned
         sprintf(dbfile, "%slocal.gdb", dirname);
     else
         sprintf(dbfile, "%s"PATHSEP"local.gdb", dirname);
-    if(!access(dbfile, R_OK) && (ret = cli_load(dbfile, engine, signo, options, NULL))) {
+    if(!access(dbfile, R_OK) && cli_dbdir_add(&dbfiles, &nfiles, dbfile)) {
 	free(dbfile);
+	cli_dbdir_free(dbfiles, nfiles);
 	closedir(dd);
-	return ret;
+	return CL_EMEM;
     }
 
     /* check for and load daily.cfg */
@@ -2875,12 +3198,14 @@ static int cli_loaddbdir(const char *dirname, struct cl_engine *engine, unsigned
         sprintf(dbfile, "%sdaily.cfg", dirname);
     else
         sprintf(dbfile, "%s"PATHSEP"daily.cfg", dirname);
-    if(!access(dbfile, R_OK) && (ret = cli_load(dbfile, engine, signo, options, NULL))) {
+    if(!access(dbfile, R_OK) && cli_dbdir_add(&dbfiles, &nfiles, dbfile)) {
 	free(dbfile);
+	cli_dbdir_free(dbfiles, nfiles);
 	closedir(dd);
-	return ret;
+	return CL_EMEM;
     }
     free(dbfile);
+    nfirst = nfiles;
 
     /* second round - load everything else */
     rewinddir(dd);
@@ -2902,6 +3227,7 @@ static int cli_loaddbdir(const char *dirname, struct cl_engine *engine, unsigned
 		dbfile = (char *) cli_malloc(strlen(dent->d_name) + dirname_len + 2);
 		if(!dbfile) {
 		    cli_errmsg("cli_loaddbdir(): dbfile == NULL\n");
+		    cli_dbdir_free(dbfiles, nfiles);
 		    closedir(dd);
 		    return CL_EMEM;
 		}
@@ -2909,18 +3235,47 @@ static int cli_loaddbdir(const char *dirname, struct cl_engine *engine, unsigned
 		    sprintf(dbfile, "%s%s", dirname, dent->d_name);
                 else
 		    sprintf(dbfile, "%s"PATHSEP"%s", dirname, dent->d_name);
-		ret = cli_load(dbfile, engine, signo, options, NULL);
-		if(ret) {
-		    cli_errmsg("cli_loaddbdir(): error loading database %s\n", dbfile);
+		if(cli_dbdir_add(&dbfiles, &nfiles, dbfile)) {
 		    free(dbfile);
+		    cli_dbdir_free(dbfiles, nfiles);
 		    closedir(dd);
-		    return ret;
+		    return CL_EMEM;
 		}
 		free(dbfile);
 	    }
 	}
     }
     closedir(dd);
+
+    if(nfiles > 1 && (nthreads = cli_dbstage_threads(engine)) > 1)
+	stager = cli_dbstage_start(dbfiles, nfiles, nthreads, options);
+
+    for(i = 0; i < nfiles; i++) {
+	if(stager) {
+	    stage = cli_dbstage_get(stager, i);
+	    if(stage->passthrough) {
+		ret = cli_load(dbfiles[i], engine, signo, options, NULL);
+	    } else {
+		if(stage->dbtype < 0)
+		    cli_dbstage_dbio(&stage->members[0], &dbio);
+		else
+		    memset(&dbio, 0, sizeof(dbio));
+		dbio.stage = stage;
+		ret = cli_load(dbfiles[i], engine, signo, options, &dbio);
+	    }
+	    cli_dbstage_release(stager, i);
+	} else {
+	    ret = cli_load(dbfiles[i], engine, signo, options, NULL);
+	}
+	if(ret) {
+	    if(i >= nfirst)
+		cli_errmsg("cli_loaddbdir(): error loading database %s\n", dbfiles[i]);
+	    break;
+	}
+    }
+    if(stager)
+	cli_dbstage_stop(stager);
+    cli_dbdir_free(dbfiles, nfiles);
     if(ret == CL_EOPEN)
 	cli_errmsg("cli_loaddb(): No supported database files found in %s\n", dirname);
 
@@ -2930,6 +3285,7 @@ static int cli_loaddbdir(const char *dirname, struct cl_engine *engine, unsigned
 int cl_load(const char *path, struct cl_engine *engine, unsigned int *signo, unsigned int dboptions)
 {
 	STATBUF sb;
+	unsigned int sigs = 0, i;
 	int ret;
 
     if(!engine) {
@@ -2990,21 +3346,34 @@ int cl_load(const char *path, struct cl_engine *engine, unsigned int *signo, uns
     if(cli_cache_init(engine))
 	return CL_EMEM;
 
+    if((dboptions & CL_DB_SIGNATURE_STATS) && !engine->sigstats) {
+	if(!(engine->sigstats = cli_sigstats_new()))
+	    return CL_EMEM;
+	for(i = 0; i < CLI_MTARGETS; i++)
+	    if(engine->root[i])
+		engine->root[i]->sigstats = engine->sigstats;
+    }
+
     engine->dboptions |= dboptions;
+    if((ret = cli_snapshot_adddb(engine, path, &sb, 1)))
+	return ret;
 
     switch(sb.st_mode & S_IFMT) {
 	case S_IFREG:
-	    ret = cli_load(path, engine, signo, dboptions, NULL);
+	    ret = cli_load(path, engine, &sigs, dboptions, NULL);
 	    break;
 
 	case S_IFDIR:
-	    ret = cli_loaddbdir(path, engine, signo, dboptions | CL_DB_DIRECTORY);
+	    ret = cli_loaddbdir(path, engine, &sigs, dboptions | CL_DB_DIRECTORY);
 	    break;
 
 	default:
 	    cli_errmsg("cl_load(%s): Not supported database file type\n", path);
 	    return CL_EOPEN;
     }
+    engine->sigs += sigs;
+    if(signo)
+	*signo += sigs;
     return ret;
 }
 
@@ -3240,6 +3609,10 @@ int cl_engine_free(struct cl_engine *engine)
 #ifdef CL_THREAD_SAFE
     pthread_mutex_unlock(&cli_ref_mutex);
 #endif
+    if(engine->delta)
+	cl_engine_free(engine->delta);
+    cli_liveupdate_free(engine->liveupdate);
+
     if(engine->root) {
 	for(i = 0; i < CLI_MTARGETS; i++) {
 	    if((root = engine->root[i])) {
@@ -3249,11 +3622,15 @@ int cl_engine_free(struct cl_engine *engine)
 		if(root->ac_lsigtable) {
 		    for(j = 0; j < root->ac_lsigs; j++) {
 			mpool_free(engine->mempool, root->ac_lsigtable[j]->logic);
+			if(root->ac_lsigtable[j]->ops)
+			    mpool_free(engine->mempool, root->ac_lsigtable[j]->ops);
 			FREE_TDB(root->ac_lsigtable[j]->tdb);
 			mpool_free(engine->mempool, root->ac_lsigtable[j]);
 		    }
 		    mpool_free(engine->mempool, root->ac_lsigtable);
 		}
+		if(root->ac_lsigalways)
+		    mpool_free(engine->mempool, root->ac_lsigalways);
 		mpool_free(engine->mempool, root);
 	    }
 	}
@@ -3315,6 +3692,8 @@ int cl_engine_free(struct cl_engine *engine)
     if(engine->pua_cats)
 	mpool_free(engine->mempool, engine->pua_cats);
 
+    cli_snapshot_freedbs(engine);
+
     if(engine->iconcheck) {
 	struct icon_matcher *iconcheck = engine->iconcheck;
 	for(i=0; i<3; i++) {
@@ -3345,12 +3724,19 @@ int cl_engine_free(struct cl_engine *engine)
     if(engine->cache)
 	cli_cache_destroy(engine);
 
+    if(engine->cache_path)
+	mpool_free(engine->mempool, engine->cache_path);
+
     cli_ftfree(engine);
     if(engine->ignored) {
 	cli_bm_free(engine->ignored);
 	mpool_free(engine->mempool, engine->ignored);
     }
 
+    cli_snapshot_free(engine);
+    cli_sigstats_free(engine->sigstats);
+    cli_scanstats_free(engine->scanstats);
+
 #ifdef USE_MPOOL
     if(engine->mempool) mpool_destroy(engine->mempool);
 #endif
@@ -3376,9 +3762,23 @@ int cl_engine_compile(struct cl_engine *engine)
 	if((root = engine->root[i])) {
 	    if((ret = cli_ac_buildtrie(root)))
 		return ret;
+	    if((ret = cli_ac_lsigcompile(root)))
+		return ret;
 	    cli_dbgmsg("Matcher[%u]: %s: AC sigs: %u (reloff: %u, absoff: %u) BM sigs: %u (reloff: %u, absoff: %u) maxpatlen %u %s\n", i, cli_mtargets[i].name, root->ac_patterns, root->ac_reloff_num, root->ac_absoff_num, root->bm_patterns, root->bm_reloff_num, root->bm_absoff_num, root->maxpatlen, root->ac_only ? "(ac_only mode)" : "");
 	}
     }
+
+    /* Only the prefiltered targets are fused, to bound the memory spent
+     * on the extra tries */
+    if((engine->dconf->other & OTHER_CONF_FUSEDMATCHER) && engine->root[0] && engine->root[0]->ac_patterns) {
+	for(i = 1; i < CLI_MTARGETS; i++) {
+	    root = engine->root[i];
+	    if(root && root->ac_patterns && root->filter && !root->ac_fused)
+		if((ret = cli_ac_fuse(root, engine->root[0])))
+		    return ret;
+	}
+    }
+
     if(engine->hm_hdb)
 	hm_flush(engine->hm_hdb);
 
@@ -3408,6 +3808,8 @@ int cl_engine_compile(struct cl_engine *engine)
 	return ret;
     }
 
+    cli_cache_file_init(engine);
+
     engine->dboptions |= CL_DB_COMPILED;
     return CL_SUCCESS;
 }
@@ -3432,6 +3834,48 @@ int cl_engine_addref(struct cl_engine *engine)
     return CL_SUCCESS;
 }
 
+/* Returns a reference to the signatures added to the engine with
+ * cl_engine_update(), to be dropped with cl_engine_free() after the scan */
+const struct cl_engine *cli_engine_delta_get(const struct cl_engine *engine)
+{
+	struct cl_engine *delta;
+
+    if(!engine->delta)
+	return NULL;
+
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_lock(&cli_ref_mutex);
+#endif
+
+    if((delta = engine->delta))
+	delta->refcount++;
+
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_unlock(&cli_ref_mutex);
+#endif
+
+    return delta;
+}
+
+/* Publishes a new delta engine, the old one is returned to the caller */
+struct cl_engine *cli_engine_delta_swap(struct cl_engine *engine, struct cl_engine *delta)
+{
+	struct cl_engine *old;
+
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_lock(&cli_ref_mutex);
+#endif
+
+    old = engine->delta;
+    engine->delta = delta;
+
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_unlock(&cli_ref_mutex);
+#endif
+
+    return old;
+}
+
 static int countentries(const char *dbname, unsigned int *sigs)
 {
 	char buffer[CLI_DEFAULT_LSIG_BUFSIZE + 1];
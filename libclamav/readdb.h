@@ -74,4 +74,7 @@ char *cli_dbgets(char *buff, unsigned int size, FILE *fs, struct cli_dbio *dbio)
 
 int cli_initroots(struct cl_engine *engine, unsigned int options);
 
+const struct cl_engine *cli_engine_delta_get(const struct cl_engine *engine);
+struct cl_engine *cli_engine_delta_swap(struct cl_engine *engine, struct cl_engine *delta);
+
 #endif
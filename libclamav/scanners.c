@@ -98,6 +98,8 @@
 #include "xar.h"
 #include "hfsplus.h"
 #include "xz_iface.h"
+#include "readdb.h"
+#include "scanstats.h"
 
 #ifdef HAVE_BZLIB_H
 #include <bzlib.h>
@@ -507,14 +509,15 @@ static int cli_scangzip_with_zib_from_the_80s(cli_ctx *ctx, unsigned char *buff)
     return ret;
 }
 
-static int cli_scangzip(cli_ctx *ctx)
+static int cli_scangzip(cli_ctx *ctx, int stream)
 {
-	int fd, ret = CL_CLEAN;
+	int ret = CL_CLEAN;
 	unsigned char buff[FILEBUFF];
-	char *tmpname;
+	struct cli_outfile out;
 	z_stream z;
 	size_t at = 0, outsize = 0;
 	fmap_t *map = *ctx->fmap;
+	const void *isize;
  	
     cli_dbgmsg("in cli_scangzip()\n");
 
@@ -524,23 +527,24 @@ static int cli_scangzip(cli_ctx *ctx)
 	return cli_scangzip_with_zib_from_the_80s(ctx, buff);
     }
 
-    if((ret = cli_gentempfd(ctx->engine->tmpdir, &tmpname, &fd)) != CL_SUCCESS) {
+    if((ret = cli_outfile_open(&out, ctx, NULL)) != CL_SUCCESS) {
 	cli_dbgmsg("GZip: Can't generate temporary file.\n");
 	inflateEnd(&z);
+	cli_outfile_close(&out, ctx);
 	return ret;
     }
+    out.streamable = stream;
+    /* ISIZE, the length of the (last) member modulo 2^32 */
+    if(stream && map->len >= 18 && (isize = fmap_need_off_once(map, map->len - 4, 4)))
+	out.expect = cli_readint32(isize);
 
     while (at < map->len) {
 	unsigned int bytes = MIN(map->len - at, map->pgsz);
 	if(!(z.next_in = (void*)fmap_need_off_once(map, at, bytes))) {
 	    cli_dbgmsg("GZip: Can't read %u bytes @ %lu.\n", bytes, (long unsigned)at);
 	    inflateEnd(&z);
-	    close(fd);
-	    if (cli_unlink(tmpname)) {
-		free(tmpname);
+	    if (cli_outfile_close(&out, ctx))
 		return CL_EUNLINK;
-	    }
-	    free(tmpname);
 	    return CL_EREAD;
 	}
 	at += bytes;
@@ -555,15 +559,15 @@ static int cli_scangzip(cli_ctx *ctx)
 		at = map->len;
 		break;
 	    }
-	    if(cli_writen(fd, buff, sizeof(buff) - z.avail_out) < 0) {
+	    if((ret = cli_outfile_write(&out, ctx, buff, sizeof(buff) - z.avail_out)) != CL_SUCCESS) {
+		if(ret == CL_BREAK) {
+		    at = map->len;
+		    break;
+		}
 		inflateEnd(&z);	    
-		close(fd);
-		if (cli_unlink(tmpname)) {
-		    free(tmpname);
+		if (cli_outfile_close(&out, ctx))
 		    return CL_EUNLINK;
-		}
-		free(tmpname);
-		return CL_EWRITE;
+		return ret;
 	    }
 	    outsize += sizeof(buff) - z.avail_out;
 	    if(cli_checklimits("GZip", ctx, outsize, 0, 0)!=CL_CLEAN) {
@@ -580,27 +584,19 @@ static int cli_scangzip(cli_ctx *ctx)
 
     inflateEnd(&z);	    
 
-    if((ret = cli_magic_scandesc(fd, ctx)) == CL_VIRUS) {
+    if((ret = cli_outfile_scan(&out, ctx)) == CL_VIRUS) {
 	cli_dbgmsg("GZip: Infected with %s\n", cli_get_last_virus(ctx));
-	close(fd);
-	if(!ctx->engine->keeptmp) {
-	    if (cli_unlink(tmpname)) {
-	    	free(tmpname);
-		return CL_EUNLINK;
-	    }
-	}
-	free(tmpname);
+	if (cli_outfile_close(&out, ctx))
+	    return CL_EUNLINK;
 	return CL_VIRUS;
     }
-    close(fd);
-    if(!ctx->engine->keeptmp)
-	if (cli_unlink(tmpname)) ret = CL_EUNLINK;
-    free(tmpname);
+    if (cli_outfile_close(&out, ctx))
+	ret = CL_EUNLINK;
     return ret;
 }
 
 #ifndef HAVE_BZLIB_H
-static int cli_scanbzip(cli_ctx *ctx) {
+static int cli_scanbzip(cli_ctx *ctx, int stream) {
     cli_warnmsg("cli_scanbzip: bzip2 support not compiled in\n");
     return CL_CLEAN;
 }
@@ -613,11 +609,11 @@ static int cli_scanbzip(cli_ctx *ctx) {
 #define BZ2_bzDecompressEnd bzDecompressEnd
 #endif
 
-static int cli_scanbzip(cli_ctx *ctx)
+static int cli_scanbzip(cli_ctx *ctx, int stream)
 {
-    int ret = CL_CLEAN, fd, rc;
+    int ret = CL_CLEAN, rc;
     unsigned long int size = 0;
-    char *tmpname;
+    struct cli_outfile out;
     bz_stream strm;
     size_t off = 0;
     size_t avail;
@@ -632,11 +628,13 @@ static int cli_scanbzip(cli_ctx *ctx)
 	return CL_EOPEN;
     }
 
-    if((ret = cli_gentempfd(ctx->engine->tmpdir, &tmpname, &fd))) {
+    if((ret = cli_outfile_open(&out, ctx, NULL))) {
 	cli_dbgmsg("Bzip: Can't generate temporary file.\n");
 	BZ2_bzDecompressEnd(&strm);
+	cli_outfile_close(&out, ctx);
 	return ret;
     }
+    out.streamable = stream;
 
     do {
 	if (!strm.avail_in) {
@@ -661,18 +659,14 @@ static int cli_scanbzip(cli_ctx *ctx)
 	    if(cli_checklimits("Bzip", ctx, size + FILEBUFF, 0, 0)!=CL_CLEAN)
 		break;
 
-	    if(cli_writen(fd, buf, sizeof(buf) - strm.avail_out) != sizeof(buf) - strm.avail_out) {
+	    if((ret = cli_outfile_write(&out, ctx, buf, sizeof(buf) - strm.avail_out))) {
+		if(ret == CL_BREAK)
+		    break;
 		cli_dbgmsg("Bzip: Can't write to file.\n");
 		BZ2_bzDecompressEnd(&strm);
-		close(fd);
-		if(!ctx->engine->keeptmp) {
-		    if (cli_unlink(tmpname)) {
-			free(tmpname);
-			return CL_EUNLINK;
-		    }
-		}
-		free(tmpname);
-		return CL_EWRITE;
+		if (cli_outfile_close(&out, ctx))
+		    return CL_EUNLINK;
+		return ret;
 	    }
 	    strm.next_out = buf;
 	    strm.avail_out = sizeof(buf);
@@ -682,30 +676,24 @@ static int cli_scanbzip(cli_ctx *ctx)
     BZ2_bzDecompressEnd(&strm);
 
     if(ret == CL_VIRUS) {
-	close(fd);
-	if(!ctx->engine->keeptmp)
-	    if (cli_unlink(tmpname)) ret = CL_EUNLINK;
-	free(tmpname);
+	if (cli_outfile_close(&out, ctx)) ret = CL_EUNLINK;
 	return ret;
     }
 
-    if((ret = cli_magic_scandesc(fd, ctx)) == CL_VIRUS ) {
+    if((ret = cli_outfile_scan(&out, ctx)) == CL_VIRUS ) {
 	cli_dbgmsg("Bzip: Infected with %s\n", cli_get_last_virus(ctx));
     }
-    close(fd);
-    if(!ctx->engine->keeptmp)
-	if (cli_unlink(tmpname)) ret = CL_EUNLINK;
-    free(tmpname);
+    if (cli_outfile_close(&out, ctx)) ret = CL_EUNLINK;
 
     return ret;
 }
 #endif
 
-static int cli_scanxz(cli_ctx *ctx)
+static int cli_scanxz(cli_ctx *ctx, int stream)
 {
-    int ret = CL_CLEAN, fd, rc;
+    int ret = CL_CLEAN, rc;
     unsigned long int size = 0;
-    char *tmpname;
+    struct cli_outfile out;
     struct CLI_XZ strm = {{0}};
     size_t off = 0;
     size_t avail;
@@ -724,13 +712,14 @@ static int cli_scanxz(cli_ctx *ctx)
 	return CL_EOPEN;
     }
 
-    if ((ret = cli_gentempfd(ctx->engine->tmpdir, &tmpname, &fd))) {
+    if ((ret = cli_outfile_open(&out, ctx, NULL))) {
 	cli_errmsg("cli_scanxz: Can't generate temporary file.\n");
 	cli_XzShutdown(&strm);
+	cli_outfile_close(&out, ctx);
         free(buf);
 	return ret;
     }
-    cli_dbgmsg("cli_scanxz: decompressing to file %s\n", tmpname);
+    out.streamable = stream;
 
     do {
         /* set up input buffer */
@@ -763,9 +752,10 @@ static int cli_scanxz(cli_ctx *ctx)
             //cli_dbgmsg("Writing %li bytes to XZ decompress temp file(%li byte total)\n",
             //           towrite, size);
 
-	    if(cli_writen(fd, buf, towrite) != towrite) {
+	    if((ret = cli_outfile_write(&out, ctx, buf, towrite))) {
+		if(ret == CL_BREAK)
+		    break;
 		cli_errmsg("cli_scanxz: Can't write to file.\n");
-                ret = CL_EWRITE;
                 goto xz_exit;
 	    }
 	    if (cli_checklimits("cli_scanxz", ctx, size, 0, 0) != CL_CLEAN) {
@@ -779,17 +769,14 @@ static int cli_scanxz(cli_ctx *ctx)
     } while (XZ_STREAM_END != rc);
 
     /* scan decompressed file */
-    if ((ret = cli_magic_scandesc(fd, ctx)) == CL_VIRUS ) {
+    if ((ret = cli_outfile_scan(&out, ctx)) == CL_VIRUS ) {
 	cli_dbgmsg("cli_scanxz: Infected with %s\n", cli_get_last_virus(ctx));
     }
 
  xz_exit:
     cli_XzShutdown(&strm);
-    close(fd);
-    if(!ctx->engine->keeptmp)
-	if (cli_unlink(tmpname) && ret == CL_CLEAN)
-            ret = CL_EUNLINK;
-    free(tmpname);
+    if (cli_outfile_close(&out, ctx) && ret == CL_CLEAN)
+        ret = CL_EUNLINK;
     free(buf);
     return ret;
 }
@@ -2110,7 +2097,7 @@ static inline void perf_done(cli_ctx* ctx){}
 #endif
 
 
-static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_t *dettype, unsigned char *refhash)
+static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_t *dettype, struct cli_digests *digests)
 {
 	int ret = CL_CLEAN, nret = CL_CLEAN;
 	struct cli_matched_type *ftoffset = NULL, *fpt;
@@ -2129,7 +2116,7 @@ static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_
     if(typercg)
 	acmode |= AC_SCAN_FT;
 
-    ret = cli_fmap_scandesc(ctx, type == CL_TYPE_TEXT_ASCII ? 0 : type, 0, &ftoffset, acmode, NULL, refhash);
+    ret = cli_fmap_scandesc(ctx, type == CL_TYPE_TEXT_ASCII ? 0 : type, 0, &ftoffset, acmode, NULL, digests);
     perf_stop(ctx, PERFT_RAW);
 
     if(ret >= CL_TYPENO) {
@@ -2146,7 +2133,7 @@ static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_
                         int tmpfd = fmap_fd(map);
                         ctx->container_type = CL_TYPE_RAR;
                         ctx->container_size = map->len - fpt->offset; /* not precise */
-                        cli_dbgmsg("RAR/RAR-SFX signature found at %u\n", (unsigned int) fpt->offset);
+                        cli_dbgmsg("RAR/RAR-SFX signature found at %lu\n", (unsigned long) fpt->offset);
                         /* if map is not file-backed, have to dump to file for scanrar */
                         if(tmpfd == -1) {
                             nret = fmap_dump_to_file(map, ctx->engine->tmpdir, &tmpname, &tmpfd);
@@ -2177,7 +2164,7 @@ static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_
                     if(type != CL_TYPE_ZIP && SCAN_ARCHIVE && (DCONF_ARCH & ARCH_CONF_ZIP)) {
                         ctx->container_type = CL_TYPE_ZIP;
                         ctx->container_size = map->len - fpt->offset; /* not precise */
-                        cli_dbgmsg("ZIP/ZIP-SFX signature found at %u\n", (unsigned int) fpt->offset);
+                        cli_dbgmsg("ZIP/ZIP-SFX signature found at %lu\n", (unsigned long) fpt->offset);
                         nret = cli_unzip_single(ctx, fpt->offset);
                     }
                     break;
@@ -2186,7 +2173,7 @@ static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_
                     if(type != CL_TYPE_MSCAB && SCAN_ARCHIVE && (DCONF_ARCH & ARCH_CONF_CAB)) {
                         ctx->container_type = CL_TYPE_MSCAB;
                         ctx->container_size = map->len - fpt->offset; /* not precise */
-                        cli_dbgmsg("CAB/CAB-SFX signature found at %u\n", (unsigned int) fpt->offset);
+                        cli_dbgmsg("CAB/CAB-SFX signature found at %lu\n", (unsigned long) fpt->offset);
                         nret = cli_scanmscab(ctx, fpt->offset);
                     }
                     break;
@@ -2195,7 +2182,7 @@ static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_
                     if(type != CL_TYPE_ARJ && SCAN_ARCHIVE && (DCONF_ARCH & ARCH_CONF_ARJ)) {
                         ctx->container_type = CL_TYPE_ARJ;
                         ctx->container_size = map->len - fpt->offset; /* not precise */
-                        cli_dbgmsg("ARJ-SFX signature found at %u\n", (unsigned int) fpt->offset);
+                        cli_dbgmsg("ARJ-SFX signature found at %lu\n", (unsigned long) fpt->offset);
                         nret = cli_scanarj(ctx, fpt->offset, &lastrar);
                     }
                     break;
@@ -2204,7 +2191,7 @@ static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_
                     if(type != CL_TYPE_7Z && SCAN_ARCHIVE && (DCONF_ARCH & ARCH_CONF_7Z)) {
                         ctx->container_type = CL_TYPE_7Z;
                         ctx->container_size = map->len - fpt->offset; /* not precise */
-                        cli_dbgmsg("7Zip-SFX signature found at %u\n", (unsigned int) fpt->offset);
+                        cli_dbgmsg("7Zip-SFX signature found at %lu\n", (unsigned long) fpt->offset);
                         nret = cli_7unz(ctx, fpt->offset);
                     }
                     break;
@@ -2213,7 +2200,7 @@ static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_
                     if(SCAN_ARCHIVE && (DCONF_ARCH & ARCH_CONF_ISO9660)) {
                         ctx->container_type = CL_TYPE_ISO9660;
                         ctx->container_size = map->len - fpt->offset; /* not precise */
-                        cli_dbgmsg("ISO9660 signature found at %u\n", (unsigned int) fpt->offset);
+                        cli_dbgmsg("ISO9660 signature found at %lu\n", (unsigned long) fpt->offset);
                         nret = cli_scaniso(ctx, fpt->offset);
                     }
                     break;
@@ -2223,7 +2210,7 @@ static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_
                        fpt->offset > 4) {
                         ctx->container_type = CL_TYPE_NULSFT;
                         ctx->container_size = map->len - fpt->offset; /* not precise */
-                        cli_dbgmsg("NSIS signature found at %u\n", (unsigned int) fpt->offset-4);
+                        cli_dbgmsg("NSIS signature found at %lu\n", (unsigned long) fpt->offset-4);
                         nret = cli_scannulsft(ctx, fpt->offset - 4);
                     }
                     break;
@@ -2232,7 +2219,7 @@ static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_
                     if(SCAN_ARCHIVE && type == CL_TYPE_MSEXE && (DCONF_ARCH & ARCH_CONF_AUTOIT)) {
                         ctx->container_type = CL_TYPE_AUTOIT;
                         ctx->container_size = map->len - fpt->offset; /* not precise */
-                        cli_dbgmsg("AUTOIT signature found at %u\n", (unsigned int) fpt->offset);
+                        cli_dbgmsg("AUTOIT signature found at %lu\n", (unsigned long) fpt->offset);
                         nret = cli_scanautoit(ctx, fpt->offset + 23);
                     }
                     break;
@@ -2241,7 +2228,7 @@ static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_
                     if(SCAN_ARCHIVE && type == CL_TYPE_MSEXE && (DCONF_ARCH & ARCH_CONF_ISHIELD)) {
                         ctx->container_type = CL_TYPE_AUTOIT;
                         ctx->container_size = map->len - fpt->offset; /* not precise */
-                        cli_dbgmsg("ISHIELD-MSI signature found at %u\n", (unsigned int) fpt->offset);
+                        cli_dbgmsg("ISHIELD-MSI signature found at %lu\n", (unsigned long) fpt->offset);
                         nret = cli_scanishield_msi(ctx, fpt->offset + 14);
                     }
                     break;
@@ -2250,7 +2237,7 @@ static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_
                     if(SCAN_ARCHIVE && (DCONF_ARCH & ARCH_CONF_DMG)) {
                         ctx->container_type = CL_TYPE_DMG;
                         nret = cli_scandmg(ctx);
-                        cli_dbgmsg("DMG signature found at %u\n", (unsigned int) fpt->offset);
+                        cli_dbgmsg("DMG signature found at %lu\n", (unsigned long) fpt->offset);
                     }
                     break;
 
@@ -2258,7 +2245,7 @@ static int cli_scanraw(cli_ctx *ctx, cli_file_t type, uint8_t typercg, cli_file_
                     if(type != CL_TYPE_PDF && SCAN_PDF && (DCONF_DOC & DOC_CONF_PDF)) {
                         ctx->container_type = CL_TYPE_PDF;
                         ctx->container_size = map->len - fpt->offset; /* not precise */
-                        cli_dbgmsg("PDF signature found at %u\n", (unsigned int) fpt->offset);
+                        cli_dbgmsg("PDF signature found at %lu\n", (unsigned long) fpt->offset);
                         nret = cli_scanpdf(ctx, fpt->offset);
                     }
                     break;
@@ -2383,7 +2370,7 @@ static void emax_reached(cli_ctx *ctx) {
 		cli_append_virus(ctx, "Detected.By.Callback");					\
 		perf_stop(ctx, PERFT_POSTCB);							\
 		if (retcode != CL_VIRUS)                                                        \
-		    return cli_checkfp(hash, hashed_size, ctx);                                 \
+		    return cli_checkfp(&digests, hashed_size, ctx);                                 \
 		return CL_VIRUS;								\
 	    case CL_CLEAN:									\
 		break;										\
@@ -2394,7 +2381,7 @@ static void emax_reached(cli_ctx *ctx) {
 	}											\
 	if (retcode == CL_CLEAN && cache_clean) {                                               \
 	    perf_start(ctx, PERFT_CACHE);                                                       \
-	    cache_add(hash, hashed_size, ctx);                                                  \
+	    cache_add(digests.digest[CLI_HASH_MD5], hashed_size, ctx);                          \
 	    perf_stop(ctx, PERFT_CACHE);							\
 	}											\
 	return retcode;										\
@@ -2415,7 +2402,7 @@ static void emax_reached(cli_ctx *ctx) {
 	    cli_append_virus(ctx, "Detected.By.Callback");		                     \
 	    perf_stop(ctx, PERFT_PRECB);                                                     \
 	    ctx->hook_lsig_matches = old_hook_lsig_matches;                                  \
-	    ret_from_magicscan(cli_checkfp(hash, hashed_size, ctx));                         \
+	    ret_from_magicscan(cli_checkfp(&digests, hashed_size, ctx));                         \
 	case CL_CLEAN:                                                                       \
 	    break;                                                                           \
 	default:                                                                             \
@@ -2426,17 +2413,19 @@ static void emax_reached(cli_ctx *ctx) {
 
 
 
-static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
+static int magic_scandesc_ft(cli_ctx *ctx, cli_file_t type, cli_file_t *scantype)
 {
 	int ret = CL_CLEAN;
 	cli_file_t dettype = 0;
 	uint8_t typercg = 1;
 	cli_file_t current_container_type = ctx->container_type;
 	size_t current_container_size = ctx->container_size, hashed_size;
-	unsigned char hash[16];
+	struct cli_digests digests;
 	bitset_t *old_hook_lsig_matches;
 	const char *filetype;
 	int cache_clean = 0, res;
+	struct timeval tv0 = { 0, 0 }, tv1;
+	uint64_t nested = 0;
 
     if(!ctx->engine) {
 	cli_errmsg("CRITICAL: engine == NULL\n");
@@ -2467,16 +2456,18 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
     if((type == CL_TYPE_ANY) || type == CL_TYPE_PART_ANY)
 	type = cli_filetype2(*ctx->fmap, ctx->engine, type);
     perf_stop(ctx, PERFT_FT);
+    *scantype = type;
     if(type == CL_TYPE_ERROR) {
 	cli_dbgmsg("cli_magic_scandesc: cli_filetype2 returned CL_TYPE_ERROR\n");
 	early_ret_from_magicscan(CL_EREAD);
     }
     filetype = cli_ftname(type);
     hashed_size = 0;
+    memset(digests.have, 0, sizeof(digests.have));
     CALL_PRESCAN_CB(cb_pre_cache);
 
     perf_start(ctx, PERFT_CACHE);
-    res = cache_check(hash, ctx);
+    res = cache_check(&digests, ctx);
     if(res != CL_VIRUS) {
 	perf_stop(ctx, PERFT_CACHE);
 	early_ret_from_magicscan(res);
@@ -2494,7 +2485,7 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 
 	CALL_PRESCAN_CB(cb_pre_scan);
 	/* ret_from_magicscan can be used below here*/
-	if((ret = cli_fmap_scandesc(ctx, 0, 0, NULL, AC_SCAN_VIR, NULL, hash)) == CL_VIRUS)
+	if((ret = cli_fmap_scandesc(ctx, 0, 0, NULL, AC_SCAN_VIR, NULL, &digests)) == CL_VIRUS)
 	    cli_dbgmsg("%s found in descriptor %d\n", cli_get_last_virus(ctx), fmap_fd(*ctx->fmap));
 	else if(ret == CL_CLEAN) {
 	    if(ctx->recursion != ctx->engine->maxreclevel)
@@ -2521,8 +2512,8 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
     }
 
     if(type != CL_TYPE_IGNORED && ctx->engine->sdb) {
-	if((ret = cli_scanraw(ctx, type, 0, &dettype, hash)) == CL_VIRUS) {
-	    ret = cli_checkfp(hash, hashed_size, ctx);
+	if((ret = cli_scanraw(ctx, type, 0, &dettype, &digests)) == CL_VIRUS) {
+	    ret = cli_checkfp(&digests, hashed_size, ctx);
 	    cli_bitset_free(ctx->hook_lsig_matches);
 	    ctx->hook_lsig_matches = old_hook_lsig_matches;
 	    ret_from_magicscan(ret);
@@ -2532,6 +2523,10 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
     ctx->recursion++;
     perf_nested_start(ctx, PERFT_CONTAINER, PERFT_SCAN);
     ctx->container_size = (*ctx->fmap)->len;
+    if(ctx->stats) {
+	nested = ctx->stats_nested;
+	gettimeofday(&tv0, NULL);
+    }
     switch(type) {
 	case CL_TYPE_IGNORED:
 	    break;
@@ -2567,19 +2562,23 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 		ret = cli_unzip(ctx);
 	    break;
 
+	/* CL_BREAK: the decompressed data turned out to need the full scan */
 	case CL_TYPE_GZ:
 	    if(SCAN_ARCHIVE && (DCONF_ARCH & ARCH_CONF_GZ))
-		ret = cli_scangzip(ctx);
+		if((ret = cli_scangzip(ctx, 1)) == CL_BREAK)
+		    ret = cli_scangzip(ctx, 0);
 	    break;
 
 	case CL_TYPE_BZ:
 	    if(SCAN_ARCHIVE && (DCONF_ARCH & ARCH_CONF_BZ))
-		ret = cli_scanbzip(ctx);
+		if((ret = cli_scanbzip(ctx, 1)) == CL_BREAK)
+		    ret = cli_scanbzip(ctx, 0);
 	    break;
 
 	case CL_TYPE_XZ:
 	    if(SCAN_ARCHIVE && (DCONF_ARCH & ARCH_CONF_XZ))
-		ret = cli_scanxz(ctx);
+		if((ret = cli_scanxz(ctx, 1)) == CL_BREAK)
+		    ret = cli_scanxz(ctx, 0);
 	    break;
 
 	case CL_TYPE_ARJ:
@@ -2798,12 +2797,20 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 	    break;
     }
     perf_nested_stop(ctx, PERFT_CONTAINER, PERFT_SCAN);
+    if(ctx->stats) {
+	/* the time of the embedded files is accounted for by their types */
+	struct cli_scanstats_type *st = &ctx->stats->types[SCANSTATS_TYPE(type)];
+
+	gettimeofday(&tv1, NULL);
+	st->unpack_usecs += (tv1.tv_sec - tv0.tv_sec) * 1000000 + tv1.tv_usec - tv0.tv_usec - (ctx->stats_nested - nested);
+	st->unpack_bytes += ctx->container_size;
+    }
     ctx->recursion--;
     ctx->container_type = current_container_type;
     ctx->container_size = current_container_size;
 
     if(ret == CL_VIRUS) {
-	ret = cli_checkfp(hash, hashed_size, ctx);
+	ret = cli_checkfp(&digests, hashed_size, ctx);
 	cli_bitset_free(ctx->hook_lsig_matches);
 	ctx->hook_lsig_matches = old_hook_lsig_matches;
 	ret_from_magicscan(ret);
@@ -2820,7 +2827,7 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 
     /* CL_TYPE_HTML: raw HTML files are not scanned, unless safety measure activated via DCONF */
     if(type != CL_TYPE_IGNORED && (type != CL_TYPE_HTML || !(DCONF_DOC & DOC_CONF_HTML_SKIPRAW)) && !ctx->engine->sdb) {
-	res = cli_scanraw(ctx, type, typercg, &dettype, hash);
+	res = cli_scanraw(ctx, type, typercg, &dettype, &digests);
 	if(res != CL_CLEAN) {
 	    switch(res) {
 		/* List of scan halts, runtime errors only! */
@@ -2839,7 +2846,7 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
 		    ret_from_magicscan(res);
 		/* CL_VIRUS = malware found, check FP and report */
 		case CL_VIRUS:
-		    ret = cli_checkfp(hash, hashed_size, ctx);
+		    ret = cli_checkfp(&digests, hashed_size, ctx);
 		    if (SCAN_ALL)
 			break;
 		    cli_bitset_free(ctx->hook_lsig_matches);
@@ -2898,7 +2905,7 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
     }
 
     if(ret == CL_VIRUS)
-	ret = cli_checkfp(hash, hashed_size, ctx);
+	ret = cli_checkfp(&digests, hashed_size, ctx);
     ctx->recursion--;
     cli_bitset_free(ctx->hook_lsig_matches);
     ctx->hook_lsig_matches = old_hook_lsig_matches;
@@ -2922,6 +2929,28 @@ static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
     }
 }
 
+static int magic_scandesc(cli_ctx *ctx, cli_file_t type)
+{
+	struct timeval tv0, tv1;
+	uint64_t nested, usecs;
+	unsigned int depth = ctx->recursion;
+	size_t len = (*ctx->fmap)->len;
+	int ret;
+
+    if(!ctx->stats)
+	return magic_scandesc_ft(ctx, type, &type);
+
+    nested = ctx->stats_nested;
+    ctx->stats_nested = 0;
+    gettimeofday(&tv0, NULL);
+    ret = magic_scandesc_ft(ctx, type, &type);
+    gettimeofday(&tv1, NULL);
+    usecs = (tv1.tv_sec - tv0.tv_sec) * 1000000 + tv1.tv_usec - tv0.tv_usec;
+    cli_scanstats_file(ctx->stats, type, len, usecs, depth);
+    ctx->stats_nested = nested + usecs;
+    return ret;
+}
+
 static int cli_base_scandesc(int desc, cli_ctx *ctx, cli_file_t type)
 {
     STATBUF sb;
@@ -2940,9 +2969,16 @@ static int cli_base_scandesc(int desc, cli_ctx *ctx, cli_file_t type)
 	early_ret_from_magicscan(CL_CLEAN);
     }
 
+    if(*ctx->fmap) /* a file written out while unpacking */
+	SCANSTATS_ADD(ctx, tmpbytes, sb.st_size);
+
     ctx->fmap++;
     perf_start(ctx, PERFT_MAP);
-    if(!(*ctx->fmap = fmap(desc, 0, sb.st_size))) {
+    if(ctx->engine->engine_options & ENGINE_OPTIONS_DIRECT_MAP)
+	*ctx->fmap = fmap_direct(desc, 0, sb.st_size);
+    else
+	*ctx->fmap = fmap(desc, 0, sb.st_size);
+    if(!*ctx->fmap) {
 	cli_errmsg("CRITICAL: fmap() failed\n");
 	ctx->fmap--;
 	perf_stop(ctx, PERFT_MAP);
@@ -2952,6 +2988,7 @@ static int cli_base_scandesc(int desc, cli_ctx *ctx, cli_file_t type)
 
     ret = magic_scandesc(ctx, type);
 
+    SCANSTATS_ADD(ctx, pagefaults, (*ctx->fmap)->faults);
     funmap(*ctx->fmap);
     ctx->fmap--;
     return ret;
@@ -2970,7 +3007,7 @@ static int magic_scandesc_hnmavocl(cli_ctx *ctx, cli_file_t type)
 	uint8_t typercg = 1;
 	cli_file_t current_container_type = ctx->container_type;
 	size_t current_container_size = ctx->container_size, hashed_size;
-	unsigned char hash[16];
+	struct cli_digests digests;
 	bitset_t *old_hook_lsig_matches;
 	const char *filetype;
 	int cache_clean = 0, res;
@@ -3011,10 +3048,11 @@ static int magic_scandesc_hnmavocl(cli_ctx *ctx, cli_file_t type)
 	}
 	filetype = cli_ftname(type);
 	hashed_size = 0;
+	memset(digests.have, 0, sizeof(digests.have));
 	CALL_PRESCAN_CB(cb_pre_cache);
 
 	perf_start(ctx, PERFT_CACHE);
-	res = cache_check(hash, ctx);
+	res = cache_check(&digests, ctx);
 	if (res != CL_VIRUS) {
 		perf_stop(ctx, PERFT_CACHE);
 		early_ret_from_magicscan(res);
@@ -3040,8 +3078,8 @@ static int magic_scandesc_hnmavocl(cli_ctx *ctx, cli_file_t type)
 	}
 
 	if (type != CL_TYPE_IGNORED && ctx->engine->sdb) {
-		if ((ret = cli_scanraw(ctx, type, 0, &dettype, hash)) == CL_VIRUS) {
-			ret = cli_checkfp(hash, hashed_size, ctx);
+		if ((ret = cli_scanraw(ctx, type, 0, &dettype, &digests)) == CL_VIRUS) {
+			ret = cli_checkfp(&digests, hashed_size, ctx);
 			cli_bitset_free(ctx->hook_lsig_matches);
 			ctx->hook_lsig_matches = old_hook_lsig_matches;
 			ret_from_magicscan(ret);
@@ -3058,7 +3096,7 @@ static int magic_scandesc_hnmavocl(cli_ctx *ctx, cli_file_t type)
 	//ctx->container_size = current_container_size;
 
 	if (ret == CL_VIRUS) {
-		ret = cli_checkfp(hash, hashed_size, ctx);
+		ret = cli_checkfp(&digests, hashed_size, ctx);
 		cli_bitset_free(ctx->hook_lsig_matches);
 		ctx->hook_lsig_matches = old_hook_lsig_matches;
 		ret_from_magicscan(ret);
@@ -3081,7 +3119,7 @@ static int magic_scandesc_hnmavocl(cli_ctx *ctx, cli_file_t type)
 	}
 
 	if (ret == CL_VIRUS)
-		ret = cli_checkfp(hash, hashed_size, ctx);
+		ret = cli_checkfp(&digests, hashed_size, ctx);
 	ctx->recursion--;
 	cli_bitset_free(ctx->hook_lsig_matches);
 	ctx->hook_lsig_matches = old_hook_lsig_matches;
@@ -3126,7 +3164,11 @@ static int cli_base_scandesc_hnmavocl(int desc, cli_ctx *ctx, cli_file_t type)
 
 	ctx->fmap++;
 	perf_start(ctx, PERFT_MAP);
-	if (!(*ctx->fmap = fmap(desc, 0, sb.st_size))) {
+	if (ctx->engine->engine_options & ENGINE_OPTIONS_DIRECT_MAP)
+		*ctx->fmap = fmap_direct(desc, 0, sb.st_size);
+	else
+		*ctx->fmap = fmap(desc, 0, sb.st_size);
+	if (!*ctx->fmap) {
 		cli_errmsg("CRITICAL: fmap() failed\n");
 		ctx->fmap--;
 		perf_stop(ctx, PERFT_MAP);
@@ -3303,9 +3345,242 @@ int cli_mem_scandesc(const void *buffer, size_t length, cli_ctx *ctx)
     return ret;
 }
 
-static int scan_common(int desc, cl_fmap_t *map, const char **virname, unsigned long int *scanned, const struct cl_engine *engine, unsigned int scanoptions, void *context)
+static int outfile_spill(struct cli_outfile *out, cli_ctx *ctx)
+{
+    int ret;
+
+    if(out->name) {
+	if((out->fd = open(out->name, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, S_IRUSR|S_IWUSR)) == -1) {
+	    cli_warnmsg("cli_outfile: failed to create temporary file %s\n", out->name);
+	    return CL_ECREAT;
+	}
+    } else if((ret = cli_gentempfd(ctx->engine->tmpdir, &out->tmpname, &out->fd)) != CL_SUCCESS) {
+	out->tmpname = NULL;
+	return ret;
+    }
+
+    if(out->len && cli_writen(out->fd, out->buf, out->len) != (int) out->len) {
+	cli_dbgmsg("cli_outfile: can't write to %s\n", out->name ? out->name : out->tmpname);
+	return CL_EWRITE;
+    }
+    free(out->buf);
+    out->buf = NULL;
+    out->size = 0;
+    return CL_SUCCESS;
+}
+
+/* Switches to scanning the data on the fly when it's something
+ * magic_scandesc() would only pass to cli_scanraw() */
+static int outfile_stream(struct cli_outfile *out, cli_ctx *ctx)
+{
+	const struct cl_engine *engine = ctx->engine;
+	unsigned char *head;
+	fmap_t *map;
+	int ret;
+
+
+    if(out->len < MAGIC_BUFFER_SIZE || SCAN_ALL || engine->sdb || ctx->delta || (engine->maxreclevel && ctx->recursion >= engine->maxreclevel))
+	return CL_EFORMAT;
+    if(engine->cb_pre_cache || engine->cb_pre_scan || engine->cb_post_scan || engine->cb_hash)
+	return CL_EFORMAT;
+
+    if(!(map = cl_fmap_open_memory(out->buf, out->len)))
+	return CL_EMAP;
+    out->type = cli_filetype2(map, engine, CL_TYPE_ANY);
+    cl_fmap_close(map);
+    switch(out->type) {
+	case CL_TYPE_BINARY_DATA:
+	case CL_TYPE_TEXT_UTF16BE:
+	    break;
+	case CL_TYPE_TEXT_ASCII:
+	    if(SCAN_STRUCTURED && (DCONF_OTHER & OTHER_CONF_DLP))
+		return CL_EFORMAT;
+	    /* fall-through */
+	case CL_TYPE_TEXT_UTF16LE:
+	case CL_TYPE_TEXT_UTF8:
+	    if(SCAN_MAIL && (DCONF_MAIL & MAIL_CONF_MBOX) && ctx->container_type == CL_TYPE_MAIL)
+		return CL_EFORMAT;
+	    break;
+	default:
+	    return CL_EFORMAT;
+    }
+
+    if(!(out->stream = cli_scanstream_init(ctx, out->type == CL_TYPE_TEXT_ASCII ? 0 : out->type, out->expect)))
+	return CL_EMEM;
+    ret = cli_scanstream_update(out->stream, out->buf, out->len);
+    if(ret != CL_SUCCESS && ret != CL_BREAK) {
+	cli_scanstream_free(out->stream);
+	out->stream = NULL;
+	return ret;
+    }
+
+    cli_dbgmsg("cli_outfile: scanning %s data on the fly\n", cli_ftname(out->type));
+    if((head = cli_realloc(out->buf, MAGIC_BUFFER_SIZE))) {
+	out->buf = head;
+	out->size = MAGIC_BUFFER_SIZE;
+    }
+    out->len = MAGIC_BUFFER_SIZE;
+    return CL_SUCCESS;
+}
+
+/* magic_scandesc() for the streamed data */
+static int outfile_stream_scan(struct cli_outfile *out, cli_ctx *ctx)
+{
+	const char *virname;
+	unsigned char md5[16];
+	uint64_t len = cli_scanstream_len(out->stream);
+	fmap_t *map;
+	int ret;
+
+
+    ret = cli_scanstream_final(out->stream, &virname, md5);
+    if(ret != CL_CLEAN && ret != CL_VIRUS && ret != CL_BREAK)
+	return ret;
+    /* too big to be scanned at all */
+    if(cli_checklimits("cli_outfile", ctx, len, 0, 0) != CL_CLEAN) {
+	emax_reached(ctx);
+	return CL_CLEAN;
+    }
+    if(ret == CL_CLEAN && out->type != CL_TYPE_BINARY_DATA && len <= ctx->engine->maxscriptnormalize && (DCONF_DOC & DOC_CONF_SCRIPT))
+	ret = CL_BREAK;
+    if(ret == CL_BREAK) {
+	cli_dbgmsg("cli_outfile: %llu bytes of streamed data need the full scan\n", (long long unsigned) len);
+	return CL_BREAK;
+    }
+    cli_updatelimits(ctx, len);
+    if(ctx->scanned)
+	*ctx->scanned += cli_scanstream_scanned(out->stream);
+
+    /* the rest only looks at the head */
+    if(!(map = cl_fmap_open_memory(out->buf, out->len)))
+	return CL_EMAP;
+    ctx->fmap++;
+    *ctx->fmap = map;
+
+    if((out->type == CL_TYPE_BINARY_DATA || out->type == CL_TYPE_TEXT_UTF16BE) && SCAN_ALGO && (DCONF_OTHER & OTHER_CONF_MYDOOMLOG) && cli_check_mydoom_log(ctx) == CL_VIRUS) {
+	ret = cli_scanstream_checkfp(out->stream, cli_get_last_virus(ctx));
+    } else if(ret == CL_VIRUS) {
+	cli_append_virus(ctx, virname);
+	ret = cli_scanstream_checkfp(out->stream, virname);
+    } else {
+	cache_add(md5, len, ctx);
+    }
+
+    ctx->fmap--;
+    cl_fmap_close(map);
+    return ret;
+}
+
+int cli_outfile_open(struct cli_outfile *out, cli_ctx *ctx, const char *name)
+{
+    memset(out, 0, sizeof(*out));
+    out->name = name;
+    out->fd = -1;
+
+    /* keep the old behaviour when the files are wanted on disk */
+    if(!ctx->engine->maxinmemory || ctx->engine->keeptmp || (ctx->engine->engine_options & ENGINE_OPTIONS_FORCE_TO_DISK))
+	return outfile_spill(out, ctx);
+
+    return CL_SUCCESS;
+}
+
+int cli_outfile_write(struct cli_outfile *out, cli_ctx *ctx, const void *data, size_t len)
+{
+	unsigned char *newbuf;
+	size_t newsize;
+	int ret;
+
+
+    if(!len)
+	return CL_SUCCESS;
+
+    if(out->stream)
+	return cli_scanstream_update(out->stream, data, len);
+
+    if(out->fd == -1 && out->len + len > ctx->engine->maxinmemory) {
+	if(out->streamable && outfile_stream(out, ctx) == CL_SUCCESS)
+	    return cli_scanstream_update(out->stream, data, len);
+	if((ret = outfile_spill(out, ctx)) != CL_SUCCESS)
+	    return ret;
+    }
+
+    if(out->fd != -1) {
+	if(cli_writen(out->fd, data, len) != (int) len)
+	    return CL_EWRITE;
+	out->len += len;
+	return CL_SUCCESS;
+    }
+
+    if(out->len + len > out->size) {
+	newsize = out->size ? out->size : FILEBUFF;
+	while(newsize < out->len + len)
+	    newsize *= 2;
+	if(newsize > ctx->engine->maxinmemory)
+	    newsize = ctx->engine->maxinmemory;
+	if(!(newbuf = cli_realloc(out->buf, newsize)))
+	    return CL_EMEM;
+	out->buf = newbuf;
+	out->size = newsize;
+    }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+    return CL_SUCCESS;
+}
+
+int cli_outfile_scan(struct cli_outfile *out, cli_ctx *ctx)
+{
+    if(out->stream)
+	return outfile_stream_scan(out, ctx);
+
+    if(out->fd != -1) {
+	if(lseek(out->fd, 0, SEEK_SET) == -1) {
+	    cli_dbgmsg("cli_outfile: call to lseek() failed\n");
+	    return CL_ESEEK;
+	}
+	return cli_magic_scandesc(out->fd, ctx);
+    }
+
+    if(out->len <= 5) {
+	cli_dbgmsg("Small data (%u bytes)\n", (unsigned int) out->len);
+	return CL_CLEAN;
+    }
+    cli_dbgmsg("cli_outfile: scanning %lu bytes from memory\n", (unsigned long) out->len);
+    return cli_mem_scandesc(out->buf, out->len, ctx);
+}
+
+int cli_outfile_close(struct cli_outfile *out, cli_ctx *ctx)
+{
+	int ret = CL_SUCCESS;
+
+
+    free(out->buf);
+    out->buf = NULL;
+    cli_scanstream_free(out->stream);
+    out->stream = NULL;
+    if(out->fd != -1) {
+	close(out->fd);
+	out->fd = -1;
+	if(!ctx->engine->keeptmp && cli_unlink(out->name ? out->name : out->tmpname))
+	    ret = CL_EUNLINK;
+    }
+    free(out->tmpname);
+    out->tmpname = NULL;
+    return ret;
+}
+
+/* Per-thread state reused by cl_scan_batch() */
+struct cl_scanctx {
+    const struct cl_engine *engine;
+    fmap_t **fmap;
+    unsigned int fmap_cnt;
+    bitset_t *hook_lsig_matches;
+    struct cli_acdata_slot acslots[CLI_MTARGETS];
+};
+
+static int scan_common(int desc, cl_fmap_t *map, const char **virname, unsigned long int *scanned, const struct cl_engine *engine, unsigned int scanoptions, void *context, struct cl_scanctx *sctx)
 {
     cli_ctx ctx;
+    unsigned int faults = 0;
     int rc;
 
     memset(&ctx, '\0', sizeof(cli_ctx));
@@ -3321,12 +3596,20 @@ static int scan_common(int desc, cl_fmap_t *map, const char **virname, unsigned
     ctx.container_size = 0;
     ctx.dconf = (struct cli_dconf *) engine->dconf;
     ctx.cb_ctx = context;
-    ctx.fmap = cli_calloc(sizeof(fmap_t *), ctx.engine->maxreclevel + 2);
-    if(!ctx.fmap)
-	return CL_EMEM;
-    if (!(ctx.hook_lsig_matches = cli_bitset_init())) {
-	free(ctx.fmap);
-	return CL_EMEM;
+    if(sctx) {
+	memset(sctx->fmap, 0, sctx->fmap_cnt * sizeof(fmap_t *));
+	memset(sctx->hook_lsig_matches->bitset, 0, sctx->hook_lsig_matches->length);
+	ctx.fmap = sctx->fmap;
+	ctx.hook_lsig_matches = sctx->hook_lsig_matches;
+	ctx.acslots = sctx->acslots;
+    } else {
+	ctx.fmap = cli_calloc(sizeof(fmap_t *), ctx.engine->maxreclevel + 2);
+	if(!ctx.fmap)
+	    return CL_EMEM;
+	if (!(ctx.hook_lsig_matches = cli_bitset_init())) {
+	    free(ctx.fmap);
+	    return CL_EMEM;
+	}
     }
     perf_init(&ctx);
 
@@ -3346,8 +3629,19 @@ static int scan_common(int desc, cl_fmap_t *map, const char **virname, unsigned
     } while(0);
 #endif
 
+    /* read before the delta: verdicts reached on an older delta must not
+       be cached once cl_engine_update() has cleared the cache */
+    ctx.cache_gen = engine->cache_gen;
+    ctx.delta = cli_engine_delta_get(engine);
     cli_logg_setup(&ctx);
+    if((ctx.stats = cli_scanstats_get(engine->scanstats))) {
+	ctx.stats->scans++;
+	if(map)
+	    faults = map->faults;
+    }
     rc = map ? cli_map_scandesc(map, 0, map->len, &ctx) : cli_magic_scandesc(desc, &ctx);
+    if(map)
+	SCANSTATS_ADD(&ctx, pagefaults, map->faults - faults);
 
     if (ctx.options & CL_SCAN_ALLMATCHES) {
 	*virname = (char *)ctx.virname; /* temp hack for scanall mode until api augmentation */
@@ -3355,18 +3649,22 @@ static int scan_common(int desc, cl_fmap_t *map, const char **virname, unsigned
 	    rc = CL_VIRUS;
     }
 
-    cli_bitset_free(ctx.hook_lsig_matches);
-    free(ctx.fmap);
+    if(!sctx) {
+	cli_bitset_free(ctx.hook_lsig_matches);
+	free(ctx.fmap);
+    }
     if(rc == CL_CLEAN && ctx.found_possibly_unwanted)
 	rc = CL_VIRUS;
     cli_logg_unsetup();
     perf_done(&ctx);
+    if(ctx.delta)
+	cl_engine_free((struct cl_engine *) ctx.delta);
     return rc;
 }
 
 int cl_scandesc_callback(int desc, const char **virname, unsigned long int *scanned, const struct cl_engine *engine, unsigned int scanoptions, void *context)
 {
-    return scan_common(desc, NULL, virname, scanned, engine, scanoptions, context);
+    return scan_common(desc, NULL, virname, scanned, engine, scanoptions, context, NULL);
 }
 
 /* File scanning supported HNMAV-OCL*/
@@ -3423,6 +3721,8 @@ static int scan_common_hnmavocl(int desc,
 	} while (0);
 #endif
 
+	ctx.cache_gen = engine->cache_gen;
+	ctx.delta = cli_engine_delta_get(engine);
 	cli_logg_setup(&ctx);
 	//rc = map ? cli_map_scandesc(map, 0, map->len, &ctx) : cli_magic_scandesc(desc, &ctx);
 	if (map){
@@ -3443,6 +3743,8 @@ static int scan_common_hnmavocl(int desc,
 		rc = CL_VIRUS;
 	cli_logg_unsetup();
 	perf_done(&ctx);
+	if (ctx.delta)
+		cl_engine_free((struct cl_engine *) ctx.delta);
 	return rc;
 }
 
@@ -3460,7 +3762,77 @@ int cl_scandesc_callback_hnmavocl(int desc,
 
 int cl_scanmap_callback(cl_fmap_t *map, const char **virname, unsigned long int *scanned, const struct cl_engine *engine, unsigned int scanoptions, void *context)
 {
-	return scan_common(-1, map, virname, scanned, engine, scanoptions, context);
+	return scan_common(-1, map, virname, scanned, engine, scanoptions, context, NULL);
+}
+
+struct cl_scanctx *cl_scanctx_new(const struct cl_engine *engine)
+{
+	struct cl_scanctx *sctx;
+
+    if(!engine) {
+	cli_errmsg("cl_scanctx_new: engine == NULL\n");
+	return NULL;
+    }
+
+    if(!(sctx = cli_calloc(1, sizeof(*sctx)))) {
+	cli_errmsg("cl_scanctx_new: Can't allocate memory for cl_scanctx\n");
+	return NULL;
+    }
+    sctx->fmap_cnt = engine->maxreclevel + 2;
+    sctx->fmap = cli_calloc(sizeof(fmap_t *), sctx->fmap_cnt);
+    sctx->hook_lsig_matches = cli_bitset_init();
+    if(!sctx->fmap || !sctx->hook_lsig_matches) {
+	cli_errmsg("cl_scanctx_new: Can't allocate memory for the scan state\n");
+	cli_bitset_free(sctx->hook_lsig_matches);
+	free(sctx->fmap);
+	free(sctx);
+	return NULL;
+    }
+    cl_engine_addref((struct cl_engine *) engine);
+    sctx->engine = engine;
+    return sctx;
+}
+
+void cl_scanctx_free(struct cl_scanctx *sctx)
+{
+    if(!sctx)
+	return;
+    cli_acdata_slots_free(sctx->acslots);
+    cli_bitset_free(sctx->hook_lsig_matches);
+    free(sctx->fmap);
+    cl_engine_free((struct cl_engine *) sctx->engine);
+    free(sctx);
+}
+
+int cl_scan_batch(struct cl_scanctx *sctx, struct cl_scan_item *items, unsigned int count, unsigned long int *scanned, unsigned int scanoptions)
+{
+	unsigned int i;
+	cl_fmap_t *map;
+	fmap_t **fmap;
+
+    if(!sctx || (count && !items)) {
+	cli_errmsg("cl_scan_batch: Invalid arguments\n");
+	return CL_ENULLARG;
+    }
+
+    if(sctx->fmap_cnt < sctx->engine->maxreclevel + 2) {
+	if(!(fmap = cli_realloc(sctx->fmap, (sctx->engine->maxreclevel + 2) * sizeof(fmap_t *))))
+	    return CL_EMEM;
+	sctx->fmap = fmap;
+	sctx->fmap_cnt = sctx->engine->maxreclevel + 2;
+    }
+
+    for(i = 0; i < count; i++) {
+	items[i].virname = NULL;
+	if(!(map = cl_fmap_open_memory(items[i].data, items[i].len))) {
+	    items[i].result = CL_EMEM;
+	    continue;
+	}
+	items[i].result = scan_common(-1, map, &items[i].virname, scanned, sctx->engine, scanoptions, items[i].context, sctx);
+	cl_fmap_close(map);
+    }
+
+    return CL_SUCCESS;
 }
 
 int cli_found_possibly_unwanted(cli_ctx* ctx)
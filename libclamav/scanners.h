@@ -34,4 +34,27 @@ int cli_map_scan(cl_fmap_t *map, off_t offset, size_t length, cli_ctx *ctx);
 int cli_mem_scandesc(const void *buffer, size_t length, cli_ctx *ctx);
 int cli_found_possibly_unwanted(cli_ctx* ctx);
 
+/* Output of an extracted file: kept in memory while it fits in
+ * engine->maxinmemory, spilled to a temporary file past that. If the
+ * caller sets streamable, plain data gets scanned on the fly instead of
+ * spilling; cli_outfile_write() then returns CL_BREAK when no more data is
+ * needed and cli_outfile_scan() returns CL_BREAK when the data has to be
+ * written again (with streamable unset) for the full scan */
+struct cli_outfile {
+    unsigned char *buf;
+    size_t len, size;
+    const char *name;	/* file to spill to, NULL for a new temporary file */
+    char *tmpname;
+    int fd;
+    int streamable;
+    uint64_t expect;	/* length of the data if the container records it */
+    cli_file_t type;	/* of the streamed data, buf keeps its head */
+    struct cli_scanstream *stream;
+};
+
+int cli_outfile_open(struct cli_outfile *out, cli_ctx *ctx, const char *name);
+int cli_outfile_write(struct cli_outfile *out, cli_ctx *ctx, const void *data, size_t len);
+int cli_outfile_scan(struct cli_outfile *out, cli_ctx *ctx);
+int cli_outfile_close(struct cli_outfile *out, cli_ctx *ctx);
+
 #endif
@@ -0,0 +1,218 @@
+/*
+ *  Engine-wide scan statistics
+ *
+ *  Copyright (C) 2013 Sourcefire, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef CL_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+#include "clamav.h"
+#include "others.h"
+#include "filetypes.h"
+#include "scanstats.h"
+
+struct cli_scanstats_set {
+    struct cli_scanstats *list;
+#ifdef CL_THREAD_SAFE
+    pthread_key_t key;
+    pthread_mutex_t mutex;
+#endif
+};
+
+#ifdef CL_THREAD_SAFE
+static void scanstats_release(void *data)
+{
+    /* the thread is gone, the next new one can take over the counters */
+    ((struct cli_scanstats *) data)->inuse = 0;
+}
+#endif
+
+struct cli_scanstats_set *cli_scanstats_new(void)
+{
+	struct cli_scanstats_set *set;
+
+    if(!(set = cli_calloc(1, sizeof(*set)))) {
+	cli_errmsg("cli_scanstats_new: Can't allocate memory for the statistics\n");
+	return NULL;
+    }
+#ifdef CL_THREAD_SAFE
+    if(pthread_key_create(&set->key, scanstats_release)) {
+	cli_errmsg("cli_scanstats_new: Can't create the thread key\n");
+	free(set);
+	return NULL;
+    }
+    pthread_mutex_init(&set->mutex, NULL);
+#endif
+    return set;
+}
+
+void cli_scanstats_free(struct cli_scanstats_set *set)
+{
+	struct cli_scanstats *stats;
+
+    if(!set)
+	return;
+#ifdef CL_THREAD_SAFE
+    pthread_key_delete(set->key);
+    pthread_mutex_destroy(&set->mutex);
+#endif
+    while((stats = set->list)) {
+	set->list = stats->next;
+	free(stats);
+    }
+    free(set);
+}
+
+/* Returns the counters of the calling thread, NULL if out of memory */
+struct cli_scanstats *cli_scanstats_get(struct cli_scanstats_set *set)
+{
+	struct cli_scanstats *stats;
+
+    if(!set)
+	return NULL;
+#ifdef CL_THREAD_SAFE
+    if((stats = pthread_getspecific(set->key)))
+	return stats;
+    pthread_mutex_lock(&set->mutex);
+    for(stats = set->list; stats && stats->inuse; stats = stats->next);
+#else
+    stats = set->list;
+#endif
+    if(!stats) {
+	if((stats = cli_calloc(1, sizeof(*stats)))) {
+	    stats->next = set->list;
+	    set->list = stats;
+	} else {
+	    cli_errmsg("cli_scanstats_get: Can't allocate memory for the counters\n");
+	}
+    }
+#ifdef CL_THREAD_SAFE
+    if(stats) {
+	stats->inuse = 1;
+	pthread_setspecific(set->key, stats);
+    }
+    pthread_mutex_unlock(&set->mutex);
+#endif
+    return stats;
+}
+
+/* Accounts one file of the given type scanned at recursion level depth */
+void cli_scanstats_file(struct cli_scanstats *stats, cli_file_t type, size_t len, uint64_t usecs, unsigned int depth)
+{
+	struct cli_scanstats_type *st = &stats->types[SCANSTATS_TYPE(type)];
+	unsigned int bucket = 0;
+
+    while(bucket < CL_STATS_LATENCY_BUCKETS - 1 && (usecs >> (bucket + 1)))
+	bucket++;
+    st->files++;
+    st->bytes += len;
+    st->usecs += usecs;
+    st->latency[bucket]++;
+    stats->depth[MIN(depth, CL_STATS_DEPTH_BUCKETS - 1)]++;
+}
+
+struct cl_stats *cl_engine_get_stats(const struct cl_engine *engine)
+{
+	struct cli_scanstats_set *set;
+	struct cli_scanstats_type *sum;
+	const struct cli_scanstats *stats;
+	struct cl_stats *ret;
+	unsigned int i, j;
+
+    if(!engine || !(set = engine->scanstats))
+	return NULL;
+
+    if(!(ret = cli_calloc(1, sizeof(*ret))) || !(sum = cli_calloc(SCANSTATS_NTYPES, sizeof(*sum)))) {
+	cli_errmsg("cl_engine_get_stats: Can't allocate memory for the statistics\n");
+	free(ret);
+	return NULL;
+    }
+
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_lock(&set->mutex);
+#endif
+    for(stats = set->list; stats; stats = stats->next) {
+	ret->scans += stats->scans;
+	ret->cache_hits += stats->cache_hits;
+	ret->cache_misses += stats->cache_misses;
+	ret->fmap_pagefaults += stats->pagefaults;
+	ret->tmpfile_bytes += stats->tmpbytes;
+	for(i = 0; i < CL_STATS_DEPTH_BUCKETS; i++)
+	    ret->depth[i] += stats->depth[i];
+	for(i = 0; i < SCANSTATS_NTYPES; i++) {
+	    const struct cli_scanstats_type *st = &stats->types[i];
+
+	    if(!st->files)
+		continue;
+	    sum[i].files += st->files;
+	    sum[i].bytes += st->bytes;
+	    sum[i].usecs += st->usecs;
+	    for(j = 0; j < CL_STATS_LATENCY_BUCKETS; j++)
+		sum[i].latency[j] += st->latency[j];
+	    sum[i].unpack_usecs += st->unpack_usecs;
+	    sum[i].unpack_bytes += st->unpack_bytes;
+	}
+    }
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_unlock(&set->mutex);
+#endif
+
+    for(i = 0; i < SCANSTATS_NTYPES; i++)
+	if(sum[i].files)
+	    ret->ntypes++;
+    if(ret->ntypes && !(ret->types = cli_calloc(ret->ntypes, sizeof(*ret->types)))) {
+	cli_errmsg("cl_engine_get_stats: Can't allocate memory for the statistics\n");
+	free(sum);
+	free(ret);
+	return NULL;
+    }
+    for(i = j = 0; i < SCANSTATS_NTYPES; i++) {
+	struct cl_stats_type *type;
+
+	if(!sum[i].files)
+	    continue;
+	type = &ret->types[j++];
+	type->type = i ? cli_ftname(i + CL_TYPENO - 1) : NULL;
+	if(!type->type)
+	    type->type = "CL_TYPE_ANY";
+	type->files = sum[i].files;
+	type->bytes = sum[i].bytes;
+	type->usecs = sum[i].usecs;
+	memcpy(type->latency, sum[i].latency, sizeof(type->latency));
+	type->unpack_usecs = sum[i].unpack_usecs;
+	type->unpack_bytes = sum[i].unpack_bytes;
+    }
+    free(sum);
+    return ret;
+}
+
+void cl_engine_stats_free(struct cl_stats *stats)
+{
+    if(!stats)
+	return;
+    free(stats->types);
+    free(stats);
+}
@@ -0,0 +1,74 @@
+/*
+ *  Engine-wide scan statistics
+ *
+ *  Copyright (C) 2013 Sourcefire, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#ifndef __SCANSTATS_H
+#define __SCANSTATS_H
+
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#include "clamav.h"
+#include "cltypes.h"
+#include "filetypes.h"
+
+/* CL_TYPE_ANY and the values out of range count as unknown (index 0) */
+#define SCANSTATS_NTYPES (CL_TYPE_IGNORED - CL_TYPENO + 2)
+#define SCANSTATS_TYPE(t) ((t) >= CL_TYPENO && (t) <= CL_TYPE_IGNORED ? (t) - CL_TYPENO + 1 : 0)
+
+struct cli_scanstats_type {
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t usecs;
+    uint64_t latency[CL_STATS_LATENCY_BUCKETS];
+    uint64_t unpack_usecs;
+    uint64_t unpack_bytes;
+};
+
+/* The counters of one scanning thread; only that thread writes them, so
+ * no atomics are needed. The blocks of the threads that have exited are
+ * kept for their counts and handed to new threads. */
+struct cli_scanstats {
+    uint64_t scans;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t pagefaults;
+    uint64_t tmpbytes;
+    uint64_t depth[CL_STATS_DEPTH_BUCKETS];
+    struct cli_scanstats_type types[SCANSTATS_NTYPES];
+    struct cli_scanstats *next;
+    int inuse;
+};
+
+/* All the blocks of an engine */
+struct cli_scanstats_set;
+
+#define SCANSTATS_ADD(ctx, field, n)		\
+    do {					\
+	if((ctx)->stats)			\
+	    (ctx)->stats->field += (n);		\
+    } while(0)
+
+struct cli_scanstats_set *cli_scanstats_new(void);
+void cli_scanstats_free(struct cli_scanstats_set *set);
+struct cli_scanstats *cli_scanstats_get(struct cli_scanstats_set *set);
+void cli_scanstats_file(struct cli_scanstats *stats, cli_file_t type, size_t len, uint64_t usecs, unsigned int depth);
+
+#endif
@@ -35,6 +35,9 @@
  *   a9993e36 4706816a ba3e2571 7850c26c 9cd0d89d
  *   84983e44 1c3bd26e baae4aa1 f95129e5 e54670f1
  *   34aa973c d4c4daa4 f61eeb2b dbad2731 6534016f
+ *
+ * On x86 the whole blocks are hashed with the SHA extensions (SHA-NI) when
+ * the CPU has them; define SHA1_NO_SHANI to always use the C version.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -53,6 +56,13 @@
 
 #include "sha1.h"
 
+#if !defined(SHA1_NO_SHANI) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SHA1_SHANI
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
 #ifndef lint
 static const char rcsid[] =
 	"$Id: sha1.c 680 2003-07-25 21:57:38Z asaddi $";
@@ -462,6 +472,118 @@ SHA1Guts (SHA1Context *sc, const uint32_t *cbuf)
   sc->hash[4] += e;
 }
 
+#ifdef SHA1_SHANI
+static int shaniState = -1;
+
+static int
+shaniUsable (void)
+{
+  unsigned int a, b, c, d;
+
+  if (shaniState < 0) {
+    int state = 0;
+
+    if (__get_cpuid_max (0, NULL) >= 7) {
+      __cpuid (1, a, b, c, d);
+      if ((c & bit_SSSE3) && (c & bit_SSE4_1)) {
+	__cpuid_count (7, 0, a, b, c, d);
+	if (b & (1 << 29))
+	  state = 1;
+      }
+    }
+    shaniState = state;
+  }
+  return shaniState;
+}
+#endif /* SHA1_SHANI */
+
+/* Turns the SHA-NI code off (use == 0) or back on when the CPU has it;
+ * returns whether it is used. For the tests, not thread safe. */
+int
+SHA1UseSHANI (int use)
+{
+#ifdef SHA1_SHANI
+  shaniState = -1;
+  if (use)
+    return shaniUsable ();
+  shaniState = 0;
+#endif /* SHA1_SHANI */
+  return 0;
+}
+
+#ifdef SHA1_SHANI
+
+/* four rounds with e in ecur; the other e register gets the next one */
+#define SHANI_RNDS(ecur, enext, m, f) { \
+  ecur = _mm_sha1nexte_epu32 (ecur, m); \
+  enext = ABCD; \
+  ABCD = _mm_sha1rnds4_epu32 (ABCD, ecur, f); \
+}
+#define SHANI_MSG2(next, m) \
+  next = _mm_sha1msg2_epu32 (next, m)
+#define SHANI_MSG1(prev, m) \
+  prev = _mm_sha1msg1_epu32 (prev, m)
+#define SHANI_XOR(prev2, m) \
+  prev2 = _mm_xor_si128 (prev2, m)
+#define SHANI_LOAD(m, i) \
+  m = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 16 * (i))), MASK)
+
+/* Same as SHA1Guts() for each of the blocks, with the SHA extensions */
+__attribute__((target("sha,sse4.1")))
+static void
+SHA1GutsSHANI (SHA1Context *sc, const uint8_t *data, uint32_t blocks)
+{
+  __m128i ABCD, ABCD_SAVE, E0, E0_SAVE, E1, M0, M1, M2, M3;
+  const __m128i MASK = _mm_set_epi64x (0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+  ABCD = _mm_loadu_si128 ((const __m128i *) sc->hash);
+  ABCD = _mm_shuffle_epi32 (ABCD, 0x1b);
+  E0 = _mm_set_epi32 (sc->hash[4], 0, 0, 0);
+
+  while (blocks--) {
+    ABCD_SAVE = ABCD;
+    E0_SAVE = E0;
+
+    SHANI_LOAD (M0, 0);
+    SHANI_LOAD (M1, 1);
+    SHANI_LOAD (M2, 2);
+    SHANI_LOAD (M3, 3);
+
+    E0 = _mm_add_epi32 (E0, M0);
+    E1 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32 (ABCD, E0, 0);
+
+    SHANI_RNDS (E1, E0, M1, 0); SHANI_MSG1 (M0, M1);
+    SHANI_RNDS (E0, E1, M2, 0); SHANI_MSG1 (M1, M2); SHANI_XOR (M0, M2);
+    SHANI_MSG2 (M0, M3); SHANI_RNDS (E1, E0, M3, 0); SHANI_MSG1 (M2, M3); SHANI_XOR (M1, M3);
+    SHANI_MSG2 (M1, M0); SHANI_RNDS (E0, E1, M0, 0); SHANI_MSG1 (M3, M0); SHANI_XOR (M2, M0);
+    SHANI_MSG2 (M2, M1); SHANI_RNDS (E1, E0, M1, 1); SHANI_MSG1 (M0, M1); SHANI_XOR (M3, M1);
+    SHANI_MSG2 (M3, M2); SHANI_RNDS (E0, E1, M2, 1); SHANI_MSG1 (M1, M2); SHANI_XOR (M0, M2);
+    SHANI_MSG2 (M0, M3); SHANI_RNDS (E1, E0, M3, 1); SHANI_MSG1 (M2, M3); SHANI_XOR (M1, M3);
+    SHANI_MSG2 (M1, M0); SHANI_RNDS (E0, E1, M0, 1); SHANI_MSG1 (M3, M0); SHANI_XOR (M2, M0);
+    SHANI_MSG2 (M2, M1); SHANI_RNDS (E1, E0, M1, 1); SHANI_MSG1 (M0, M1); SHANI_XOR (M3, M1);
+    SHANI_MSG2 (M3, M2); SHANI_RNDS (E0, E1, M2, 2); SHANI_MSG1 (M1, M2); SHANI_XOR (M0, M2);
+    SHANI_MSG2 (M0, M3); SHANI_RNDS (E1, E0, M3, 2); SHANI_MSG1 (M2, M3); SHANI_XOR (M1, M3);
+    SHANI_MSG2 (M1, M0); SHANI_RNDS (E0, E1, M0, 2); SHANI_MSG1 (M3, M0); SHANI_XOR (M2, M0);
+    SHANI_MSG2 (M2, M1); SHANI_RNDS (E1, E0, M1, 2); SHANI_MSG1 (M0, M1); SHANI_XOR (M3, M1);
+    SHANI_MSG2 (M3, M2); SHANI_RNDS (E0, E1, M2, 2); SHANI_MSG1 (M1, M2); SHANI_XOR (M0, M2);
+    SHANI_MSG2 (M0, M3); SHANI_RNDS (E1, E0, M3, 3); SHANI_MSG1 (M2, M3); SHANI_XOR (M1, M3);
+    SHANI_MSG2 (M1, M0); SHANI_RNDS (E0, E1, M0, 3); SHANI_MSG1 (M3, M0); SHANI_XOR (M2, M0);
+    SHANI_MSG2 (M2, M1); SHANI_RNDS (E1, E0, M1, 3); SHANI_XOR (M3, M1);
+    SHANI_MSG2 (M3, M2); SHANI_RNDS (E0, E1, M2, 3);
+    SHANI_RNDS (E1, E0, M3, 3);
+
+    E0 = _mm_sha1nexte_epu32 (E0, E0_SAVE);
+    ABCD = _mm_add_epi32 (ABCD, ABCD_SAVE);
+    data += 64;
+  }
+
+  ABCD = _mm_shuffle_epi32 (ABCD, 0x1b);
+  _mm_storeu_si128 ((__m128i *) sc->hash, ABCD);
+  sc->hash[4] = _mm_extract_epi32 (E0, 3);
+}
+#endif /* SHA1_SHANI */
+
 void
 SHA1Update (SHA1Context *sc, const void *vdata, uint32_t len)
 {
@@ -512,6 +634,16 @@ SHA1Update (SHA1Context *sc, const void *vdata, uint32_t len)
   }
 #else /* SHA1_FAST_COPY */
   while (len) {
+#ifdef SHA1_SHANI
+    if (!sc->bufferLength && len > 63L && shaniUsable ()) {
+      bytesToCopy = len & ~63L;
+      SHA1GutsSHANI (sc, data, bytesToCopy >> 6);
+      sc->totalLength += bytesToCopy * 8L;
+      data += bytesToCopy;
+      len -= bytesToCopy;
+      continue;
+    }
+#endif /* SHA1_SHANI */
     bufferBytesLeft = 64L - sc->bufferLength;
 
     bytesToCopy = bufferBytesLeft;
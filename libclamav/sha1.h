@@ -59,6 +59,7 @@ extern "C" {
 void SHA1Init (SHA1Context *sc);
 void SHA1Update (SHA1Context *sc, const void *data, uint32_t len);
 void SHA1Final (SHA1Context *sc, uint8_t hash[SHA1_HASH_SIZE]);
+int SHA1UseSHANI (int use);
 
 #ifdef __cplusplus
 }
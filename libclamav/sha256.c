@@ -35,6 +35,9 @@
  *   ba7816bf 8f01cfea 414140de 5dae2223 b00361a3 96177a9c b410ff61 f20015ad
  *   248d6a61 d20638b8 e5c02693 0c3e6039 a33ce459 64ff2167 f6ecedd4 19db06c1
  *   cdc76e5c 9914fb92 81a1c7e2 84d73e67 f1809a48 a497200e 046d39cc c7112cd0
+ *
+ * On x86 the whole blocks are hashed with the SHA extensions (SHA-NI) when
+ * the CPU has them; define SHA256_NO_SHANI to always use the C version.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -53,6 +56,13 @@
 
 #include "sha256.h"
 
+#if !defined(SHA256_NO_SHANI) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SHA256_SHANI
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
 #ifndef lint
 static const char rcsid[] =
 	"$Id: sha256.c 680 2003-07-25 21:57:49Z asaddi $";
@@ -317,6 +327,115 @@ SHA256Guts (SHA256_CTX *sc, const uint32_t *cbuf)
   sc->hash[7] += h;
 }
 
+#ifdef SHA256_SHANI
+static int shaniState = -1;
+
+static int
+shaniUsable (void)
+{
+  unsigned int a, b, c, d;
+
+  if (shaniState < 0) {
+    int state = 0;
+
+    if (__get_cpuid_max (0, NULL) >= 7) {
+      __cpuid (1, a, b, c, d);
+      if ((c & bit_SSSE3) && (c & bit_SSE4_1)) {
+	__cpuid_count (7, 0, a, b, c, d);
+	if (b & (1 << 29))
+	  state = 1;
+      }
+    }
+    shaniState = state;
+  }
+  return shaniState;
+}
+#endif /* SHA256_SHANI */
+
+/* Turns the SHA-NI code off (use == 0) or back on when the CPU has it;
+ * returns whether it is used. For the tests, not thread safe. */
+int
+sha256_use_shani (int use)
+{
+#ifdef SHA256_SHANI
+  shaniState = -1;
+  if (use)
+    return shaniUsable ();
+  shaniState = 0;
+#endif /* SHA256_SHANI */
+  return 0;
+}
+
+#ifdef SHA256_SHANI
+
+#define SHANI_RNDS(m, i) { \
+  MSG = _mm_add_epi32 (m, _mm_loadu_si128 ((const __m128i *) &K[4 * (i)])); \
+  STATE1 = _mm_sha256rnds2_epu32 (STATE1, STATE0, MSG); \
+  MSG = _mm_shuffle_epi32 (MSG, 0x0e); \
+  STATE0 = _mm_sha256rnds2_epu32 (STATE0, STATE1, MSG); \
+}
+#define SHANI_MSG2(next, m, prev) \
+  next = _mm_sha256msg2_epu32 (_mm_add_epi32 (next, _mm_alignr_epi8 (m, prev, 4)), m)
+#define SHANI_MSG1(prev, m) \
+  prev = _mm_sha256msg1_epu32 (prev, m)
+#define SHANI_LOAD(m, i) \
+  m = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 16 * (i))), MASK)
+
+/* Same as SHA256Guts() for each of the blocks, with the SHA extensions */
+__attribute__((target("sha,sse4.1")))
+static void
+SHA256GutsSHANI (SHA256_CTX *sc, const uint8_t *data, uint32_t blocks)
+{
+  __m128i STATE0, STATE1, MSG, TMP, M0, M1, M2, M3, ABEF, CDGH;
+  const __m128i MASK = _mm_set_epi64x (0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  TMP = _mm_loadu_si128 ((const __m128i *) &sc->hash[0]);
+  STATE1 = _mm_loadu_si128 ((const __m128i *) &sc->hash[4]);
+  TMP = _mm_shuffle_epi32 (TMP, 0xb1);
+  STATE1 = _mm_shuffle_epi32 (STATE1, 0x1b);
+  STATE0 = _mm_alignr_epi8 (TMP, STATE1, 8);
+  STATE1 = _mm_blend_epi16 (STATE1, TMP, 0xf0);
+
+  while (blocks--) {
+    ABEF = STATE0;
+    CDGH = STATE1;
+
+    SHANI_LOAD (M0, 0);
+    SHANI_LOAD (M1, 1);
+    SHANI_LOAD (M2, 2);
+    SHANI_LOAD (M3, 3);
+
+    SHANI_RNDS (M0, 0);
+    SHANI_RNDS (M1, 1); SHANI_MSG1 (M0, M1);
+    SHANI_RNDS (M2, 2); SHANI_MSG1 (M1, M2);
+    SHANI_RNDS (M3, 3); SHANI_MSG2 (M0, M3, M2); SHANI_MSG1 (M2, M3);
+    SHANI_RNDS (M0, 4); SHANI_MSG2 (M1, M0, M3); SHANI_MSG1 (M3, M0);
+    SHANI_RNDS (M1, 5); SHANI_MSG2 (M2, M1, M0); SHANI_MSG1 (M0, M1);
+    SHANI_RNDS (M2, 6); SHANI_MSG2 (M3, M2, M1); SHANI_MSG1 (M1, M2);
+    SHANI_RNDS (M3, 7); SHANI_MSG2 (M0, M3, M2); SHANI_MSG1 (M2, M3);
+    SHANI_RNDS (M0, 8); SHANI_MSG2 (M1, M0, M3); SHANI_MSG1 (M3, M0);
+    SHANI_RNDS (M1, 9); SHANI_MSG2 (M2, M1, M0); SHANI_MSG1 (M0, M1);
+    SHANI_RNDS (M2, 10); SHANI_MSG2 (M3, M2, M1); SHANI_MSG1 (M1, M2);
+    SHANI_RNDS (M3, 11); SHANI_MSG2 (M0, M3, M2); SHANI_MSG1 (M2, M3);
+    SHANI_RNDS (M0, 12); SHANI_MSG2 (M1, M0, M3); SHANI_MSG1 (M3, M0);
+    SHANI_RNDS (M1, 13); SHANI_MSG2 (M2, M1, M0);
+    SHANI_RNDS (M2, 14); SHANI_MSG2 (M3, M2, M1);
+    SHANI_RNDS (M3, 15);
+
+    STATE0 = _mm_add_epi32 (STATE0, ABEF);
+    STATE1 = _mm_add_epi32 (STATE1, CDGH);
+    data += 64;
+  }
+
+  TMP = _mm_shuffle_epi32 (STATE0, 0x1b);
+  STATE1 = _mm_shuffle_epi32 (STATE1, 0xb1);
+  STATE0 = _mm_blend_epi16 (TMP, STATE1, 0xf0);
+  STATE1 = _mm_alignr_epi8 (STATE1, TMP, 8);
+  _mm_storeu_si128 ((__m128i *) &sc->hash[0], STATE0);
+  _mm_storeu_si128 ((__m128i *) &sc->hash[4], STATE1);
+}
+#endif /* SHA256_SHANI */
+
 void
 sha256_update (SHA256_CTX *sc, const void *vdata, uint32_t len)
 {
@@ -366,6 +485,16 @@ sha256_update (SHA256_CTX *sc, const void *vdata, uint32_t len)
   }
 #else /* SHA256_FAST_COPY */
   while (len) {
+#ifdef SHA256_SHANI
+    if (!sc->bufferLength && len > 63L && shaniUsable ()) {
+      bytesToCopy = len & ~63L;
+      SHA256GutsSHANI (sc, data, bytesToCopy >> 6);
+      sc->totalLength += bytesToCopy * 8L;
+      data += bytesToCopy;
+      len -= bytesToCopy;
+      continue;
+    }
+#endif /* SHA256_SHANI */
     bufferBytesLeft = 64L - sc->bufferLength;
 
     bytesToCopy = bufferBytesLeft;
@@ -58,6 +58,7 @@ extern "C" {
 void sha256_init (SHA256_CTX *sc);
 void sha256_update (SHA256_CTX *sc, const void *data, uint32_t len);
 void sha256_final (SHA256_CTX *sc, uint8_t hash[SHA256_HASH_SIZE]);
+int sha256_use_shani (int use);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,223 @@
+/*
+ *  Per-signature hit and cost statistics
+ *
+ *  Copyright (C) 2013 Sourcefire, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clamav.h"
+#include "others.h"
+#include "sigstats.h"
+
+#define SIGSTATS_TOP 50	/* rows printed per table */
+
+struct cli_sigstats *cli_sigstats_new(void)
+{
+	struct cli_sigstats *sigstats;
+
+    if(!(sigstats = cli_calloc(1, sizeof(*sigstats)))) {
+	cli_errmsg("cli_sigstats_new: Can't allocate memory for the statistics\n");
+	return NULL;
+    }
+    if(cli_hashtab_init(&sigstats->hashes, 64)) {
+	cli_errmsg("cli_sigstats_new: Can't initialize the hash table\n");
+	free(sigstats);
+	return NULL;
+    }
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_init(&sigstats->mutex, NULL);
+#endif
+    return sigstats;
+}
+
+void cli_sigstats_free(struct cli_sigstats *sigstats)
+{
+    if(!sigstats)
+	return;
+    cli_hashtab_free(&sigstats->hashes);
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_destroy(&sigstats->mutex);
+#endif
+    free(sigstats->stats);
+    free(sigstats);
+}
+
+/* Called while loading, returns the id for SIGSTAT_INC() or 0 */
+uint32_t cli_sigstats_add(struct cli_sigstats *sigstats, const char *virname, unsigned int kind, int32_t sub)
+{
+	struct cli_sigstat *stat;
+
+    if(!sigstats)
+	return 0;
+
+    if(sigstats->nstats == sigstats->maxstats) {
+	uint32_t max = sigstats->maxstats ? sigstats->maxstats * 2 : 1024;
+
+	if(!(stat = cli_realloc(sigstats->stats, max * sizeof(*stat)))) {
+	    cli_errmsg("cli_sigstats_add: Can't allocate memory for %u records\n", max);
+	    return 0;
+	}
+	sigstats->stats = stat;
+	sigstats->maxstats = max;
+    }
+    stat = &sigstats->stats[sigstats->nstats++];
+    memset(stat, 0, sizeof(*stat));
+    stat->virname = virname;
+    stat->kind = kind;
+    stat->sub = sub;
+    return sigstats->nstats;
+}
+
+void cli_sigstats_hash(struct cli_sigstats *sigstats, const char *virname)
+{
+	struct cli_element *el;
+	size_t len;
+
+    if(!sigstats || !virname)
+	return;
+
+    len = strlen(virname);
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_lock(&sigstats->mutex);
+#endif
+    if((el = cli_hashtab_find(&sigstats->hashes, virname, len)))
+	el->data++;
+    else
+	cli_hashtab_insert(&sigstats->hashes, virname, len, 1);
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_unlock(&sigstats->mutex);
+#endif
+}
+
+static uint64_t sigstat_cost(const struct cli_sigstat *stat)
+{
+    return stat->kind == SIGSTAT_LSIG ? stat->usecs : stat->verifies;
+}
+
+static int sigstat_comp(const void *a, const void *b)
+{
+    const struct cli_sigstat *sa = *(const struct cli_sigstat * const *) a;
+    const struct cli_sigstat *sb = *(const struct cli_sigstat * const *) b;
+    uint64_t ca = sigstat_cost(sa), cb = sigstat_cost(sb);
+
+    if(ca != cb)
+	return ca < cb ? 1 : -1;
+    if(sa->candidates != sb->candidates)
+	return sa->candidates < sb->candidates ? 1 : -1;
+    return 0;
+}
+
+static int hashstat_comp(const void *a, const void *b)
+{
+    const struct cli_element *ea = *(const struct cli_element * const *) a;
+    const struct cli_element *eb = *(const struct cli_element * const *) b;
+
+    if(ea->data != eb->data)
+	return ea->data < eb->data ? 1 : -1;
+    return 0;
+}
+
+static void sigstats_print_kind(const struct cli_sigstats *sigstats, unsigned int kind, const struct cli_sigstat **list)
+{
+	const char *names[] = { "AC pattern", "BM pattern", "Logical signature" };
+	const struct cli_sigstat *stat;
+	char name[128];
+	uint32_t i, n = 0;
+
+    for(i = 0; i < sigstats->nstats; i++) {
+	stat = &sigstats->stats[i];
+	if(stat->kind == kind && (stat->candidates || stat->verifies))
+	    list[n++] = stat;
+    }
+    if(!n)
+	return;
+    cli_qsort(list, n, sizeof(*list), sigstat_comp);
+
+    cli_infomsg(NULL, "%-48s %12s %12s %10s %12s\n", names[kind],
+		kind == SIGSTAT_LSIG ? "" : "#candidates", kind == SIGSTAT_LSIG ? "#evals" : "#verifies",
+		"#hits", kind == SIGSTAT_LSIG ? "usecs total" : "");
+    cli_infomsg(NULL, "%-48s %12s %12s %10s %12s\n", "=================",
+		kind == SIGSTAT_LSIG ? "" : "===========", kind == SIGSTAT_LSIG ? "======" : "=========",
+		"=====", kind == SIGSTAT_LSIG ? "===========" : "");
+    for(i = 0; i < n && i < SIGSTATS_TOP; i++) {
+	stat = list[i];
+	if(stat->sub >= 0)
+	    snprintf(name, sizeof(name), "%s/%d", stat->virname ? stat->virname : "\"noname\"", stat->sub);
+	else
+	    snprintf(name, sizeof(name), "%s", stat->virname ? stat->virname : "\"noname\"");
+	if(kind == SIGSTAT_LSIG)
+	    cli_infomsg(NULL, "%-48s %12s %12llu %10llu %12llu\n", name, "",
+			(unsigned long long) stat->verifies, (unsigned long long) stat->hits, (unsigned long long) stat->usecs);
+	else
+	    cli_infomsg(NULL, "%-48s %12llu %12llu %10llu\n", name, (unsigned long long) stat->candidates,
+			(unsigned long long) stat->verifies, (unsigned long long) stat->hits);
+    }
+    if(n > SIGSTATS_TOP)
+	cli_infomsg(NULL, "(%u more)\n", n - SIGSTATS_TOP);
+    cli_infomsg(NULL, "\n");
+}
+
+/* Prints the statistics collected with CL_DB_SIGNATURE_STATS, the most
+ * expensive signatures first */
+void cli_sigstats_print(const struct cl_engine *engine)
+{
+	const struct cli_sigstats *sigstats;
+	const struct cli_sigstat **list;
+	const struct cli_element **hlist;
+	uint32_t i, n = 0;
+
+    if(!engine || !(sigstats = engine->sigstats))
+	return;
+
+    if(sigstats->nstats) {
+	if(!(list = cli_malloc(sigstats->nstats * sizeof(*list)))) {
+	    cli_errmsg("cli_sigstats_print: Can't allocate memory for the list\n");
+	    return;
+	}
+	sigstats_print_kind(sigstats, SIGSTAT_AC, list);
+	sigstats_print_kind(sigstats, SIGSTAT_BM, list);
+	sigstats_print_kind(sigstats, SIGSTAT_LSIG, list);
+	free(list);
+    }
+
+    if(!sigstats->hashes.used)
+	return;
+    if(!(hlist = cli_malloc(sigstats->hashes.used * sizeof(*hlist)))) {
+	cli_errmsg("cli_sigstats_print: Can't allocate memory for the list\n");
+	return;
+    }
+    for(i = 0; i < sigstats->hashes.capacity; i++) {
+	const struct cli_element *el = &sigstats->hashes.htable[i];
+	if(el->key && *el->key) /* "" marks the deleted ones */
+	    hlist[n++] = el;
+    }
+    cli_qsort(hlist, n, sizeof(*hlist), hashstat_comp);
+    cli_infomsg(NULL, "%-48s %10s\n", "Hash signature", "#hits");
+    cli_infomsg(NULL, "%-48s %10s\n", "==============", "=====");
+    for(i = 0; i < n && i < SIGSTATS_TOP; i++)
+	cli_infomsg(NULL, "%-48s %10ld\n", hlist[i]->key, hlist[i]->data);
+    if(n > SIGSTATS_TOP)
+	cli_infomsg(NULL, "(%u more)\n", n - SIGSTATS_TOP);
+    free(hlist);
+}
@@ -0,0 +1,86 @@
+/*
+ *  Per-signature hit and cost statistics
+ *
+ *  Copyright (C) 2013 Sourcefire, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#ifndef __SIGSTATS_H
+#define __SIGSTATS_H
+
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#ifdef CL_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+#include "clamav.h"
+#include "cltypes.h"
+#include "hashtab.h"
+
+/* With CL_DB_SIGNATURE_STATS every AC and BM pattern and every logical
+ * signature loaded gets a record (the perfid of the pattern, 0 when the
+ * statistics are off). Patterns with the same bytes share their trie node,
+ * the first one of them counts the candidates and the verifications for
+ * all. Hash signatures have no per-entry id, their hits are counted by
+ * name. */
+
+enum {
+    SIGSTAT_AC = 0,
+    SIGSTAT_BM,
+    SIGSTAT_LSIG
+};
+
+struct cli_sigstat {
+    const char *virname;
+    uint64_t candidates;	/* AC: the trie reached the pattern, BM: the prefix matched */
+    uint64_t verifies;		/* full checks (wildcards, alternatives, specials), LSIG: evaluations */
+    uint64_t hits;
+    uint64_t usecs;		/* LSIG: time spent in the evaluation */
+    int32_t sub;		/* part or subsignature number, -1 if none */
+    uint8_t kind;
+};
+
+struct cli_sigstats {
+    struct cli_sigstat *stats;
+    uint32_t nstats, maxstats;
+    struct cli_hashtable hashes;	/* virus name -> hits */
+#ifdef CL_THREAD_SAFE
+    pthread_mutex_t mutex;
+#endif
+};
+
+#if defined(CL_THREAD_SAFE) && defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+#define SIGSTAT_ADD(v, n) __sync_fetch_and_add(&(v), (n))
+#else
+#define SIGSTAT_ADD(v, n) ((v) += (n))
+#endif
+
+#define SIGSTAT_INC(sigstats, id, field)				\
+    do {								\
+	if(UNLIKELY(id))						\
+	    SIGSTAT_ADD((sigstats)->stats[(id) - 1].field, 1);		\
+    } while(0)
+
+struct cli_sigstats *cli_sigstats_new(void);
+void cli_sigstats_free(struct cli_sigstats *sigstats);
+uint32_t cli_sigstats_add(struct cli_sigstats *sigstats, const char *virname, unsigned int kind, int32_t sub);
+void cli_sigstats_hash(struct cli_sigstats *sigstats, const char *virname);
+void cli_sigstats_print(const struct cl_engine *engine);
+
+#endif
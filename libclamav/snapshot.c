@@ -0,0 +1,1996 @@
+/*
+ *  Compiled engine snapshots
+ *
+ *  Copyright (C) 2013 Sourcefire, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#if HAVE_CONFIG_H
+#include "clamav-config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#if defined(HAVE_SHM_OPEN)
+#define SN_SHM
+#endif
+#endif
+
+#include "clamav.h"
+#include "others.h"
+#include "matcher.h"
+#include "matcher-ac.h"
+#include "matcher-bm.h"
+#include "matcher-hash.h"
+#include "filtering.h"
+#include "filetypes.h"
+#include "readdb.h"
+#include "dconf.h"
+#include "cache.h"
+#include "phishcheck.h"
+#include "regex_list.h"
+#include "bytecode.h"
+#include "mpool.h"
+#include "str.h"
+#include "snapshot.h"
+
+/* A snapshot is the compiled engine written out field by field. Scalars
+ * are native 32-bit words: the file is only valid for the byte order and
+ * the libclamav version that wrote it, both are checked on load. Arrays
+ * carry their element count and start 8-byte aligned, strings their length
+ * (or SN_NONE for NULL), and the pointers between structures are stored as
+ * 1-based indices. Everything holding pointers is rebuilt in the mpool on
+ * load; the transition tables of the tries and the hash arrays with their
+ * virus names, which make up most of a compiled engine, are used in place
+ * from the read-only mapping of the file.
+ * Bytecode, phishing, container metadata, icon and certificate signatures
+ * are left out: they're parsed again from the recorded database files on
+ * load (sn_reload()), with CL_DB_SNAPSHOT telling cli_load() to skip
+ * everything else.
+ */
+#define SN_MAGIC	"ClamAV-Snapshot"
+#define SN_VERSION	3
+#define SN_NONE		0xffffffff
+
+/* section tags, they only help to catch a reader/writer mismatch */
+#define SN_TAG_ENGINE	0x454e4731
+#define SN_TAG_HASH	0x48534831
+#define SN_TAG_ROOT	0x52545431
+#define SN_TAG_FUSED	0x46534431
+#define SN_TAG_END	0x454e4431
+
+#define SN_PATT_WORDS	33
+#define SN_STATE_WORDS	16
+#define SN_LSIG_WORDS	16
+#define SN_BMPATT_WORDS	13
+
+/* what sn_get_dbs() compares */
+#define SN_CHECK_FILES	1
+#define SN_CHECK_ROOTS	2
+
+extern const unsigned int hashlen[];
+
+struct sn_out {
+    FILE *fs;
+    unsigned char *buf;	/* writing to memory; with neither only off is counted */
+    size_t off;
+    int err;
+};
+
+struct sn_in {
+    const unsigned char *map;
+    size_t size, off;
+    int err;
+};
+
+struct sn_ptr {
+    const void *ptr;
+    uint32_t idx;
+};
+
+static inline unsigned int sn_popcount(uint32_t v)
+{
+#ifdef __GNUC__
+    return __builtin_popcount(v);
+#else
+    v = v - ((v >> 1) & 0x55555555);
+    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+    return (((v + (v >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+#endif
+}
+
+/* Writer */
+
+static void sn_put(struct sn_out *out, const void *data, size_t len)
+{
+    if(out->err || !len)
+	return;
+    if(out->buf)
+	memcpy(out->buf + out->off, data, len);
+    else if(out->fs && fwrite(data, 1, len, out->fs) != len)
+	out->err = CL_EWRITE;
+    out->off += len;
+}
+
+static void sn_putu32(struct sn_out *out, uint32_t val)
+{
+    sn_put(out, &val, sizeof(val));
+}
+
+static void sn_putarray(struct sn_out *out, const void *data, uint32_t n, size_t size)
+{
+	static const char pad[8];
+
+    sn_putu32(out, n);
+    if(out->off & 7)
+	sn_put(out, pad, 8 - (out->off & 7));
+    sn_put(out, data, (size_t) n * size);
+}
+
+static void sn_putstr(struct sn_out *out, const char *str)
+{
+	uint32_t len;
+
+    if(!str) {
+	sn_putu32(out, SN_NONE);
+	return;
+    }
+    len = strlen(str);
+    sn_putu32(out, len);
+    sn_put(out, str, len + 1);
+}
+
+static int sn_ptrcmp(const void *a, const void *b)
+{
+	const struct sn_ptr *pa = a, *pb = b;
+
+    if((const char *) pa->ptr < (const char *) pb->ptr)
+	return -1;
+    return (const char *) pa->ptr > (const char *) pb->ptr;
+}
+
+static struct sn_ptr *sn_ptrmap(const void * const *table, uint32_t n)
+{
+	struct sn_ptr *map;
+	uint32_t i;
+
+    if(!(map = (struct sn_ptr *) cli_malloc((n + 1) * sizeof(struct sn_ptr)))) {
+	cli_errmsg("cl_engine_save: Can't allocate memory for pointer map\n");
+	return NULL;
+    }
+    for(i = 0; i < n; i++) {
+	map[i].ptr = table[i];
+	map[i].idx = i + 1;
+    }
+    qsort(map, n, sizeof(struct sn_ptr), sn_ptrcmp);
+    return map;
+}
+
+/* 0 for NULL, the 1-based index of ptr otherwise */
+static uint32_t sn_ptridx(struct sn_out *out, const struct sn_ptr *map, uint32_t n, const void *ptr)
+{
+	struct sn_ptr key, *found;
+
+    if(!ptr)
+	return 0;
+    key.ptr = ptr;
+    found = (struct sn_ptr *) bsearch(&key, map, n, sizeof(struct sn_ptr), sn_ptrcmp);
+    if(!found) {
+	cli_errmsg("cl_engine_save: Dangling pointer in matcher\n");
+	out->err = CL_EARG;
+	return 0;
+    }
+    return found->idx;
+}
+
+static uint32_t sn_off(const void *base, const void *ptr, size_t size)
+{
+    return ptr ? ((const char *) ptr - (const char *) base) / size : SN_NONE;
+}
+
+static void sn_put_ftypes(struct sn_out *out, const struct cli_ftype *ftypes)
+{
+	const struct cli_ftype *ftype;
+	uint32_t n = 0;
+
+    for(ftype = ftypes; ftype; ftype = ftype->next)
+	n++;
+    sn_putu32(out, n);
+    for(ftype = ftypes; ftype; ftype = ftype->next) {
+	sn_putu32(out, ftype->type);
+	sn_putu32(out, ftype->offset);
+	sn_putarray(out, ftype->magic, ftype->length, 1);
+	sn_putstr(out, ftype->tname);
+    }
+}
+
+static void sn_put_szh(struct sn_out *out, const struct cli_sz_hash *szh, unsigned int hlen)
+{
+	uint32_t i, len = 0;
+
+    sn_putarray(out, szh->hash_array, szh->items, hlen);
+    for(i = 0; i < szh->items; i++)
+	len += strlen(szh->virusnames[i]) + 1;
+    sn_putu32(out, len);
+    for(i = 0; i < szh->items; i++)
+	sn_put(out, szh->virusnames[i], strlen(szh->virusnames[i]) + 1);
+}
+
+static void sn_put_hm(struct sn_out *out, const struct cli_matcher *root)
+{
+	const struct cli_htu32_element *item;
+	unsigned int type;
+	uint32_t n;
+
+    sn_putu32(out, SN_TAG_HASH);
+    sn_putu32(out, !!root);
+    if(!root)
+	return;
+
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
+	n = 0;
+	item = NULL;
+	if(root->hm.sizehashes[type].capacity)
+	    while((item = cli_htu32_next(&root->hm.sizehashes[type], item)))
+		n++;
+	sn_putu32(out, n);
+	item = NULL;
+	while(n-- && (item = cli_htu32_next(&root->hm.sizehashes[type], item))) {
+	    sn_putu32(out, item->key);
+	    sn_put_szh(out, (const struct cli_sz_hash *) item->data.as_ptr, hashlen[type]);
+	}
+    }
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++)
+	sn_put_szh(out, &root->hwild.hashes[type], hashlen[type]);
+}
+
+static void sn_put_lsigs(struct sn_out *out, const struct cli_matcher *root)
+{
+	const struct cli_ac_lsig *lsig;
+	const struct cli_lsig_tdb *tdb;
+	uint32_t i, w[SN_LSIG_WORDS];
+
+    sn_putu32(out, root->ac_lsigs);
+    for(i = 0; i < root->ac_lsigs; i++) {
+	lsig = root->ac_lsigtable[i];
+	tdb = &lsig->tdb;
+	w[0] = lsig->id;
+	w[1] = lsig->bc_idx;
+	w[2] = tdb->cnt[CLI_TDB_UINT];
+	w[3] = tdb->cnt[CLI_TDB_RANGE];
+	w[4] = tdb->cnt[CLI_TDB_STR];
+	w[5] = tdb->subsigs;
+	w[6] = sn_off(tdb->val, tdb->target, sizeof(uint32_t));
+	w[7] = sn_off(tdb->val, tdb->container, sizeof(uint32_t));
+	w[8] = sn_off(tdb->val, tdb->handlertype, sizeof(uint32_t));
+	w[9] = sn_off(tdb->range, tdb->engine, sizeof(uint32_t));
+	w[10] = sn_off(tdb->range, tdb->nos, sizeof(uint32_t));
+	w[11] = sn_off(tdb->range, tdb->ep, sizeof(uint32_t));
+	w[12] = sn_off(tdb->range, tdb->filesize, sizeof(uint32_t));
+	w[13] = sn_off(tdb->str, tdb->icongrp1, 1);
+	w[14] = sn_off(tdb->str, tdb->icongrp2, 1);
+	w[15] = tdb->macro_ptids ? tdb->subsigs : 0;
+	sn_put(out, w, sizeof(w));
+	sn_putstr(out, lsig->logic);
+	sn_putarray(out, tdb->val, w[2], sizeof(uint32_t));
+	sn_putarray(out, tdb->range, w[3], sizeof(uint32_t));
+	sn_putarray(out, tdb->str, w[4], 1);
+	sn_putarray(out, tdb->macro_ptids, w[15], sizeof(uint32_t));
+    }
+}
+
+static void sn_put_special(struct sn_out *out, const struct cli_ac_special *special)
+{
+	const struct cli_ac_special *sp;
+	uint32_t n = 0;
+
+    for(sp = special; sp; sp = sp->next)
+	n++;
+    sn_putu32(out, n);
+    for(sp = special; sp; sp = sp->next) {
+	sn_putu32(out, sp->type);
+	sn_putu32(out, sp->negative);
+	sn_putu32(out, sp->num);
+	sn_putu32(out, sp->len);
+	if(sp->type == AC_SPECIAL_ALT_CHAR)
+	    sn_putarray(out, sp->str, sp->num, 1);
+	else if(sp->type == AC_SPECIAL_ALT_STR)
+	    sn_putarray(out, sp->str, sp->len, 1);
+	else
+	    sn_putarray(out, NULL, 0, 1);
+    }
+}
+
+static void sn_put_acpatt(struct sn_out *out, const struct cli_ac_patt *patt, const struct sn_ptr *map, uint32_t n)
+{
+	uint32_t i, w[SN_PATT_WORDS];
+
+    w[0] = patt->length;
+    w[1] = patt->prefix_length;
+    w[2] = !!patt->prefix;
+    w[3] = patt->mindist;
+    w[4] = patt->maxdist;
+    w[5] = patt->sigid;
+    w[6] = patt->lsigid[0];
+    w[7] = patt->lsigid[1];
+    w[8] = patt->lsigid[2];
+    w[9] = patt->ch[0];
+    w[10] = patt->ch[1];
+    w[11] = patt->ch_mindist[0];
+    w[12] = patt->ch_mindist[1];
+    w[13] = patt->ch_maxdist[0];
+    w[14] = patt->ch_maxdist[1];
+    w[15] = patt->parts;
+    w[16] = patt->partno;
+    w[17] = patt->special;
+    w[18] = patt->special_pattern;
+    w[19] = patt->special_len;
+    w[20] = patt->rtype;
+    w[21] = patt->type;
+    w[22] = patt->offdata[0];
+    w[23] = patt->offdata[1];
+    w[24] = patt->offdata[2];
+    w[25] = patt->offdata[3];
+    w[26] = patt->offset_min;
+    w[27] = patt->offset_max;
+    w[28] = patt->boundary;
+    w[29] = patt->depth;
+    w[30] = sn_ptridx(out, map, n, patt->next);
+    w[31] = sn_ptridx(out, map, n, patt->next_same);
+    w[32] = patt->rootidx;
+    sn_put(out, w, sizeof(w));
+    sn_putarray(out, patt->prefix ? patt->prefix : patt->pattern, patt->prefix_length + patt->length, sizeof(uint16_t));
+    sn_putstr(out, patt->virname);
+    for(i = 0; i < patt->special; i++)
+	sn_put_special(out, patt->special_table[i]);
+}
+
+/* The filter and the frozen trie; ac_dtrans and ac_strans are sized from
+ * the states which use them */
+static void sn_put_trie(struct sn_out *out, const struct cli_matcher *root, const struct sn_ptr *map, uint32_t n)
+{
+	const struct cli_ac_state *state;
+	uint32_t i, k, nstates = root->ac_nodes + 1, ndtrans = 0, nstrans = 0, end, w[SN_STATE_WORDS];
+
+    sn_putu32(out, !!root->filter);
+    if(root->filter) {
+	sn_put(out, root->filter->B, sizeof(root->filter->B));
+	sn_put(out, root->filter->end, sizeof(root->filter->end));
+	sn_putu32(out, root->filter->m);
+    }
+
+    sn_putu32(out, nstates);
+    for(i = 0; i < nstates; i++) {
+	state = &root->ac_states[i];
+	w[0] = sn_ptridx(out, map, n, state->list);
+	w[1] = sn_ptridx(out, map, n, state->faillist);
+	w[2] = state->trans;
+	w[3] = state->fail;
+	for(k = 0; k < 8; k++)
+	    w[4 + k] = state->map[k];
+	memcpy(&w[12], state->rank, sizeof(state->rank));
+	w[14] = state->dense;
+	w[15] = 0;
+	sn_put(out, w, sizeof(w));
+	if(state->dense) {
+	    if((end = state->trans + 256) > ndtrans)
+		ndtrans = end;
+	} else {
+	    for(end = state->trans, k = 0; k < 8; k++)
+		end += sn_popcount(state->map[k]);
+	    if(end > nstrans)
+		nstrans = end;
+	}
+    }
+    sn_putarray(out, root->ac_dtrans, ndtrans, sizeof(uint32_t));
+    sn_putarray(out, root->ac_strans, nstrans, sizeof(uint32_t));
+}
+
+static void sn_put_bm(struct sn_out *out, const struct cli_matcher *root)
+{
+	const struct cli_bm_patt *patt;
+	const struct cli_bm_patt **table;
+	struct sn_ptr *map;
+	uint32_t i, n = 0, w[SN_BMPATT_WORDS];
+
+    sn_putarray(out, root->bm_shift, BM_HASH_SIZE, 1);
+    sn_putarray(out, root->bm_pref, root->bm_pref ? BM_HASH_SIZE : 0, sizeof(struct cli_bm_pref));
+
+    if(!(table = (const struct cli_bm_patt **) cli_malloc((root->bm_patterns + 1) * sizeof(*table)))) {
+	out->err = CL_EMEM;
+	return;
+    }
+    sn_putu32(out, root->bm_patterns);
+    for(i = 0; i < BM_HASH_SIZE; i++) {
+	for(patt = root->bm_suffix[i]; patt && n < root->bm_patterns; patt = patt->next) {
+	    table[n++] = patt;
+	    w[0] = i;
+	    w[1] = patt->length;
+	    w[2] = patt->prefix_length;
+	    w[3] = !!patt->prefix;
+	    w[4] = patt->cnt;
+	    w[5] = patt->boundary;
+	    w[6] = patt->filesize;
+	    w[7] = patt->offdata[0];
+	    w[8] = patt->offdata[1];
+	    w[9] = patt->offdata[2];
+	    w[10] = patt->offdata[3];
+	    w[11] = patt->offset_min;
+	    w[12] = patt->offset_max;
+	    sn_put(out, w, sizeof(w));
+	    sn_putarray(out, patt->prefix ? patt->prefix : patt->pattern, patt->prefix_length + patt->length, 1);
+	    sn_putstr(out, patt->virname);
+	}
+    }
+    if(n != root->bm_patterns) {
+	cli_errmsg("cl_engine_save: BM pattern count mismatch\n");
+	out->err = CL_EARG;
+    }
+
+    /* bm_pattab as indices into the patterns above */
+    sn_putu32(out, root->bm_offmode ? root->bm_patterns : 0);
+    if(root->bm_offmode && n) {
+	if(!(map = sn_ptrmap((const void * const *) table, n))) {
+	    out->err = CL_EMEM;
+	} else {
+	    for(i = 0; i < root->bm_patterns; i++)
+		sn_putu32(out, sn_ptridx(out, map, n, root->bm_pattab[i]));
+	    free(map);
+	}
+    }
+    free(table);
+}
+
+static void sn_put_fused(struct sn_out *out, const struct cli_matcher *fused)
+{
+	struct sn_ptr *map;
+	uint32_t i;
+
+    sn_putu32(out, SN_TAG_FUSED);
+    sn_putu32(out, fused->ac_patterns);
+    if(!(map = sn_ptrmap((const void * const *) fused->ac_pattable, fused->ac_patterns))) {
+	out->err = CL_EMEM;
+	return;
+    }
+    /* the patterns are copies of the target root's followed by the
+     * generic root's, only the links differ */
+    for(i = 0; i < fused->ac_patterns; i++) {
+	sn_putu32(out, sn_ptridx(out, map, fused->ac_patterns, fused->ac_pattable[i]->next));
+	sn_putu32(out, sn_ptridx(out, map, fused->ac_patterns, fused->ac_pattable[i]->next_same));
+	sn_putu32(out, fused->ac_pattable[i]->depth);
+	sn_putu32(out, fused->ac_pattable[i]->rootidx);
+    }
+    sn_putu32(out, fused->maxpatlen);
+    sn_put_trie(out, fused, map, fused->ac_patterns);
+    free(map);
+}
+
+static void sn_put_root(struct sn_out *out, const struct cli_matcher *root)
+{
+	struct sn_ptr *map;
+	uint32_t i;
+
+    sn_putu32(out, SN_TAG_ROOT);
+    sn_putu32(out, root->ac_only);
+    sn_putu32(out, root->bm_offmode);
+    sn_putu32(out, root->maxpatlen);
+    sn_putu32(out, root->eof_maxoff);
+    sn_putu32(out, root->ac_partsigs);
+    sn_putu32(out, root->ac_absoff_num);
+    sn_putu32(out, root->bm_reloff_num);
+    sn_putu32(out, root->bm_absoff_num);
+
+    sn_put_lsigs(out, root);
+
+    sn_putu32(out, root->ac_patterns);
+    if(!(map = sn_ptrmap((const void * const *) root->ac_pattable, root->ac_patterns))) {
+	out->err = CL_EMEM;
+	return;
+    }
+    for(i = 0; i < root->ac_patterns; i++)
+	sn_put_acpatt(out, root->ac_pattable[i], map, root->ac_patterns);
+    sn_put_trie(out, root, map, root->ac_patterns);
+    free(map);
+
+    if(!root->ac_only)
+	sn_put_bm(out, root);
+
+    sn_putu32(out, !!root->ac_fused);
+    if(root->ac_fused)
+	sn_put_fused(out, root->ac_fused);
+}
+
+/* Returns CL_SUCCESS if the engine can be written out, fn is the caller
+ * for the messages */
+static int sn_check(const struct cl_engine *engine, const char *fn)
+{
+    if(!(engine->dboptions & CL_DB_COMPILED)) {
+	cli_errmsg("%s: Engine not compiled\n", fn);
+	return CL_EARG;
+    }
+    if(engine->liveupdate) {
+	cli_errmsg("%s: Engines changed with cl_engine_update() can't be saved\n", fn);
+	return CL_EARG;
+    }
+    return CL_SUCCESS;
+}
+
+/* Whether the engine has signatures sn_reload() must parse again */
+static int sn_side(const struct cl_engine *engine)
+{
+    return engine->bcs.count || engine->whitelist_matcher || engine->domainlist_matcher || engine->cdb || engine->iconcheck || engine->cmgr.crts;
+}
+
+/* Writes the whole snapshot; a zeroed magic marks it as incomplete */
+static void sn_write(struct sn_out *out, const struct cl_engine *engine, int complete)
+{
+	const struct cli_dbfile *db;
+	char magic[16];
+	unsigned int i;
+
+    memset(magic, 0, sizeof(magic));
+    if(complete)
+	memcpy(magic, SN_MAGIC, sizeof(SN_MAGIC));
+    sn_put(out, magic, sizeof(magic));
+    sn_putu32(out, SN_VERSION);
+    sn_putu32(out, 0x01020304);
+    sn_putstr(out, cl_retver());
+    sn_putu32(out, engine->dboptions & ~(CL_DB_COMPILED | CL_DB_SIGNATURE_STATS));
+    sn_putu32(out, engine->ac_only);
+    sn_putu32(out, engine->ac_mindepth);
+    sn_putu32(out, engine->ac_maxdepth);
+    sn_putstr(out, engine->pua_cats);
+    sn_putu32(out, sn_side(engine));
+    for(i = 0, db = engine->dbfiles; db; db = db->next)
+	i++;
+    sn_putu32(out, i);
+    for(db = engine->dbfiles; db; db = db->next) {
+	sn_putstr(out, db->path);
+	sn_putu32(out, db->root);
+	sn_putu32(out, (uint32_t) db->size);
+	sn_putu32(out, (uint32_t) (db->size >> 32));
+	sn_putu32(out, (uint32_t) db->mtime);
+	sn_putu32(out, (uint32_t) (db->mtime >> 32));
+    }
+
+    sn_putu32(out, SN_TAG_ENGINE);
+    sn_putu32(out, engine->sigs);
+    sn_putu32(out, engine->dbversion[0]);
+    sn_putu32(out, engine->dbversion[1]);
+    sn_put(out, engine->dbdigest, sizeof(engine->dbdigest));
+    sn_putu32(out, engine->sdb);
+    sn_putarray(out, engine->dconf, sizeof(struct cli_dconf) / sizeof(uint32_t), sizeof(uint32_t));
+    sn_put_ftypes(out, engine->ftypes);
+    sn_put_ftypes(out, engine->ptypes);
+
+    sn_put_hm(out, engine->hm_hdb);
+    sn_put_hm(out, engine->hm_mdb);
+    sn_put_hm(out, engine->hm_fp);
+
+    sn_putu32(out, CLI_MTARGETS);
+    for(i = 0; i < CLI_MTARGETS; i++)
+	sn_put_root(out, engine->root[i]);
+    sn_putu32(out, SN_TAG_END);
+}
+
+int cl_engine_save(const struct cl_engine *engine, const char *path)
+{
+	struct sn_out out;
+	char *tmpname;
+	int ret;
+
+    if(!engine || !path)
+	return CL_ENULLARG;
+
+    if((ret = sn_check(engine, "cl_engine_save")))
+	return ret;
+
+    /* write to a temporary file and rename it, processes which have the
+     * old snapshot mapped keep using it */
+    if(!(tmpname = cli_malloc(strlen(path) + 16))) {
+	cli_errmsg("cl_engine_save: Can't allocate memory for file name\n");
+	return CL_EMEM;
+    }
+    sprintf(tmpname, "%s.tmp%u", path, (unsigned int) getpid());
+    memset(&out, 0, sizeof(out));
+    if(!(out.fs = fopen(tmpname, "wb"))) {
+	cli_errmsg("cl_engine_save: Can't create %s\n", tmpname);
+	free(tmpname);
+	return CL_ECREAT;
+    }
+
+    sn_write(&out, engine, 1);
+
+    if(fclose(out.fs) && !out.err)
+	out.err = CL_EWRITE;
+    if(!out.err && rename(tmpname, path)) {
+	cli_errmsg("cl_engine_save: Can't rename %s to %s\n", tmpname, path);
+	out.err = CL_EWRITE;
+    }
+    if(out.err) {
+	if(out.err == CL_EWRITE)
+	    cli_errmsg("cl_engine_save: Can't write %s\n", tmpname);
+	unlink(tmpname);
+	free(tmpname);
+	return out.err;
+    }
+    free(tmpname);
+    cli_dbgmsg("cl_engine_save: Saved %u signatures to %s (%lu bytes)\n", engine->sigs, path, (unsigned long) out.off);
+    return CL_SUCCESS;
+}
+
+#ifdef SN_SHM
+/* Creates the shared memory object, locked while the snapshot is written.
+ * An object without the magic which nobody holds the lock on was left by a
+ * publisher that died and is replaced (a publisher between its shm_open()
+ * and fcntl() below looks the same, that window is left open). Returns -1
+ * with errno EEXIST if a snapshot is published or being written */
+static int sn_shm_create(const char *name)
+{
+	struct flock fl;
+	STATBUF sb, cur;
+	void *map;
+	int fd, cfd, complete, retry;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    for(retry = 0; ; retry++) {
+	if((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) != -1) {
+	    /* without record locks on shm objects nothing is ever replaced */
+	    fcntl(fd, F_SETLK, &fl);
+	    return fd;
+	}
+	if(errno != EEXIST || retry)
+	    return -1;
+	if((fd = shm_open(name, O_RDWR, 0)) == -1) {
+	    if(errno == ENOENT)
+		continue;
+	    return -1;
+	}
+	if(fcntl(fd, F_SETLK, &fl) == -1 || FSTAT(fd, &sb) == -1) {
+	    close(fd);
+	    errno = EEXIST;
+	    return -1;
+	}
+	complete = 0;
+	if(sb.st_size >= 16) {
+	    if((map = mmap(NULL, 16, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		errno = EEXIST;
+		return -1;
+	    }
+	    complete = !memcmp(map, SN_MAGIC, sizeof(SN_MAGIC));
+	    munmap(map, 16);
+	}
+	/* only if the name still refers to the object locked here */
+	if(!complete && (cfd = shm_open(name, O_RDONLY, 0)) != -1) {
+	    if(FSTAT(cfd, &cur) == -1 || cur.st_dev != sb.st_dev || cur.st_ino != sb.st_ino)
+		complete = 1;
+	    close(cfd);
+	}
+	if(complete) {
+	    close(fd);
+	    errno = EEXIST;
+	    return -1;
+	}
+	cli_warnmsg("cl_engine_share: Replacing incomplete shared memory object %s\n", name);
+	shm_unlink(name);
+	close(fd);
+    }
+}
+#endif
+
+int cl_engine_share(const struct cl_engine *engine, const char *name)
+{
+#ifdef SN_SHM
+	struct sn_out out;
+	void *map;
+	int fd;
+#endif
+	int ret;
+
+    if(!engine || !name)
+	return CL_ENULLARG;
+
+    if((ret = sn_check(engine, "cl_engine_share")))
+	return ret;
+
+#ifdef SN_SHM
+    /* the first pass only sizes the snapshot */
+    memset(&out, 0, sizeof(out));
+    sn_write(&out, engine, 1);
+
+    if((fd = sn_shm_create(name)) == -1) {
+	cli_errmsg("cl_engine_share: Can't create shared memory object %s\n", name);
+	return CL_ECREAT;
+    }
+    if(ftruncate(fd, out.off)) {
+	cli_errmsg("cl_engine_share: Can't resize shared memory object %s\n", name);
+	close(fd);
+	shm_unlink(name);
+	return CL_EWRITE;
+    }
+    map = mmap(NULL, out.off, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+	cli_errmsg("cl_engine_share: Can't map shared memory object %s\n", name);
+	shm_unlink(name);
+	close(fd);
+	return CL_EMAP;
+    }
+
+    /* processes attaching before the magic is in place fail cleanly */
+    out.buf = (unsigned char *) map;
+    out.off = 0;
+    sn_write(&out, engine, 0);
+    msync(map, out.off, MS_SYNC);
+    strncpy((char *) map, SN_MAGIC, 16);
+    munmap(map, out.off);
+    /* drops the lock */
+    close(fd);
+    cli_dbgmsg("cl_engine_share: Shared %u signatures as %s (%lu bytes)\n", engine->sigs, name, (unsigned long) out.off);
+    return CL_SUCCESS;
+#else
+    cli_errmsg("cl_engine_share: Shared memory objects are not supported on this system\n");
+    return CL_EARG;
+#endif
+}
+
+int cl_engine_unshare(const char *name)
+{
+    if(!name)
+	return CL_ENULLARG;
+#ifdef SN_SHM
+    if(shm_unlink(name)) {
+	cli_errmsg("cl_engine_unshare: Can't remove shared memory object %s\n", name);
+	return CL_EUNLINK;
+    }
+    return CL_SUCCESS;
+#else
+    cli_errmsg("cl_engine_unshare: Shared memory objects are not supported on this system\n");
+    return CL_EARG;
+#endif
+}
+
+/* Reader; any read past the end or malformed value sets in->err and the
+ * load fails with CL_EMALFDB */
+
+static const void *sn_get(struct sn_in *in, size_t len)
+{
+	const void *pt;
+
+    if(in->err || len > in->size - in->off) {
+	in->err = 1;
+	return NULL;
+    }
+    pt = in->map + in->off;
+    in->off += len;
+    return pt;
+}
+
+static uint32_t sn_getu32(struct sn_in *in)
+{
+	const void *pt = sn_get(in, sizeof(uint32_t));
+	uint32_t val = 0;
+
+    if(pt)
+	memcpy(&val, pt, sizeof(val));
+    return val;
+}
+
+static void sn_getwords(struct sn_in *in, uint32_t *w, unsigned int n)
+{
+	const void *pt = sn_get(in, n * sizeof(uint32_t));
+
+    if(pt)
+	memcpy(w, pt, n * sizeof(uint32_t));
+    else
+	memset(w, 0, n * sizeof(uint32_t));
+}
+
+static const void *sn_getarray(struct sn_in *in, uint32_t *n, size_t size)
+{
+    *n = sn_getu32(in);
+    if(in->off & 7)
+	sn_get(in, 8 - (in->off & 7));
+    if(in->err || (size && *n > (in->size - in->off) / size)) {
+	in->err = 1;
+	*n = 0;
+	return NULL;
+    }
+    return sn_get(in, (size_t) *n * size);
+}
+
+/* NULL is only valid if !in->err */
+static const char *sn_getstr(struct sn_in *in)
+{
+	uint32_t len = sn_getu32(in);
+	const char *str;
+
+    if(in->err || len == SN_NONE)
+	return NULL;
+    if(!(str = (const char *) sn_get(in, (size_t) len + 1)))
+	return NULL;
+    if(str[len]) {
+	in->err = 1;
+	return NULL;
+    }
+    return str;
+}
+
+static int sn_tag(struct sn_in *in, uint32_t tag)
+{
+    if(sn_getu32(in) != tag || in->err) {
+	cli_errmsg("cl_engine_load_snapshot: Malformed snapshot at offset %lu\n", (unsigned long) in->off);
+	in->err = 1;
+	return 0;
+    }
+    return 1;
+}
+
+static int sn_get_ftypes(struct sn_in *in, struct cl_engine *engine, struct cli_ftype **list)
+{
+	struct cli_ftype *new, **last = list;
+	const unsigned char *magic;
+	const char *tname;
+	uint32_t n, i, type, offset, len;
+
+    n = sn_getu32(in);
+    for(i = 0; i < n && !in->err; i++) {
+	type = sn_getu32(in);
+	offset = sn_getu32(in);
+	magic = (const unsigned char *) sn_getarray(in, &len, 1);
+	tname = sn_getstr(in);
+	if(in->err || !tname || len > 0xffff)
+	    return CL_EMALFDB;
+
+	if(!(new = (struct cli_ftype *) mpool_calloc(engine->mempool, 1, sizeof(struct cli_ftype))))
+	    return CL_EMEM;
+	new->type = (cli_file_t) type;
+	new->offset = offset;
+	new->length = len;
+	new->magic = (unsigned char *) mpool_malloc(engine->mempool, len ? len : 1);
+	new->tname = cli_mpool_strdup(engine->mempool, tname);
+	/* keep the list consistent for cli_ftfree() */
+	*last = new;
+	last = &new->next;
+	if(!new->magic || !new->tname)
+	    return CL_EMEM;
+	memcpy(new->magic, magic, len);
+    }
+    return in->err ? CL_EMALFDB : CL_SUCCESS;
+}
+
+static int sn_get_szh(struct sn_in *in, struct cli_matcher *root, struct cli_sz_hash *szh, unsigned int hlen)
+{
+	const char *names;
+	uint32_t i, len, off;
+
+    szh->hash_array = (uint8_t *) sn_getarray(in, &szh->items, hlen);
+    len = sn_getu32(in);
+    names = (const char *) sn_get(in, len);
+    if(in->err)
+	return CL_EMALFDB;
+    if(!szh->items)
+	return CL_SUCCESS;
+
+    if(!(szh->virusnames = (const char **) mpool_malloc(root->mempool, szh->items * sizeof(*szh->virusnames)))) {
+	szh->items = 0;
+	return CL_EMEM;
+    }
+    for(i = 0, off = 0; i < szh->items; i++) {
+	const char *end = off < len ? memchr(names + off, 0, len - off) : NULL;
+	if(!end) {
+	    szh->items = i;
+	    return CL_EMALFDB;
+	}
+	szh->virusnames[i] = names + off;
+	off = end - names + 1;
+    }
+    return CL_SUCCESS;
+}
+
+static int sn_get_hm(struct sn_in *in, struct cl_engine *engine, struct cli_matcher **hm)
+{
+	struct cli_matcher *root;
+	struct cli_htu32_element item;
+	struct cli_sz_hash *szh;
+	unsigned int type;
+	uint32_t n, key;
+	int ret;
+
+    if(!sn_tag(in, SN_TAG_HASH))
+	return CL_EMALFDB;
+    if(!sn_getu32(in))
+	return in->err ? CL_EMALFDB : CL_SUCCESS;
+
+    if(!(root = (struct cli_matcher *) mpool_calloc(engine->mempool, 1, sizeof(struct cli_matcher))))
+	return CL_EMEM;
+#ifdef USE_MPOOL
+    root->mempool = engine->mempool;
+#endif
+    root->snapshot = 1;
+    *hm = root;
+
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++) {
+	n = sn_getu32(in);
+	if(in->err)
+	    return CL_EMALFDB;
+	if(!n)
+	    continue;
+	if(n > in->size / 8)
+	    return CL_EMALFDB;
+	if((ret = cli_htu32_init(&root->hm.sizehashes[type], n + n / 4 + 1, root->mempool)))
+	    return ret;
+	while(n--) {
+	    key = sn_getu32(in);
+	    if(in->err || !key || cli_htu32_find(&root->hm.sizehashes[type], key))
+		return CL_EMALFDB;
+	    if(!(szh = (struct cli_sz_hash *) mpool_calloc(root->mempool, 1, sizeof(*szh))))
+		return CL_EMEM;
+	    item.key = key;
+	    item.data.as_ptr = szh;
+	    if((ret = cli_htu32_insert(&root->hm.sizehashes[type], &item, root->mempool))) {
+		mpool_free(root->mempool, szh);
+		return ret;
+	    }
+	    if((ret = sn_get_szh(in, root, szh, hashlen[type])))
+		return ret;
+	}
+    }
+    for(type = CLI_HASH_MD5; type < CLI_HASH_AVAIL_TYPES; type++)
+	if((ret = sn_get_szh(in, root, &root->hwild.hashes[type], hashlen[type])))
+	    return ret;
+    /* only builds the lookup index, the sets are saved sorted */
+    hm_flush(root);
+
+    return CL_SUCCESS;
+}
+
+static int sn_lsigoff(const void *base, uint32_t off, uint32_t cnt, uint32_t need, size_t size, const void **pt)
+{
+    if(off == SN_NONE) {
+	*pt = NULL;
+	return 0;
+    }
+    if(off >= cnt || need > cnt - off)
+	return 1;
+    *pt = (const char *) base + off * size;
+    return 0;
+}
+
+static int sn_get_lsigs(struct sn_in *in, struct cli_matcher *root)
+{
+	struct cli_ac_lsig *lsig;
+	struct cli_lsig_tdb *tdb;
+	const char *logic;
+	const void *val, *range, *str, *ptids, *pt = NULL;
+	uint32_t i, n, cnt, w[SN_LSIG_WORDS];
+	int err = 0;
+
+    n = sn_getu32(in);
+    if(in->err || n > in->size / sizeof(w))
+	return CL_EMALFDB;
+    if(!n)
+	return CL_SUCCESS;
+    if(!(root->ac_lsigtable = (struct cli_ac_lsig **) mpool_calloc(root->mempool, n, sizeof(struct cli_ac_lsig *))))
+	return CL_EMEM;
+
+    for(i = 0; i < n; i++) {
+	sn_getwords(in, w, SN_LSIG_WORDS);
+	logic = sn_getstr(in);
+	val = sn_getarray(in, &cnt, sizeof(uint32_t));
+	err |= cnt != w[2];
+	range = sn_getarray(in, &cnt, sizeof(uint32_t));
+	err |= cnt != w[3];
+	str = sn_getarray(in, &cnt, 1);
+	err |= cnt != w[4] || (cnt && ((const char *) str)[cnt - 1]);
+	ptids = sn_getarray(in, &cnt, sizeof(uint32_t));
+	/* bc_idx is checked once the bytecode is loaded, see sn_reload() */
+	err |= cnt != w[15] || w[5] > 64 || (w[15] && w[15] != w[5]);
+	if(in->err || err || !logic)
+	    return CL_EMALFDB;
+
+	if(!(lsig = (struct cli_ac_lsig *) mpool_calloc(root->mempool, 1, sizeof(struct cli_ac_lsig))))
+	    return CL_EMEM;
+	tdb = &lsig->tdb;
+#ifdef USE_MPOOL
+	tdb->mempool = root->mempool;
+#endif
+	lsig->id = w[0];
+	lsig->bc_idx = w[1];
+	if(!(lsig->logic = cli_mpool_strdup(root->mempool, logic))) {
+	    mpool_free(root->mempool, lsig);
+	    return CL_EMEM;
+	}
+	root->ac_lsigtable[root->ac_lsigs++] = lsig;
+
+	/* each array is counted only once allocated, see FREE_TDB() */
+	if(w[2]) {
+	    if(!(tdb->val = (uint32_t *) mpool_malloc(root->mempool, w[2] * sizeof(uint32_t))))
+		return CL_EMEM;
+	    memcpy(tdb->val, val, w[2] * sizeof(uint32_t));
+	    tdb->cnt[CLI_TDB_UINT] = w[2];
+	}
+	if(w[3]) {
+	    if(!(tdb->range = (uint32_t *) mpool_malloc(root->mempool, w[3] * sizeof(uint32_t))))
+		return CL_EMEM;
+	    memcpy(tdb->range, range, w[3] * sizeof(uint32_t));
+	    tdb->cnt[CLI_TDB_RANGE] = w[3];
+	}
+	if(w[4]) {
+	    if(!(tdb->str = (char *) mpool_malloc(root->mempool, w[4])))
+		return CL_EMEM;
+	    memcpy(tdb->str, str, w[4]);
+	    tdb->cnt[CLI_TDB_STR] = w[4];
+	}
+	if(w[15]) {
+	    if(!(tdb->macro_ptids = (uint32_t *) mpool_malloc(root->mempool, w[15] * sizeof(uint32_t))))
+		return CL_EMEM;
+	    memcpy(tdb->macro_ptids, ptids, w[15] * sizeof(uint32_t));
+	}
+	tdb->subsigs = w[5];
+
+	err |= sn_lsigoff(tdb->val, w[6], w[2], 1, sizeof(uint32_t), &pt);
+	tdb->target = (const uint32_t *) pt;
+	err |= sn_lsigoff(tdb->val, w[7], w[2], 1, sizeof(uint32_t), &pt);
+	tdb->container = (const uint32_t *) pt;
+	err |= sn_lsigoff(tdb->val, w[8], w[2], 1, sizeof(uint32_t), &pt);
+	tdb->handlertype = (const uint32_t *) pt;
+	err |= sn_lsigoff(tdb->range, w[9], w[3], 2, sizeof(uint32_t), &pt);
+	tdb->engine = (const uint32_t *) pt;
+	err |= sn_lsigoff(tdb->range, w[10], w[3], 2, sizeof(uint32_t), &pt);
+	tdb->nos = (const uint32_t *) pt;
+	err |= sn_lsigoff(tdb->range, w[11], w[3], 2, sizeof(uint32_t), &pt);
+	tdb->ep = (const uint32_t *) pt;
+	err |= sn_lsigoff(tdb->range, w[12], w[3], 2, sizeof(uint32_t), &pt);
+	tdb->filesize = (const uint32_t *) pt;
+	err |= sn_lsigoff(tdb->str, w[13], w[4], 1, 1, &pt);
+	tdb->icongrp1 = (const char *) pt;
+	err |= sn_lsigoff(tdb->str, w[14], w[4], 1, 1, &pt);
+	tdb->icongrp2 = (const char *) pt;
+	if(err)
+	    return CL_EMALFDB;
+    }
+    return CL_SUCCESS;
+}
+
+static int sn_get_special(struct sn_in *in, struct cli_matcher *root, struct cli_ac_special **special)
+{
+	struct cli_ac_special *new, **last = special;
+	const void *str;
+	uint32_t i, n, len, w[4];
+
+    n = sn_getu32(in);
+    if(!n || n > 0xffff)
+	in->err = 1;
+    for(i = 0; i < n && !in->err; i++) {
+	sn_getwords(in, w, 4);
+	str = sn_getarray(in, &len, 1);
+	if(in->err || w[2] > 0xffff || w[3] > 0xffff)
+	    return CL_EMALFDB;
+	if((w[0] == AC_SPECIAL_ALT_CHAR && len != w[2]) || (w[0] == AC_SPECIAL_ALT_STR && len != w[3]))
+	    return CL_EMALFDB;
+
+	if(!(new = (struct cli_ac_special *) mpool_calloc(root->mempool, 1, sizeof(struct cli_ac_special))))
+	    return CL_EMEM;
+	*last = new;
+	last = &new->next;
+	new->type = w[0];
+	new->negative = w[1];
+	new->num = w[2];
+	new->len = w[3];
+	if(len) {
+	    if(!(new->str = (unsigned char *) mpool_malloc(root->mempool, len)))
+		return CL_EMEM;
+	    memcpy(new->str, str, len);
+	}
+    }
+    return in->err ? CL_EMALFDB : CL_SUCCESS;
+}
+
+/* Checks the fields of a pattern the matcher uses as indices */
+static int sn_chkpatt(const struct cli_matcher *root, const struct cli_ac_patt *patt)
+{
+	uint32_t i, specials = 0;
+	const uint16_t *pt = patt->prefix ? patt->prefix : patt->pattern;
+
+    for(i = 0; i < (uint32_t) patt->prefix_length + patt->length; i++)
+	if((pt[i] & CLI_MATCH_WILDCARD) == CLI_MATCH_SPECIAL)
+	    specials++;
+    for(i = 0; i < 2; i++)
+	if((patt->ch[i] & CLI_MATCH_WILDCARD) == CLI_MATCH_SPECIAL)
+	    specials++;
+    if(specials > patt->special || patt->special_pattern > patt->special)
+	return 1;
+    if(!patt->length || patt->depth > patt->length)
+	return 1;
+    if(patt->parts && (!patt->sigid || patt->sigid > root->ac_partsigs || !patt->partno || patt->partno > patt->parts))
+	return 1;
+    if(patt->lsigid[0] && (patt->lsigid[1] >= root->ac_lsigs || patt->lsigid[2] >= 64))
+	return 1;
+    if(patt->offdata[0] == CLI_OFF_MACRO && patt->offdata[1] >= 32)
+	return 1;
+    return 0;
+}
+
+static int sn_get_acpatt(struct sn_in *in, struct cli_matcher *root, uint32_t *links)
+{
+	struct cli_ac_patt *patt;
+	const uint16_t *data;
+	const char *virname;
+	uint32_t i, len, w[SN_PATT_WORDS];
+	int ret;
+
+    sn_getwords(in, w, SN_PATT_WORDS);
+    data = (const uint16_t *) sn_getarray(in, &len, sizeof(uint16_t));
+    virname = sn_getstr(in);
+    if(in->err || !virname || !len || len != w[0] + w[1] || w[0] > 0xffff || w[1] > 0xffff || (w[1] && !w[2]) || w[17] > 0xffff)
+	return CL_EMALFDB;
+
+    if(!(patt = (struct cli_ac_patt *) mpool_calloc(root->mempool, 1, sizeof(struct cli_ac_patt))))
+	return CL_EMEM;
+    patt->virname = cli_mpool_strdup(root->mempool, virname);
+    patt->pattern = (uint16_t *) mpool_malloc(root->mempool, len * sizeof(uint16_t));
+    if(!patt->virname || !patt->pattern) {
+	mpool_free(root->mempool, patt->virname);
+	mpool_free(root->mempool, patt->pattern);
+	mpool_free(root->mempool, patt);
+	return CL_EMEM;
+    }
+    memcpy(patt->pattern, data, len * sizeof(uint16_t));
+    if(w[2]) {
+	patt->prefix = patt->pattern;
+	patt->pattern += w[1];
+    }
+    root->ac_pattable[root->ac_patterns++] = patt;
+
+    patt->length = w[0];
+    patt->prefix_length = w[1];
+    patt->mindist = w[3];
+    patt->maxdist = w[4];
+    patt->sigid = w[5];
+    patt->lsigid[0] = w[6];
+    patt->lsigid[1] = w[7];
+    patt->lsigid[2] = w[8];
+    patt->ch[0] = w[9];
+    patt->ch[1] = w[10];
+    patt->ch_mindist[0] = w[11];
+    patt->ch_mindist[1] = w[12];
+    patt->ch_maxdist[0] = w[13];
+    patt->ch_maxdist[1] = w[14];
+    patt->parts = w[15];
+    patt->partno = w[16];
+    patt->special_pattern = w[18];
+    patt->special_len = w[19];
+    patt->rtype = w[20];
+    patt->type = w[21];
+    patt->offdata[0] = w[22];
+    patt->offdata[1] = w[23];
+    patt->offdata[2] = w[24];
+    patt->offdata[3] = w[25];
+    patt->offset_min = w[26];
+    patt->offset_max = w[27];
+    patt->boundary = w[28];
+    patt->depth = w[29];
+    links[0] = w[30];
+    links[1] = w[31];
+    patt->rootidx = w[32];
+
+    if(w[17]) {
+	if(!(patt->special_table = (struct cli_ac_special **) mpool_calloc(root->mempool, w[17], sizeof(struct cli_ac_special *))))
+	    return CL_EMEM;
+	patt->special = w[17];
+	for(i = 0; i < w[17]; i++)
+	    if((ret = sn_get_special(in, root, &patt->special_table[i])))
+		return ret;
+    }
+
+    if(sn_chkpatt(root, patt))
+	return CL_EMALFDB;
+
+    if(patt->lsigid[0])
+	root->ac_lsigtable[patt->lsigid[1]]->virname = patt->virname;
+
+    return CL_SUCCESS;
+}
+
+static int sn_setlinks(struct cli_matcher *root, const uint32_t *links)
+{
+	uint32_t i;
+
+    for(i = 0; i < root->ac_patterns; i++) {
+	if(links[2 * i] > root->ac_patterns || links[2 * i + 1] > root->ac_patterns)
+	    return CL_EMALFDB;
+	root->ac_pattable[i]->next = links[2 * i] ? root->ac_pattable[links[2 * i] - 1] : NULL;
+	root->ac_pattable[i]->next_same = links[2 * i + 1] ? root->ac_pattable[links[2 * i + 1] - 1] : NULL;
+    }
+    return CL_SUCCESS;
+}
+
+/* Rebuilds ac_reloff, cli_ac_addsig() numbers the patterns with a relative
+ * offset in the order they're added */
+static int sn_reloff(struct cli_matcher *root)
+{
+	struct cli_ac_patt *patt;
+	uint32_t i, n = 0;
+
+    for(i = 0; i < root->ac_patterns; i++) {
+	patt = root->ac_pattable[i];
+	if(patt->offdata[0] != CLI_OFF_ANY && patt->offdata[0] != CLI_OFF_ABSOLUTE && patt->offdata[0] != CLI_OFF_MACRO)
+	    n++;
+    }
+    if(!n)
+	return CL_SUCCESS;
+    if(!(root->ac_reloff = (struct cli_ac_patt **) mpool_malloc(root->mempool, n * sizeof(struct cli_ac_patt *))))
+	return CL_EMEM;
+    for(i = 0; i < root->ac_patterns; i++) {
+	patt = root->ac_pattable[i];
+	if(patt->offdata[0] != CLI_OFF_ANY && patt->offdata[0] != CLI_OFF_ABSOLUTE && patt->offdata[0] != CLI_OFF_MACRO) {
+	    if(patt->offset_min != root->ac_reloff_num * 2 || patt->offset_max != patt->offset_min + 1)
+		return CL_EMALFDB;
+	    root->ac_reloff[root->ac_reloff_num++] = patt;
+	}
+    }
+    return CL_SUCCESS;
+}
+
+static int sn_get_trie(struct sn_in *in, struct cli_matcher *root)
+{
+	struct cli_ac_state *state;
+	const unsigned char *words;
+	uint8_t *chk;
+	uint32_t i, j, k, nstates, ndtrans, nstrans, end, w[SN_STATE_WORDS];
+	uint64_t len;
+
+    if(sn_getu32(in)) {
+	if(!root->filter && !(root->filter = (struct filter *) mpool_malloc(root->mempool, sizeof(struct filter))))
+	    return CL_EMEM;
+	words = (const unsigned char *) sn_get(in, sizeof(root->filter->B) + sizeof(root->filter->end));
+	if(!words)
+	    return CL_EMALFDB;
+	memcpy(root->filter->B, words, sizeof(root->filter->B));
+	memcpy(root->filter->end, words + sizeof(root->filter->B), sizeof(root->filter->end));
+	root->filter->m = sn_getu32(in);
+    } else if(root->filter) {
+	mpool_free(root->mempool, root->filter);
+	root->filter = NULL;
+    }
+
+    nstates = sn_getu32(in);
+    if(in->err || !nstates || nstates > (in->size - in->off) / sizeof(w))
+	return CL_EMALFDB;
+    if(root->ac_root && root->ac_root->trans) {
+	mpool_free(root->mempool, root->ac_root->trans);
+	root->ac_root->trans = NULL;
+    }
+    if(!(root->ac_states = (struct cli_ac_state *) mpool_calloc(root->mempool, nstates, sizeof(struct cli_ac_state))))
+	return CL_EMEM;
+    root->ac_nodes = nstates - 1;
+    words = (const unsigned char *) sn_get(in, (size_t) nstates * sizeof(w));
+    root->ac_dtrans = (uint32_t *) sn_getarray(in, &ndtrans, sizeof(uint32_t));
+    root->ac_strans = (uint32_t *) sn_getarray(in, &nstrans, sizeof(uint32_t));
+    root->snapshot = 1;
+    if(in->err)
+	return CL_EMALFDB;
+    if(!nstrans)
+	root->ac_strans = NULL;
+
+    for(i = 0; i < nstates; i++) {
+	memcpy(w, words + (size_t) i * sizeof(w), sizeof(w));
+	state = &root->ac_states[i];
+	if(w[0] > root->ac_patterns || w[1] > root->ac_patterns)
+	    return CL_EMALFDB;
+	state->list = w[0] ? root->ac_pattable[w[0] - 1] : NULL;
+	state->faillist = w[1] ? root->ac_pattable[w[1] - 1] : NULL;
+	state->trans = w[2];
+	state->fail = w[3];
+	memcpy(state->map, &w[4], sizeof(state->map));
+	memcpy(state->rank, &w[12], sizeof(state->rank));
+	state->dense = !!w[14];
+	if(state->dense) {
+	    len = (uint64_t) state->trans + 256;
+	    if(len > ndtrans)
+		return CL_EMALFDB;
+	} else {
+	    if(state->fail >= nstates)
+		return CL_EMALFDB;
+	    for(end = 0, k = 0; k < 8; k++) {
+		if(state->rank[k] != end)
+		    return CL_EMALFDB;
+		end += sn_popcount(state->map[k]);
+	    }
+	    if((uint64_t) state->trans + end > nstrans)
+		return CL_EMALFDB;
+	}
+    }
+    for(i = 0; i < ndtrans; i++)
+	if(root->ac_dtrans[i] >= nstates)
+	    return CL_EMALFDB;
+    for(i = 0; i < nstrans; i++)
+	if(root->ac_strans[i] >= nstates)
+	    return CL_EMALFDB;
+
+    /* every chain of sparse states has to end in a dense one */
+    if(!(chk = (uint8_t *) cli_calloc(nstates, 1)))
+	return CL_EMEM;
+    for(i = 0; i < nstates; i++) {
+	for(j = i, k = 0; !root->ac_states[j].dense && !chk[j]; j = root->ac_states[j].fail) {
+	    if(++k > nstates) {
+		free(chk);
+		return CL_EMALFDB;
+	    }
+	}
+	for(j = i; !root->ac_states[j].dense && !chk[j]; j = root->ac_states[j].fail)
+	    chk[j] = 1;
+    }
+    free(chk);
+    return CL_SUCCESS;
+}
+
+static int sn_get_bm(struct sn_in *in, struct cli_matcher *root)
+{
+	struct cli_bm_patt *patt, *last = NULL, **table;
+	const unsigned char *data;
+	const void *pt;
+	const char *virname;
+	uint32_t i, n, len, idx, lastidx = SN_NONE, w[SN_BMPATT_WORDS];
+	int ret = CL_SUCCESS;
+
+    pt = sn_getarray(in, &n, 1);
+    if(in->err || n != BM_HASH_SIZE)
+	return CL_EMALFDB;
+    memcpy(root->bm_shift, pt, BM_HASH_SIZE);
+    pt = sn_getarray(in, &n, sizeof(struct cli_bm_pref));
+    if(in->err || (n && n != BM_HASH_SIZE))
+	return CL_EMALFDB;
+    if(n) {
+	if(!(root->bm_pref = (struct cli_bm_pref *) mpool_malloc(root->mempool, BM_HASH_SIZE * sizeof(struct cli_bm_pref))))
+	    return CL_EMEM;
+	memcpy(root->bm_pref, pt, BM_HASH_SIZE * sizeof(struct cli_bm_pref));
+    }
+
+    n = sn_getu32(in);
+    if(in->err || n > in->size / sizeof(w))
+	return CL_EMALFDB;
+    if(!(table = (struct cli_bm_patt **) cli_malloc((n + 1) * sizeof(*table))))
+	return CL_EMEM;
+    for(i = 0; i < n; i++) {
+	sn_getwords(in, w, SN_BMPATT_WORDS);
+	data = (const unsigned char *) sn_getarray(in, &len, 1);
+	virname = sn_getstr(in);
+	if(in->err || w[0] >= BM_HASH_SIZE || w[1] < 3 || w[1] > 0xffff || w[2] > 0xffff || len != w[1] + w[2] || (w[2] && !w[3])) {
+	    ret = CL_EMALFDB;
+	    break;
+	}
+	/* the buckets are saved one after the other, in list order */
+	if(w[0] != lastidx && root->bm_suffix[w[0]]) {
+	    ret = CL_EMALFDB;
+	    break;
+	}
+
+	if(!(patt = (struct cli_bm_patt *) mpool_calloc(root->mempool, 1, sizeof(struct cli_bm_patt)))) {
+	    ret = CL_EMEM;
+	    break;
+	}
+	patt->pattern = (unsigned char *) mpool_malloc(root->mempool, len);
+	patt->virname = virname ? cli_mpool_strdup(root->mempool, virname) : NULL;
+	if(!patt->pattern || (virname && !patt->virname)) {
+	    mpool_free(root->mempool, patt->pattern);
+	    mpool_free(root->mempool, patt->virname);
+	    mpool_free(root->mempool, patt);
+	    ret = CL_EMEM;
+	    break;
+	}
+	memcpy(patt->pattern, data, len);
+	if(w[3]) {
+	    patt->prefix = patt->pattern;
+	    patt->pattern += w[2];
+	}
+	patt->length = w[1];
+	patt->prefix_length = w[2];
+	patt->cnt = w[4];
+	patt->boundary = w[5];
+	patt->filesize = w[6];
+	patt->offdata[0] = w[7];
+	patt->offdata[1] = w[8];
+	patt->offdata[2] = w[9];
+	patt->offdata[3] = w[10];
+	patt->offset_min = w[11];
+	patt->offset_max = w[12];
+	patt->pattern0 = patt->pattern[0];
+
+	if(w[0] == lastidx)
+	    last->next = patt;
+	else
+	    root->bm_suffix[w[0]] = patt;
+	last = patt;
+	lastidx = w[0];
+	table[root->bm_patterns++] = patt;
+    }
+
+    /* bm_pattab; cli_bm_initoff() indexes its offsets with offset_min */
+    if(!ret) {
+	n = sn_getu32(in);
+	if(in->err || (n && (!root->bm_offmode || n != root->bm_patterns)) || (!n && root->bm_offmode && root->bm_patterns))
+	    ret = CL_EMALFDB;
+    }
+    if(!ret && n) {
+	if(!(root->bm_pattab = (struct cli_bm_patt **) mpool_malloc(root->mempool, n * sizeof(struct cli_bm_patt *))))
+	    ret = CL_EMEM;
+	for(i = 0; !ret && i < n; i++) {
+	    idx = sn_getu32(in);
+	    if(in->err || !idx || idx > root->bm_patterns) {
+		ret = CL_EMALFDB;
+		break;
+	    }
+	    patt = table[idx - 1];
+	    if(patt->offdata[0] != CLI_OFF_ABSOLUTE && patt->offset_min != i) {
+		ret = CL_EMALFDB;
+		break;
+	    }
+	    root->bm_pattab[i] = patt;
+	}
+    }
+    free(table);
+    return ret;
+}
+
+static int sn_get_fused(struct sn_in *in, struct cli_matcher *troot, const struct cli_matcher *groot)
+{
+	struct cli_matcher *fused;
+	struct cli_ac_patt *patt;
+	uint32_t i, n, *links, w[4];
+	int ret;
+
+    if(!sn_tag(in, SN_TAG_FUSED))
+	return CL_EMALFDB;
+    n = sn_getu32(in);
+    if(in->err || !n || n != troot->ac_patterns + groot->ac_patterns)
+	return CL_EMALFDB;
+
+    if(!(fused = (struct cli_matcher *) mpool_calloc(troot->mempool, 1, sizeof(struct cli_matcher))))
+	return CL_EMEM;
+    fused->type = troot->type;
+#ifdef USE_MPOOL
+    fused->mempool = troot->mempool;
+#endif
+    fused->snapshot = 1;
+    if((ret = cli_ac_init(fused, troot->ac_mindepth, troot->ac_maxdepth, 0))) {
+	mpool_free(troot->mempool, fused);
+	return ret;
+    }
+    /* from here on cli_ac_free(troot) cleans up */
+    troot->ac_fused = fused;
+
+    fused->ac_pattable = (struct cli_ac_patt **) mpool_calloc(fused->mempool, n, sizeof(struct cli_ac_patt *));
+    links = (uint32_t *) cli_malloc(2 * n * sizeof(uint32_t));
+    if(!fused->ac_pattable || !links) {
+	free(links);
+	return CL_EMEM;
+    }
+    for(i = 0; i < n; i++) {
+	sn_getwords(in, w, 4);
+	if(in->err || w[3] != (i >= troot->ac_patterns) || w[2] > 0xff) {
+	    free(links);
+	    return CL_EMALFDB;
+	}
+	if(!(patt = (struct cli_ac_patt *) mpool_malloc(fused->mempool, sizeof(struct cli_ac_patt)))) {
+	    free(links);
+	    return CL_EMEM;
+	}
+	memcpy(patt, w[3] ? groot->ac_pattable[i - troot->ac_patterns] : troot->ac_pattable[i], sizeof(struct cli_ac_patt));
+	patt->depth = w[2];
+	patt->rootidx = w[3];
+	links[2 * i] = w[0];
+	links[2 * i + 1] = w[1];
+	fused->ac_pattable[fused->ac_patterns++] = patt;
+	if(patt->depth > patt->length) {
+	    free(links);
+	    return CL_EMALFDB;
+	}
+    }
+    ret = sn_setlinks(fused, links);
+    free(links);
+    if(ret)
+	return ret;
+    fused->maxpatlen = sn_getu32(in);
+    return sn_get_trie(in, fused);
+}
+
+static int sn_get_root(struct sn_in *in, struct cl_engine *engine, struct cli_matcher *root)
+{
+	uint32_t i, j, n, *links, w[8];
+	struct cli_ac_lsig *lsig;
+	int ret;
+
+    if(!sn_tag(in, SN_TAG_ROOT))
+	return CL_EMALFDB;
+    sn_getwords(in, w, 8);
+    if(in->err || w[0] != root->ac_only || w[1] != root->bm_offmode || w[2] > 0xffff)
+	return CL_EMALFDB;
+    root->maxpatlen = w[2];
+    root->eof_maxoff = w[3];
+    root->ac_partsigs = w[4];
+    root->ac_absoff_num = w[5];
+    root->bm_reloff_num = w[6];
+    root->bm_absoff_num = w[7];
+
+    if((ret = sn_get_lsigs(in, root)))
+	return ret;
+
+    n = sn_getu32(in);
+    if(in->err || n > in->size / (SN_PATT_WORDS * sizeof(uint32_t)))
+	return CL_EMALFDB;
+    if(n) {
+	if(!(root->ac_pattable = (struct cli_ac_patt **) mpool_calloc(root->mempool, n, sizeof(struct cli_ac_patt *))))
+	    return CL_EMEM;
+	if(!(links = (uint32_t *) cli_malloc(2 * n * sizeof(uint32_t))))
+	    return CL_EMEM;
+	for(i = 0; i < n; i++) {
+	    if((ret = sn_get_acpatt(in, root, &links[2 * i]))) {
+		free(links);
+		return ret;
+	    }
+	}
+	ret = sn_setlinks(root, links);
+	free(links);
+	if(ret)
+	    return ret;
+    }
+    for(i = 0; i < root->ac_lsigs; i++) {
+	lsig = root->ac_lsigtable[i];
+	if(lsig->tdb.macro_ptids)
+	    for(j = 0; j < lsig->tdb.subsigs; j++)
+		if(lsig->tdb.macro_ptids[j] >= root->ac_patterns)
+		    return CL_EMALFDB;
+    }
+    if((ret = sn_reloff(root)))
+	return ret;
+    if((ret = sn_get_trie(in, root)))
+	return ret;
+
+    if(!root->ac_only && (ret = sn_get_bm(in, root)))
+	return ret;
+
+    if(sn_getu32(in)) {
+	if(root == engine->root[0])
+	    return CL_EMALFDB;
+	if((ret = sn_get_fused(in, root, engine->root[0])))
+	    return ret;
+    }
+    return in->err ? CL_EMALFDB : CL_SUCCESS;
+}
+
+static int sn_adddb(struct cl_engine *engine, const char *path, uint64_t size, uint64_t mtime, unsigned int root)
+{
+	struct cli_dbfile *db, **pt;
+
+    if(!(db = mpool_malloc(engine->mempool, sizeof(*db)))) {
+	cli_errmsg("cli_snapshot_adddb: Can't allocate memory for database entry\n");
+	return CL_EMEM;
+    }
+    if(!(db->path = cli_mpool_strdup(engine->mempool, path))) {
+	cli_errmsg("cli_snapshot_adddb: Can't allocate memory for database path\n");
+	mpool_free(engine->mempool, db);
+	return CL_EMEM;
+    }
+    db->size = size;
+    db->mtime = mtime;
+    db->root = root;
+    db->next = NULL;
+    for(pt = &engine->dbfiles; *pt; pt = &(*pt)->next);
+    *pt = db;
+    return CL_SUCCESS;
+}
+
+int cli_snapshot_adddb(struct cl_engine *engine, const char *path, const STATBUF *sb, unsigned int root)
+{
+    return sn_adddb(engine, path, S_ISDIR(sb->st_mode) ? 0 : sb->st_size, sb->st_mtime, root);
+}
+
+void cli_snapshot_freedbs(struct cl_engine *engine)
+{
+	struct cli_dbfile *db;
+
+    while((db = engine->dbfiles)) {
+	engine->dbfiles = db->next;
+	mpool_free(engine->mempool, db->path);
+	mpool_free(engine->mempool, db);
+    }
+}
+
+/* Walks the databases the snapshot was saved from, recording them in the
+ * engine if there's one. CL_EARG means that one of them was changed or
+ * removed since (SN_CHECK_FILES), or that the roots (the paths cl_load()
+ * was called for) aren't the ndbpaths ones in dbpaths (SN_CHECK_ROOTS) */
+static int sn_get_dbs(struct sn_in *in, struct cl_engine *engine, int check, const char * const *dbpaths, unsigned int ndbpaths)
+{
+	const char *path;
+	uint32_t n, w[5];
+	uint64_t size, mtime;
+	unsigned int nroots = 0;
+	STATBUF sb;
+
+    n = sn_getu32(in);
+    while(n--) {
+	path = sn_getstr(in);
+	sn_getwords(in, w, 5);
+	if(in->err || !path)
+	    return CL_EMALFDB;
+	size = w[1] | ((uint64_t) w[2] << 32);
+	mtime = w[3] | ((uint64_t) w[4] << 32);
+	if((check & SN_CHECK_ROOTS) && w[0] && (nroots >= ndbpaths || strcmp(dbpaths[nroots], path))) {
+	    cli_dbgmsg("sn_get_dbs: Snapshot saved from other databases than %s\n", path);
+	    return CL_EARG;
+	}
+	if((check & SN_CHECK_FILES) && (CLAMSTAT(path, &sb) == -1 || (uint64_t) sb.st_mtime != mtime || (!S_ISDIR(sb.st_mode) && (uint64_t) sb.st_size != size))) {
+	    cli_dbgmsg("sn_get_dbs: %s changed since the snapshot was saved\n", path);
+	    return CL_EARG;
+	}
+	if(w[0])
+	    nroots++;
+	if(engine && sn_adddb(engine, path, size, mtime, w[0]))
+	    return CL_EMEM;
+    }
+    if((check & SN_CHECK_ROOTS) && nroots != ndbpaths) {
+	cli_dbgmsg("sn_get_dbs: Snapshot saved from %u databases, not %u\n", nroots, ndbpaths);
+	return CL_EARG;
+    }
+    return CL_SUCCESS;
+}
+
+int cli_snapshot_reload(const char *dbname)
+{
+    return cli_strbcasestr(dbname, ".cvd") || cli_strbcasestr(dbname, ".cld") || cli_strbcasestr(dbname, ".cud") ||
+	cli_strbcasestr(dbname, ".info") || cli_strbcasestr(dbname, ".ign") || cli_strbcasestr(dbname, ".ign2") ||
+	cli_strbcasestr(dbname, ".cbc") || cli_strbcasestr(dbname, ".pdb") || cli_strbcasestr(dbname, ".gdb") ||
+	cli_strbcasestr(dbname, ".wdb") || cli_strbcasestr(dbname, ".cdb") || cli_strbcasestr(dbname, ".idb") ||
+	cli_strbcasestr(dbname, ".crb") || cli_strbcasestr(dbname, ".cat");
+}
+
+/* Parses the signatures the snapshot doesn't hold from the database files
+ * it was saved from, in the same order. The lsigs of the bytecodes are in
+ * the snapshot, cli_loadcbc() only loads the bytecode itself, so that the
+ * bc_idx they refer to come out the same */
+static int sn_reload(struct cl_engine *engine, unsigned int dboptions)
+{
+	const struct cli_dbfile *db;
+	const struct cli_ac_lsig *lsig;
+	unsigned int sigs = 0, i, j;
+	int ret;
+
+    for(db = engine->dbfiles; db; db = db->next) {
+	if(db->root || !cli_snapshot_reload(db->path))
+	    continue;
+	if((ret = cli_load(db->path, engine, &sigs, dboptions | CL_DB_SNAPSHOT, NULL)))
+	    return ret;
+    }
+    for(i = 0; i < CLI_MTARGETS; i++) {
+	for(j = 0; j < engine->root[i]->ac_lsigs; j++) {
+	    lsig = engine->root[i]->ac_lsigtable[j];
+	    if(lsig->bc_idx > engine->bcs.count) {
+		cli_errmsg("cl_engine_load_snapshot: Bytecode %u missing from the databases\n", lsig->bc_idx);
+		return CL_EMALFDB;
+	    }
+	}
+    }
+
+    /* the rest of what cl_engine_compile() does for them */
+    if((ret = cli_build_regex_list(engine->whitelist_matcher)) || (ret = cli_build_regex_list(engine->domainlist_matcher)))
+	return ret;
+    if(engine->ignored) {
+	cli_bm_free(engine->ignored);
+	mpool_free(engine->mempool, engine->ignored);
+	engine->ignored = NULL;
+    }
+    return CL_SUCCESS;
+}
+
+static int sn_load(struct sn_in *in, struct cl_engine *engine, unsigned int *signo, unsigned int dboptions, int check)
+{
+	const char *magic, *str;
+	const void *dconf;
+	uint32_t n, i, sigs, side, w[4];
+	int ret;
+
+    magic = (const char *) sn_get(in, 16);
+    if(!magic || memcmp(magic, SN_MAGIC, sizeof(SN_MAGIC))) {
+	cli_errmsg("cl_engine_load_snapshot: Not a snapshot file\n");
+	return CL_EMALFDB;
+    }
+    if(sn_getu32(in) != SN_VERSION || sn_getu32(in) != 0x01020304) {
+	cli_errmsg("cl_engine_load_snapshot: Unsupported snapshot format or byte order\n");
+	return CL_EARG;
+    }
+    str = sn_getstr(in);
+    if(!str || strcmp(str, cl_retver())) {
+	cli_errmsg("cl_engine_load_snapshot: Snapshot saved by libclamav %s\n", str ? str : "?");
+	return CL_EARG;
+    }
+    sn_getwords(in, w, 4);
+    str = sn_getstr(in);
+    side = sn_getu32(in);
+    if(in->err)
+	return CL_EMALFDB;
+    if(w[0] != dboptions) {
+	cli_errmsg("cl_engine_load_snapshot: Snapshot saved with dboptions 0x%x\n", w[0]);
+	return CL_EARG;
+    }
+    if(w[1] != engine->ac_only || w[2] != engine->ac_mindepth || w[3] != engine->ac_maxdepth ||
+       !str != !engine->pua_cats || (str && strcmp(str, engine->pua_cats))) {
+	cli_errmsg("cl_engine_load_snapshot: Snapshot saved with different engine settings\n");
+	return CL_EARG;
+    }
+    /* what sn_reload() parses has to match the rest */
+    if((ret = sn_get_dbs(in, engine, (check || side) ? SN_CHECK_FILES : 0, NULL, 0))) {
+	if(ret == CL_EARG)
+	    cli_errmsg("cl_engine_load_snapshot: The databases changed since the snapshot was saved\n");
+	return ret;
+    }
+
+    if(!sn_tag(in, SN_TAG_ENGINE))
+	return CL_EMALFDB;
+    sigs = sn_getu32(in);
+    engine->dbversion[0] = sn_getu32(in);
+    engine->dbversion[1] = sn_getu32(in);
+    if((str = sn_get(in, sizeof(engine->dbdigest))))
+	memcpy(engine->dbdigest, str, sizeof(engine->dbdigest));
+    engine->sdb = sn_getu32(in);
+    dconf = sn_getarray(in, &n, sizeof(uint32_t));
+    if(in->err || n != sizeof(struct cli_dconf) / sizeof(uint32_t))
+	return CL_EMALFDB;
+    memcpy(engine->dconf, dconf, sizeof(struct cli_dconf));
+
+    /* what cl_load() would have set up */
+    if((dboptions & CL_DB_PHISHING_URLS) && !engine->phishcheck && (engine->dconf->phishing & PHISHING_CONF_ENGINE))
+	if((ret = phishing_init(engine)))
+	    return ret;
+    if((dboptions & CL_DB_BYTECODE) && !engine->bcs.inited)
+	if((ret = cli_bytecode_init(&engine->bcs)))
+	    return ret;
+    if(cli_cache_init(engine))
+	return CL_EMEM;
+    engine->dboptions |= dboptions;
+    if((ret = cli_initroots(engine, dboptions)))
+	return ret;
+
+    if((ret = sn_get_ftypes(in, engine, &engine->ftypes)) || (ret = sn_get_ftypes(in, engine, &engine->ptypes)))
+	return ret;
+    if((ret = sn_get_hm(in, engine, &engine->hm_hdb)) || (ret = sn_get_hm(in, engine, &engine->hm_mdb)) || (ret = sn_get_hm(in, engine, &engine->hm_fp)))
+	return ret;
+
+    if(sn_getu32(in) != CLI_MTARGETS)
+	return CL_EMALFDB;
+    for(i = 0; i < CLI_MTARGETS; i++)
+	if((ret = sn_get_root(in, engine, engine->root[i])))
+	    return ret;
+    if(!sn_tag(in, SN_TAG_END))
+	return CL_EMALFDB;
+
+    for(i = 0; i < CLI_MTARGETS; i++)
+	if((ret = cli_ac_lsigcompile(engine->root[i])))
+	    return ret;
+    if(side && (ret = sn_reload(engine, dboptions)))
+	return ret;
+
+    /* sigs counts the reloaded signatures too */
+    engine->sigs += sigs;
+    if(signo)
+	*signo += sigs;
+    return CL_SUCCESS;
+}
+
+/* Checks that nothing is loaded in the engine yet */
+static int sn_empty(const struct cl_engine *engine, const char *fn)
+{
+	unsigned int i;
+
+    if(engine->dboptions & CL_DB_COMPILED) {
+	cli_errmsg("%s: Engine already compiled\n", fn);
+	return CL_EARG;
+    }
+    if(engine->snapshot || engine->dbfiles || engine->hm_hdb || engine->hm_mdb || engine->hm_fp || engine->ftypes) {
+	cli_errmsg("%s: Databases already loaded\n", fn);
+	return CL_EARG;
+    }
+    for(i = 0; i < CLI_MTARGETS; i++) {
+	if(engine->root[i]) {
+	    cli_errmsg("%s: Databases already loaded\n", fn);
+	    return CL_EARG;
+	}
+    }
+    return CL_SUCCESS;
+}
+
+/* Maps the snapshot open on fd, which is closed here */
+static int sn_map(int fd, const char *fn, const char *name, void **mapped, size_t *size)
+{
+	STATBUF sb;
+	void *map;
+
+    if(FSTAT(fd, &sb) == -1) {
+	cli_errmsg("%s: Can't stat %s\n", fn, name);
+	close(fd);
+	return CL_ESTAT;
+    }
+    if(sb.st_size < 32 || (uint64_t) sb.st_size > (size_t) -1) {
+	cli_errmsg("%s: Bad snapshot size\n", fn);
+	close(fd);
+	return CL_EMALFDB;
+    }
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+	cli_errmsg("%s: Can't map %s\n", fn, name);
+	return CL_EMAP;
+    }
+#else
+    if(!(map = cli_malloc(sb.st_size))) {
+	close(fd);
+	return CL_EMEM;
+    }
+    if(cli_readn(fd, map, sb.st_size) != sb.st_size) {
+	cli_errmsg("%s: Can't read %s\n", fn, name);
+	free(map);
+	close(fd);
+	return CL_EREAD;
+    }
+    close(fd);
+#endif
+    *mapped = map;
+    *size = sb.st_size;
+    return CL_SUCCESS;
+}
+
+static void sn_unmap(void *map, size_t size)
+{
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+    munmap(map, size);
+#else
+    free(map);
+#endif
+}
+
+/* Maps the snapshot open on fd (closed here) and loads the engine from it */
+static int sn_load_fd(struct cl_engine *engine, int fd, const char *fn, const char *name, unsigned int *signo, unsigned int dboptions, int check)
+{
+	struct sn_in in;
+	int ret;
+
+    if((ret = sn_map(fd, fn, name, &engine->snapshot, &engine->snapshot_size)))
+	return ret;
+
+    memset(&in, 0, sizeof(in));
+    in.map = (const unsigned char *) engine->snapshot;
+    in.size = engine->snapshot_size;
+    /* on failure the engine is left for cl_engine_free() */
+    if((ret = sn_load(&in, engine, signo, dboptions, check))) {
+	if(ret == CL_EMALFDB)
+	    cli_errmsg("%s: Malformed snapshot %s\n", fn, name);
+	return ret;
+    }
+
+    mpool_flush(engine->mempool);
+    if((ret = cli_bytecode_prepare2(engine, &engine->bcs, engine->dconf->bytecode))) {
+	cli_errmsg("%s: Unable to compile/load bytecode: %s\n", fn, cl_strerror(ret));
+	return ret;
+    }
+    cli_cache_file_init(engine);
+    engine->dboptions |= CL_DB_COMPILED;
+    cli_dbgmsg("%s: Loaded %u signatures from %s\n", fn, engine->sigs, name);
+    return CL_SUCCESS;
+}
+
+int cl_engine_load_snapshot(struct cl_engine *engine, const char *path, unsigned int *signo, unsigned int dboptions)
+{
+	int fd, ret;
+
+    if(!engine || !path)
+	return CL_ENULLARG;
+
+    if((ret = sn_empty(engine, "cl_engine_load_snapshot")))
+	return ret;
+
+    if((fd = open(path, O_RDONLY | O_BINARY)) == -1) {
+	cli_errmsg("cl_engine_load_snapshot: Can't open %s\n", path);
+	return CL_EOPEN;
+    }
+    return sn_load_fd(engine, fd, "cl_engine_load_snapshot", path, signo, dboptions, 1);
+}
+
+int cl_snapshot_check(const char *path, const char * const *dbpaths, unsigned int ndbpaths)
+{
+	struct sn_in in;
+	const char *magic, *str;
+	void *map;
+	size_t size;
+	int fd, ret;
+
+    if(!path || (ndbpaths && !dbpaths))
+	return CL_ENULLARG;
+
+    if((fd = open(path, O_RDONLY | O_BINARY)) == -1) {
+	cli_dbgmsg("cl_snapshot_check: Can't open %s\n", path);
+	return CL_EOPEN;
+    }
+    if((ret = sn_map(fd, "cl_snapshot_check", path, &map, &size)))
+	return ret;
+
+    /* only the header, as far as the databases */
+    memset(&in, 0, sizeof(in));
+    in.map = (const unsigned char *) map;
+    in.size = size;
+    magic = (const char *) sn_get(&in, 16);
+    if(!magic || memcmp(magic, SN_MAGIC, sizeof(SN_MAGIC)) || sn_getu32(&in) != SN_VERSION || sn_getu32(&in) != 0x01020304) {
+	cli_dbgmsg("cl_snapshot_check: %s is not a snapshot of this format\n", path);
+	ret = CL_EARG;
+    } else if(!(str = sn_getstr(&in)) || strcmp(str, cl_retver())) {
+	cli_dbgmsg("cl_snapshot_check: %s was saved by libclamav %s\n", path, str ? str : "?");
+	ret = CL_EARG;
+    } else {
+	sn_get(&in, 4 * sizeof(uint32_t));
+	sn_getstr(&in);
+	sn_getu32(&in);
+	ret = in.err ? CL_EMALFDB : sn_get_dbs(&in, NULL, SN_CHECK_FILES | SN_CHECK_ROOTS, dbpaths, ndbpaths);
+    }
+    sn_unmap(map, size);
+    return ret;
+}
+
+int cl_engine_attach(struct cl_engine *engine, const char *name, unsigned int *signo, unsigned int dboptions)
+{
+#ifdef SN_SHM
+	int fd;
+#endif
+	int ret;
+
+    if(!engine || !name)
+	return CL_ENULLARG;
+
+    if((ret = sn_empty(engine, "cl_engine_attach")))
+	return ret;
+
+#ifdef SN_SHM
+    if((fd = shm_open(name, O_RDONLY, 0)) == -1) {
+	cli_dbgmsg("cl_engine_attach: Can't open shared memory object %s\n", name);
+	return CL_EOPEN;
+    }
+    return sn_load_fd(engine, fd, "cl_engine_attach", name, signo, dboptions, 0);
+#else
+    cli_errmsg("cl_engine_attach: Shared memory objects are not supported on this system\n");
+    return CL_EARG;
+#endif
+}
+
+void cli_snapshot_free(struct cl_engine *engine)
+{
+    if(!engine->snapshot)
+	return;
+    sn_unmap(engine->snapshot, engine->snapshot_size);
+    engine->snapshot = NULL;
+}
@@ -0,0 +1,38 @@
+/*
+ *  Copyright (C) 2013 Sourcefire, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA 02110-1301, USA.
+ */
+
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include "clamav.h"
+#include "others.h"
+
+/* Unmaps engine->snapshot, called by cl_engine_free() once the matchers
+ * pointing into it are gone */
+void cli_snapshot_free(struct cl_engine *engine);
+
+/* Records a database for the snapshot: root for the paths given to
+ * cl_load(), else a file read from them */
+int cli_snapshot_adddb(struct cl_engine *engine, const char *path, const STATBUF *sb, unsigned int root);
+
+void cli_snapshot_freedbs(struct cl_engine *engine);
+
+/* Whether cli_load() parses dbname again for a snapshot being loaded */
+int cli_snapshot_reload(const char *dbname);
+
+#endif
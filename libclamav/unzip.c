@@ -58,20 +58,18 @@ static int wrap_inflateinit2(void *a, int b) {
 
 static int unz(const uint8_t *src, uint32_t csize, uint32_t usize, uint16_t method, uint16_t flags, unsigned int *fu, cli_ctx *ctx, char *tmpd) {
   char name[1024], obuf[BUFSIZ];
-  char *tempfile = name;
-  int of, ret=CL_CLEAN;
+  struct cli_outfile out;
+  int ret=CL_CLEAN;
   unsigned int res=1, written=0;
 
   if(tmpd) {
     snprintf(name, sizeof(name), "%s"PATHSEP"zip.%03u", tmpd, *fu);
     name[sizeof(name)-1]='\0';
-  } else {
-    if(!(tempfile = cli_gentemp(ctx->engine->tmpdir))) return CL_EMEM;
   }
-  if((of = open(tempfile, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, S_IRUSR|S_IWUSR))==-1) {
-    cli_warnmsg("cli_unzip: failed to create temporary file %s\n", tempfile);
-    if(!tmpd) free(tempfile);
-    return CL_ECREAT;
+  if((ret = cli_outfile_open(&out, ctx, tmpd ? name : NULL)) != CL_SUCCESS) {
+    cli_warnmsg("cli_unzip: failed to create temporary file\n");
+    cli_outfile_close(&out, ctx);
+    return ret;
   }
   switch (method) {
   case ALG_STORED:
@@ -89,8 +87,8 @@ static int unz(const uint8_t *src, uint32_t csize, uint32_t usize, uint16_t meth
 	cli_dbgmsg("cli_unzip: trimming output size to maxfilesize (%lu)\n", (long unsigned int) ctx->engine->maxfilesize);
 	csize = ctx->engine->maxfilesize;
       }
-      if(cli_writen(of, src, csize)!=(int)csize) ret = CL_EWRITE;
-      else res=0;
+      if((ret = cli_outfile_write(&out, ctx, src, csize)) == CL_SUCCESS)
+	res=0;
     }
     break;
 
@@ -151,9 +149,8 @@ static int unz(const uint8_t *src, uint32_t csize, uint32_t usize, uint16_t meth
 	  res = Z_STREAM_END;
 	  break;
 	}
-	if(cli_writen(of, obuf, sizeof(obuf)-(*avail_out)) != (int)(sizeof(obuf)-(*avail_out))) {
+	if((ret = cli_outfile_write(&out, ctx, obuf, sizeof(obuf)-(*avail_out))) != CL_SUCCESS) {
 	  cli_warnmsg("cli_unzip: falied to write %lu inflated bytes\n", sizeof(obuf)-(*avail_out));
-	  ret = CL_EWRITE;
 	  res = 100;
 	  break;
 	}
@@ -195,9 +192,8 @@ static int unz(const uint8_t *src, uint32_t csize, uint32_t usize, uint16_t meth
 	  res = BZ_STREAM_END;
 	  break;
 	}
-	if(cli_writen(of, obuf, sizeof(obuf)-strm.avail_out) != (int)(sizeof(obuf)-strm.avail_out)) {
+	if((ret = cli_outfile_write(&out, ctx, obuf, sizeof(obuf)-strm.avail_out)) != CL_SUCCESS) {
 	  cli_warnmsg("cli_unzip: falied to write %lu bunzipped bytes\n", sizeof(obuf)-strm.avail_out);
-	  ret = CL_EWRITE;
 	  res = 100;
 	  break;
 	}
@@ -232,9 +228,8 @@ static int unz(const uint8_t *src, uint32_t csize, uint32_t usize, uint16_t meth
 	  res = 0;
 	  break;
 	}
-	if(cli_writen(of, obuf, sizeof(obuf)-strm.avail_out) != (int)(sizeof(obuf)-strm.avail_out)) {
+	if((ret = cli_outfile_write(&out, ctx, obuf, sizeof(obuf)-strm.avail_out)) != CL_SUCCESS) {
 	  cli_warnmsg("cli_unzip: falied to write %lu exploded bytes\n", sizeof(obuf)-strm.avail_out);
-	  ret = CL_EWRITE;
 	  res = 100;
 	  break;
 	}
@@ -279,31 +274,21 @@ static int unz(const uint8_t *src, uint32_t csize, uint32_t usize, uint16_t meth
 
   if(!res) {
     (*fu)++;
-    cli_dbgmsg("cli_unzip: extracted to %s\n", tempfile);
-    if (lseek(of, 0, SEEK_SET) == -1) {
-        cli_dbgmsg("cli_unzip: call to lseek() failed\n");
-        if (!(tmpd))
-            free(tempfile);
-        close(of);
-        return CL_ESEEK;
-    }
-    ret = cli_magic_scandesc(of, ctx);
-    close(of);
-    if(!ctx->engine->keeptmp)
-      if(cli_unlink(tempfile)) ret = CL_EUNLINK;
-    if(!tmpd) free(tempfile);
+    if(out.fd != -1)
+      cli_dbgmsg("cli_unzip: extracted to %s\n", out.name ? out.name : out.tmpname);
+    else
+      cli_dbgmsg("cli_unzip: extracted %lu bytes to memory\n", (unsigned long) out.len);
+    ret = cli_outfile_scan(&out, ctx);
+    if(cli_outfile_close(&out, ctx)) ret = CL_EUNLINK;
     return ret;
   }
 
-  close(of);
-  if(!ctx->engine->keeptmp)
-    if(cli_unlink(tempfile)) ret = CL_EUNLINK;
-  if(!tmpd) free(tempfile);
+  if(cli_outfile_close(&out, ctx)) ret = CL_EUNLINK;
   cli_dbgmsg("cli_unzip: extraction failed\n");
   return ret;
 }
 
-static unsigned int lhdr(fmap_t *map, uint32_t loff,uint32_t zsize, unsigned int *fu, unsigned int fc, const uint8_t *ch, int *ret, cli_ctx *ctx, char *tmpd, int detect_encrypted) {
+static unsigned int lhdr(fmap_t *map, size_t loff,uint32_t zsize, unsigned int *fu, unsigned int fc, const uint8_t *ch, int *ret, cli_ctx *ctx, char *tmpd, int detect_encrypted) {
   const uint8_t *lh, *zip;
   char name[256];
   uint32_t csize, usize;
@@ -65,6 +65,13 @@ struct cdiff_ctx {
     struct cdiff_node *add_start, *add_last;
     struct cdiff_node *del_start;
     struct cdiff_node *xchg_start, *xchg_last;
+
+    /* cdiff_apply_engine(): the lines added to and removed from open_db */
+    struct cl_engine *engine;
+    unsigned int dboptions;
+    char *added, *removed;
+    size_t added_len, removed_len;
+    int reload;
 };
 
 struct cdiff_cmd {
@@ -138,6 +145,11 @@ static void cdiff_ctx_free(struct cdiff_ctx *ctx)
 	ctx->xchg_start = ctx->xchg_start->next;
 	free(pt);
     }
+
+    free(ctx->added);
+    free(ctx->removed);
+    ctx->added = ctx->removed = NULL;
+    ctx->added_len = ctx->removed_len = 0;
 }
 
 static char *cdiff_token(const char *line, unsigned int token, unsigned int last)
@@ -333,6 +345,32 @@ static int cdiff_cmd_xchg(const char *cmdstr, struct cdiff_ctx *ctx, char *lbuf,
     return 0;
 }
 
+/* Collects the changes for cl_engine_update(); if that's not possible the
+ * engine just needs a full reload */
+static void cdiff_engine_line(struct cdiff_ctx *ctx, char **buf, size_t *len, const char *line)
+{
+	size_t linelen = strlen(line);
+	char *pt;
+
+
+    if(!ctx->engine || ctx->reload)
+	return;
+
+    while(linelen && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+	linelen--;
+
+    if(!(pt = realloc(*buf, *len + linelen + 2))) {
+	logg("^cdiff_engine_line: Can't allocate memory, the engine will be reloaded\n");
+	ctx->reload = 1;
+	return;
+    }
+    memcpy(pt + *len, line, linelen);
+    pt[*len + linelen] = '\n';
+    pt[*len + linelen + 1] = 0;
+    *buf = pt;
+    *len += linelen + 1;
+}
+
 static int cdiff_cmd_close(const char *cmdstr, struct cdiff_ctx *ctx, char *lbuf, unsigned int lbuflen)
 {
 	struct cdiff_node *add, *del, *xchg;
@@ -382,6 +420,7 @@ static int cdiff_cmd_close(const char *cmdstr, struct cdiff_ctx *ctx, char *lbuf
 		    logg("!cdiff_cmd_close: Can't apply DEL at line %d of %s\n", lines, ctx->open_db);
 		    return -1;
 		}
+		cdiff_engine_line(ctx, &ctx->removed, &ctx->removed_len, lbuf);
 		del = del->next;
 		continue;
 	    }
@@ -404,6 +443,8 @@ static int cdiff_cmd_close(const char *cmdstr, struct cdiff_ctx *ctx, char *lbuf
 		    free(tmp);
 		    return -1;
 		}
+		cdiff_engine_line(ctx, &ctx->removed, &ctx->removed_len, lbuf);
+		cdiff_engine_line(ctx, &ctx->added, &ctx->added_len, xchg->str2);
 		xchg = xchg->next;
 		continue;
 	    }
@@ -458,12 +499,20 @@ static int cdiff_cmd_close(const char *cmdstr, struct cdiff_ctx *ctx, char *lbuf
 		logg("!cdiff_cmd_close: Can't write to %s\n", ctx->open_db);
 		return -1;
 	    }
+	    cdiff_engine_line(ctx, &ctx->added, &ctx->added_len, add->str);
 	    add = add->next;
 	}
 
 	fclose(fh);
     }
 
+    if(ctx->engine && !ctx->reload && (ctx->added || ctx->removed)) {
+	if(cl_engine_update(ctx->engine, ctx->open_db, ctx->added, ctx->removed, ctx->dboptions) != CL_SUCCESS) {
+	    logg("*cdiff_cmd_close: Can't update the engine with %s, it will be reloaded\n", ctx->open_db);
+	    ctx->reload = 1;
+	}
+    }
+
     cdiff_ctx_free(ctx);
 
     return 0;
@@ -480,6 +529,7 @@ static int cdiff_cmd_move(const char *cmdstr, struct cdiff_ctx *ctx, char *lbuf,
 	logg("!cdiff_cmd_move: Database %s is still open\n", ctx->open_db);
 	return -1;
     }
+    ctx->reload = 1;
 
     if(!(arg = cdiff_token(cmdstr, 3, 0))) {
 	logg("!cdiff_cmd_move: Can't get third argument\n");
@@ -686,6 +736,7 @@ static int cdiff_cmd_unlink(const char *cmdstr, struct cdiff_ctx *ctx, char *lbu
 	logg("!cdiff_cmd_unlink: Database %s is still open\n", ctx->open_db);
 	return -1;
     }
+    ctx->reload = 1;
 
     if(!(db = cdiff_token(cmdstr, 1, 1))) {
 	logg("!cdiff_cmd_unlink: Can't get first argument\n");
@@ -753,7 +804,7 @@ static int cdiff_execute(const char *cmdstr, struct cdiff_ctx *ctx, char *lbuf,
     return 0;
 }
 
-int cdiff_apply(int fd, unsigned short mode)
+static int cdiff_apply_common(int fd, unsigned short mode, struct cl_engine *engine, unsigned int dboptions)
 {
 	struct cdiff_ctx ctx;
 	FILE *fh;
@@ -770,6 +821,8 @@ int cdiff_apply(int fd, unsigned short mode)
 #define DSIGBUFF 350
 
     memset(&ctx, 0, sizeof(ctx));
+    ctx.engine = engine;
+    ctx.dboptions = dboptions;
 
     if((desc = dup(fd)) == -1) {
 	logg("!cdiff_apply: Can't duplicate descriptor %d\n", fd);
@@ -1038,5 +1091,15 @@ int cdiff_apply(int fd, unsigned short mode)
     }
 
     logg("*cdiff_apply: Parsed %d lines and executed %d commands\n", lines, cmds);
-    return 0;
+    return engine ? ctx.reload : 0;
+}
+
+int cdiff_apply(int fd, unsigned short mode)
+{
+    return cdiff_apply_common(fd, mode, NULL, 0);
+}
+
+int cdiff_apply_engine(int fd, unsigned short mode, struct cl_engine *engine, unsigned int dboptions)
+{
+    return cdiff_apply_common(fd, mode, engine, dboptions);
 }
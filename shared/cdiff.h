@@ -21,6 +21,14 @@
 #ifndef __CDIFF_H
 #define __CDIFF_H
 
+#include "libclamav/clamav.h"
+
 int cdiff_apply(int fd, unsigned short mode);
 
+/* Like cdiff_apply(), and passes the changes on to a compiled engine loaded
+ * from the same databases with cl_engine_update(). Returns 1 if the engine
+ * couldn't follow them all (MOVE, UNLINK, unsupported database types) and
+ * must be reloaded, -1 on error */
+int cdiff_apply_engine(int fd, unsigned short mode, struct cl_engine *engine, unsigned int dboptions);
+
 #endif
@@ -31,6 +31,7 @@
 #include <check.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/time.h>
 #include "../libclamav/clamav.h"
 #include "../libclamav/others.h"
 #include "../libclamav/bytecode.h"
@@ -244,6 +245,21 @@ START_TEST (test_inf_int)
 }
 END_TEST
 
+/* a cheap loop followed by an endless loop of large memsets, the timeout
+ * (10ms) must still be noticed soon after the loop turns expensive */
+START_TEST (test_inf_slow_int)
+{
+    struct timeval tv0, tv1;
+    long ms;
+    cl_init(CL_INIT_DEFAULT);
+    gettimeofday(&tv0, NULL);
+    runtest("input/infslow.cbc", 0, CL_ETIMEOUT, 1, NULL, NULL, NULL, NULL, 0);
+    gettimeofday(&tv1, NULL);
+    ms = (tv1.tv_sec - tv0.tv_sec)*1000 + (tv1.tv_usec - tv0.tv_usec)/1000;
+    fail_unless_fmt(ms < 200, "bytecode timeout overshot, run took %ldms\n", ms);
+}
+END_TEST
+
 START_TEST (test_matchwithread_jit)
 {
     struct cli_exe_section sect;
@@ -319,6 +335,32 @@ START_TEST (test_bswap_int)
 }
 END_TEST
 
+/* These hit the interpreter's fused instructions, a failing check returns
+ * its number instead of 0xbeef */
+START_TEST (test_icmpbr_int)
+{
+    cl_init(CL_INIT_DEFAULT);
+    /* icmp+br of every predicate and operand width */
+    runtest("input/icmpbr.cbc", 0xbeef, 0, 1, NULL, NULL, NULL, NULL, 0);
+}
+END_TEST
+
+START_TEST (test_gepload_int)
+{
+    cl_init(CL_INIT_DEFAULT);
+    /* gepz+load off an alloca and off a pointer, gep1+load, load+add */
+    runtest("input/gepload.cbc", 0xbeef, 0, 1, NULL, NULL, NULL, NULL, 0);
+}
+END_TEST
+
+START_TEST (test_loadoob_int)
+{
+    cl_init(CL_INIT_DEFAULT);
+    /* must catch the out of bounds gepz+load */
+    runtest("input/loadoob.cbc", 0, CL_EBYTECODE, 1, NULL, NULL, NULL, NULL, 0);
+}
+END_TEST
+
 START_TEST (test_inflate_jit)
 {
     cl_init(CL_INIT_DEFAULT);
@@ -527,6 +569,63 @@ START_TEST (test_load_bytecode_int)
 }
 END_TEST
 
+/* runs the bytecodes of the engine that were prepared for the JIT */
+static unsigned runjit(struct cl_engine *engine)
+{
+    unsigned i, n = 0;
+    int rc;
+    cli_ctx cctx;
+    struct cli_bc_ctx *ctx;
+    const char *virname = NULL;
+
+    memset(&cctx, 0, sizeof(cctx));
+    cctx.virname = &virname;
+    cctx.engine = engine;
+    for (i=0;i<engine->bcs.count;i++) {
+	struct cli_bc *bc = &engine->bcs.all_bcs[i];
+	if (bc->state != bc_jit)
+	    continue;
+	ctx = cli_bytecode_context_alloc();
+	fail_unless(!!ctx, "cli_bytecode_context_alloc failed");
+	ctx->ctx = &cctx;
+	cli_bytecode_context_setfuncid(ctx, bc, 0);
+	rc = cli_bytecode_run(&engine->bcs, bc, ctx);
+	fail_unless_fmt(rc == CL_SUCCESS, "cli_bytecode_run failed for bytecode %u: %s\n",
+			i, cl_strerror(rc));
+	cli_bytecode_context_destroy(ctx);
+	n++;
+    }
+    return n;
+}
+
+START_TEST (test_reload_bytecode_jit)
+{
+    struct cl_engine *engine, *engine2;
+    unsigned n;
+    cl_init(CL_INIT_DEFAULT);
+    engine = cl_engine_new();
+    fail_unless(!!engine, "failed to create engine\n");
+    runload("input/bytecode.cvd", engine, 5);
+    n = runjit(engine);
+    fail_unless(!have_clamjit || n, "no bytecode was prepared for the JIT\n");
+
+    /* the new engine reuses the code compiled for the old one, which
+     * must stay valid after the old engine is gone */
+    engine2 = cl_engine_new();
+    fail_unless(!!engine2, "failed to create engine\n");
+    runload("input/bytecode.cvd", engine2, 5);
+    cl_engine_free(engine);
+    fail_unless_fmt(runjit(engine2) == n, "expected %u JIT bytecodes after reload\n", n);
+
+    engine = cl_engine_new();
+    fail_unless(!!engine, "failed to create engine\n");
+    runload("input/bytecode.cvd", engine, 5);
+    cl_engine_free(engine2);
+    fail_unless_fmt(runjit(engine) == n, "expected %u JIT bytecodes after reload\n", n);
+    cl_engine_free(engine);
+}
+END_TEST
+
 #if defined(CL_THREAD_SAFE) && defined(C_LINUX) && ((__GLIBC__ << 16) + __GLIBC_MINOR__ >= (2 << 16) + 4)
 #define DO_BARRIER
 #endif
@@ -592,11 +691,15 @@ Suite *test_bytecode_suite(void)
     tcase_add_test(tc_cli_arith, test_div0_int);
     tcase_add_test(tc_cli_arith, test_lsig_int);
     tcase_add_test(tc_cli_arith, test_inf_int);
+    tcase_add_test(tc_cli_arith, test_inf_slow_int);
     tcase_add_test(tc_cli_arith, test_matchwithread_int);
     tcase_add_test(tc_cli_arith, test_pdf_int);
     tcase_add_test(tc_cli_arith, test_bswap_int);
     tcase_add_test(tc_cli_arith, test_inflate_int);
     tcase_add_test(tc_cli_arith, test_retmagic_int);
+    tcase_add_test(tc_cli_arith, test_icmpbr_int);
+    tcase_add_test(tc_cli_arith, test_gepload_int);
+    tcase_add_test(tc_cli_arith, test_loadoob_int);
 
     tcase_add_test(tc_cli_arith, test_api_extract_jit);
     tcase_add_test(tc_cli_arith, test_api_files_jit);
@@ -624,6 +727,7 @@ Suite *test_bytecode_suite(void)
 
     tcase_add_test(tc_cli_arith, test_load_bytecode_jit);
     tcase_add_test(tc_cli_arith, test_load_bytecode_int);
+    tcase_add_test(tc_cli_arith, test_reload_bytecode_jit);
 #ifdef DO_BARRIER
     tcase_add_test(tc_cli_arith, test_parallel_load);
 #endif
@@ -10,13 +10,18 @@
 #include <string.h>
 #include <check.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <dirent.h>
 #include <sys/mman.h>
+#ifdef CL_THREAD_SAFE
+#include <pthread.h>
+#endif
 #include "../libclamav/clamav.h"
 #include "../libclamav/others.h"
 #include "../libclamav/matcher.h"
 #include "../libclamav/version.h"
 #include "../libclamav/dsig.h"
+#include "../libclamav/sha1.h"
 #include "../libclamav/sha256.h"
 #include "../libclamav/fpu.h"
 #include "checks.h"
@@ -461,6 +466,840 @@ static int get_test_file(int i, char *file, unsigned fsize, unsigned long *size)
     *size = st.st_size;
     return fd;
 }
+static unsigned prescan_calls;
+
+static cl_error_t count_prescan(int fd, const char *type, void *context)
+{
+    prescan_calls++;
+    return CL_CLEAN;
+}
+
+/* returns how many times the pre-scan callback ran, 0 for a cached file */
+static unsigned scan_counting_prescans(struct cl_engine *engine, char fill)
+{
+    unsigned long int scanned = 0;
+    const char *virname = NULL;
+    char buf[4096];
+    cl_fmap_t *map;
+    int ret;
+
+    cl_engine_set_clcb_pre_scan(engine, count_prescan);
+    memset(buf, fill, sizeof(buf));
+    map = cl_fmap_open_memory(buf, sizeof(buf));
+    fail_unless(!!map, "cl_fmap_open_memory");
+    prescan_calls = 0;
+    ret = cl_scanmap_callback(map, &virname, &scanned, engine, CL_SCAN_STDOPT, NULL);
+    fail_unless_fmt(ret == CL_CLEAN, "cl_scanmap_callback: %s", cl_strerror(ret));
+    cl_fmap_close(map);
+    return prescan_calls;
+}
+
+static struct cl_engine *cache_test_engine(const char *cache_file, uint32_t dbversion, int clock, const char *extra_db)
+{
+    struct cl_engine *engine;
+    unsigned int sigs = 0;
+
+    if (!inited)
+	fail_unless(cl_init(CL_INIT_DEFAULT) == 0, "cl_init");
+    inited = 1;
+    engine = cl_engine_new();
+    fail_unless(!!engine, "cl_engine_new");
+    if (cache_file)
+	fail_unless(cl_engine_set_str(engine, CL_ENGINE_CACHE_FILE, cache_file) == CL_SUCCESS, "cl_engine_set_str");
+    if (clock)
+	fail_unless(cl_engine_set_num(engine, CL_ENGINE_CACHE_CLOCK, 1) == CL_SUCCESS, "cl_engine_set_num");
+    fail_unless(cl_load(OBJDIR"/clamav.hdb", engine, &sigs, CL_DB_STDOPT) == 0, "cl_load");
+    if (extra_db)
+	fail_unless(cl_load(extra_db, engine, &sigs, CL_DB_STDOPT) == 0, "cl_load");
+    /* normally comes from daily.cvd */
+    engine->dbversion[0] = dbversion;
+    fail_unless(cl_engine_compile(engine) == 0, "cl_engine_compile");
+    return engine;
+}
+
+static unsigned scan_with_cache_file(const char *path, uint32_t dbversion, const char *extra_db)
+{
+    struct cl_engine *engine = cache_test_engine(path, dbversion, 0, extra_db);
+    unsigned calls = scan_counting_prescans(engine, 'A');
+
+    cl_engine_free(engine);
+    return calls;
+}
+
+/* clean results stored with CL_ENGINE_CACHE_FILE survive the engine */
+START_TEST (test_cl_engine_cache_file)
+{
+    char *path, *dir, ndb[512];
+    FILE *f;
+
+    path = cli_gentemp(NULL);
+    fail_unless(!!path, "cli_gentemp");
+    fail_unless(scan_with_cache_file(path, 1, NULL) > 0, "first scan was cached");
+    fail_unless(scan_with_cache_file(path, 1, NULL) == 0, "second scan was not cached");
+    fail_unless(scan_with_cache_file(path, 2, NULL) > 0, "database update didn't invalidate the cache");
+
+    /* local databases don't change the version */
+    dir = cli_gentemp(NULL);
+    fail_unless(!!dir, "cli_gentemp");
+    fail_unless(mkdir(dir, 0700) == 0, "mkdir");
+    snprintf(ndb, sizeof(ndb), "%s/local.ndb", dir);
+    f = fopen(ndb, "w");
+    fail_unless(!!f, "fopen");
+    fputs("Test.CacheFile.1:0:*:4341434845464953\n", f);
+    fclose(f);
+    fail_unless(scan_with_cache_file(path, 2, ndb) > 0, "extra database didn't invalidate the cache");
+    fail_unless(scan_with_cache_file(path, 2, ndb) == 0, "scan with the extra database was not cached");
+    f = fopen(ndb, "w");
+    fail_unless(!!f, "fopen");
+    fputs("Test.CacheFile.2:0:*:4341434845464954\n", f);
+    fclose(f);
+    fail_unless(scan_with_cache_file(path, 2, ndb) > 0, "changed database didn't invalidate the cache");
+    cli_rmdirs(dir);
+    free(dir);
+    cli_unlink(path);
+    free(path);
+}
+END_TEST
+
+/* the CLOCK backend caches like the default one and evicts when a set is full */
+START_TEST (test_cl_engine_cache_clock)
+{
+    struct cl_engine *engine = cache_test_engine(NULL, 0, 1, NULL);
+    unsigned i;
+
+    fail_unless(cl_engine_get_num(engine, CL_ENGINE_CACHE_CLOCK, NULL) == 1, "cl_engine_get_num");
+    errmsg_expected();
+    fail_unless(cl_engine_set_num(engine, CL_ENGINE_CACHE_CLOCK, 0) == CL_EARG, "backend changed after compile");
+    fail_unless(scan_counting_prescans(engine, 'A') > 0, "first scan was cached");
+    fail_unless(scan_counting_prescans(engine, 'A') == 0, "second scan was not cached");
+    for (i = 0; i < 64; i++)
+	scan_counting_prescans(engine, 'a' + i);
+    fail_unless(scan_counting_prescans(engine, 'a') == 0, "recent scan was not cached");
+    cl_engine_free(engine);
+}
+END_TEST
+
+static struct cl_engine *load_threads_engine(const char *dir, uint32_t nthreads, const char *data, unsigned int nsigs)
+{
+    struct cl_engine *engine;
+    unsigned long int scanned = 0;
+    const char *virname = NULL;
+    unsigned int sigs = 0;
+    cl_fmap_t *map;
+    int ret;
+
+    engine = cl_engine_new();
+    fail_unless(!!engine, "cl_engine_new");
+    fail_unless(cl_engine_set_num(engine, CL_ENGINE_LOAD_THREADS, nthreads) == CL_SUCCESS, "cl_engine_set_num");
+    ret = cl_load(dir, engine, &sigs, CL_DB_STDOPT);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_load: %s", cl_strerror(ret));
+    fail_unless_fmt(sigs == nsigs, "sigs: %u", sigs);
+    fail_unless(cl_engine_compile(engine) == 0, "cl_engine_compile");
+
+    map = cl_fmap_open_memory(data, strlen(data));
+    fail_unless(!!map, "cl_fmap_open_memory");
+    ret = cl_scanmap_callback(map, &virname, &scanned, engine, CL_SCAN_STDOPT, NULL);
+    fail_unless_fmt(ret == CL_VIRUS, "cl_scanmap_callback: %s", cl_strerror(ret));
+    fail_unless_fmt(!strcmp(virname, "Test.LoadThreads.UNOFFICIAL"), "virusname: %s", virname);
+    cl_fmap_close(map);
+    return engine;
+}
+
+static void load_threads_copy(const char *src, const char *dst)
+{
+    char buf[8192];
+    size_t n;
+    FILE *in, *out;
+
+    in = fopen(src, "rb");
+    fail_unless_fmt(!!in, "fopen %s", src);
+    out = fopen(dst, "wb");
+    fail_unless_fmt(!!out, "fopen %s", dst);
+    while ((n = fread(buf, 1, sizeof(buf), in)))
+	fail_unless(fwrite(buf, 1, n, out) == n, "fwrite");
+    fclose(in);
+    fclose(out);
+}
+
+/* the loader threads don't change what gets loaded */
+START_TEST (test_cl_load_threads)
+{
+    const char *data = "xxLOADTHREADS!xx", *srcdir = getenv("srcdir");
+    const char *virname1 = NULL, *virname4 = NULL;
+    unsigned long int scanned = 0;
+    struct cl_engine *e1, *e4;
+    char *dir, path[512], cvd[512];
+    unsigned int i;
+    int ret1, ret4, fd;
+    FILE *f;
+
+    if (!inited)
+	fail_unless(cl_init(CL_INIT_DEFAULT) == 0, "cl_init");
+    inited = 1;
+    dir = cli_gentemp(NULL);
+    fail_unless(!!dir, "cli_gentemp");
+    fail_unless(mkdir(dir, 0700) == 0, "mkdir");
+
+    snprintf(path, sizeof(path), "%s/a.hdb", dir);
+    f = fopen(path, "w");
+    fail_unless(!!f, "fopen");
+    fputs("# comment\n"
+	  "0123456789abcdef0123456789abcdef:17:Test.LoadThreads.1\n"
+	  "0123456789abcdef0123456789abcdee:17:Test.LoadThreads.2:999\n"
+	  "0123456789abcdef0123456789abcdef01234567:17:Test.LoadThreads.3\n", f);
+    fclose(f);
+    snprintf(path, sizeof(path), "%s/b.hsb", dir);
+    f = fopen(path, "w");
+    fail_unless(!!f, "fopen");
+    fputs("0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef:*:Test.LoadThreads.4:73", f);
+    fclose(f);
+    snprintf(path, sizeof(path), "%s/c.ndb", dir);
+    f = fopen(path, "w");
+    fail_unless(!!f, "fopen");
+    fputs("Test.LoadThreads:0:*:4c4f41445448524541445321\n", f);
+    fclose(f);
+    snprintf(path, sizeof(path), "%s/d.ldb", dir);
+    f = fopen(path, "w");
+    fail_unless(!!f, "fopen");
+    fputs("# comment\n"
+	  "Test.LoadThreads.5;Target:0;0&1;4c4f4144;4e4f5045\n", f);
+    fclose(f);
+    snprintf(path, sizeof(path), "%s/e.cdb", dir);
+    f = fopen(path, "w");
+    fail_unless(!!f, "fopen");
+    fputs("Test.LoadThreads.6:CL_TYPE_ZIP:*:loadthreads\\.txt:*:*:*:*:*:*\n", f);
+    fclose(f);
+
+    cl_engine_free(load_threads_engine(dir, 1, data, 6));
+    cl_engine_free(load_threads_engine(dir, 4, data, 6));
+
+    /* a CVD is unpacked and checked by the threads */
+    if (!srcdir)
+	srcdir = SRCDIR;
+    snprintf(cvd, sizeof(cvd), "%s/input/bytecode.cvd", srcdir);
+    snprintf(path, sizeof(path), "%s/bytecode.cvd", dir);
+    load_threads_copy(cvd, path);
+    e1 = load_threads_engine(dir, 1, data, 11);
+    e4 = load_threads_engine(dir, 4, data, 11);
+    fail_unless_fmt(e4->sigs == e1->sigs, "sigs: %u, single-threaded %u", e4->sigs, e1->sigs);
+    fail_unless_fmt(e4->bcs.count == e1->bcs.count && e1->bcs.count, "bytecodes: %u, single-threaded %u", e4->bcs.count, e1->bcs.count);
+    for (i = 0; i < CLI_MTARGETS; i++) {
+	fail_unless_fmt(e4->root[i]->ac_patterns == e1->root[i]->ac_patterns, "root %u: AC patterns %u, single-threaded %u", i, e4->root[i]->ac_patterns, e1->root[i]->ac_patterns);
+	fail_unless_fmt(e4->root[i]->ac_lsigs == e1->root[i]->ac_lsigs, "root %u: lsigs %u, single-threaded %u", i, e4->root[i]->ac_lsigs, e1->root[i]->ac_lsigs);
+	fail_unless_fmt(e4->root[i]->bm_patterns == e1->root[i]->bm_patterns, "root %u: BM patterns %u, single-threaded %u", i, e4->root[i]->bm_patterns, e1->root[i]->bm_patterns);
+    }
+
+    /* detected by one of the bytecodes */
+    fd = open(OBJDIR"/../test/clam.exe", O_RDONLY);
+    fail_unless(fd >= 0, "open clam.exe");
+    ret1 = cl_scandesc(fd, &virname1, &scanned, e1, CL_SCAN_STDOPT);
+    fail_unless(lseek(fd, 0, SEEK_SET) == 0, "lseek");
+    ret4 = cl_scandesc(fd, &virname4, &scanned, e4, CL_SCAN_STDOPT);
+    close(fd);
+    fail_unless_fmt(ret1 == CL_VIRUS, "cl_scandesc: %s", cl_strerror(ret1));
+    fail_unless_fmt(ret4 == ret1 && !strcmp(virname4, virname1), "detected %s, single-threaded %s", virname4, virname1);
+    cl_engine_free(e1);
+    cl_engine_free(e4);
+    cli_rmdirs(dir);
+    free(dir);
+}
+END_TEST
+
+/* feeds nblocks blocks of 64 KB, with sig in block sigblock, to a new
+ * stream; *fed is the number of blocks it took */
+static int stream_feed(cli_ctx *ctx, uint64_t size, unsigned int nblocks, unsigned int sigblock, const char *sig, unsigned int *fed, const char **virname)
+{
+    static unsigned char block[65536];
+    struct cli_scanstream *st;
+    unsigned char md5[16];
+    int ret = CL_SUCCESS;
+
+    st = cli_scanstream_init(ctx, 0, size);
+    fail_unless(!!st, "cli_scanstream_init");
+    for (*fed = 0; *fed < nblocks && ret == CL_SUCCESS; (*fed)++) {
+	memset(block, 'a', sizeof(block));
+	if (*fed == sigblock)
+	    memcpy(block + 1000, sig, strlen(sig));
+	ret = cli_scanstream_update(st, block, sizeof(block));
+	fail_unless_fmt(ret == CL_SUCCESS || ret == CL_BREAK, "cli_scanstream_update: %s", cl_strerror(ret));
+    }
+    ret = cli_scanstream_final(st, virname, md5);
+    cli_scanstream_free(st);
+    return ret;
+}
+
+/* a match ends the stream unless the size limits or the .fp hashes may
+ * still overrule it; only what needs the whole file falls back */
+START_TEST (test_cli_scanstream)
+{
+    const uint64_t size = 16 * 65536;
+    struct cl_engine *engine;
+    unsigned int sigs = 0, fed;
+    const char *virname;
+    char *dir, path[512];
+    cli_ctx ctx;
+    FILE *f;
+    int ret;
+
+    if (!inited)
+	fail_unless(cl_init(CL_INIT_DEFAULT) == 0, "cl_init");
+    inited = 1;
+    dir = cli_gentemp(NULL);
+    fail_unless(!!dir, "cli_gentemp");
+    fail_unless(mkdir(dir, 0700) == 0, "mkdir");
+    snprintf(path, sizeof(path), "%s/stream.ndb", dir);
+    f = fopen(path, "w");
+    fail_unless(!!f, "fopen");
+    fputs("Test.Stream:0:*:53545245414d534947\n", f);
+    fclose(f);
+    snprintf(path, sizeof(path), "%s/stream.ldb", dir);
+    f = fopen(path, "w");
+    fail_unless(!!f, "fopen");
+    fputs("Test.Stream.Lsig;Target:0;0&1;4c5349474f4e45;4c53494754574f\n", f);
+    fclose(f);
+
+    engine = cl_engine_new();
+    fail_unless(!!engine, "cl_engine_new");
+    fail_unless(cl_load(dir, engine, &sigs, CL_DB_STDOPT) == 0, "cl_load");
+    fail_unless(cl_engine_compile(engine) == 0, "cl_engine_compile");
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.engine = engine;
+    ctx.options = CL_SCAN_STDOPT;
+    ctx.container_type = CL_TYPE_ANY;
+    ctx.dconf = (struct cli_dconf *) engine->dconf;
+
+    /* the recorded size is within the default limits */
+    ret = stream_feed(&ctx, size, 16, 2, "STREAMSIG", &fed, &virname);
+    fail_unless_fmt(ret == CL_VIRUS && !strcmp(virname, "Test.Stream.UNOFFICIAL"), "known size: %s", cl_strerror(ret));
+    fail_unless_fmt(fed < 16, "known size: read %u blocks", fed);
+    /* the limits need the length */
+    ret = stream_feed(&ctx, 0, 16, 2, "STREAMSIG", &fed, &virname);
+    fail_unless_fmt(ret == CL_VIRUS, "unknown size: %s", cl_strerror(ret));
+    fail_unless_fmt(fed == 16, "unknown size: read %u blocks", fed);
+    /* the recorded size turns out to be wrong before the match */
+    ret = stream_feed(&ctx, 2 * 65536, 16, 4, "STREAMSIG", &fed, &virname);
+    fail_unless_fmt(ret == CL_VIRUS, "wrong size: %s", cl_strerror(ret));
+    fail_unless_fmt(fed == 16, "wrong size: read %u blocks", fed);
+    fail_unless(cl_engine_set_num(engine, CL_ENGINE_MAX_FILESIZE, 0) == CL_SUCCESS, "cl_engine_set_num");
+    fail_unless(cl_engine_set_num(engine, CL_ENGINE_MAX_SCANSIZE, 0) == CL_SUCCESS, "cl_engine_set_num");
+    ret = stream_feed(&ctx, 0, 16, 2, "STREAMSIG", &fed, &virname);
+    fail_unless_fmt(ret == CL_VIRUS, "no limits: %s", cl_strerror(ret));
+    fail_unless_fmt(fed < 16, "no limits: read %u blocks", fed);
+
+    /* logical signatures are evaluated on the stream */
+    ret = stream_feed(&ctx, size, 16, 3, "LSIGONE.LSIGTWO", &fed, &virname);
+    fail_unless_fmt(ret == CL_VIRUS && !strcmp(virname, "Test.Stream.Lsig.UNOFFICIAL"), "lsig: %s", cl_strerror(ret));
+    ret = stream_feed(&ctx, size, 16, 3, "LSIGONE", &fed, &virname);
+    fail_unless_fmt(ret == CL_CLEAN, "partial lsig: %s", cl_strerror(ret));
+    ret = stream_feed(&ctx, size, 16, 16, "", &fed, &virname);
+    fail_unless_fmt(ret == CL_CLEAN, "clean: %s", cl_strerror(ret));
+
+    /* an embedded zip needs the full scan */
+    ret = stream_feed(&ctx, size, 16, 5, "PK\003\004\024\000\000\000\010\000", &fed, &virname);
+    fail_unless_fmt(ret == CL_BREAK, "embedded type: %s", cl_strerror(ret));
+    fail_unless_fmt(fed < 16, "embedded type: read %u blocks", fed);
+
+    cl_engine_free(engine);
+    cli_rmdirs(dir);
+    free(dir);
+}
+END_TEST
+
+static const char *live_scan(struct cl_engine *engine, const char *data)
+{
+    unsigned long int scanned = 0;
+    const char *virname = NULL;
+    cl_fmap_t *map;
+    int ret;
+
+    map = cl_fmap_open_memory(data, strlen(data));
+    fail_unless(!!map, "cl_fmap_open_memory");
+    ret = cl_scanmap_callback(map, &virname, &scanned, engine, CL_SCAN_STDOPT, NULL);
+    fail_unless_fmt(ret == CL_VIRUS || ret == CL_CLEAN, "cl_scanmap_callback: %s", cl_strerror(ret));
+    cl_fmap_close(map);
+    return ret == CL_VIRUS ? virname : NULL;
+}
+
+/* signatures added and removed with cl_engine_update() apply to the next
+ * scans, also to files already cached as clean */
+START_TEST (test_cl_engine_update)
+{
+    const char *oldsig = "Test.Live.Old:0:*:4f4c44534947\n";
+    const char *newsig = "Test.Live.New:0:*:4e4557534947\n";
+    const char *twinsig = "Test.Live.Twin:0:*:5457494e4f4e45\n";
+    const char *splitsig = "Test.Live.Split:0:*:53504c4954*414141\n";
+    const char *lsig = "Test.Live.Lsig;Target:0;0;4c534947414141\n";
+    struct cl_engine *engine;
+    unsigned int sigs = 0;
+    const char *virname;
+    char *dir, path[512];
+    FILE *f;
+    int ret;
+
+    if (!inited)
+	fail_unless(cl_init(CL_INIT_DEFAULT) == 0, "cl_init");
+    inited = 1;
+    dir = cli_gentemp(NULL);
+    fail_unless(!!dir, "cli_gentemp");
+    fail_unless(mkdir(dir, 0700) == 0, "mkdir");
+    snprintf(path, sizeof(path), "%s/live.ndb", dir);
+    f = fopen(path, "w");
+    fail_unless(!!f, "fopen");
+    fputs(oldsig, f);
+    fputs(twinsig, f);
+    fputs("Test.Live.Twin:0:*:5457494e54574f\n", f);
+    fputs(splitsig, f);
+    fputs("Test.Live.Split:0:*:53504c4954*424242\n", f);
+    fclose(f);
+    snprintf(path, sizeof(path), "%s/live.ldb", dir);
+    f = fopen(path, "w");
+    fail_unless(!!f, "fopen");
+    fputs(lsig, f);
+    fputs("Test.Live.Lsig;Target:0;0;4c534947424242\n", f);
+    fclose(f);
+    snprintf(path, sizeof(path), "%s/live.ndb", dir);
+
+    engine = cl_engine_new();
+    fail_unless(!!engine, "cl_engine_new");
+    errmsg_expected();
+    fail_unless(cl_engine_update(engine, "live.ndb", newsig, NULL, CL_DB_STDOPT) == CL_EARG, "update before compile");
+    fail_unless(cl_load(dir, engine, &sigs, CL_DB_STDOPT) == 0, "cl_load");
+    fail_unless(cl_engine_compile(engine) == 0, "cl_engine_compile");
+
+    virname = live_scan(engine, "xxOLDSIGxx");
+    fail_unless_fmt(virname && !strcmp(virname, "Test.Live.Old.UNOFFICIAL"), "virusname: %s", virname);
+    fail_unless(!live_scan(engine, "xxNEWSIGxx"), "new signature before the update");
+
+    ret = cl_engine_update(engine, path, newsig, NULL, CL_DB_STDOPT);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_update: %s", cl_strerror(ret));
+    virname = live_scan(engine, "xxNEWSIGxx");
+    fail_unless_fmt(virname && !strcmp(virname, "Test.Live.New.UNOFFICIAL"), "virusname: %s", virname);
+    fail_unless(!!live_scan(engine, "xxOLDSIGxx"), "old signature lost");
+
+    /* one in the compiled engine, one from the earlier update */
+    ret = cl_engine_update(engine, "live.ndb", NULL, oldsig, CL_DB_STDOPT);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_update: %s", cl_strerror(ret));
+    fail_unless(!live_scan(engine, "xxOLDSIGxx"), "removed signature still matches");
+    fail_unless(!!live_scan(engine, "xxNEWSIGxx"), "added signature lost");
+    ret = cl_engine_update(engine, "live.ndb", NULL, newsig, CL_DB_STDOPT);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_update: %s", cl_strerror(ret));
+    fail_unless(!live_scan(engine, "xxNEWSIGxx"), "removed signature still matches");
+
+    /* only the removed one of the signatures sharing a name goes */
+    fail_unless(!!live_scan(engine, "xxTWINONExx") && !!live_scan(engine, "xxTWINTWOxx"), "twin signature missed");
+    ret = cl_engine_update(engine, "live.ndb", NULL, twinsig, CL_DB_STDOPT);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_update: %s", cl_strerror(ret));
+    fail_unless(!live_scan(engine, "xxTWINONExx"), "removed signature still matches");
+    virname = live_scan(engine, "xxTWINTWOxx");
+    fail_unless_fmt(virname && !strcmp(virname, "Test.Live.Twin.UNOFFICIAL"), "other signature of the name lost: %s", virname);
+
+    fail_unless(!!live_scan(engine, "SPLIT..AAA") && !!live_scan(engine, "SPLIT..BBB"), "split signature missed");
+    ret = cl_engine_update(engine, "live.ndb", NULL, splitsig, CL_DB_STDOPT);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_update: %s", cl_strerror(ret));
+    fail_unless(!live_scan(engine, "SPLIT..AAA"), "removed signature still matches");
+    fail_unless(!!live_scan(engine, "SPLIT..BBB"), "split signature with the same first part lost");
+
+    fail_unless(!!live_scan(engine, "LSIGAAA") && !!live_scan(engine, "LSIGBBB"), "lsig missed");
+    ret = cl_engine_update(engine, "live.ldb", NULL, lsig, CL_DB_STDOPT);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_update: %s", cl_strerror(ret));
+    fail_unless(!live_scan(engine, "LSIGAAA"), "removed lsig still matches");
+    fail_unless(!!live_scan(engine, "LSIGBBB"), "other lsig of the name lost");
+
+    ret = cl_engine_update(engine, "live.hdb", "b2feb339b1ded53e7edb05c42788ac32:12:Test.Live.Hash\n", NULL, CL_DB_STDOPT);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_update: %s", cl_strerror(ret));
+    virname = live_scan(engine, "xxLIVEHASHxx");
+    fail_unless_fmt(virname && !strcmp(virname, "Test.Live.Hash.UNOFFICIAL"), "virusname: %s", virname);
+
+    errmsg_expected();
+    fail_unless(cl_engine_update(engine, "live.pdb", "R:example.com\n", NULL, CL_DB_STDOPT) == CL_EARG, "phishing update");
+    errmsg_expected();
+    fail_unless(cl_engine_save(engine, path) == CL_EARG, "cl_engine_save after update");
+
+    cl_engine_free(engine);
+    cli_rmdirs(dir);
+    free(dir);
+}
+END_TEST
+
+static cl_error_t update_during_scan(int fd, int result, const char *virname, void *context)
+{
+    struct cl_engine *engine = context;
+    int ret;
+
+    cl_engine_set_clcb_post_scan(engine, NULL);
+    ret = cl_engine_update(engine, "live.ndb", "Test.Live.During:0:*:445552494e47\n", NULL, CL_DB_STDOPT);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_update: %s", cl_strerror(ret));
+    return CL_CLEAN;
+}
+
+/* a scan still running on the signatures from before cl_engine_update()
+ * doesn't cache its clean result, neither in memory nor in the cache file */
+START_TEST (test_cl_engine_update_during_scan)
+{
+    const char *data = "xxDURINGxx";
+    unsigned long int scanned = 0;
+    const char *virname;
+    struct cl_engine *engine;
+    cl_fmap_t *map;
+    char *path;
+    int clock, ret;
+
+    path = cli_gentemp(NULL);
+    fail_unless(!!path, "cli_gentemp");
+    for (clock = 0; clock < 2; clock++) {
+	engine = cache_test_engine(path, 1, clock, NULL);
+	cl_engine_set_clcb_post_scan(engine, update_during_scan);
+	map = cl_fmap_open_memory(data, strlen(data));
+	fail_unless(!!map, "cl_fmap_open_memory");
+	virname = NULL;
+	ret = cl_scanmap_callback(map, &virname, &scanned, engine, CL_SCAN_STDOPT, engine);
+	fail_unless_fmt(ret == CL_CLEAN, "scan before the update: %s", cl_strerror(ret));
+	cl_fmap_close(map);
+	virname = live_scan(engine, data);
+	fail_unless_fmt(virname && !strcmp(virname, "Test.Live.During.UNOFFICIAL"), "clock %d: virusname: %s", clock, virname);
+	cl_engine_free(engine);
+    }
+    cli_unlink(path);
+    free(path);
+}
+END_TEST
+
+START_TEST (test_cl_engine_get_stats)
+{
+    struct cl_engine *engine;
+    struct cl_stats *stats;
+    unsigned int sigs = 0, i;
+    unsigned long long files = 0;
+    char *dir, path[512];
+    FILE *f;
+
+    if (!inited)
+	fail_unless(cl_init(CL_INIT_DEFAULT) == 0, "cl_init");
+    inited = 1;
+    dir = cli_gentemp(NULL);
+    fail_unless(!!dir, "cli_gentemp");
+    fail_unless(mkdir(dir, 0700) == 0, "mkdir");
+    snprintf(path, sizeof(path), "%s/stats.ndb", dir);
+    f = fopen(path, "w");
+    fail_unless(!!f, "fopen");
+    fputs("Test.Stats:0:*:535441545349470a\n", f);
+    fclose(f);
+
+    engine = cl_engine_new();
+    fail_unless(!!engine, "cl_engine_new");
+    fail_unless(cl_load(dir, engine, &sigs, CL_DB_STDOPT) == 0, "cl_load");
+    fail_unless(cl_engine_compile(engine) == 0, "cl_engine_compile");
+
+    stats = cl_engine_get_stats(engine);
+    fail_unless(!!stats, "cl_engine_get_stats");
+    fail_unless(!stats->scans && !stats->ntypes, "statistics before scanning");
+    cl_engine_stats_free(stats);
+
+    fail_unless(!live_scan(engine, "clean text file\n"), "false positive");
+    fail_unless(!live_scan(engine, "clean text file\n"), "false positive");
+    fail_unless(!!live_scan(engine, "STATSIG\n"), "signature missed");
+
+    stats = cl_engine_get_stats(engine);
+    fail_unless(!!stats, "cl_engine_get_stats");
+    fail_unless_fmt(stats->scans == 3, "%llu scans", stats->scans);
+    fail_unless_fmt(stats->cache_hits == 1 && stats->cache_misses == 2, "cache: %llu hits, %llu misses", stats->cache_hits, stats->cache_misses);
+    fail_unless_fmt(stats->depth[0] == 3, "%llu files at level 0", stats->depth[0]);
+    for (i = 0; i < stats->ntypes; i++) {
+	fail_unless(!!stats->types[i].type, "type name");
+	files += stats->types[i].files;
+    }
+    fail_unless_fmt(files == 3, "%llu files in the types", files);
+    cl_engine_stats_free(stats);
+
+    cl_engine_free(engine);
+    cli_rmdirs(dir);
+    free(dir);
+}
+END_TEST
+
+#ifdef CL_THREAD_SAFE
+#define FMAP_THREADS 4
+#define FMAP_THREADS_SIZE (12*1024*1024) /* enough to start the aging */
+
+static off_t fmap_threads_pread(void *handle, void *buf, size_t count, off_t offset)
+{
+    return pread(*((int*)handle), buf, count, offset);
+}
+
+static void *fmap_threads_read(void *arg)
+{
+    int fd = *(int *)arg;
+    const unsigned char *p;
+    cl_fmap_t *map;
+    size_t at, i;
+    unsigned int pass;
+
+    map = cl_fmap_open_handle(&fd, 0, FMAP_THREADS_SIZE, fmap_threads_pread, 1);
+    if (!map)
+	return "cl_fmap_open_handle";
+    /* the second pass pages in again what the aging dropped */
+    for (pass = 0; pass < 2; pass++) {
+	for (at = 0; at < FMAP_THREADS_SIZE; at += 65536) {
+	    if (!(p = fmap_need_off_once(map, at, 65536))) {
+		funmap(map);
+		return "fmap_need_off_once";
+	    }
+	    for (i = 0; i < 65536; i += 4096) {
+		if (p[i] != (unsigned char)((at + i) >> 12)) {
+		    funmap(map);
+		    return "bad data";
+		}
+	    }
+	}
+    }
+    funmap(map);
+    return NULL;
+}
+
+/* threads paging in their own maps at the same time see their own data */
+START_TEST (test_fmap_threads)
+{
+    pthread_t threads[FMAP_THREADS];
+    unsigned char page[4096];
+    void *err;
+    char *path;
+    size_t at;
+    unsigned int i;
+    int fd;
+
+    path = cli_gentemp(NULL);
+    fail_unless(!!path, "cli_gentemp");
+    fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0600);
+    fail_unless(fd != -1, "open");
+    for (at = 0; at < FMAP_THREADS_SIZE; at += sizeof(page)) {
+	memset(page, at >> 12, sizeof(page));
+	fail_unless(cli_writen(fd, page, sizeof(page)) == sizeof(page), "cli_writen");
+    }
+
+    for (i = 0; i < FMAP_THREADS; i++)
+	fail_unless(!pthread_create(&threads[i], NULL, fmap_threads_read, &fd), "pthread_create");
+    for (i = 0; i < FMAP_THREADS; i++) {
+	pthread_join(threads[i], &err);
+	fail_unless_fmt(!err, "thread %u: %s", i, (const char *)err);
+    }
+
+    close(fd);
+    cli_unlink(path);
+    free(path);
+}
+END_TEST
+#endif
+
+#define FMAP_SEQ_SIZE (12*1024*1024) /* enough to start the aging */
+#define FMAP_SEQ_OVERLAP 64 /* stands for the maxpatlen of the scan */
+
+/* Walks the map as cli_fmap_scandesc() does, with header and lookahead
+ * reads in between, and checks the state fmap_sequential() keeps */
+static void fmap_seq_walk(fmap_t *map, unsigned int pass)
+{
+    uint32_t s, *bitmap = &map->placeholder_for_bitmap;
+    size_t offset = 0, bytes = 0, end, i, last_ra = 0;
+    unsigned int n = 0, topups = 0, page, dropped = 0;
+    const unsigned char *p;
+
+    while (offset < map->len) {
+	bytes = MIN(map->len - offset, SCANBUFF);
+	p = fmap_need_off_once(map, offset, bytes);
+	fail_unless_fmt(!!p, "pass %u: fmap_need_off_once at %lu", pass, (unsigned long)offset);
+	for (i = 0; i < bytes; i += 4096)
+	    fail_unless_fmt(p[i] == (unsigned char)((offset + i) >> 12), "pass %u: bad data at %lu", pass, (unsigned long)(offset + i));
+	end = offset + bytes;
+	n++;
+	if (n == 1)
+	    fail_unless_fmt(map->seq_page == 0, "pass %u: no reset at offset 0", pass);
+	fail_unless_fmt(map->seq == n && map->seq_at == offset && map->seq_end == end, "pass %u: need %u at %lu not sequential (%u)", pass, n, (unsigned long)offset, map->seq);
+
+	/* the needs out of the walk are ignored */
+	fail_unless(!!fmap_need_off_once(map, 0x3c, 4), "fmap_need_off_once header");
+	if (end + 3 * 4096 + 16 <= map->len)
+	    fail_unless(!!fmap_need_off_once(map, end + 3 * 4096, 16), "fmap_need_off_once lookahead");
+	fail_unless_fmt(map->seq == n && map->seq_at == offset && map->seq_end == end, "pass %u: need %u at %lu lost after the other needs", pass, n, (unsigned long)offset);
+
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	/* the readahead window is topped up half a window at a time */
+	if (n < SEQ_MIN) {
+	    fail_unless_fmt(!map->ra_end, "pass %u: readahead before the access is sequential", pass);
+	} else {
+	    fail_unless_fmt(map->ra_end >= MIN(end + SEQ_READAHEAD / 2, map->real_len) && map->ra_end <= MIN(end + SEQ_READAHEAD, map->real_len),
+			    "pass %u: readahead to %lu at %lu", pass, (unsigned long)map->ra_end, (unsigned long)end);
+	    if (map->ra_end != last_ra)
+		topups++;
+	    last_ra = map->ra_end;
+	}
+#endif
+
+	/* the unlocked pages left behind are at age 0 or already dropped */
+	if (map->aging && n >= SEQ_MIN) {
+	    page = offset / map->pgsz;
+	    fail_unless_fmt(map->seq_page == page, "pass %u: seq_page %u at page %u", pass, map->seq_page, page);
+	    for (i = 1; i < page; i++) {
+		s = bitmap[i];
+		fail_unless_fmt(s == FM_MASK_PAGED || s == FM_MASK_SEEN, "pass %u: page %lu behind the scan in state %08x", pass, (unsigned long)i, s);
+	    }
+	}
+
+	if (bytes < SCANBUFF)
+	    break;
+	offset += bytes - FMAP_SEQ_OVERLAP;
+    }
+    fail_unless_fmt(offset + bytes == map->len, "pass %u: walk ended at %lu", pass, (unsigned long)(offset + bytes));
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+    fail_unless_fmt(topups && topups < n / 2, "pass %u: %u readahead top-ups for %u needs", pass, topups, n);
+#endif
+
+    /* the consumed pages go first, the header page read all along stays */
+    if (map->aging) {
+	for (i = 1; i < map->pages; i++)
+	    if (bitmap[i] == FM_MASK_SEEN)
+		dropped++;
+	fail_unless_fmt(dropped, "pass %u: no page dropped", pass);
+	fail_unless_fmt((bitmap[0] & FM_MASK_PAGED) && (bitmap[0] & FM_MASK_COUNT), "pass %u: header page aged out (%08x)", pass, bitmap[0]);
+    }
+}
+
+START_TEST (test_fmap_sequential)
+{
+    unsigned char page[4096];
+    fmap_t *map;
+    char *path;
+    size_t at;
+    int fd;
+
+    path = cli_gentemp(NULL);
+    fail_unless(!!path, "cli_gentemp");
+    fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0600);
+    fail_unless(fd != -1, "open");
+    for (at = 0; at < FMAP_SEQ_SIZE; at += sizeof(page)) {
+	memset(page, at >> 12, sizeof(page));
+	fail_unless(cli_writen(fd, page, sizeof(page)) == sizeof(page), "cli_writen");
+    }
+
+    map = fmap(fd, 0, FMAP_SEQ_SIZE);
+    fail_unless(!!map, "fmap");
+    fail_unless(map->handle_is_fd, "not a handle map");
+    /* the second pass starts over at offset 0 and reads back the
+     * pages the aging dropped */
+    fmap_seq_walk(map, 1);
+    fmap_seq_walk(map, 2);
+    funmap(map);
+
+    close(fd);
+    cli_unlink(path);
+    free(path);
+}
+END_TEST
+
+#define GB ((size_t)1 << 30)
+#define HUGE_SIZE (4 * GB + GB / 2 + 4096)
+
+/* a ZIP entry, deflated so that the signature is only found inside */
+static const char huge_zip[] =
+    "\x50\x4b\x03\x04\x14\x00\x00\x00\x08\x00\x00\x00\x00\x00\xbf\x11\x5a\xb8"
+    "\x14\x00\x00\x00\x3c\x00\x00\x00\x05\x00\x00\x00\x68\x2e\x74\x78\x74\xab"
+    "\xa8\xf0\x08\x75\x77\x8d\xf2\x0c\x08\x70\x75\xa9\xa8\xe0\xaa\x20\x85\x0b"
+    "\x00";
+
+struct huge_part {
+    size_t offset;
+    const char *data;
+    size_t len;
+};
+
+/* zeros with the parts laid in, the list ends with a NULL data */
+static off_t huge_pread(void *handle, void *buf, size_t count, off_t offset)
+{
+    const struct huge_part *part;
+    size_t start, end;
+
+    memset(buf, 0, count);
+    for (part = handle; part->data; part++) {
+	start = MAX(part->offset, (size_t)offset);
+	end = MIN(part->offset + part->len, (size_t)offset + count);
+	if (start < end)
+	    memcpy((char *)buf + start - offset, part->data + start - part->offset, end - start);
+    }
+    return count;
+}
+
+static const char *huge_scan(struct cl_engine *engine, const struct huge_part *parts)
+{
+    unsigned long int scanned = 0;
+    const char *virname = NULL;
+    cl_fmap_t *map;
+    int ret;
+
+    map = cl_fmap_open_handle((void *)parts, 0, HUGE_SIZE, huge_pread, 1);
+    fail_unless(!!map, "cl_fmap_open_handle");
+    ret = cl_scanmap_callback(map, &virname, &scanned, engine, CL_SCAN_STDOPT, NULL);
+    fail_unless_fmt(ret == CL_VIRUS || ret == CL_CLEAN, "cl_scanmap_callback: %s", cl_strerror(ret));
+    cl_fmap_close(map);
+    return ret == CL_VIRUS ? virname : NULL;
+}
+
+/* in files of 4 GB or more the matchers see folded offsets (scan_offset()):
+ * the parts of a signature a gigabyte apart must not pair up, while the
+ * signatures and the embedded archives past 4 GB are still found where
+ * they are */
+START_TEST (test_cl_scan_huge)
+{
+    const char *ndb = "Test.Huge.Pair:0:*:485547454f4e45{-64}4855474554574f\n"
+	"Test.Huge.Zip:0:*:485547455a4950504544\n";
+    /* folded one gigabyte apart these would be 16 bytes apart */
+    const struct huge_part apart[] = {
+	{ 2 * GB + GB / 2, "HUGEONE", 7 },
+	{ 3 * GB + GB / 2 + 16, "HUGETWO", 7 },
+	{ 4 * GB + GB / 2, huge_zip, sizeof(huge_zip) - 1 },
+	{ 0, NULL, 0 }
+    };
+    const struct huge_part pair[] = {
+	{ 4 * GB + GB / 4, "HUGEONE", 7 },
+	{ 4 * GB + GB / 4 + 32, "HUGETWO", 7 },
+	{ 0, NULL, 0 }
+    };
+    struct cl_engine *engine;
+    unsigned int sigs = 0;
+    const char *virname;
+    char *dir, path[512];
+    FILE *f;
+
+    if (sizeof(size_t) < 8)
+	return;
+    if (!inited)
+	fail_unless(cl_init(CL_INIT_DEFAULT) == 0, "cl_init");
+    inited = 1;
+    dir = cli_gentemp(NULL);
+    fail_unless(!!dir, "cli_gentemp");
+    fail_unless(mkdir(dir, 0700) == 0, "mkdir");
+    snprintf(path, sizeof(path), "%s/huge.ndb", dir);
+    f = fopen(path, "w");
+    fail_unless(!!f, "fopen");
+    fputs(ndb, f);
+    fclose(f);
+    engine = cl_engine_new();
+    fail_unless(!!engine, "cl_engine_new");
+    fail_unless(cl_load(path, engine, &sigs, CL_DB_STDOPT) == 0, "cl_load");
+    fail_unless(cl_engine_set_num(engine, CL_ENGINE_MAX_FILESIZE, 2 * HUGE_SIZE) == CL_SUCCESS, "cl_engine_set_num");
+    fail_unless(cl_engine_set_num(engine, CL_ENGINE_MAX_SCANSIZE, 2 * HUGE_SIZE) == CL_SUCCESS, "cl_engine_set_num");
+    /* no need to hash the data for the cache */
+    fail_unless(cl_engine_set_num(engine, CL_ENGINE_DISABLE_CACHE, 1) == CL_SUCCESS, "cl_engine_set_num");
+    fail_unless(cl_engine_compile(engine) == 0, "cl_engine_compile");
+
+    virname = huge_scan(engine, apart);
+    fail_unless_fmt(virname && !strcmp(virname, "Test.Huge.Zip.UNOFFICIAL"), "virusname: %s", virname);
+    virname = huge_scan(engine, pair);
+    fail_unless_fmt(virname && !strcmp(virname, "Test.Huge.Pair.UNOFFICIAL"), "virusname: %s", virname);
+
+    cl_engine_free(engine);
+    cli_rmdirs(dir);
+    free(dir);
+}
+END_TEST
+
 #ifdef CHECK_HAVE_LOOPS
 
 static off_t pread_cb(void *handle, void *buf, size_t count, off_t offset)
@@ -590,6 +1429,282 @@ START_TEST (test_cl_scanmap_callback_mem_allscan)
     munmap(mem, size);
 }
 END_TEST
+
+START_TEST (test_cl_scan_batch)
+{
+    static const char clean[] = "just some clean data";
+    struct cl_scan_item items[4];
+    struct cl_scanctx *sctx;
+    unsigned long int scanned = 0;
+    void *mem;
+    unsigned long size;
+    char file[256];
+    int ret, i;
+
+    int fd = get_test_file(_i, file, sizeof(file), &size);
+
+    mem = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    fail_unless(mem != MAP_FAILED, "mmap");
+
+    sctx = cl_scanctx_new(g_engine);
+    fail_unless(!!sctx, "cl_scanctx_new");
+
+    /* the state left over by a detection must not leak into the next item */
+    memset(items, 0, sizeof(items));
+    for (i = 0; i < 4; i++) {
+	items[i].data = (i % 2) ? (const void *)clean : mem;
+	items[i].len = (i % 2) ? sizeof(clean) - 1 : size;
+    }
+    cli_dbgmsg("scanning (batch) %s\n", file);
+    ret = cl_scan_batch(sctx, items, 4, &scanned, CL_SCAN_STDOPT);
+    cli_dbgmsg("scan end (batch) %s\n", file);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_scan_batch: %s", cl_strerror(ret));
+    for (i = 1; i < 4; i += 2)
+	fail_unless_fmt(items[i].result == CL_CLEAN, "cl_scan_batch item %d: %s", i, cl_strerror(items[i].result));
+    if (!FALSE_NEGATIVE) {
+	for (i = 0; i < 4; i += 2) {
+	    fail_unless_fmt(items[i].result == CL_VIRUS, "cl_scan_batch failed for %s: %s", file, cl_strerror(items[i].result));
+	    fail_unless_fmt(items[i].virname && !strcmp(items[i].virname, "ClamAV-Test-File.UNOFFICIAL"), "virusname: %s for %s", items[i].virname, file);
+	}
+    }
+
+    cl_scanctx_free(sctx);
+    close(fd);
+    munmap(mem, size);
+}
+END_TEST
+
+/* an engine loaded from a snapshot of g_engine detects the same */
+START_TEST (test_cl_engine_snapshot)
+{
+    struct cl_engine *engine;
+    const char *virname = NULL;
+    unsigned long int scanned = 0;
+    unsigned long size;
+    unsigned int sigs = 0;
+    char file[256], *path;
+    int ret, fd;
+
+    path = cli_gentemp(NULL);
+    fail_unless(!!path, "cli_gentemp");
+    ret = cl_engine_save(g_engine, path);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_save: %s", cl_strerror(ret));
+
+    engine = cl_engine_new();
+    fail_unless(!!engine, "cl_engine_new");
+    errmsg_expected();
+    fail_unless(cl_engine_load_snapshot(engine, path, &sigs, CL_DB_STDOPT | CL_DB_PUA) == CL_EARG, "snapshot loaded with different dboptions");
+    cl_engine_free(engine);
+
+    engine = cl_engine_new();
+    fail_unless(!!engine, "cl_engine_new");
+    ret = cl_engine_load_snapshot(engine, path, &sigs, CL_DB_STDOPT);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_load_snapshot: %s", cl_strerror(ret));
+    fail_unless(sigs == 1, "sigs");
+    errmsg_expected();
+    fail_unless(cl_engine_load_snapshot(engine, path, &sigs, CL_DB_STDOPT) == CL_EARG, "snapshot loaded into a compiled engine");
+
+    fd = get_test_file(_i, file, sizeof(file), &size);
+    ret = cl_scandesc(fd, &virname, &scanned, engine, CL_SCAN_STDOPT);
+    if (!FALSE_NEGATIVE) {
+	fail_unless_fmt(ret == CL_VIRUS, "cl_scandesc failed for %s: %s", file, cl_strerror(ret));
+	fail_unless_fmt(virname && !strcmp(virname, "ClamAV-Test-File.UNOFFICIAL"), "virusname: %s", virname);
+    }
+    close(fd);
+
+    cl_engine_free(engine);
+    cli_unlink(path);
+    free(path);
+}
+END_TEST
+
+static void snapshot_write_db(const char *path, const char *sig)
+{
+    FILE *f = fopen(path, "w");
+
+    fail_unless(!!f, "fopen");
+    fputs(sig, f);
+    fclose(f);
+}
+
+/* a snapshot is only up to date with the databases it was saved from */
+START_TEST (test_cl_snapshot_check)
+{
+    struct cl_engine *engine;
+    unsigned int sigs = 0;
+    char *dir, *path, db[512];
+    const char *dbpaths[2];
+    int ret;
+
+    if (!inited)
+	fail_unless(cl_init(CL_INIT_DEFAULT) == 0, "cl_init");
+    inited = 1;
+    dir = cli_gentemp(NULL);
+    fail_unless(!!dir, "cli_gentemp");
+    fail_unless(mkdir(dir, 0700) == 0, "mkdir");
+    snprintf(db, sizeof(db), "%s/a.ndb", dir);
+    snapshot_write_db(db, "Test.Snapshot.1:0:*:534e415053484f54\n");
+    path = cli_gentemp(NULL);
+    fail_unless(!!path, "cli_gentemp");
+
+    engine = cl_engine_new();
+    fail_unless(!!engine, "cl_engine_new");
+    fail_unless(cl_load(dir, engine, &sigs, CL_DB_STDOPT) == 0, "cl_load");
+    fail_unless(cl_engine_compile(engine) == 0, "cl_engine_compile");
+    ret = cl_engine_save(engine, path);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_save: %s", cl_strerror(ret));
+    cl_engine_free(engine);
+
+    dbpaths[0] = dir;
+    dbpaths[1] = db;
+    ret = cl_snapshot_check(path, dbpaths, 1);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_snapshot_check: %s", cl_strerror(ret));
+    fail_unless(cl_snapshot_check(path, dbpaths, 2) == CL_EARG, "snapshot of other databases");
+    fail_unless(cl_snapshot_check(path, dbpaths + 1, 1) == CL_EARG, "snapshot of other databases");
+    fail_unless(cl_snapshot_check(path, NULL, 0) == CL_EARG, "snapshot of other databases");
+
+    engine = cl_engine_new();
+    fail_unless(!!engine, "cl_engine_new");
+    ret = cl_engine_load_snapshot(engine, path, &sigs, CL_DB_STDOPT);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_load_snapshot: %s", cl_strerror(ret));
+    cl_engine_free(engine);
+
+    /* likely within the same second, the size tells */
+    snapshot_write_db(db, "Test.Snapshot.2:0:*:534e415053484f5421\n");
+    fail_unless(cl_snapshot_check(path, dbpaths, 1) == CL_EARG, "changed database not noticed");
+    engine = cl_engine_new();
+    fail_unless(!!engine, "cl_engine_new");
+    errmsg_expected();
+    fail_unless(cl_engine_load_snapshot(engine, path, &sigs, CL_DB_STDOPT) == CL_EARG, "snapshot of changed databases loaded");
+    cl_engine_free(engine);
+
+    cli_unlink(db);
+    fail_unless(cl_snapshot_check(path, dbpaths, 1) == CL_EARG, "removed database not noticed");
+
+    cli_unlink(path);
+    free(path);
+    cli_rmdirs(dir);
+    free(dir);
+}
+END_TEST
+
+/* the bytecode, phishing, container and certificate signatures left out of
+ * a snapshot are parsed again when it's loaded */
+START_TEST (test_cl_snapshot_side)
+{
+    struct cl_engine *engine, *snap;
+    const char *virname = NULL, *srcdir = getenv("srcdir");
+    unsigned long int scanned = 0;
+    unsigned int sigs = 0, snapsigs = 0;
+    char *dir, *path, db[512], cvd[512];
+    int ret, fd;
+
+    if (!inited)
+	fail_unless(cl_init(CL_INIT_DEFAULT) == 0, "cl_init");
+    inited = 1;
+    if (!srcdir)
+	srcdir = SRCDIR;
+    snprintf(cvd, sizeof(cvd), "%s/input/bytecode.cvd", srcdir);
+    dir = cli_gentemp(NULL);
+    fail_unless(!!dir, "cli_gentemp");
+    fail_unless(mkdir(dir, 0700) == 0, "mkdir");
+    snprintf(db, sizeof(db), "%s/a.ndb", dir);
+    snapshot_write_db(db, "Test.Snapshot.1:0:*:534e415053484f54\n");
+    snprintf(db, sizeof(db), "%s/a.cdb", dir);
+    snapshot_write_db(db, "Test.Snapshot.Cdb:CL_TYPE_ZIP:*:clam\\.exe:*:*:*:*:*:*\n");
+    snprintf(db, sizeof(db), "%s/a.pdb", dir);
+    snapshot_write_db(db, "H:example.com\n");
+    snprintf(db, sizeof(db), "%s/a.crb", dir);
+    snapshot_write_db(db, "Test.Snapshot.Crt;1;00112233445566778899aabbccddeeff00112233;;c0ffee00c0ffee00c0ffee00c0ffee01;010001;1;0;1;0;Test\n");
+    path = cli_gentemp(NULL);
+    fail_unless(!!path, "cli_gentemp");
+
+    engine = cl_engine_new();
+    fail_unless(!!engine, "cl_engine_new");
+    fail_unless(cl_load(dir, engine, &sigs, CL_DB_STDOPT) == 0, "cl_load");
+    fail_unless(cl_load(cvd, engine, &sigs, CL_DB_STDOPT) == 0, "cl_load");
+    fail_unless(cl_engine_compile(engine) == 0, "cl_engine_compile");
+    ret = cl_engine_save(engine, path);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_save: %s", cl_strerror(ret));
+
+    snap = cl_engine_new();
+    fail_unless(!!snap, "cl_engine_new");
+    ret = cl_engine_load_snapshot(snap, path, &snapsigs, CL_DB_STDOPT);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_load_snapshot: %s", cl_strerror(ret));
+    fail_unless_fmt(snapsigs == sigs, "sigs: %u, loaded %u", snapsigs, sigs);
+    fail_unless_fmt(snap->bcs.count == engine->bcs.count && snap->bcs.count, "bytecodes: %u, loaded %u", snap->bcs.count, engine->bcs.count);
+    fail_unless(snap->cdb && snap->domainlist_matcher, "container and phishing signatures");
+    fail_unless_fmt(snap->cmgr.items == engine->cmgr.items && snap->cmgr.items, "certificates: %u, loaded %u", snap->cmgr.items, engine->cmgr.items);
+
+    fd = open(OBJDIR"/../test/clam.zip", O_RDONLY);
+    fail_unless(fd >= 0, "open clam.zip");
+    ret = cl_scandesc(fd, &virname, &scanned, snap, CL_SCAN_STDOPT);
+    fail_unless_fmt(ret == CL_VIRUS, "cl_scandesc: %s", cl_strerror(ret));
+    fail_unless_fmt(virname && !strcmp(virname, "Test.Snapshot.Cdb.UNOFFICIAL"), "virusname: %s", virname);
+    close(fd);
+    cl_engine_free(snap);
+    cl_engine_free(engine);
+
+    /* what's parsed again must be what the snapshot was saved from */
+    snapshot_write_db(db, "Test.Snapshot.Crt2;1;00112233445566778899aabbccddeeff00112233;;c0ffee00c0ffee00c0ffee00c0ffee01;010001;1;0;1;0;Test\n");
+    snap = cl_engine_new();
+    fail_unless(!!snap, "cl_engine_new");
+    errmsg_expected();
+    fail_unless(cl_engine_load_snapshot(snap, path, &snapsigs, CL_DB_STDOPT) == CL_EARG, "snapshot of changed databases loaded");
+    cl_engine_free(snap);
+
+    cli_unlink(path);
+    free(path);
+    cli_rmdirs(dir);
+    free(dir);
+}
+END_TEST
+
+#ifdef HAVE_SHM_OPEN
+/* an engine attached to a shared g_engine detects the same */
+START_TEST (test_cl_engine_share)
+{
+    struct cl_engine *engine;
+    const char *virname = NULL;
+    unsigned long int scanned = 0;
+    unsigned long size;
+    unsigned int sigs = 0;
+    char file[256], name[64];
+    int ret, fd;
+
+    snprintf(name, sizeof(name), "/clamav-check-%u", (unsigned int) getpid());
+    engine = cl_engine_new();
+    fail_unless(!!engine, "cl_engine_new");
+    fail_unless(cl_engine_attach(engine, name, &sigs, CL_DB_STDOPT) == CL_EOPEN, "attached to a missing object");
+
+    /* left by a publisher that died before writing the snapshot */
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    fail_unless(fd >= 0, "shm_open");
+    close(fd);
+    ret = cl_engine_share(g_engine, name);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_share: %s", cl_strerror(ret));
+    errmsg_expected();
+    fail_unless(cl_engine_share(g_engine, name) == CL_ECREAT, "object shared twice");
+
+    ret = cl_engine_attach(engine, name, &sigs, CL_DB_STDOPT);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_attach: %s", cl_strerror(ret));
+    fail_unless(sigs == 1, "sigs");
+    ret = cl_engine_unshare(name);
+    fail_unless_fmt(ret == CL_SUCCESS, "cl_engine_unshare: %s", cl_strerror(ret));
+
+    /* the mapping outlives the object */
+    fd = get_test_file(_i, file, sizeof(file), &size);
+    ret = cl_scandesc(fd, &virname, &scanned, engine, CL_SCAN_STDOPT);
+    if (!FALSE_NEGATIVE) {
+	fail_unless_fmt(ret == CL_VIRUS, "cl_scandesc failed for %s: %s", file, cl_strerror(ret));
+	fail_unless_fmt(virname && !strcmp(virname, "ClamAV-Test-File.UNOFFICIAL"), "virusname: %s", virname);
+    }
+    close(fd);
+
+    cl_engine_free(engine);
+}
+END_TEST
+#endif
 #endif
 
 static Suite *test_cl_suite(void)
@@ -597,6 +1712,7 @@ static Suite *test_cl_suite(void)
     Suite *s = suite_create("cl_api");
     TCase *tc_cl = tcase_create("cl_dup");
     TCase *tc_cl_scan = tcase_create("cl_scan");
+    TCase *tc_cl_huge = tcase_create("cl_huge");
     int expect = expected_testfiles;
     suite_add_tcase (s, tc_cl);
     tcase_add_test(tc_cl, test_cl_free);
@@ -616,6 +1732,24 @@ static Suite *test_cl_suite(void)
     tcase_add_test(tc_cl, test_cl_statchkdir);
     tcase_add_test(tc_cl, test_cl_settempdir);
     tcase_add_test(tc_cl, test_cl_strerror);
+    tcase_add_test(tc_cl, test_cl_engine_cache_file);
+    tcase_add_test(tc_cl, test_cl_engine_cache_clock);
+    tcase_add_test(tc_cl, test_cl_load_threads);
+    tcase_add_test(tc_cl, test_cli_scanstream);
+    tcase_add_test(tc_cl, test_cl_engine_update);
+    tcase_add_test(tc_cl, test_cl_engine_update_during_scan);
+    tcase_add_test(tc_cl, test_cl_engine_get_stats);
+    tcase_add_test(tc_cl, test_cl_snapshot_check);
+    tcase_add_test(tc_cl, test_cl_snapshot_side);
+    tcase_add_test(tc_cl, test_fmap_sequential);
+#ifdef CL_THREAD_SAFE
+    tcase_add_test(tc_cl, test_fmap_threads);
+#endif
+
+    suite_add_tcase(s, tc_cl_huge);
+    tcase_add_test(tc_cl_huge, test_cl_scan_huge);
+    /* two scans of 4.5 GB */
+    tcase_set_timeout(tc_cl_huge, 300);
 
     suite_add_tcase(s, tc_cl_scan);
     tcase_add_checked_fixture (tc_cl_scan, engine_setup, engine_teardown);
@@ -634,6 +1768,11 @@ static Suite *test_cl_suite(void)
     tcase_add_loop_test(tc_cl_scan, test_cl_scanmap_callback_handle_allscan, 0, expect);
     tcase_add_loop_test(tc_cl_scan, test_cl_scanmap_callback_mem, 0, expect);
     tcase_add_loop_test(tc_cl_scan, test_cl_scanmap_callback_mem_allscan, 0, expect);
+    tcase_add_loop_test(tc_cl_scan, test_cl_scan_batch, 0, expect);
+    tcase_add_loop_test(tc_cl_scan, test_cl_engine_snapshot, 0, expect);
+#ifdef HAVE_SHM_OPEN
+    tcase_add_loop_test(tc_cl_scan, test_cl_engine_share, 0, expect);
+#endif
 #endif
     return s;
 }
@@ -815,6 +1954,94 @@ START_TEST (test_sha256)
 }
 END_TEST
 
+static uint8_t resmd5[3][16] = {
+  { 0x90, 0x01, 0x50, 0x98, 0x3c, 0xd2, 0x4f, 0xb0, 0xd6, 0x96, 0x3f, 0x7d,
+    0x28, 0xe1, 0x7f, 0x72 },
+  { 0x82, 0x15, 0xef, 0x07, 0x96, 0xa2, 0x0b, 0xca, 0xaa, 0xe1, 0x16, 0xd3,
+    0x87, 0x6c, 0x66, 0x4a },
+  { 0x77, 0x07, 0xd6, 0xae, 0x4e, 0x02, 0x7c, 0x70, 0xee, 0xa2, 0xa9, 0x35,
+    0xc2, 0x29, 0x6f, 0x21 }
+};
+
+static uint8_t res1[3][SHA1_HASH_SIZE] = {
+  { 0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e, 0x25, 0x71,
+    0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d },
+  { 0x84, 0x98, 0x3e, 0x44, 0x1c, 0x3b, 0xd2, 0x6e, 0xba, 0xae, 0x4a, 0xa1,
+    0xf9, 0x51, 0x29, 0xe5, 0xe5, 0x46, 0x70, 0xf1 },
+  { 0x34, 0xaa, 0x97, 0x3c, 0xd4, 0xc4, 0xda, 0xa4, 0xf6, 0x1e, 0xeb, 0x2b,
+    0xdb, 0xad, 0x27, 0x31, 0x65, 0x34, 0x01, 0x6f }
+};
+
+/* update sizes that straddle the 64 byte blocks and the multihash slices */
+static const size_t hash_splits[] = { 1, 3, 63, 64, 65, 127, 4095, 4097, 8191, 55, 56, 57 };
+
+/* _i == 0: the C code only, _i == 1: SHA-NI when the CPU has it */
+START_TEST (test_multihash)
+{
+    struct cli_multihash mh;
+    struct cli_digests digests;
+    SHA1Context sha1;
+    SHA256_CTX sha256;
+    uint8_t hsha1[SHA1_HASH_SIZE], hsha256[SHA256_HASH_SIZE];
+    const uint8_t *data[3];
+    size_t len[3], at, n;
+    unsigned int i, j, k, shani;
+    uint8_t *buf;
+
+    buf = malloc(1000000);
+    fail_unless(!!buf, "malloc");
+    memset(buf, 0x61, 1000000);
+    data[0] = tv1; len[0] = sizeof(tv1);
+    data[1] = tv2; len[1] = sizeof(tv2);
+    data[2] = buf; len[2] = 1000000;
+
+    shani = SHA1UseSHANI(_i);
+    fail_unless(sha256_use_shani(_i) == shani, "SHA-NI usable for one of SHA1/SHA256 only");
+    if(_i && !shani)
+	cli_dbgmsg("test_multihash: no SHA-NI, the C code is tested twice\n");
+
+    for(i = 0; i < 3; i++) {
+	/* k == 0 feeds the whole vector at once */
+	for(k = 0; k <= sizeof(hash_splits) / sizeof(hash_splits[0]); k++) {
+	    memset(&digests, 0, sizeof(digests));
+	    cli_multihash_init(&mh, CLI_DIGEST(CLI_HASH_MD5) | CLI_DIGEST(CLI_HASH_SHA1) | CLI_DIGEST(CLI_HASH_SHA256));
+	    SHA1Init(&sha1);
+	    sha256_init(&sha256);
+	    for(at = 0, j = k; at < len[i]; at += n, j++) {
+		n = k ? hash_splits[j % (sizeof(hash_splits) / sizeof(hash_splits[0]))] : len[i];
+		if(n > len[i] - at)
+		    n = len[i] - at;
+		cli_multihash_update(&mh, data[i] + at, n);
+		SHA1Update(&sha1, data[i] + at, n);
+		sha256_update(&sha256, data[i] + at, n);
+	    }
+	    cli_multihash_final(&mh, &digests);
+	    SHA1Final(&sha1, hsha1);
+	    sha256_final(&sha256, hsha256);
+
+	    fail_unless_fmt(!memcmp(hsha1, res1[i], sizeof(hsha1)), "sha1 test vector #%u, splits %u failed", i + 1, k);
+	    fail_unless_fmt(!memcmp(hsha256, res256[i], sizeof(hsha256)), "sha256 test vector #%u, splits %u failed", i + 1, k);
+	    fail_unless_fmt(digests.have[CLI_HASH_MD5] && digests.have[CLI_HASH_SHA1] && digests.have[CLI_HASH_SHA256], "multihash digests missing, vector #%u", i + 1);
+	    fail_unless_fmt(!memcmp(digests.digest[CLI_HASH_MD5], resmd5[i], sizeof(resmd5[i])), "multihash md5 test vector #%u, splits %u failed", i + 1, k);
+	    fail_unless_fmt(!memcmp(digests.digest[CLI_HASH_SHA1], res1[i], sizeof(res1[i])), "multihash sha1 test vector #%u, splits %u failed", i + 1, k);
+	    fail_unless_fmt(!memcmp(digests.digest[CLI_HASH_SHA256], res256[i], sizeof(res256[i])), "multihash sha256 test vector #%u, splits %u failed", i + 1, k);
+	}
+    }
+
+    /* only the wanted digests are computed */
+    memset(&digests, 0, sizeof(digests));
+    cli_multihash_init(&mh, CLI_DIGEST(CLI_HASH_SHA256));
+    cli_multihash_update(&mh, tv2, sizeof(tv2));
+    cli_multihash_final(&mh, &digests);
+    fail_unless(!digests.have[CLI_HASH_MD5] && !digests.have[CLI_HASH_SHA1] && digests.have[CLI_HASH_SHA256], "multihash computed unwanted digests");
+    fail_unless(!memcmp(digests.digest[CLI_HASH_SHA256], res256[1], sizeof(res256[1])), "multihash sha256 alone failed");
+
+    SHA1UseSHANI(1);
+    sha256_use_shani(1);
+    free(buf);
+}
+END_TEST
+
 static Suite *test_cli_suite(void)
 {
     Suite *s = suite_create("cli");
@@ -830,6 +2057,7 @@ static Suite *test_cli_suite(void)
     suite_add_tcase (s, tc_cli_dsig);
     tcase_add_loop_test(tc_cli_dsig, test_cli_dsig, 0, dsig_tests_cnt);
     tcase_add_test(tc_cli_dsig, test_sha256);
+    tcase_add_loop_test(tc_cli_dsig, test_multihash, 0, 2);
 
     return s;
 }
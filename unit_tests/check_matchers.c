@@ -32,6 +32,8 @@
 #include "../libclamav/matcher-bm.h"
 #include "../libclamav/others.h"
 #include "../libclamav/default.h"
+#include "../libclamav/sigstats.h"
+#include "../libclamav/filtering.h"
 #include "checks.h"
 
 static const struct ac_testdata_s {
@@ -123,6 +125,60 @@ START_TEST (test_ac_scanbuff) {
 }
 END_TEST
 
+START_TEST (test_ac_scanbuff_fused) {
+	struct cli_ac_data gdata, tdata;
+	struct cli_matcher *groot, *troot;
+	unsigned int i;
+	int ret;
+
+    groot = ctx.engine->root[0];
+    fail_unless(groot != NULL, "groot == NULL");
+    groot->ac_only = 1;
+    troot = (struct cli_matcher *) mpool_calloc(ctx.engine->mempool, 1, sizeof(struct cli_matcher));
+    fail_unless(troot != NULL, "troot == NULL");
+    troot->type = 7;
+    troot->ac_only = 1;
+#ifdef USE_MPOOL
+    troot->mempool = ctx.engine->mempool;
+#endif
+    ctx.engine->root[7] = troot;
+
+    ret = cli_ac_init(groot, CLI_DEFAULT_AC_MINDEPTH, CLI_DEFAULT_AC_MAXDEPTH, 1);
+    fail_unless(ret == CL_SUCCESS, "cli_ac_init() failed");
+    ret = cli_ac_init(troot, CLI_DEFAULT_AC_MINDEPTH, CLI_DEFAULT_AC_MAXDEPTH, 1);
+    fail_unless(ret == CL_SUCCESS, "cli_ac_init() failed");
+
+    /* split the signatures between the generic and the target root */
+    for(i = 0; ac_testdata[i].data; i++) {
+	ret = cli_parse_add(i % 2 ? troot : groot, ac_testdata[i].virname, ac_testdata[i].hexsig, 0, 0, "*", 0, NULL, 0);
+	fail_unless(ret == CL_SUCCESS, "cli_parse_add() failed");
+    }
+
+    ret = cli_ac_buildtrie(groot);
+    fail_unless(ret == CL_SUCCESS, "cli_ac_buildtrie() failed");
+    ret = cli_ac_buildtrie(troot);
+    fail_unless(ret == CL_SUCCESS, "cli_ac_buildtrie() failed");
+    ret = cli_ac_fuse(troot, groot);
+    fail_unless(ret == CL_SUCCESS, "cli_ac_fuse() failed");
+    fail_unless(troot->ac_fused != NULL, "troot->ac_fused == NULL");
+    fail_unless(troot->ac_fused->ac_patterns == troot->ac_patterns + groot->ac_patterns, "cli_ac_fuse() lost patterns");
+
+    ret = cli_ac_initdata(&gdata, groot->ac_partsigs, 0, 0, CLI_DEFAULT_AC_TRACKLEN);
+    fail_unless(ret == CL_SUCCESS, "cli_ac_initdata() failed");
+    ret = cli_ac_initdata(&tdata, troot->ac_partsigs, 0, 0, CLI_DEFAULT_AC_TRACKLEN);
+    fail_unless(ret == CL_SUCCESS, "cli_ac_initdata() failed");
+
+    for(i = 0; ac_testdata[i].data; i++) {
+	ret = cli_ac_scanbuff_fused((const unsigned char*)ac_testdata[i].data, strlen(ac_testdata[i].data), &virname, NULL, NULL, troot, &tdata, groot, &gdata, 0, 0, NULL, AC_SCAN_VIR, NULL);
+	fail_unless_fmt(ret == CL_VIRUS, "cli_ac_scanbuff_fused() failed for %s", ac_testdata[i].virname);
+	fail_unless_fmt(!strncmp(virname, ac_testdata[i].virname, strlen(ac_testdata[i].virname)), "Dataset %u matched with %s", i, virname);
+    }
+
+    cli_ac_freedata(&gdata);
+    cli_ac_freedata(&tdata);
+}
+END_TEST
+
 START_TEST (test_bm_scanbuff) {
 	struct cli_matcher *root;
 	const char *virname = NULL;
@@ -151,6 +207,48 @@ START_TEST (test_bm_scanbuff) {
 }
 END_TEST
 
+START_TEST (test_bm_scanbuff_long) {
+	struct cli_matcher *root;
+	const char *virname = NULL;
+	unsigned char buf[64];
+	int ret;
+
+
+    root = ctx.engine->root[0];
+    fail_unless(root != NULL, "root == NULL");
+
+#ifdef USE_MPOOL
+    root->mempool = mpool_create();
+#endif
+    ret = cli_bm_init(root);
+    fail_unless(ret == CL_SUCCESS, "cli_bm_init() failed");
+
+    /* "deadbe" and "deadbeef" share a bm_suffix bucket */
+    ret = cli_parse_add(root, "Sig1", "deadbe", 0, 0, "*", 0, NULL, 0);
+    fail_unless(ret == CL_SUCCESS, "cli_parse_add() failed");
+    ret = cli_parse_add(root, "Sig2", "deadbeef", 0, 0, "*", 0, NULL, 0);
+    fail_unless(ret == CL_SUCCESS, "cli_parse_add() failed");
+    ret = cli_parse_add(root, "Sig3", "babe0123", 0, 0, "*", 0, NULL, 0);
+    fail_unless(ret == CL_SUCCESS, "cli_parse_add() failed");
+
+    memset(buf, 'a', sizeof(buf));
+    ret = cli_bm_scanbuff(buf, sizeof(buf), &virname, NULL, root, 0, NULL, NULL, NULL);
+    fail_unless(ret == CL_CLEAN, "cli_bm_scanbuff() failed");
+
+    memcpy(&buf[21], "\xba\xbe\x01\x23", 4);
+    ret = cli_bm_scanbuff(buf, sizeof(buf), &virname, NULL, root, 0, NULL, NULL, NULL);
+    fail_unless(ret == CL_VIRUS, "cli_bm_scanbuff() failed");
+    fail_unless(!strncmp(virname, "Sig3", 4), "Incorrect signature matched in cli_bm_scanbuff()\n");
+
+    /* the last positions of the buffer */
+    memset(buf, 'a', sizeof(buf));
+    memcpy(&buf[sizeof(buf) - 3], "\xde\xad\xbe", 3);
+    ret = cli_bm_scanbuff(buf, sizeof(buf), &virname, NULL, root, 0, NULL, NULL, NULL);
+    fail_unless(ret == CL_VIRUS, "cli_bm_scanbuff() failed");
+    fail_unless(!strncmp(virname, "Sig1", 4), "Incorrect signature matched in cli_bm_scanbuff()\n");
+}
+END_TEST
+
 START_TEST (test_ac_scanbuff_allscan) {
 	struct cli_ac_data mdata;
 	struct cli_matcher *root;
@@ -227,6 +325,288 @@ START_TEST (test_bm_scanbuff_allscan) {
 }
 END_TEST
 
+static const char *lsig_testdata[] = {
+    "0", "0&1", "0|1", "0&1&2", "0|1&2", "0&1|2", "(0&1)|2", "(0|1)&2",
+    "0>1", "0=0", "0<2", "0=2&1", "(0|1)>1", "(0|1)=0", "(0|1|2)>2,2",
+    "((0|1)&2)|(3&4)", "(0&1)>1|2=0", "(0|(1&2))<3,1", "0&(1|2>1)", "(0|1)>0,2"
+};
+
+START_TEST (test_ac_lsigeval) {
+	struct cli_matcher *root;
+	struct cli_ac_lsig *lsig;
+	unsigned int i, j, k, evalcnt, nlsigs = sizeof(lsig_testdata) / sizeof(lsig_testdata[0]);
+	uint64_t evalids;
+	uint32_t lsigcnt[64];
+	int ret, expected;
+
+    root = ctx.engine->root[0];
+    root->ac_lsigtable = (struct cli_ac_lsig **) mpool_calloc(ctx.engine->mempool, nlsigs, sizeof(struct cli_ac_lsig *));
+    fail_unless(!!root->ac_lsigtable, "ac_lsigtable == NULL");
+    for(i = 0; i < nlsigs; i++) {
+	lsig = (struct cli_ac_lsig *) mpool_calloc(ctx.engine->mempool, 1, sizeof(struct cli_ac_lsig));
+	fail_unless(!!lsig, "lsig == NULL");
+	lsig->logic = (char *) mpool_calloc(ctx.engine->mempool, strlen(lsig_testdata[i]) + 1, 1);
+	fail_unless(!!lsig->logic, "lsig->logic == NULL");
+	strcpy(lsig->logic, lsig_testdata[i]);
+	root->ac_lsigtable[root->ac_lsigs++] = lsig;
+    }
+
+    ret = cli_ac_lsigcompile(root);
+    fail_unless(ret == CL_SUCCESS, "cli_ac_lsigcompile() failed");
+
+    /* every combination of 0-2 hits on subsigs 0-4 */
+    memset(lsigcnt, 0, sizeof(lsigcnt));
+    for(k = 0; k < 243; k++) {
+	for(j = 0, i = k; j < 5; j++, i /= 3)
+	    lsigcnt[j] = i % 3;
+	for(i = 0; i < nlsigs; i++) {
+	    lsig = root->ac_lsigtable[i];
+	    fail_unless_fmt(!!lsig->ops, "%s not compiled", lsig->logic);
+	    evalcnt = 0;
+	    evalids = 0;
+	    expected = cli_ac_chklsig(lsig->logic, lsig->logic + strlen(lsig->logic), lsigcnt, &evalcnt, &evalids, 0);
+	    ret = cli_ac_lsigeval(lsig->ops, lsig->nops, lsigcnt);
+	    fail_unless_fmt(ret == expected, "%s evaluated to %d instead of %d", lsig->logic, ret, expected);
+	    if(!k) {
+		for(j = 0; j < root->ac_lsigalways_num && root->ac_lsigalways[j] != i; j++);
+		fail_unless_fmt((j < root->ac_lsigalways_num) == (expected == 1), "%s in ac_lsigalways: %d", lsig->logic, j < root->ac_lsigalways_num);
+	    }
+	}
+    }
+}
+END_TEST
+
+/* the match state is reused for the next file after cli_ac_resetdata(),
+ * the relative offsets must then follow the new file size */
+START_TEST (test_ac_resetdata) {
+	struct cli_ac_data mdata;
+	struct cli_target_info info;
+	struct cli_matcher *root;
+	char buf[64];
+	int ret;
+
+    root = ctx.engine->root[0];
+    root->ac_only = 1;
+#ifdef USE_MPOOL
+    root->mempool = mpool_create();
+#endif
+    ret = cli_ac_init(root, CLI_DEFAULT_AC_MINDEPTH, CLI_DEFAULT_AC_MAXDEPTH, 1);
+    fail_unless(ret == CL_SUCCESS, "cli_ac_init() failed");
+    ret = cli_parse_add(root, "Test_EOF", "52454c4f4646", 0, 0, "EOF-10", 0, NULL, 0);
+    fail_unless(ret == CL_SUCCESS, "cli_parse_add() failed");
+    ret = cli_ac_buildtrie(root);
+    fail_unless(ret == CL_SUCCESS, "cli_ac_buildtrie() failed");
+    ret = cli_ac_initdata(&mdata, root->ac_partsigs, root->ac_lsigs, root->ac_reloff_num, CLI_DEFAULT_AC_TRACKLEN);
+    fail_unless(ret == CL_SUCCESS, "cli_ac_initdata() failed");
+    memset(&info, 0, sizeof(info));
+
+    /* RELOFF at EOF-10 of a 40 byte file */
+    memset(buf, 'x', sizeof(buf));
+    memcpy(buf + 30, "RELOFF", 6);
+    info.fsize = 40;
+    fail_unless(cli_ac_caloff(root, &mdata, &info) == CL_SUCCESS, "cli_ac_caloff() failed");
+    ret = cli_ac_scanbuff((const unsigned char *) buf, 40, &virname, NULL, NULL, root, &mdata, 0, 0, NULL, AC_SCAN_VIR, NULL);
+    fail_unless_fmt(ret == CL_VIRUS, "first file: %d", ret);
+
+    /* the same data as a 50 byte file, where EOF-10 is at 40 */
+    cli_ac_resetdata(&mdata);
+    info.fsize = 50;
+    fail_unless(cli_ac_caloff(root, &mdata, &info) == CL_SUCCESS, "cli_ac_caloff() failed");
+    ret = cli_ac_scanbuff((const unsigned char *) buf, 50, &virname, NULL, NULL, root, &mdata, 0, 0, NULL, AC_SCAN_VIR, NULL);
+    fail_unless_fmt(ret == CL_CLEAN, "stale offset matched: %d", ret);
+
+    cli_ac_resetdata(&mdata);
+    memset(buf, 'x', sizeof(buf));
+    memcpy(buf + 40, "RELOFF", 6);
+    fail_unless(cli_ac_caloff(root, &mdata, &info) == CL_SUCCESS, "cli_ac_caloff() failed");
+    ret = cli_ac_scanbuff((const unsigned char *) buf, 50, &virname, NULL, NULL, root, &mdata, 0, 0, NULL, AC_SCAN_VIR, NULL);
+    fail_unless_fmt(ret == CL_VIRUS, "second file: %d", ret);
+
+    cli_ac_freedata(&mdata);
+}
+END_TEST
+
+static void hm_testhash(char *hash, unsigned char *digest, unsigned int i)
+{
+    unsigned int j;
+    char *bin;
+
+    for(j = 0; j < 32; j++)
+	hash[j] = "0123456789abcdef"[(((i * 2654435761U) >> ((j % 8) * 4)) & 15) ^ (j / 8)];
+    hash[32] = 0;
+    bin = cli_hex2str(hash);
+    fail_unless(!!bin, "cli_hex2str");
+    memcpy(digest, bin, 16);
+    free(bin);
+}
+
+static void hm_check(struct cli_matcher *root, unsigned int n, const char *phase)
+{
+    unsigned char digest[16];
+    char hash[33];
+    unsigned int i;
+    int ret;
+
+    for(i = 0; i < n; i++) {
+	hm_testhash(hash, digest, i);
+	virname = NULL;
+	ret = cli_hm_scan(digest, 100 + i % 3, &virname, root, CLI_HASH_MD5);
+	fail_unless_fmt(ret == CL_VIRUS, "%s: hash %u not found", phase, i);
+	if(i % 5)
+	    fail_unless_fmt(!strcmp(virname, "Test_Hash"), "%s: virname %s", phase, virname);
+	else
+	    fail_unless_fmt(!strncmp(virname, "Test_Dup", 8), "%s: virname %s", phase, virname);
+	fail_unless_fmt(cli_hm_scan(digest, 99, &virname, root, CLI_HASH_MD5) == CL_CLEAN, "%s: hash %u found with the wrong size", phase, i);
+	fail_unless_fmt(cli_hm_scan_wild(digest, &virname, root, CLI_HASH_MD5) == (i % 7 ? CL_CLEAN : CL_VIRUS), "%s: wildcard hash %u", phase, i);
+	digest[15] ^= 1;
+	fail_unless_fmt(cli_hm_scan(digest, 100 + i % 3, &virname, root, CLI_HASH_MD5) == CL_CLEAN, "%s: hash %u false positive", phase, i);
+    }
+}
+
+/* around the bucket size, and enough to spill buckets */
+static const unsigned int hm_counts[] = { 1, 7, 8, 9, 3000 };
+
+START_TEST (test_hm_scan) {
+	struct cli_matcher *root;
+	unsigned char digest[16];
+	const unsigned int n = hm_counts[_i];
+	char hash[33];
+	unsigned int i;
+
+    root = (struct cli_matcher *) mpool_calloc(ctx.engine->mempool, 1, sizeof(struct cli_matcher));
+    fail_unless(root != NULL, "root == NULL");
+#ifdef USE_MPOOL
+    root->mempool = ctx.engine->mempool;
+#endif
+
+    for(i = 0; i < n; i++) {
+	hm_testhash(hash, digest, i);
+	fail_unless(!hm_addhash_str(root, hash, 100 + i % 3, i % 5 ? "Test_Hash" : "Test_Dup1"), "hm_addhash_str");
+	if(!(i % 5))
+	    fail_unless(!hm_addhash_str(root, hash, 100 + i % 3, "Test_Dup2"), "hm_addhash_str");
+	if(!(i % 7))
+	    fail_unless(!hm_addhash_str(root, hash, 0, "Test_Wild"), "hm_addhash_str");
+    }
+    hm_flush(root);
+    fail_unless(root->hm.index[CLI_HASH_MD5] != NULL, "no index built");
+    hm_check(root, n, "index");
+
+    /* entries removed by cl_engine_update() stay in the index */
+    hm_testhash(hash, digest, 0);
+    fail_unless(hm_tombstone_str(root, hash, 100) == 2, "hm_tombstone_str");
+    fail_unless(cli_hm_scan(digest, 100, &virname, root, CLI_HASH_MD5) == CL_CLEAN, "tombstone");
+    fail_unless(cli_hm_scan_wild(digest, &virname, root, CLI_HASH_MD5) == CL_VIRUS, "tombstone");
+
+    /* adding drops the index until the next hm_flush() */
+    fail_unless(!hm_addhash_str(root, hash, 100, "Test_Dup1"), "hm_addhash_str");
+    hm_flush(root);
+    hm_check(root, n, "rebuilt index");
+}
+END_TEST
+
+START_TEST (test_sigstats) {
+	struct cli_ac_data mdata;
+	struct cli_matcher *root;
+	const struct cli_sigstat *stat;
+	int ret;
+
+    root = ctx.engine->root[0];
+    fail_unless(root != NULL, "root == NULL");
+    ((struct cl_engine *) ctx.engine)->sigstats = root->sigstats = cli_sigstats_new();
+    fail_unless(root->sigstats != NULL, "cli_sigstats_new() failed");
+
+#ifdef USE_MPOOL
+    root->mempool = mpool_create();
+#endif
+    ret = cli_bm_init(root);
+    fail_unless(ret == CL_SUCCESS, "cli_bm_init() failed");
+    ret = cli_ac_init(root, CLI_DEFAULT_AC_MINDEPTH, CLI_DEFAULT_AC_MAXDEPTH, 1);
+    fail_unless(ret == CL_SUCCESS, "cli_ac_init() failed");
+
+    ret = cli_parse_add(root, "SigBM", "deadbeef0102", 0, 0, "*", 0, NULL, 0);
+    fail_unless(ret == CL_SUCCESS, "cli_parse_add() failed");
+    ret = cli_parse_add(root, "SigAC", ac_testdata[0].hexsig, 0, 0, "*", 0, NULL, 0);
+    fail_unless(ret == CL_SUCCESS, "cli_parse_add() failed");
+    fail_unless_fmt(root->sigstats->nstats == 2, "%u records instead of 2", root->sigstats->nstats);
+
+    ret = cli_ac_buildtrie(root);
+    fail_unless(ret == CL_SUCCESS, "cli_ac_buildtrie() failed");
+    ret = cli_ac_initdata(&mdata, root->ac_partsigs, 0, 0, CLI_DEFAULT_AC_TRACKLEN);
+    fail_unless(ret == CL_SUCCESS, "cli_ac_initdata() failed");
+
+    ret = cli_bm_scanbuff((const unsigned char*)"blah\xde\xad\xbe\xef\x01\x02", 10, &virname, NULL, root, 0, NULL, NULL, NULL);
+    fail_unless(ret == CL_VIRUS, "cli_bm_scanbuff() failed");
+    ret = cli_bm_scanbuff((const unsigned char*)"blah\xde\xad\xbe\xef\x01\x03", 10, &virname, NULL, root, 0, NULL, NULL, NULL);
+    fail_unless(ret == CL_CLEAN, "cli_bm_scanbuff() failed");
+    stat = &root->sigstats->stats[0];
+    fail_unless(stat->kind == SIGSTAT_BM && !strncmp(stat->virname, "SigBM", 5), "wrong BM record");
+    fail_unless_fmt(stat->candidates == 2 && stat->hits == 1, "BM: %llu candidates, %llu hits",
+		    (unsigned long long) stat->candidates, (unsigned long long) stat->hits);
+
+    ret = cli_ac_scanbuff((const unsigned char*)ac_testdata[0].data, strlen(ac_testdata[0].data), &virname, NULL, NULL, root, &mdata, 0, 0, NULL, AC_SCAN_VIR, NULL);
+    fail_unless(ret == CL_VIRUS, "cli_ac_scanbuff() failed");
+    stat = &root->sigstats->stats[1];
+    fail_unless(stat->kind == SIGSTAT_AC && !strncmp(stat->virname, "SigAC", 5), "wrong AC record");
+    fail_unless_fmt(stat->verifies >= 1 && stat->hits == 1, "AC: %llu verifies, %llu hits",
+		    (unsigned long long) stat->verifies, (unsigned long long) stat->hits);
+
+    cli_ac_freedata(&mdata);
+}
+END_TEST
+
+/* collects every candidate by restarting the search past each one */
+static unsigned int filter_candidates(int (*search)(const struct filter *, const unsigned char *, unsigned long, struct filter_match_info *),
+				      const struct filter *m, const unsigned char *data, unsigned long len, unsigned long *out, unsigned int max)
+{
+    struct filter_match_info inf;
+    unsigned long off = 0;
+    unsigned int n = 0;
+
+    while (n < max && off < len && !search(m, data + off, len - off, &inf)) {
+	out[n++] = off + inf.first_match;
+	off += inf.first_match + 1;
+    }
+    return n;
+}
+
+START_TEST (test_filter_search_ext) {
+	struct filter *m;
+	unsigned char data[300], pat[12];
+	unsigned long cand_vec[300], cand_scalar[300];
+	unsigned int round, i, j, len, plen, nvec, nscalar;
+	uint32_t seed = 0x12345678;
+
+#define FILTER_RND() (seed = seed * 1103515245 + 12345, seed >> 16)
+    m = cli_malloc(sizeof(*m));
+    fail_unless(!!m, "cli_malloc() failed");
+    for (round = 0; round < 200; round++) {
+	/* a small alphabet makes candidates common, a full one makes them rare */
+	unsigned int alpha = (round & 1) ? 4 : 256;
+
+	filter_init(m);
+	for (i = 0; i < 1 + round % 8; i++) {
+	    plen = 2 + FILTER_RND() % (sizeof(pat) - 1);
+	    for (j = 0; j < plen; j++)
+		pat[j] = 'a' + FILTER_RND() % alpha;
+	    filter_add_static(m, pat, plen, "test");
+	}
+	/* cover every length around the 16 byte blocks and the tail */
+	len = round < 100 ? round : FILTER_RND() % sizeof(data);
+	for (j = 0; j < len; j++)
+	    data[j] = 'a' + FILTER_RND() % alpha;
+
+	nvec = filter_candidates(filter_search_ext, m, data, len, cand_vec, 300);
+	nscalar = filter_candidates(filter_search_ext_scalar, m, data, len, cand_scalar, 300);
+	fail_unless_fmt(nvec == nscalar, "round %u (len %u): %u candidates, expected %u", round, len, nvec, nscalar);
+	for (j = 0; j < nvec; j++)
+	    fail_unless_fmt(cand_vec[j] == cand_scalar[j], "round %u (len %u): candidate %u at %lu, expected %lu",
+			    round, len, j, cand_vec[j], cand_scalar[j]);
+    }
+#undef FILTER_RND
+    free(m);
+}
+END_TEST
+
 Suite *test_matchers_suite(void)
 {
     Suite *s = suite_create("matchers");
@@ -235,9 +615,16 @@ Suite *test_matchers_suite(void)
     suite_add_tcase(s, tc_matchers);
     tcase_add_checked_fixture (tc_matchers, setup, teardown);
     tcase_add_test(tc_matchers, test_ac_scanbuff);
+    tcase_add_test(tc_matchers, test_ac_scanbuff_fused);
     tcase_add_test(tc_matchers, test_bm_scanbuff);
+    tcase_add_test(tc_matchers, test_bm_scanbuff_long);
     tcase_add_test(tc_matchers, test_ac_scanbuff_allscan);
     tcase_add_test(tc_matchers, test_bm_scanbuff_allscan);
+    tcase_add_test(tc_matchers, test_ac_lsigeval);
+    tcase_add_test(tc_matchers, test_ac_resetdata);
+    tcase_add_loop_test(tc_matchers, test_hm_scan, 0, sizeof(hm_counts)/sizeof(hm_counts[0]));
+    tcase_add_test(tc_matchers, test_sigstats);
+    tcase_add_test(tc_matchers, test_filter_search_ext);
     return s;
 }
 